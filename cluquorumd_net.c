@@ -23,230 +23,2021 @@
  * asynchronous from the quorum daemon (as of 1.2.17)
  */
  
+#define _GNU_SOURCE		/* pthread_timedjoin_np */
 #include <string.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <syslog.h>
+#include <signal.h>
 #include <net_tie.h>
-#include <ping.h>
+#include <probe.h>
+#include <probe_trace.h>
+#include <probe_hops.h>
+#include <probe_rtnl.h>
 
 
-#define LOG(lvl, fmt, args...) do{ syslog(lvl, fmt, ##args); printf(fmt, ##args); } while(0)
+/* Replays print trace time rather than bothering syslog */
+#define LOG(lvl, fmt, args...) do{ \
+	if (tb_replay) \
+		printf("[%12.6f] ", (double)tb_trace.tf_clock / 1000000); \
+	else \
+		syslog(lvl, fmt, ##args); \
+	printf(fmt, ##args); } while(0)
 
 
+#define NET_RTO_MIN		20000	/* usec; see net_tiebreaker_timeout */
+#define NET_RTO_MAX		1000000
+#define NET_GRAY_LOSS		10	/* %; see net_tiebreaker_gray */
+#define NET_GRAY_RTT		200000	/* usec, 90th percentile */
+
 static int ping_interval = 2000000; /* In microseconds */
 static int declare_online = 1;
 static int declare_offline = 1;
+static int declare_down = 0;		/* usec; see net_timing */
 static pthread_t net_thread = (pthread_t)0;
+static int net_wake_fd = -1;		/* eventfd: stop, or reload */
+static int net_stopping = 0;
 static int net_vote_alive = 0;
+static int net_degraded = 0;		/* full-size probes failing */
 static char *tb_ip = NULL;
 static pthread_rwlock_t net_lock = PTHREAD_RWLOCK_INITIALIZER;
-static int totem_timeout = 0;
+static int totem_timeout = 0;		/* usec, as given */
+static int ping_hint = 0;		/* usec, as given */
+static char *tb_paths[NET_MAX_PATHS];
+static int tb_npaths = 0;
+static int path_policy = PROBE_POLICY_ANY;
+static struct icmp_opts tb_marking;	/* DSCP/priority for every path */
+static int probe_max_gap = 0;		/* usec; keeps detection in budget */
+static double probe_max_rate = 0;	/* probes/sec per path; 0 = auto */
+static int probe_backend = PROBE_BACKEND_POLL;
+static uint32_t probe_busy_poll = 0;	/* usec spin window; 0 = off */
+static int probe_rto_min = NET_RTO_MIN;	/* usec; 0 = fixed timeout */
+static int probe_rto_max = NET_RTO_MAX;
+static int probe_hedge_copies = 1;	/* see net_tiebreaker_hedge */
+static int probe_hedge_spacing = PROBE_HEDGE_SPACING;
+static int gray_loss = NET_GRAY_LOSS;	/* %; 0 = loss never degrades */
+static int gray_rtt = NET_GRAY_RTT;	/* usec; 0 = RTT never does */
+static volatile sig_atomic_t dump_stats = 0;
+static struct probe_trace tb_trace;	/* see net_tiebreaker_trace */
+static int tb_tracing = 0;
+static int tb_replay = 0;
+static double tb_replay_speed = 0;	/* 0 = as fast as possible */
+static int tb_transitions[3];		/* to offline, online, degraded */
+static unsigned net_config_gen = 0;	/* see net_tiebreaker_load */
+static uint64_t net_reload_start = 0;
+static char *tb_peers[NET_MAX_PATHS];	/* see net_tiebreaker_add_peer */
+static int tb_npeers = 0;
+static int net_peer = NET_PEER_UNKNOWN;
+static struct probe_rtnl tb_rtnl;	/* see net_link_events */
+static int tb_confirm = 0;		/* confirmation rounds left */
+
+/* pp_group of the probe paths */
+#define NET_GROUP_TB		0
+#define NET_GROUP_PEER		1
+
+#define NET_PEER_MISSES		2	/* all-path misses to call it down */
+#define NET_STOP_TIMEOUT	2000	/* msec to wait for the thread to stop */
+#define NET_CONFIRM_GAP		10000	/* usec between confirmation rounds */
+#define NET_MAX_TKO		127	/* rounds; the thread counts in a char */
+
+/* Failover timing, from the token timeout; see net_timing */
+struct net_timing {
+	int		nt_interval;
+	int		nt_max_gap;
+	int		nt_online;
+	int		nt_offline;
+	int		nt_down;	/* usec without a reply, to go offline */
+};
+
+/*
+ * A configuration file, parsed; see net_tiebreaker_load.  Anything the
+ * file leaves out is -1 (or NULL), and stays as it is.
+ */
+struct net_config {
+	char		*nc_target;
+	int		nc_token;	/* msec */
+	int		nc_interval;	/* msec */
+	char		*nc_paths[NET_MAX_PATHS];
+	int		nc_npaths;
+	char		*nc_peers[NET_MAX_PATHS];
+	int		nc_npeers;
+	int		nc_policy;
+	int		nc_dscp;
+	int		nc_priority;
+	double		nc_rate;
+	int		nc_backend;
+	int		nc_busy_poll;
+	int		nc_rto_min;	/* usec */
+	int		nc_rto_max;
+	int		nc_hedge;
+	int		nc_hedge_spacing; /* usec */
+	int		nc_gray_loss;
+	int		nc_gray_rtt;	/* usec */
+};
+
+/*
+ * Vote grade; see net_grade_update.  NET_GRADE_WINDOW rounds of history,
+ * and a better grade must hold for NET_GRADE_HOLD rounds to count.
+ */
+#define NET_GRADE_WINDOW	32
+#define NET_GRADE_HOLD		8
+#define NET_GRADE_SLACK		1000	/* usec of RTT which never count */
+
+struct net_grade {
+	uint8_t		ng_ok[NET_GRADE_WINDOW];	/* answered? */
+	uint32_t	ng_rtt[NET_GRADE_WINDOW];	/* usec, if so */
+	int		ng_next;
+	int		ng_rounds;
+	int		ng_grade;
+	int		ng_better;	/* rounds the raw grade beat it */
+};
+
+static int net_grade = 0;
+
+/*
+ * Gray failure: alive, but losing or slow; see net_gray_update.  At
+ * least NET_GRAY_ROUNDS rounds since the tiebreaker came online to go
+ * degraded, and NET_GRADE_HOLD clean ones to come back.
+ */
+#define NET_GRAY_ROUNDS		8
+
+struct net_gray {
+	int		gy_state;	/* NET_TB_* */
+	int		gy_rounds;	/* online, up to NET_GRADE_WINDOW */
+	int		gy_clear;	/* rounds under the exit thresholds */
+	int		gy_lost;	/* of gy_rounds, as last worked out */
+	uint32_t	gy_p50;		/* usec */
+	uint32_t	gy_p90;
+};
+
+static int net_state = NET_TB_OFFLINE;
+
+/* Hop sweep of a failing path; see net_hops_start */
+#define NET_HOPS_IDLE		0
+#define NET_HOPS_RUNNING	1
+#define NET_HOPS_DONE		2
+
+struct net_hops_req {
+	struct sockaddr_in	hr_dst;
+	struct icmp_opts	hr_opts;
+	char			hr_name[PROBE_NAMELEN];
+	uint32_t		hr_timeout;
+	uint16_t		hr_id;
+};
+
+static pthread_mutex_t tb_hops_lock = PTHREAD_MUTEX_INITIALIZER;
+static int tb_hops_state = NET_HOPS_IDLE;
+static pthread_t tb_hops_thread;	/* joined by the quorum thread */
+static int tb_hops_started = 0;
+static int tb_hops_wake = -1;		/* eventfd: stop the sweep */
+static struct probe_hops tb_hops;
+static char tb_hops_path[PROBE_NAMELEN];
+
+
+/**
+  Clean up local variables
+ */
+static void
+net_cleanup(void)
+{
+	pthread_rwlock_wrlock(&net_lock);
+	net_vote_alive = 0;
+	net_degraded = 0;
+	net_peer = NET_PEER_UNKNOWN;
+	net_grade = 0;
+	net_state = NET_TB_OFFLINE;
+	if (tb_ip) {
+		free(tb_ip);
+		tb_ip = NULL;
+	}
+	pthread_rwlock_unlock(&net_lock);
+}
+
+
+static void
+net_log_line(void *arg __attribute__((unused)), const char *line)
+{
+	LOG(LOG_INFO, "IPv4 TB: %s\n", line);
+}
+
+
+/**
+  Read link, route and neighbour events, and log the ones which concern
+  our paths.
+
+  @param pe		Engine the monitor was last mapped to.
+  @return		Number of paths with news.
+ */
+static int
+net_link_events(struct probe_engine *pe)
+{
+	struct probe_rtnl_path *rl;
+	struct probe_path *pp;
+	char ifname[IF_NAMESIZE], via[INET_ADDRSTRLEN];
+	int x, n;
+
+	n = probe_rtnl_read(&tb_rtnl, pe);
+	if (n <= 0)
+		return 0;
+
+	for (x = 0; x < tb_rtnl.rt_npaths; x++) {
+		rl = &tb_rtnl.rt_paths[x];
+		pp = &pe->pe_paths[x];
+		if (!rl->rl_events)
+			continue;
+		if (!if_indextoname(rl->rl_ifindex, ifname))
+			strcpy(ifname, "?");
+		inet_ntop(AF_INET, &rl->rl_nexthop, via, sizeof(via));
+
+		if (rl->rl_events & PROBE_RTNL_EV_LINK)
+			LOG(LOG_NOTICE, "IPv4 TB: Path %s: link %s %s\n",
+			    pp->pp_name, ifname,
+			    rl->rl_state == PROBE_RTNL_DOWN ? "down" : "up");
+		else if (rl->rl_state == PROBE_RTNL_NOROUTE)
+			LOG(LOG_NOTICE, "IPv4 TB: Path %s: no route\n",
+			    pp->pp_name);
+		else if (rl->rl_events & PROBE_RTNL_EV_ROUTE)
+			LOG(LOG_INFO, "IPv4 TB: Path %s: now via %s dev %s\n",
+			    pp->pp_name, via, ifname);
+		if (rl->rl_events & PROBE_RTNL_EV_NEIGH)
+			LOG(LOG_INFO, "IPv4 TB: Path %s: next hop %s %s\n",
+			    pp->pp_name, via, rl->rl_neigh_failed ?
+			    "does not resolve" : "resolves again");
+		rl->rl_events = 0;
+	}
+
+	return n;
+}
+
+
+/**
+  The time, in microseconds: the trace's when replaying one.
+ */
+static uint64_t
+net_clock(void)
+{
+	return tb_replay ? tb_trace.tf_clock : probe_now();
+}
+
+
+/**
+  Start a run of confirmation rounds, NET_CONFIRM_GAP apart, with a
+  probe grant so that the rate budget does not hold them back.
+
+  @param pe		Engine.
+  @param rounds		How many; the offline hysteresis, so that the
+  			misses are counted within the run (the offline
+  			decision still waits out the offline time).  A
+  			recovery shows up as quickly, but must then
+  			hold for the online hysteresis at the usual
+  			interval.
+ */
+static void
+net_confirm(struct probe_engine *pe, int rounds)
+{
+	tb_confirm = rounds - 1;
+	probe_grant(pe, -1, rounds);
+}
+
+
+/**
+  Wait out a ping interval, or until we are told to stop; when replaying
+  a trace, only as long as the replay speed asks for.  During a run of
+  confirmation rounds, wait NET_CONFIRM_GAP instead.  A link, route or
+  neighbour event on one of pe's paths cuts the wait short.
+
+  @param interval	Ping interval (microseconds).
+  @param pe		Engine to match link events against; NULL to
+  			ignore them.
+  @return		1 if a link event cut the wait short, 0 if not.
+ */
+static int
+net_sleep(int interval, struct probe_engine *pe)
+{
+	struct pollfd pfd[2];
+	uint64_t now, until;
+
+	if (tb_confirm > 0) {
+		--tb_confirm;
+		if (interval > NET_CONFIRM_GAP)
+			interval = NET_CONFIRM_GAP;
+	}
+
+	if (tb_replay) {
+		if (tb_replay_speed > 0)
+			usleep((useconds_t)(interval / tb_replay_speed));
+		return 0;
+	}
+	if (net_wake_fd < 0 && tb_rtnl.rt_sock < 0) {
+		usleep(interval);
+		return 0;
+	}
+
+	pfd[0].fd = net_wake_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = pe ? tb_rtnl.rt_sock : -1;
+	pfd[1].events = POLLIN;
+	until = probe_now() + interval;
+	while ((now = probe_now()) < until) {
+		pfd[0].revents = 0;
+		pfd[1].revents = 0;
+		if (poll(pfd, 2, (int)((until - now + 999) / 1000)) < 0 &&
+		    errno != EINTR)
+			break;
+		if (pfd[0].revents & POLLIN)
+			break;
+		if ((pfd[1].revents & POLLIN) && net_link_events(pe) > 0)
+			return 1;
+	}
+	return 0;
+}
+
+
+/**
+  Empty the wake eventfd, once whoever wrote to it has had their way
+  (a reload is picked up by the loop; a stop ends it).
+ */
+static void
+net_drain_wake(void)
+{
+	uint64_t val;
+
+	if (net_wake_fd >= 0 && read(net_wake_fd, &val, sizeof(val)) < 0 &&
+	    errno != EAGAIN)
+		LOG(LOG_WARNING, "IPv4 TB: Wake descriptor: %s\n",
+		    strerror(errno));
+}
+
+
+/**
+  Hop sweep thread: probe every hop of the path at once, and leave the
+  result for the tiebreaker thread to log.
+ */
+static void *
+net_hops_thread(void *arg)
+{
+	struct net_hops_req *hr = arg;
+	struct probe_hops hs;
+
+	if (probe_hops_sweep(&hr->hr_dst, &hr->hr_opts, hr->hr_id,
+			     PROBE_HOPS_MAX, hr->hr_timeout, tb_hops_wake,
+			     &hs) < 0) {
+		memset(&hs, 0, sizeof(hs));
+		hs.hs_target = hr->hr_dst.sin_addr;
+	}
+
+	pthread_mutex_lock(&tb_hops_lock);
+	tb_hops = hs;
+	memcpy(tb_hops_path, hr->hr_name, sizeof(tb_hops_path));
+	tb_hops_state = NET_HOPS_DONE;
+	pthread_mutex_unlock(&tb_hops_lock);
+
+	free(hr);
+	return NULL;
+}
+
+
+/**
+  Find out where a path which just missed is broken, in the background,
+  so that it is known by the time the tiebreaker is declared offline;
+  the offline decision never waits for it.  One sweep at a time, in a
+  thread which belongs to the quorum thread: it is joined there, before
+  the next sweep or by net_hops_stop.
+
+  The sweep's answers also reach pe's sockets; pe is told to skip them
+  rather than count them as foreign.
+
+  @param pe		Engine the path belongs to.
+  @param pp		Path which missed.
+  @param timeout	How long to wait for hops to answer (usec).
+ */
+static void
+net_hops_start(struct probe_engine *pe, struct probe_path *pp,
+	       uint32_t timeout)
+{
+	struct net_hops_req *hr;
+	pthread_attr_t attrs;
+
+	pthread_mutex_lock(&tb_hops_lock);
+	if (tb_hops_state == NET_HOPS_RUNNING) {
+		pthread_mutex_unlock(&tb_hops_lock);
+		return;
+	}
+	pthread_mutex_unlock(&tb_hops_lock);
+
+	/* The last sweep is over; it only has to return */
+	if (tb_hops_started) {
+		pthread_join(tb_hops_thread, NULL);
+		tb_hops_started = 0;
+	}
+	if (tb_hops_wake < 0) {
+		tb_hops_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (tb_hops_wake < 0)
+			return;
+	}
+
+	hr = malloc(sizeof(*hr));
+	if (!hr)
+		return;
+	hr->hr_dst = pp->pp_addr;
+	hr->hr_opts = pp->pp_opts;
+	memcpy(hr->hr_name, pp->pp_name, sizeof(hr->hr_name));
+	hr->hr_timeout = timeout;
+	hr->hr_id = icmp_alloc_id();
+	probe_skip_id(pe, hr->hr_id);
+
+	pthread_mutex_lock(&tb_hops_lock);
+	pthread_attr_init(&attrs);
+	pthread_attr_setstacksize(&attrs, 65536);
+	if (pthread_create(&tb_hops_thread, &attrs, net_hops_thread,
+			   hr) == 0) {
+		tb_hops_state = NET_HOPS_RUNNING;
+		tb_hops_started = 1;
+	} else {
+		free(hr);
+	}
+	pthread_attr_destroy(&attrs);
+	pthread_mutex_unlock(&tb_hops_lock);
+}
+
+
+/**
+  Stop any hop sweep and join its thread, before the quorum thread
+  exits.  The sweep gives up its wait as soon as its eventfd is written
+  to, so this is quick.
+ */
+static void
+net_hops_stop(void)
+{
+	uint64_t val = 1;
+
+	if (tb_hops_started) {
+		if (write(tb_hops_wake, &val, sizeof(val)) < 0)
+			LOG(LOG_WARNING, "IPv4 TB: Failed to stop hop "
+			    "sweep: %s\n", strerror(errno));
+		pthread_join(tb_hops_thread, NULL);
+		tb_hops_started = 0;
+	}
+	if (tb_hops_wake >= 0) {
+		close(tb_hops_wake);
+		tb_hops_wake = -1;
+	}
+
+	pthread_mutex_lock(&tb_hops_lock);
+	tb_hops_state = NET_HOPS_IDLE;
+	pthread_mutex_unlock(&tb_hops_lock);
+}
+
+
+/**
+  Log the result of the last hop sweep, if it is in.
+
+  @param discard	Just throw it away (the path recovered).
+  @return		1 if it was in, 0 if the sweep is still running
+  			(or none was started).
+ */
+static int
+net_hops_log(int discard)
+{
+	char buf[512];
+	int ret = 0;
+
+	pthread_mutex_lock(&tb_hops_lock);
+	if (tb_hops_state == NET_HOPS_DONE) {
+		if (!discard)
+			LOG(LOG_NOTICE, "IPv4 TB: Path %s hop map: %s\n",
+			    tb_hops_path,
+			    probe_hops_format(&tb_hops, buf, sizeof(buf)));
+		tb_hops_state = NET_HOPS_IDLE;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&tb_hops_lock);
+	return ret;
+}
+
+
+/**
+  Grade the tiebreaker vote by the link quality of the last
+  NET_GRADE_WINDOW rounds: NET_GRADE_MAX for a clean path, one less for
+  any loss, for loss over a quarter of the rounds, and for a mean RTT of
+  more than twice the window's best (and NET_GRADE_SLACK over it); never
+  below 1 while the tiebreaker is alive, and 0 when it is not.  Worse
+  grades take effect at once, better ones only once they have held for
+  NET_GRADE_HOLD rounds.
+
+  @param ng		Grade state.
+  @param pe		Engine, after a round which told us something.
+  @param answered	The tiebreaker answered this round.
+  @param alive		The tiebreaker's vote, after hysteresis.
+  @return		The grade.
+ */
+static int
+net_grade_update(struct net_grade *ng, struct probe_engine *pe,
+		 int answered, int alive)
+{
+	struct probe_path *pp;
+	uint64_t total = 0;
+	uint32_t rtt = 0, best = UINT32_MAX;
+	int x, n, lost = 0, ok = 0, raw;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		pp = &pe->pe_paths[x];
+		if (pp->pp_group != NET_GROUP_TB || !pp->pp_fresh ||
+		    pp->pp_result != PING_SUCCESS)
+			continue;
+		if (!rtt || pp->pp_stats.ps_rtt_last < rtt)
+			rtt = pp->pp_stats.ps_rtt_last;
+	}
+
+	ng->ng_ok[ng->ng_next] = !!answered;
+	ng->ng_rtt[ng->ng_next] = rtt;
+	ng->ng_next = (ng->ng_next + 1) % NET_GRADE_WINDOW;
+	if (ng->ng_rounds < NET_GRADE_WINDOW)
+		++ng->ng_rounds;
+
+	n = ng->ng_rounds;
+	for (x = 0; x < n; x++) {
+		if (!ng->ng_ok[x]) {
+			++lost;
+			continue;
+		}
+		++ok;
+		total += ng->ng_rtt[x];
+		if (ng->ng_rtt[x] < best)
+			best = ng->ng_rtt[x];
+	}
+
+	raw = NET_GRADE_MAX;
+	if (lost)
+		--raw;
+	if (lost * 4 > n)
+		--raw;
+	if (ok && total > (uint64_t)best * 2 * ok &&
+	    total > ((uint64_t)best + NET_GRADE_SLACK) * ok)
+		--raw;
+	if (raw < 1)
+		raw = 1;
+
+	if (!alive) {
+		ng->ng_grade = 0;
+		ng->ng_better = 0;
+	} else if (!ng->ng_grade || raw <= ng->ng_grade) {
+		ng->ng_grade = raw;
+		ng->ng_better = 0;
+	} else if (++ng->ng_better >= NET_GRADE_HOLD) {
+		ng->ng_grade = raw;
+		ng->ng_better = 0;
+	}
+
+	return ng->ng_grade;
+}
+
+
+/**
+  Work out whether the tiebreaker is degraded: alive, but losing more
+  than loss percent of the rounds since it came online (at most the
+  last NET_GRADE_WINDOW), or with a 90th percentile RTT over rtt_us.
+  Another state rather than a miss: it says nothing against the vote
+  itself, but tells us the network is in trouble before it fails
+  outright.  It takes NET_GRAY_ROUNDS rounds of history to go degraded,
+  and NET_GRADE_HOLD rounds under half of both thresholds to come back.
+
+  @param gy		Gray state.
+  @param ng		Grade state, with this round in it.
+  @param alive		The tiebreaker's vote, after hysteresis.
+  @param loss		Loss threshold (percent); 0 for none.
+  @param rtt_us		RTT threshold; 0 for none.
+  @return		NET_TB_OFFLINE, NET_TB_DEGRADED or NET_TB_ONLINE.
+ */
+static int
+net_gray_update(struct net_gray *gy, const struct net_grade *ng, int alive,
+		int loss, int rtt_us)
+{
+	uint32_t rtt[NET_GRADE_WINDOW], v;
+	int x, y, n, ok = 0, over = 0, under = 1;
+
+	if (!alive) {
+		gy->gy_state = NET_TB_OFFLINE;
+		gy->gy_rounds = 0;
+		gy->gy_clear = 0;
+		gy->gy_lost = 0;
+		return gy->gy_state;
+	}
+	if (gy->gy_rounds < ng->ng_rounds)
+		++gy->gy_rounds;
+
+	/* The latest gy_rounds rounds, with the RTTs in order */
+	n = gy->gy_rounds;
+	gy->gy_lost = 0;
+	for (x = 1; x <= n; x++) {
+		y = (ng->ng_next - x + NET_GRADE_WINDOW) % NET_GRADE_WINDOW;
+		if (!ng->ng_ok[y]) {
+			++gy->gy_lost;
+			continue;
+		}
+		v = ng->ng_rtt[y];
+		for (y = ok++; y > 0 && rtt[y - 1] > v; y--)
+			rtt[y] = rtt[y - 1];
+		rtt[y] = v;
+	}
+	gy->gy_p50 = ok ? rtt[(ok - 1) / 2] : 0;
+	gy->gy_p90 = ok ? rtt[(ok * 9 + 9) / 10 - 1] : 0;
+
+	if (loss) {
+		over |= gy->gy_lost * 100 > loss * n;
+		under &= gy->gy_lost * 200 <= loss * n;
+	}
+	if (rtt_us && ok) {
+		over |= gy->gy_p90 > (uint32_t)rtt_us;
+		under &= gy->gy_p90 <= (uint32_t)rtt_us / 2;
+	}
+
+	if (gy->gy_state != NET_TB_DEGRADED) {
+		gy->gy_state = over && n >= NET_GRAY_ROUNDS ?
+			       NET_TB_DEGRADED : NET_TB_ONLINE;
+		gy->gy_clear = 0;
+	} else if (!under) {
+		gy->gy_clear = 0;
+	} else if (++gy->gy_clear >= NET_GRADE_HOLD) {
+		gy->gy_state = NET_TB_ONLINE;
+		gy->gy_clear = 0;
+	}
+
+	return gy->gy_state;
+}
+
+
+/**
+  Split a peer spec, <address>[,<path options>], into its parts.
+
+  @param spec		Peer spec.
+  @param host		Filled in with the address.
+  @param hostlen	Size of host.
+  @param opts		Filled in with the path options.
+  @return		0, or -1 if the spec is bad.
+ */
+static int
+net_peer_parse(const char *spec, char *host, size_t hostlen,
+	       struct icmp_opts *opts)
+{
+	const char *comma;
+	size_t len;
+
+	comma = strchr(spec, ',');
+	len = comma ? (size_t)(comma - spec) : strlen(spec);
+	if (!len || len >= hostlen) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(host, spec, len);
+	host[len] = 0;
+
+	if (!comma) {
+		memset(opts, 0, sizeof(*opts));
+		return 0;
+	}
+	return icmp_opts_parse(comma + 1, opts);
+}
+
+
+/**
+  (Re)build the probe engine for a tiebreaker target: one path per
+  configured path spec, or a single default-route path if there are none.
+  Paths to the peer (see net_tiebreaker_add_peer) ride along on the same
+  engine, in their own group.  The settings are copied under net_lock,
+  and the paths set up (which may mean resolving host names) after it
+  is dropped, so a slow name server holds up neither reloads nor
+  net_cancel_quorum_thread.
+
+  @param pe		Engine; torn down and re-initialized.
+  @param target		Tiebreaker host.
+  @return		0 on success, -1 if we ran out of memory.
+ */
+static int
+net_build_engine(struct probe_engine *pe, char *target)
+{
+	struct icmp_opts opts, marking;
+	char host[PROBE_NAMELEN];
+	char *paths[NET_MAX_PATHS], *peers[NET_MAX_PATHS];
+	int x, idx, ret = 0, npaths, npeers, backend, tracing, replay;
+
+	probe_engine_destroy(pe);
+	probe_engine_init(pe);
+
+	pthread_rwlock_rdlock(&net_lock);
+	backend = probe_backend;
+	probe_set_busy_poll(pe, probe_busy_poll);
+	probe_set_rto(pe, probe_rto_min, probe_rto_max);
+	probe_set_hedge(pe, probe_hedge_copies, probe_hedge_spacing);
+	probe_set_wake(pe, net_wake_fd);
+	marking = tb_marking;
+	tracing = tb_tracing;
+	replay = tb_replay;
+	npaths = 0;
+	npeers = 0;
+	if (!replay) {
+		for (; npaths < tb_npaths; npaths++)
+			if (!(paths[npaths] = strdup(tb_paths[npaths])))
+				ret = -1;
+		for (; npeers < tb_npeers; npeers++)
+			if (!(peers[npeers] = strdup(tb_peers[npeers])))
+				ret = -1;
+	}
+	pthread_rwlock_unlock(&net_lock);
+
+	if (probe_set_backend(pe, backend) < 0)
+		LOG(LOG_WARNING, "IPv4 TB: Receive backend unavailable, "
+		    "using poll: %s\n", strerror(errno));
+	else if (pe->pe_backend != backend)
+		LOG(LOG_NOTICE, "IPv4 TB: io_uring unavailable, using epoll\n");
+	if ((tracing || replay) && probe_trace_attach(pe, &tb_trace) < 0)
+		ret = -1;
+	if (replay || ret < 0)
+		goto out;
+
+	for (x = 0; x < npaths || (!x && !npaths); x++) {
+		memset(&opts, 0, sizeof(opts));
+		if (npaths && icmp_opts_parse(paths[x], &opts) < 0) {
+			ret = -1;
+			break;
+		}
+		if (!opts.io_dscp)
+			opts.io_dscp = marking.io_dscp;
+		if (!opts.io_priority)
+			opts.io_priority = marking.io_priority;
+
+		idx = probe_add_path(pe, target, &opts,
+				     npaths ? paths[x] : NULL);
+		if (idx < 0) {
+			ret = -1;
+			break;
+		}
+		if (pe->pe_paths[idx].pp_sock < 0)
+			LOG(LOG_WARNING, "IPv4 TB: Path %s unusable for now: "
+			    "%s\n", pe->pe_paths[idx].pp_name,
+			    strerror(errno));
+	}
+	for (x = 0; !ret && x < npeers; x++) {
+		if (net_peer_parse(peers[x], host, sizeof(host),
+				   &opts) < 0) {
+			ret = -1;
+			break;
+		}
+		if (!opts.io_dscp)
+			opts.io_dscp = marking.io_dscp;
+		if (!opts.io_priority)
+			opts.io_priority = marking.io_priority;
+
+		idx = probe_add_path(pe, host, &opts, peers[x]);
+		if (idx < 0) {
+			ret = -1;
+			break;
+		}
+		pe->pe_paths[idx].pp_group = NET_GROUP_PEER;
+		if (pe->pe_paths[idx].pp_sock < 0)
+			LOG(LOG_WARNING, "IPv4 TB: Peer path %s unusable for "
+			    "now: %s\n", pe->pe_paths[idx].pp_name,
+			    strerror(errno));
+	}
+
+out:
+	for (x = 0; x < npaths; x++)
+		free(paths[x]);
+	for (x = 0; x < npeers; x++)
+		free(peers[x]);
+	return ret;
+}
+
+
+/**
+  Net tiebreaker thread.
+
+  @param arg		Unused.
+  @return		NULL
+ */
+void *
+net_quorum_thread(void *arg)
+{
+	struct probe_engine pe;
+	struct probe_path *pp;
+	int restart, rebuild, policy, fresh, degraded, failed = 0;
+	int hops_wanted = 0, peer = NET_PEER_UNKNOWN, peer_misses = 0;
+	int peer_fresh, grade = 0, nold = 0, kept, link_down;
+	int loss, rtt, warn;
+	struct net_grade ng;
+	struct net_gray gy;
+	struct probe_path *old = NULL;
+	unsigned gen = 0;
+	uint64_t reloaded = 0, last_reply = 0;
+	char alive, was_alive, hits = 0, misses = 0, _online, _offline;
+	int interval, timeout, down, ping_ret = PING_TIMEOUT, errno_save = 0, x;
+	double min_rate, max_rate, cur_min = -1, cur_max = -1;
+	char target[64] = "";
+
+	probe_engine_init(&pe);
+	memset(&ng, 0, sizeof(ng));
+	memset(&gy, 0, sizeof(gy));
+
+	tb_rtnl.rt_sock = -1;
+	tb_confirm = 0;
+	if (!tb_replay && probe_rtnl_open(&tb_rtnl) < 0)
+		LOG(LOG_WARNING, "IPv4 TB: Not watching link events: %s\n",
+		    strerror(errno));
+
+	while (1) {
+		alive = 0;
+		restart = 0;
+		rebuild = 0;
+
+		if (__atomic_load_n(&net_stopping, __ATOMIC_ACQUIRE))
+			break;
+		net_drain_wake();
+
+		pthread_rwlock_rdlock(&net_lock);
+		was_alive = net_vote_alive;
+		if (!tb_ip) {
+			pthread_rwlock_unlock(&net_lock);
+			break;
+		}
+		if (strcmp(tb_ip, target)) {
+			strncpy(target, tb_ip, sizeof(target) - 1);
+			rebuild = 1;
+		}
+		if (gen != net_config_gen) {
+			gen = net_config_gen;
+			reloaded = net_reload_start;
+			rebuild = 1;
+		}
+
+		interval = ping_interval;
+		timeout = probe_rto_max;
+		_online = declare_online;
+		_offline = declare_offline;
+		down = declare_down;
+		policy = path_policy;
+		loss = gray_loss;
+		rtt = gray_rtt;
+		min_rate = probe_max_gap ? 1000000.0 / probe_max_gap : 0;
+		max_rate = probe_max_rate ? probe_max_rate :
+					    1000000.0 / interval;
+
+		pthread_rwlock_unlock(&net_lock);
+
+		/* Paths which survive a rebuild keep their history */
+		if (rebuild && pe.pe_npaths) {
+			nold = pe.pe_npaths;
+			old = malloc(sizeof(*old) * nold);
+			if (old)
+				memcpy(old, pe.pe_paths, sizeof(*old) * nold);
+			else
+				nold = 0;
+		}
+
+		if (rebuild && net_build_engine(&pe, target) < 0) {
+			LOG(LOG_ERR, "IPv4 TB: Failed to set up probe "
+			    "engine: %s\n", strerror(errno));
+			free(old);
+			old = NULL;
+			nold = 0;
+			target[0] = 0;
+			if (tb_replay)
+				break;
+			net_sleep(interval, NULL);
+			continue;
+		}
+
+		if (rebuild || min_rate != cur_min || max_rate != cur_max) {
+			probe_set_budget(&pe, min_rate, max_rate);
+			cur_min = min_rate;
+			cur_max = max_rate;
+		}
+
+		if (rebuild) {
+			kept = probe_carry_over(&pe, old, nold);
+			free(old);
+			old = NULL;
+			nold = 0;
+			if (reloaded)
+				LOG(LOG_INFO, "IPv4 TB: Configuration %u applied "
+				    "in %.3fms; %d of %d paths kept their "
+				    "history\n", gen,
+				    (double)(probe_now() - reloaded) / 1000,
+				    kept, pe.pe_npaths);
+			reloaded = 0;
+
+			if (tb_rtnl.rt_sock >= 0 &&
+			    probe_rtnl_map(&tb_rtnl, &pe) < 0)
+				LOG(LOG_WARNING, "IPv4 TB: Route lookup "
+				    "failed: %s\n", strerror(errno));
+		}
+
+		if (dump_stats) {
+			dump_stats = 0;
+			probe_dump(&pe, net_log_line, NULL);
+			if (tb_rtnl.rt_sock >= 0)
+				LOG(LOG_INFO, "IPv4 TB: link events: %llu "
+				    "read, %llu on our paths, %llu overruns\n",
+				    (unsigned long long)tb_rtnl.rt_messages,
+				    (unsigned long long)tb_rtnl.rt_relevant,
+				    (unsigned long long)tb_rtnl.rt_overruns);
+			LOG(LOG_INFO, "IPv4 TB: %s; last %d rounds lost %d, "
+			    "rtt p50/p90 %u/%u us; degraded %d times\n",
+			    gy.gy_state == NET_TB_ONLINE ? "online" :
+			    gy.gy_state == NET_TB_DEGRADED ? "degraded" :
+			    "offline", gy.gy_rounds, gy.gy_lost, gy.gy_p50,
+			    gy.gy_p90, tb_transitions[2]);
+		}
+
+		if (probe_round(&pe, timeout) < 0) {
+			if (tb_replay && errno == ENODATA)
+				break;
+			/* Woken by net_cancel_quorum_thread */
+			if (errno == EINTR)
+				continue;
+			LOG(LOG_ERR, "IPv4 TB: Probe failed: %s\n",
+			    strerror(errno));
+			if (tb_replay)
+				break;
+		}
+
+		if (tb_tracing && !pe.pe_trace) {
+			LOG(LOG_WARNING, "IPv4 TB: Trace recording stopped: "
+			    "%s\n", strerror(tb_trace.tf_error));
+			tb_tracing = 0;
+		}
+
+		fresh = 0;
+		peer_fresh = 0;
+		degraded = 0;
+		warn = 0;
+		for (x = 0; x < pe.pe_npaths; x++) {
+			pp = &pe.pe_paths[x];
+			if (pp->pp_group == NET_GROUP_PEER) {
+				peer_fresh += pp->pp_fresh;
+				continue;
+			}
+			fresh += pp->pp_fresh;
+			if (pp->pp_events & PROBE_EV_BACKOFF)
+				LOG(LOG_INFO, "IPv4 TB: Path %s partial loss; "
+				    "backing off to %.2f probes/s\n",
+				    pp->pp_name, pp->pp_budget.pb_rate);
+			if (pp->pp_events & PROBE_EV_RATELIMIT)
+				LOG(LOG_NOTICE, "IPv4 TB: Path %s is ICMP "
+				    "rate limited; holding below %.2f "
+				    "probes/s\n", pp->pp_name,
+				    pp->pp_budget.pb_ceiling);
+			if (pp->pp_events & PROBE_EV_RXQ_OVERFLOW)
+				LOG(LOG_WARNING, "IPv4 TB: Path %s missed "
+				    "while the receive queue was dropping "
+				    "packets (%llu so far); not network "
+				    "loss\n", pp->pp_name,
+				    (unsigned long long)pe.pe_drops);
+			if (pp->pp_events & PROBE_EV_MTU_LOST)
+				LOG(LOG_WARNING, "IPv4 TB: Path %s degraded: "
+				    "%u byte probes fail (%s) while small "
+				    "ones get through; MTU blackhole?\n",
+				    pp->pp_name, pp->pp_opts.io_mtu,
+				    icmp_ping_strerror(pp->pp_mtu_result));
+			if (pp->pp_events & PROBE_EV_MTU_OK)
+				LOG(LOG_NOTICE, "IPv4 TB: Path %s passes "
+				    "%u byte probes again\n", pp->pp_name,
+				    pp->pp_opts.io_mtu);
+			if (pp->pp_events & PROBE_EV_RTT_RISE)
+				LOG(LOG_WARNING, "IPv4 TB: Path %s RTT up "
+				    "to %u us from %u us; early warning\n",
+				    pp->pp_name, pp->pp_stats.ps_rtt_last,
+				    pp->pp_cp_alarm);
+			if (pp->pp_events & PROBE_EV_LOSS_RISE)
+				LOG(LOG_WARNING, "IPv4 TB: Path %s losing "
+				    "probes; early warning\n", pp->pp_name);
+			if (pp->pp_events &
+			    (PROBE_EV_RTT_RISE | PROBE_EV_LOSS_RISE))
+				++warn;
+			degraded += pp->pp_degraded;
+		}
+
+		/*
+		 * A path which is going bad often does so for a while
+		 * before it fails: look again at the confirmation rate,
+		 * so that if it does fail, the misses come in quickly.
+		 * Only the probing speeds up; going offline still takes
+		 * the offline time without a reply, so a latency rise
+		 * followed by a short burst of loss is not enough.
+		 */
+		if (warn && was_alive && tb_confirm <= 0)
+			net_confirm(&pe, _offline);
+
+		/*
+		 * The peer is up if any path to it answered; down only
+		 * once every path has missed a few rounds running.
+		 */
+		if (peer_fresh) {
+			if (probe_alive_group(&pe, NET_GROUP_PEER,
+					      PROBE_POLICY_ANY)) {
+				peer_misses = 0;
+				if (peer != NET_PEER_UP)
+					LOG(LOG_NOTICE, "IPv4 TB: Peer "
+					    "reachable\n");
+				peer = NET_PEER_UP;
+			} else if (++peer_misses >= NET_PEER_MISSES &&
+				   peer != NET_PEER_DOWN) {
+				LOG(LOG_NOTICE, "IPv4 TB: Peer unreachable "
+				    "on every path\n");
+				peer = NET_PEER_DOWN;
+			}
+		}
+
+		pthread_rwlock_wrlock(&net_lock);
+		net_degraded = degraded > 0;
+		net_peer = peer;
+		pthread_rwlock_unlock(&net_lock);
+
+		/*
+		 * Every path was over its probe budget this time around;
+		 * we learned nothing, so neither hits nor misses count.
+		 */
+		if (!fresh) {
+			if (net_sleep(interval, &pe))
+				net_confirm(&pe, _offline);
+			continue;
+		}
+
+	        if (probe_alive_group(&pe, NET_GROUP_TB, policy)) {
+			/*
+			 * If we ping successfully, misses must
+			 * be reset.  We must miss _offline 
+			 * *consecutive* pings to declare the
+			 * IP tiebreaker offline
+			 */
+			misses = 0;
+			alive = 1;
+			last_reply = net_clock();
+		} else {
+			/*
+			 * Save errno for later because pthread_rwlock_*
+			 * may alter it.
+			 */
+			errno_save = errno;
+			/*
+			 * Sorry, must have _online consecutive
+			 * hits to be declared online if currently down.
+			 * Otherwise, this line is meaningless.
+			 */
+			hits = 0;
+		}
+
+		/*
+		 * Report the first failed path; with several paths, note
+		 * the ones which are down even if the policy says alive.
+		 */
+		for (x = 0; x < pe.pe_npaths; x++) {
+			pp = &pe.pe_paths[x];
+			if (pp->pp_group != NET_GROUP_TB ||
+			    pp->pp_result == PING_SUCCESS)
+				continue;
+			if (!alive) {
+				ping_ret = pp->pp_result;
+				failed = x;
+				break;
+			}
+			errno = errno_save;
+			LOG(LOG_DEBUG, "IPv4 TB: Path %s missed ping; %s\n",
+			    pp->pp_name, icmp_ping_strerror(pp->pp_result));
+		}
+
+		pthread_rwlock_rdlock(&net_lock);
+		if (!tb_ip || strcmp(tb_ip, target)) {
+			/* Tie breaker changed during ping; restart */
+			restart = 1;
+		}
+		pthread_rwlock_unlock(&net_lock);
+
+		/*
+		   If tiebreaker IP changed, start from the top and 
+		   try pinging the new one before updating status
+		 */
+		if (restart)
+			continue;
+
+		link_down = 0;
+		if (was_alive && !alive) {
+			/*
+			 * The kernel says the links are down (all of them,
+			 * or with -A any one): no need to wait for more
+			 * misses.
+			 */
+			link_down = probe_rtnl_down(&pe, NET_GROUP_TB, policy);
+			if (link_down)
+				misses = _offline - 1;
+			/* First miss: find out where the path is broken */
+			else if (!misses && !tb_replay)
+				net_hops_start(&pe, &pe.pe_paths[failed],
+					       (uint32_t)timeout);
+
+			/*
+			 * Confirmation rounds come 10ms apart, so the
+			 * count alone says little about how long the
+			 * tiebreaker has been gone: it must also have
+			 * been silent for the whole offline time.
+			 */
+			if (misses < _offline)
+				++misses;
+			if (misses < _offline || (!link_down &&
+			    net_clock() - last_reply < (uint64_t)down)) {
+				alive = was_alive;
+
+				/*
+				 * pthread_rwlock_* are not guaranteed to
+				 * leave errno unmodified, so set back to
+				 * our saved value before reporting the
+				 * error.
+				 */
+				errno = errno_save;
+
+				/* Whine if we miss a ping */
+				LOG(LOG_DEBUG, "IPv4 TB: Missed ping "
+				       "(%d/%d); %s\n", misses, _offline,
+				       icmp_ping_strerror(ping_ret));
+			} else {
+				++tb_transitions[0];
+				LOG(LOG_NOTICE, "IPv4 TB @ %s Offline%s\n",
+				       target, link_down ? " (link down)" : "");
+				hops_wanted = !link_down;
+			}
+		} else if (!was_alive && alive) {
+			if (++hits < _online) {
+				alive = was_alive;
+				misses = 0;
+			} else {
+				++tb_transitions[1];
+				LOG(LOG_NOTICE, "IPv4 TB @ %s Online\n",
+				       target);
+			}
+		}
+		
+		/*
+		 * The hop map goes out with the offline transition, or
+		 * as soon after as the sweep is done; if the misses
+		 * came to nothing, nobody needs it.
+		 */
+		if ((hops_wanted || !misses) && net_hops_log(!hops_wanted))
+			hops_wanted = 0;
+
+		x = net_grade_update(&ng, &pe, probe_alive_group(&pe,
+				     NET_GROUP_TB, policy), alive);
+		if (x != grade)
+			LOG(LOG_INFO, "IPv4 TB: Vote grade %d/%d\n", x,
+			    NET_GRADE_MAX);
+		grade = x;
+
+		x = gy.gy_state;
+		if (net_gray_update(&gy, &ng, alive, loss, rtt) ==
+		    NET_TB_DEGRADED && x != NET_TB_DEGRADED) {
+			++tb_transitions[2];
+			LOG(LOG_WARNING, "IPv4 TB @ %s Degraded: lost %d of "
+			    "%d rounds, rtt p50/p90 %u/%u us\n", target,
+			    gy.gy_lost, gy.gy_rounds, gy.gy_p50, gy.gy_p90);
+		} else if (x == NET_TB_DEGRADED &&
+			   gy.gy_state == NET_TB_ONLINE) {
+			LOG(LOG_NOTICE, "IPv4 TB @ %s No longer degraded\n",
+			    target);
+		}
+
+		pthread_rwlock_wrlock(&net_lock);
+		net_vote_alive = alive;
+		net_grade = grade;
+		net_state = gy.gy_state;
+		pthread_rwlock_unlock(&net_lock);
+
+		if (net_sleep(interval, &pe))
+			net_confirm(&pe, _offline);
+	}
+	net_hops_stop();
+	probe_rtnl_close(&tb_rtnl);
+	probe_engine_destroy(&pe);
+	net_cleanup();
+
+	printf("Exiting\n");
+
+	return NULL;
+}
+
+
+/**
+  Work out the ping interval and the hysteresis for a failover time.
+
+  @param fo_time	Token timeout (microseconds).
+  @param _interval	Ping interval hint (microseconds).
+  @param nt		Filled in.
+  @return		0, or -1 if fo_time is too short, or the interval too
+  			short for it (more rounds than the thread can count).
+ */
+static int
+net_timing(int fo_time, int _interval, struct net_timing *nt)
+{
+	int _tko;
+	int up_time, down_time;
+
+	if (fo_time < 2000000) {
+		LOG(LOG_ERR, "IPv4-TB: Failover time too fast for "
+		       "IP-based tiebreaker.\n");
+		return -1;
+	}
+
+	_tko = fo_time / _interval;
+
+	/* IP declare-up time must *EXCEED* failover time */
+	up_time = fo_time + (3 * _interval);
+
+	/* Death/dead time for IP tiebreakers must be *less* than failover
+	 * time, leaving enough space ping lag */
+	down_time = _interval * (((_tko&~1)-1) / 2);
+
+	/* Slow down the ping rate slightly */
+	_interval = (_interval<<2)/3;
+
+	/* Misses must also span the whole of it; see net_quorum_thread */
+	nt->nt_down = down_time;
+
+	/* Get our base TKOs for up / down */
+	up_time /= _interval;
+	down_time /= _interval;
+
+	if (down_time < 1 || up_time > NET_MAX_TKO) {
+		LOG(LOG_ERR, "IPv4-TB: Ping interval does not fit the "
+		       "failover time (On:%d Off:%d rounds).\n", up_time,
+		       down_time);
+		return -1;
+	}
+
+	nt->nt_interval = _interval;
+
+	/*
+	 * Paths which back off from a rate limiter may stretch the gap
+	 * between probes, but only as far as still fits declare_offline
+	 * probes in three quarters of the failover time.
+	 */
+	nt->nt_max_gap = down_time ? (fo_time / 4 * 3) / down_time :
+				     _interval;
+	if (nt->nt_max_gap < _interval)
+		nt->nt_max_gap = _interval;
+
+	/* Ensure we exceed membership f/o speed for declaring online */
+	nt->nt_online = up_time;
+
+	/* Way less for declaring offline. */
+	nt->nt_offline = down_time;
+
+	return 0;
+}
+
+
+static void
+net_timing_apply(struct net_timing *nt)
+{
+	ping_interval = nt->nt_interval;
+	probe_max_gap = nt->nt_max_gap;
+	declare_online = nt->nt_online;
+	declare_offline = nt->nt_offline;
+	declare_down = nt->nt_down;
+}
+
+
+static int
+get_interval_tko(int fo_time, int _interval)
+{
+	struct net_timing nt;
+
+	if (net_timing(fo_time, _interval, &nt) < 0)
+		return -1;
+
+	pthread_rwlock_wrlock(&net_lock);
+	net_timing_apply(&nt);
+	totem_timeout = fo_time;
+	ping_hint = _interval;
+	pthread_rwlock_unlock(&net_lock);
+
+	LOG(LOG_INFO, "IPv4-TB: Interval %d microseconds, On:%d Off:%d\n",
+	       nt.nt_interval, nt.nt_online, nt.nt_offline);
+
+	return 0;
+}
+
+
+/**
+  Store the tiebreaker IP in our local copy.
+
+  @param target		New tiebreaker IP address
+ */
+int
+net_tiebreaker_init(char *target, int token, int interval)
+{
+	errno = EINVAL;
+
+	if (!target)
+		return -1;
+
+	if (get_interval_tko(token, interval) < 0)
+		return -1;
+
+	pthread_rwlock_wrlock(&net_lock);
+	if (tb_ip && strcmp(tb_ip, target))
+		free(tb_ip);
+	tb_ip = strdup(target);
+	pthread_rwlock_unlock(&net_lock);
+
+	errno = 0;
+	return 0;
+}
+	
+
+/**
+  Add a probe path to the tiebreaker.  Each path gets its own socket,
+  pinned by interface, source address and/or routing mark; see
+  icmp_opts_parse for the syntax.  Takes effect when the thread next
+  (re)builds its probe engine.
+
+  @param spec		Path specification.
+  @return		0 on success, -1 on a bad spec or too many paths.
+ */
+int
+net_tiebreaker_add_path(char *spec)
+{
+	struct icmp_opts opts;
+	int ret = -1;
+
+	if (icmp_opts_parse(spec, &opts) < 0)
+		return -1;
+
+	pthread_rwlock_wrlock(&net_lock);
+	if (tb_npaths < NET_MAX_PATHS) {
+		tb_paths[tb_npaths] = strdup(spec);
+		if (tb_paths[tb_npaths]) {
+			++tb_npaths;
+			ret = 0;
+		}
+	} else {
+		errno = ENOSPC;
+	}
+	pthread_rwlock_unlock(&net_lock);
+
+	return ret;
+}
+
+
+/**
+  Add a path to the peer node, by way of a network the cluster does not
+  use, so that when the peer drops out of the membership we can tell a
+  dead peer (unreachable everywhere) from a network split (reachable
+  here, just not over the cluster network).  Probed on the same engine
+  as the tiebreaker, but never counted towards its vote; see
+  net_tiebreaker_peer.  Takes effect when the thread next (re)builds
+  its probe engine.
+
+  @param spec		<address>[,<path options>]; see icmp_opts_parse.
+  @return		0 on success, -1 on a bad spec or too many paths.
+ */
+int
+net_tiebreaker_add_peer(char *spec)
+{
+	struct icmp_opts opts;
+	char host[PROBE_NAMELEN];
+	int ret = -1;
+
+	if (net_peer_parse(spec, host, sizeof(host), &opts) < 0)
+		return -1;
+
+	pthread_rwlock_wrlock(&net_lock);
+	if (tb_npeers < NET_MAX_PATHS) {
+		tb_peers[tb_npeers] = strdup(spec);
+		if (tb_peers[tb_npeers]) {
+			++tb_npeers;
+			ret = 0;
+		}
+	} else {
+		errno = ENOSPC;
+	}
+	pthread_rwlock_unlock(&net_lock);
+
+	return ret;
+}
+
+
+static void
+net_config_free(struct net_config *nc)
+{
+	int x;
+
+	free(nc->nc_target);
+	for (x = 0; x < nc->nc_npaths; x++)
+		free(nc->nc_paths[x]);
+	for (x = 0; x < nc->nc_npeers; x++)
+		free(nc->nc_peers[x]);
+}
+
+
+/**
+  Parse a probe timeout setting: <min>[,<max>] in milliseconds, or 0
+  for a fixed timeout.
+
+  @return		0, or -1 if it is no good.
+ */
+static int
+net_timeout_parse(const char *spec, int *min_us, int *max_us)
+{
+	char *end;
+	long lo, hi = NET_RTO_MAX / 1000;
+
+	lo = strtol(spec, &end, 10);
+	if (*end == ',')
+		hi = strtol(end + 1, &end, 10);
+	if (*end || end == spec || lo < 0 || hi < 1 || hi > 60000 ||
+	    (lo && lo > hi))
+		return -1;
+
+	*min_us = (int)lo * 1000;
+	*max_us = (int)hi * 1000;
+	return 0;
+}
+
+
+/**
+  Parse a hedging setting: <copies>[,<spacing>], spacing in
+  milliseconds.
+
+  @return		0, or -1 if it is no good.
+ */
+static int
+net_hedge_parse(const char *spec, int *copies, int *spacing_us)
+{
+	char *end;
+	long n, ms = PROBE_HEDGE_SPACING / 1000;
+
+	n = strtol(spec, &end, 10);
+	if (*end == ',')
+		ms = strtol(end + 1, &end, 10);
+	if (*end || end == spec || n < 1 || n > PROBE_HEDGE_MAX ||
+	    ms < 1 || ms > 1000)
+		return -1;
+
+	*copies = (int)n;
+	*spacing_us = (int)ms * 1000;
+	return 0;
+}
+
+
+/**
+  Parse the degraded thresholds: <loss>[,<rtt>], loss in percent of
+  rounds and rtt (90th percentile) in milliseconds; 0 turns either off.
+
+  @return		0, or -1 if it is no good.
+ */
+static int
+net_gray_parse(const char *spec, int *loss, int *rtt_us)
+{
+	char *end;
+	long pct, ms = NET_GRAY_RTT / 1000;
+
+	pct = strtol(spec, &end, 10);
+	if (*end == ',')
+		ms = strtol(end + 1, &end, 10);
+	if (*end || end == spec || pct < 0 || pct > 100 || ms < 0 ||
+	    ms > 60000)
+		return -1;
+
+	*loss = (int)pct;
+	*rtt_us = (int)ms * 1000;
+	return 0;
+}
+
+
+/**
+  Take one "key value" line of a configuration file.
+
+  @return		0, or -1 if the key or value is no good.
+ */
+static int
+net_config_line(struct net_config *nc, char *key, char *val)
+{
+	struct icmp_opts opts;
+	char host[PROBE_NAMELEN], *end, **list;
+	int *count;
+	long num;
+
+	if (!strcmp(key, "path") || !strcmp(key, "peer")) {
+		if (key[1] == 'a') {
+			if (icmp_opts_parse(val, &opts) < 0)
+				return -1;
+			list = nc->nc_paths;
+			count = &nc->nc_npaths;
+		} else {
+			if (net_peer_parse(val, host, sizeof(host),
+					   &opts) < 0)
+				return -1;
+			list = nc->nc_peers;
+			count = &nc->nc_npeers;
+		}
+		if (*count < 0)
+			*count = 0;
+		if (*count >= NET_MAX_PATHS)
+			return -1;
+		list[*count] = strdup(val);
+		if (!list[*count])
+			return -1;
+		++*count;
+		return 0;
+	}
+
+	if (!strcmp(key, "tiebreaker")) {
+		free(nc->nc_target);
+		nc->nc_target = strdup(val);
+		return nc->nc_target ? 0 : -1;
+	}
+	if (!strcmp(key, "policy")) {
+		if (!strcmp(val, "any"))
+			nc->nc_policy = PROBE_POLICY_ANY;
+		else if (!strcmp(val, "all"))
+			nc->nc_policy = PROBE_POLICY_ALL;
+		else
+			return -1;
+		return 0;
+	}
+	if (!strcmp(key, "backend")) {
+		nc->nc_backend = probe_backend_parse(val);
+		return nc->nc_backend < 0 ? -1 : 0;
+	}
+	if (!strcmp(key, "rate")) {
+		nc->nc_rate = strtod(val, &end);
+		return (*end || end == val || nc->nc_rate < 0) ? -1 : 0;
+	}
+	if (!strcmp(key, "timeout"))
+		return net_timeout_parse(val, &nc->nc_rto_min,
+					 &nc->nc_rto_max);
+	if (!strcmp(key, "hedge"))
+		return net_hedge_parse(val, &nc->nc_hedge,
+				       &nc->nc_hedge_spacing);
+	if (!strcmp(key, "degraded"))
+		return net_gray_parse(val, &nc->nc_gray_loss,
+				      &nc->nc_gray_rtt);
+
+	num = strtol(val, &end, 0);
+	if (*end || end == val || num < 0 || num > 0x7fffffffL)
+		return -1;
+	if (!strcmp(key, "token") && num >= MIN_TOKEN &&
+	    num <= 0x7fffffffL / 1000)
+		nc->nc_token = (int)num;
+	else if (!strcmp(key, "interval") && num >= MIN_INTERVAL &&
+		 num <= 0x7fffffffL / 1000)
+		nc->nc_interval = (int)num;
+	else if (!strcmp(key, "dscp") && num <= 63)
+		nc->nc_dscp = (int)num;
+	else if (!strcmp(key, "priority"))
+		nc->nc_priority = (int)num;
+	else if (!strcmp(key, "busy_poll"))
+		nc->nc_busy_poll = (int)num;
+	else
+		return -1;
+	return 0;
+}
+
+
+/**
+  Load a configuration file, one "key value" per line ('#' starts a
+  comment): tiebreaker <host>, token <msec>, interval <msec>, path
+  <spec>, peer <spec>, policy any|all, dscp <x>, priority <x>, rate
+  <probes/s>, backend <name>, busy_poll <usec>, timeout <min>[,<max>],
+  hedge <copies>[,<spacing>] and degraded <loss>[,<rtt>], as for the
+  corresponding command line options.  Settings the file leaves out
+  stay as they are; path and peer lines, if there are any, replace the
+  whole list.
+
+  The file is checked in full before anything changes, and then all of
+  it takes effect at once.  The thread is woken to rebuild its probe
+  engine; paths which did not change keep their statistics and budget,
+  and the online/offline hysteresis carries on where it was.
+
+  @param file		Configuration file.
+  @return		0, or -1 if it could not be read or is no good
+  			(nothing changes).
+ */
+int
+net_tiebreaker_load(char *file)
+{
+	struct net_config nc;
+	struct net_timing nt;
+	char line[512], *key, *val, *save = NULL;
+	uint64_t start = probe_now(), one = 1;
+	unsigned gen;
+	int x, lineno = 0, ret = -1, token, hint;
+	FILE *fp;
+
+	memset(&nc, 0, sizeof(nc));
+	nc.nc_token = nc.nc_interval = -1;
+	nc.nc_npaths = nc.nc_npeers = -1;
+	nc.nc_policy = nc.nc_dscp = nc.nc_priority = -1;
+	nc.nc_backend = nc.nc_busy_poll = -1;
+	nc.nc_rate = -1;
+	nc.nc_rto_min = nc.nc_rto_max = -1;
+	nc.nc_hedge = nc.nc_hedge_spacing = -1;
+	nc.nc_gray_loss = nc.nc_gray_rtt = -1;
+
+	fp = fopen(file, "r");
+	if (!fp)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		++lineno;
+		val = strchr(line, '#');
+		if (val)
+			*val = 0;
+		key = strtok_r(line, " \t\r\n", &save);
+		if (!key)
+			continue;
+		val = strtok_r(NULL, " \t\r\n", &save);
+		if (!val || strtok_r(NULL, " \t\r\n", &save) ||
+		    net_config_line(&nc, key, val) < 0) {
+			LOG(LOG_ERR, "IPv4 TB: %s:%d: bad setting '%s'\n",
+			    file, lineno, key);
+			errno = EINVAL;
+			goto out;
+		}
+	}
+	if (ferror(fp))
+		goto out;
+
+	pthread_rwlock_rdlock(&net_lock);
+	token = nc.nc_token >= 0 ? nc.nc_token * 1000 : totem_timeout;
+	hint = nc.nc_interval >= 0 ? nc.nc_interval * 1000 : ping_hint;
+	x = !nc.nc_target && !tb_ip;
+	pthread_rwlock_unlock(&net_lock);
+
+	if (x) {
+		LOG(LOG_ERR, "IPv4 TB: %s: no tiebreaker\n", file);
+		errno = EINVAL;
+		goto out;
+	}
+	if (!token)
+		token = TOTEM_TOKEN_DEFAULT * 1000;
+	if (hint <= 0 || net_timing(token, hint, &nt) < 0) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	pthread_rwlock_wrlock(&net_lock);
+	if (nc.nc_target) {
+		free(tb_ip);
+		tb_ip = nc.nc_target;
+		nc.nc_target = NULL;
+	}
+	net_timing_apply(&nt);
+	totem_timeout = token;
+	ping_hint = hint;
+	if (nc.nc_npaths >= 0) {
+		for (x = 0; x < tb_npaths; x++)
+			free(tb_paths[x]);
+		memcpy(tb_paths, nc.nc_paths, sizeof(tb_paths));
+		tb_npaths = nc.nc_npaths;
+		nc.nc_npaths = 0;
+	}
+	if (nc.nc_npeers >= 0) {
+		for (x = 0; x < tb_npeers; x++)
+			free(tb_peers[x]);
+		memcpy(tb_peers, nc.nc_peers, sizeof(tb_peers));
+		tb_npeers = nc.nc_npeers;
+		nc.nc_npeers = 0;
+	}
+	if (nc.nc_policy >= 0)
+		path_policy = nc.nc_policy;
+	if (nc.nc_dscp >= 0)
+		tb_marking.io_dscp = nc.nc_dscp;
+	if (nc.nc_priority >= 0)
+		tb_marking.io_priority = nc.nc_priority;
+	if (nc.nc_rate >= 0)
+		probe_max_rate = nc.nc_rate;
+	if (nc.nc_backend >= 0)
+		probe_backend = nc.nc_backend;
+	if (nc.nc_busy_poll >= 0)
+		probe_busy_poll = nc.nc_busy_poll;
+	if (nc.nc_rto_min >= 0) {
+		probe_rto_min = nc.nc_rto_min;
+		probe_rto_max = nc.nc_rto_max;
+	}
+	if (nc.nc_hedge >= 0) {
+		probe_hedge_copies = nc.nc_hedge;
+		probe_hedge_spacing = nc.nc_hedge_spacing;
+	}
+	if (nc.nc_gray_loss >= 0) {
+		gray_loss = nc.nc_gray_loss;
+		gray_rtt = nc.nc_gray_rtt;
+	}
+	gen = ++net_config_gen;
+	net_reload_start = start;
+	pthread_rwlock_unlock(&net_lock);
+
+	LOG(LOG_INFO, "IPv4 TB: Configuration %u loaded from %s; interval "
+	    "%d microseconds, On:%d Off:%d\n", gen, file, nt.nt_interval,
+	    nt.nt_online, nt.nt_offline);
+
+	/* Do not leave it to finish its sleep */
+	if (net_wake_fd >= 0 && write(net_wake_fd, &one, sizeof(one)) < 0)
+		LOG(LOG_WARNING, "IPv4 TB: Failed to wake thread: %s\n",
+		    strerror(errno));
+	ret = 0;
+out:
+	fclose(fp);
+	net_config_free(&nc);
+	return ret;
+}
+
+
+/**
+  The ping interval hint currently in effect (milliseconds), as last set
+  from the command line or a configuration file.
+ */
+int
+net_tiebreaker_interval(void)
+{
+	int ms;
+
+	pthread_rwlock_rdlock(&net_lock);
+	ms = ping_hint / 1000;
+	pthread_rwlock_unlock(&net_lock);
+
+	return ms;
+}
+
+
+/**
+  Set the failover timing alone, for when the tiebreaker itself comes
+  from a configuration file; see net_tiebreaker_init.
+ */
+int
+net_tiebreaker_timing(int token, int interval)
+{
+	return get_interval_tko(token, interval);
+}
+
+
+/**
+  Choose how path results combine: by default the tiebreaker counts as
+  alive if any path answers; with all set, only if every path does.
+ */
+void
+net_tiebreaker_policy(int all)
+{
+	pthread_rwlock_wrlock(&net_lock);
+	path_policy = all ? PROBE_POLICY_ALL : PROBE_POLICY_ANY;
+	pthread_rwlock_unlock(&net_lock);
+}
+
+
+/**
+  Mark tiebreaker probes so they are not queued behind bulk traffic on a
+  saturated uplink.  Applies to every path which does not set its own
+  dscp= or prio=.
+
+  @param dscp		DSCP code point (0-63) for IP_TOS; 0 = leave alone.
+  @param priority	SO_PRIORITY, i.e. the local qdisc band; 0 = leave
+  			alone.
+  @return		0, or -1 if dscp or priority is out of range.
+ */
+int
+net_tiebreaker_marking(int dscp, int priority)
+{
+	if (dscp < 0 || dscp > 63 || priority < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_rwlock_wrlock(&net_lock);
+	tb_marking.io_dscp = dscp;
+	tb_marking.io_priority = priority;
+	pthread_rwlock_unlock(&net_lock);
+
+	return 0;
+}
 
 
 /**
-  Clean up local variables
+  Cap the probe rate of each path.  The rate backs off from there if an
+  ICMP rate limiter seems to be dropping our echoes.
+
+  @param rate		Probes per second; 0 means one per ping interval.
  */
-static void
-net_cleanup(void)
+void
+net_tiebreaker_rate(double rate)
 {
 	pthread_rwlock_wrlock(&net_lock);
-	net_vote_alive = 0;
-	if (tb_ip) {
-		free(tb_ip);
-		tb_ip = NULL;
-	}
-	net_thread = (pthread_t)0;
+	probe_max_rate = rate > 0 ? rate : 0;
 	pthread_rwlock_unlock(&net_lock);
 }
 
 
 /**
-  Net tiebreaker thread.
+  Spin rather than sleep around each expected reply, for usec at a time.
+  Costs CPU; the statistics dump shows how much, and the RTTs of
+  replies caught spinning vs. blocked.  Takes effect when the thread
+  next (re)builds its probe engine.
 
-  @param arg		Unused.
-  @return		NULL
+  @param usec		Spin window; 0 turns busy polling off.
  */
-void *
-net_quorum_thread(void *arg)
+void
+net_tiebreaker_busy_poll(int usec)
 {
-	int restart;
-	char alive, was_alive, hits = 0, misses = 0, _online, _offline;
-	int interval, ping_ret, errno_save;
-	char target[64];
-
-	while (1) {
-		alive = 0;
-		restart = 0;
-
-		pthread_rwlock_rdlock(&net_lock);
-		was_alive = net_vote_alive;
-		if (!tb_ip) {
-			pthread_rwlock_unlock(&net_lock);
-			break;
-		}
-		strncpy(target, tb_ip, sizeof(target));
+	pthread_rwlock_wrlock(&net_lock);
+	probe_busy_poll = usec > 0 ? usec : 0;
+	pthread_rwlock_unlock(&net_lock);
+}
 
-		interval = ping_interval;
-		_online = declare_online;
-		_offline = declare_offline;
 
-		pthread_rwlock_unlock(&net_lock);
+/**
+  Set the probe timeout.  By default each probe waits as long as its
+  path's RTT history says a reply could take (smoothed RTT plus four
+  deviations, as TCP's retransmission timeout, doubling after each
+  timeout), between NET_RTO_MIN and NET_RTO_MAX; a miss on a fast path
+  is then known in milliseconds.  The offline hysteresis still counts
+  misses at the ping interval, so it keeps to the failover time.  Takes
+  effect when the thread next (re)builds its probe engine.
 
-		ping_ret = icmp_ping_host(target, 0, 1);
-	        if (ping_ret == 0) {
-			/*
-			 * If we ping successfully, misses must
-			 * be reset.  We must miss _offline 
-			 * *consecutive* pings to declare the
-			 * IP tiebreaker offline
-			 */
-			misses = 0;
-			alive = 1;
-		} else {
-			/*
-			 * Save errno for later because pthread_rwlock_*
-			 * may alter it.
-			 */
-			errno_save = errno;
-			/*
-			 * Sorry, must have _online consecutive
-			 * hits to be declared online if currently down.
-			 * Otherwise, this line is meaningless.
-			 */
-			hits = 0;
-		}
+  @param spec		<min>[,<max>] in milliseconds; 0 for a fixed
+  			timeout of <max> (1 second by default).
+  @return		0, or -1 if spec is no good.
+ */
+int
+net_tiebreaker_timeout(char *spec)
+{
+	int lo, hi;
 
-		pthread_rwlock_rdlock(&net_lock);
-		if (strcmp(tb_ip, target)) {
-			/* Tie breaker changed during ping; restart */
-			restart = 1;
-		}
-		pthread_rwlock_unlock(&net_lock);
+	if (net_timeout_parse(spec, &lo, &hi) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
 
-		/*
-		   If tiebreaker IP changed, start from the top and 
-		   try pinging the new one before updating status
-		 */
-		if (restart)
-			continue;
+	pthread_rwlock_wrlock(&net_lock);
+	probe_rto_min = lo;
+	probe_rto_max = hi;
+	pthread_rwlock_unlock(&net_lock);
+	return 0;
+}
 
-		if (was_alive && !alive) {
-			if (++misses < _offline) {
-				alive = was_alive;
 
-				/*
-				 * pthread_rwlock_* are not guaranteed to
-				 * leave errno unmodified, so set back to
-				 * our saved value before reporting the
-				 * error.
-				 */
-				errno = errno_save;
+/**
+  Hedge each probe: send it <copies> times, <spacing> apart, and take
+  whichever reply comes back first, so that one lost echo no longer
+  makes a miss.  Costs <copies> times the echoes.  Takes effect when
+  the thread next (re)builds its probe engine.
 
-				/* Whine if we miss a ping */
-				LOG(LOG_DEBUG, "IPv4 TB: Missed ping "
-				       "(%d/%d); %s\n", misses, _offline,
-				       icmp_ping_strerror(ping_ret));
-			} else {
-				LOG(LOG_NOTICE, "IPv4 TB @ %s Offline\n",
-				       target);
-			}
-		} else if (!was_alive && alive) {
-			if (++hits < _online) {
-				alive = was_alive;
-				misses = 0;
-			} else {
-				LOG(LOG_NOTICE, "IPv4 TB @ %s Online\n",
-				       target);
-			}
-		}
-		
-		pthread_rwlock_wrlock(&net_lock);
-		net_vote_alive = alive;
-		pthread_rwlock_unlock(&net_lock);
+  @param spec		<copies>[,<spacing>], spacing in milliseconds
+  			(5 by default); 1 turns hedging off.
+  @return		0, or -1 if spec is no good.
+ */
+int
+net_tiebreaker_hedge(char *spec)
+{
+	int copies, spacing;
 
-		usleep(interval);
+	if (net_hedge_parse(spec, &copies, &spacing) < 0) {
+		errno = EINVAL;
+		return -1;
 	}
-	net_cleanup();
-
-	printf("Exiting\n");
 
-	return NULL;
+	pthread_rwlock_wrlock(&net_lock);
+	probe_hedge_copies = copies;
+	probe_hedge_spacing = spacing;
+	pthread_rwlock_unlock(&net_lock);
+	return 0;
 }
 
 
-static int
-get_interval_tko(int fo_time, int _interval)
+/**
+  Set when the tiebreaker counts as degraded (see net_tiebreaker_state):
+  losing more than <loss> percent of rounds, or answering with a 90th
+  percentile RTT over <rtt>.  Takes effect on the next round.
+
+  @param spec		<loss>[,<rtt>], rtt in milliseconds (default
+  			10,200); 0 turns that test off.
+  @return		0, or -1 if spec is no good.
+ */
+int
+net_tiebreaker_gray(char *spec)
 {
-	int _tko;
-	int up_time, down_time;
-	char *val = NULL;
-	int ccsfd;
+	int loss, rtt;
 
-	if (fo_time < 2000000) {
-		LOG(LOG_ERR, "IPv4-TB: Failover time too fast for "
-		       "IP-based tiebreaker.\n");
+	if (net_gray_parse(spec, &loss, &rtt) < 0) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	_tko = fo_time / _interval;
+	pthread_rwlock_wrlock(&net_lock);
+	gray_loss = loss;
+	gray_rtt = rtt;
+	pthread_rwlock_unlock(&net_lock);
+	return 0;
+}
 
-	/* IP declare-up time must *EXCEED* failover time */
-	up_time = fo_time + (3 * _interval);
 
-	/* Death/dead time for IP tiebreakers must be *less* than failover
-	 * time, leaving enough space ping lag */
-	down_time = _interval * (((_tko&~1)-1) / 2);
+/**
+  Choose the probe engine's I/O backend.  Takes effect when the
+  thread next (re)builds its probe engine.
 
-	/* Slow down the ping rate slightly */
-	_interval = (_interval<<2)/3;
+  @param name		Backend name; see probe_backend_parse.
+  @return		0, or -1 if there is no such backend.
+ */
+int
+net_tiebreaker_backend(char *name)
+{
+	int backend;
 
-	/* Get our base TKOs for up / down */
-	up_time /= _interval;
-	down_time /= _interval;
+	backend = probe_backend_parse(name);
+	if (backend < 0) {
+		errno = EINVAL;
+		return -1;
+	}
 
 	pthread_rwlock_wrlock(&net_lock);
-	ping_interval = _interval;
+	probe_backend = backend;
+	pthread_rwlock_unlock(&net_lock);
 
-	/* Ensure we exceed membership f/o speed for declaring online */
-	declare_online = up_time;
+	return 0;
+}
 
-	/* Way less for declaring offline. */
-	declare_offline = down_time;
-	pthread_rwlock_unlock(&net_lock);
 
-	LOG(LOG_INFO, "IPv4-TB: Interval %d microseconds, On:%d Off:%d\n",
-	       _interval, up_time, down_time);
+/**
+  Record every probe outcome to a trace file, for net_tiebreaker_replay
+  to play back later.  Takes effect when the thread next (re)builds its
+  probe engine.
 
+  @param file		Trace file; created, or truncated if it exists.
+  @return		0, or -1 if it could not be opened.
+ */
+int
+net_tiebreaker_trace(char *file)
+{
+	if (probe_trace_open(&tb_trace, file, 0) < 0)
+		return -1;
+	tb_tracing = 1;
 	return 0;
 }
 
 
 /**
-  Store the tiebreaker IP in our local copy.
+  Run a recorded trace through the tiebreaker thread's decision logic,
+  in this thread, with the current settings (interval, token timeout,
+  path policy) in place of the recorded ones.  Every recorded round
+  stands in for one probe round; transitions are logged with the trace
+  time at which they would have happened.
 
-  @param target		New tiebreaker IP address
+  @param file		Trace file from net_tiebreaker_trace or qping.
+  @param speed		Multiple of real time to replay at; 0 means as
+  			fast as possible.
+  @param token		Token timeout (microseconds).
+  @param interval	Ping interval hint (microseconds).
+  @return		0, or -1 if the trace could not be read.
  */
 int
-net_tiebreaker_init(char *target, int token, int interval)
+net_tiebreaker_replay(char *file, double speed, int token, int interval)
 {
-	errno = EINVAL;
+	uint64_t start, elapsed;
 
-	if (!target)
+	if (probe_trace_open(&tb_trace, file, 1) < 0)
 		return -1;
+	tb_replay = 1;
+	tb_replay_speed = speed;
 
-	if (get_interval_tko(token, interval) < 0)
+	if (net_tiebreaker_init(tb_trace.tf_paths[0].tp_host, token,
+				interval) < 0) {
+		probe_trace_close(&tb_trace);
+		tb_replay = 0;
 		return -1;
+	}
 
-	pthread_rwlock_wrlock(&net_lock);
-	if (tb_ip && strcmp(tb_ip, target))
-		free(tb_ip);
-	tb_ip = strdup(target);
-	pthread_rwlock_unlock(&net_lock);
+	start = probe_now();
+	net_quorum_thread(NULL);
+	elapsed = probe_now() - start;
 
-	errno = 0;
-	return;
+	LOG(LOG_INFO, "IPv4 TB: Replayed %llu rounds (%.3fs of trace) in "
+	    "%.3fs; %d offline, %d online, %d degraded transitions\n",
+	    (unsigned long long)tb_trace.tf_rounds,
+	    (double)tb_trace.tf_clock / 1000000, (double)elapsed / 1000000,
+	    tb_transitions[0], tb_transitions[1], tb_transitions[2]);
+
+	probe_trace_close(&tb_trace);
+	tb_replay = 0;
+	return 0;
 }
-	
+
+
+/**
+  Ask the thread to log its per-path statistics.  Only sets a flag, so
+  this is safe to call from a signal handler.
+ */
+void
+net_tiebreaker_dump(void)
+{
+	dump_stats = 1;
+}
+
 
 /**
   Provide the status of the net tiebreaker IP to the quorum daemon.
@@ -266,19 +2057,136 @@ net_tiebreaker(void)
 
 
 /**
-  Cancel the net tiebreaker thread
+  Is the tiebreaker reachable only by small packets?  Set while the
+  full-size probes of some path (see the mtu= path option) are failing,
+  whatever net_tiebreaker says; traffic the size of the cluster's own
+  may not be getting through.
+
+  @return		1 if degraded, 0 if not
  */
 int
-net_cancel_quorum_thread(void)
+net_tiebreaker_degraded(void)
 {
+	int ret;
+
 	pthread_rwlock_rdlock(&net_lock);
-	if (net_thread == (pthread_t)0) {
-		pthread_rwlock_unlock(&net_lock);
+	ret = net_degraded;
+	pthread_rwlock_unlock(&net_lock);
+	return ret;
+}
+
+
+/**
+  What the peer paths say about the peer node, for telling why it left
+  the membership.
+
+  @return		NET_PEER_UP if some peer path answers,
+  			NET_PEER_DOWN if none has for NET_PEER_MISSES
+			rounds, NET_PEER_UNKNOWN if there are no peer
+			paths or no answers yet.
+ */
+int
+net_tiebreaker_peer(void)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&net_lock);
+	ret = net_peer;
+	pthread_rwlock_unlock(&net_lock);
+	return ret;
+}
+
+
+/**
+  Graded tiebreaker vote, for telling which side of a split has the
+  better path to the tiebreaker; see net_grade_update.
+
+  @return		0 (tiebreaker offline) to NET_GRADE_MAX.
+ */
+int
+net_tiebreaker_grade(void)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&net_lock);
+	ret = net_grade;
+	pthread_rwlock_unlock(&net_lock);
+	return ret;
+}
+
+
+/**
+  Three-way state of the tiebreaker: offline (as net_tiebreaker says),
+  online, or online but degraded by loss or RTT; see net_gray_update.
+
+  @return		NET_TB_OFFLINE, NET_TB_DEGRADED or NET_TB_ONLINE.
+ */
+int
+net_tiebreaker_state(void)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&net_lock);
+	ret = net_state;
+	pthread_rwlock_unlock(&net_lock);
+	return ret;
+}
+
+
+/**
+  Stop the net tiebreaker thread: wake it through its eventfd, wherever
+  it is waiting, and join it once it has closed its sockets.  Nothing
+  is cancelled, so the thread never dies holding net_lock or inside
+  syslog().  The hop sweep thread is joined by the tiebreaker thread on
+  its way out, so the deadline covers both.  A thread which already
+  exited by itself (say, no tiebreaker configured) is simply joined.
+  Gives up after NET_STOP_TIMEOUT (say, if it is stuck resolving a host
+  name) and leaves the thread to finish by itself; it stays joinable,
+  so a later call picks it up.
+
+  @return		0, or -1 (ETIMEDOUT) if the thread did not stop in
+  			time.
+ */
+int
+net_cancel_quorum_thread(void)
+{
+	struct timespec deadline;
+	pthread_t thread = net_thread;
+	uint64_t start, val = 1;
+	int ret;
+
+	if (thread == (pthread_t)0)
 		return 0;
+
+	start = probe_now();
+	__atomic_store_n(&net_stopping, 1, __ATOMIC_RELEASE);
+	if (write(net_wake_fd, &val, sizeof(val)) < 0)
+		LOG(LOG_WARNING, "IPv4 TB: Failed to wake thread: %s\n",
+		    strerror(errno));
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += NET_STOP_TIMEOUT / 1000;
+	deadline.tv_nsec += (long)(NET_STOP_TIMEOUT % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		++deadline.tv_sec;
+		deadline.tv_nsec -= 1000000000;
 	}
-	pthread_rwlock_unlock(&net_lock);
-		
-	pthread_cancel(net_thread);
+
+	ret = pthread_timedjoin_np(thread, NULL, &deadline);
+	if (ret) {
+		LOG(LOG_WARNING, "IPv4 TB: Thread did not stop within %dms; "
+		    "leaving it\n", NET_STOP_TIMEOUT);
+		errno = ret;
+		return -1;
+	}
+
+	LOG(LOG_INFO, "IPv4 TB: Thread stopped in %.3fms\n",
+	    (double)(probe_now() - start) / 1000);
+
+	net_thread = (pthread_t)0;
+	close(net_wake_fd);
+	net_wake_fd = -1;
+	__atomic_store_n(&net_stopping, 0, __ATOMIC_RELEASE);
 	net_cleanup();
 	return 0;
 }
@@ -287,8 +2195,11 @@ net_cancel_quorum_thread(void)
 /**
   Spawn the net tiebreaker thread.  Must have already called 
   net_tiebreaker_init at least once, or the thread will exit quickly.
+  The thread is joinable; net_cancel_quorum_thread stops and joins it.
+  A previous thread is stopped and joined first.
 
-  @return		Values returned by pthread_create.
+  @return		Values returned by pthread_create, or ETIMEDOUT
+  			if the previous thread would not stop.
  */
 int
 net_create_quorum_thread(pthread_t * thread)
@@ -296,13 +2207,24 @@ net_create_quorum_thread(pthread_t * thread)
 	int ret;
 	pthread_attr_t attrs;
 
+	if (net_cancel_quorum_thread() < 0)
+		return errno;
+
+	net_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (net_wake_fd < 0)
+		return errno;
+
 	pthread_attr_init(&attrs);
 	pthread_attr_setinheritsched(&attrs, PTHREAD_INHERIT_SCHED);
-	pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED);
 	pthread_attr_setstacksize(&attrs, 65536);
 	pthread_atfork(NULL, NULL, NULL);
 
 	ret = pthread_create(&net_thread, &attrs, net_quorum_thread, NULL);
+	pthread_attr_destroy(&attrs);
+	if (ret) {
+		close(net_wake_fd);
+		net_wake_fd = -1;
+	}
 	if (thread)
 		*thread = net_thread;
 
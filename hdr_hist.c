@@ -0,0 +1,143 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Log-linear ("HDR") histogram, for latency percentiles.
+ *
+ * Values below HDR_SUB get a bucket each.  Above that, every power of
+ * two is split into HDR_HALF equal buckets, so a bucket is never wider
+ * than 1/HDR_HALF of the values in it.
+ */
+
+#include <hdr_hist.h>
+#include <string.h>
+
+
+static int
+hdr_index(uint64_t value)
+{
+	int msb, shift;
+
+	if (value < HDR_SUB)
+		return (int)value;
+	if (value >> HDR_MAX_BITS)
+		value = (1ULL << HDR_MAX_BITS) - 1;
+
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - (HDR_SUB_BITS - 1);
+	return HDR_SUB + (shift - 1) * HDR_HALF +
+	       (int)((value >> shift) - HDR_HALF);
+}
+
+
+/**
+ * Largest value which lands in the same bucket as index idx.
+ */
+static uint64_t
+hdr_value(int idx)
+{
+	uint64_t top;
+	int shift;
+
+	if (idx < HDR_SUB)
+		return (uint64_t)idx;
+
+	shift = (idx - HDR_SUB) / HDR_HALF + 1;
+	top = (uint64_t)((idx - HDR_SUB) % HDR_HALF + HDR_HALF);
+	return ((top + 1) << shift) - 1;
+}
+
+
+void
+hdr_init(struct hdr_hist *hh)
+{
+	memset(hh, 0, sizeof(*hh));
+	hh->hh_min = UINT64_MAX;
+}
+
+
+void
+hdr_record(struct hdr_hist *hh, uint64_t value)
+{
+	++hh->hh_counts[hdr_index(value)];
+	++hh->hh_count;
+	hh->hh_total += value;
+	if (value < hh->hh_min)
+		hh->hh_min = value;
+	if (value > hh->hh_max)
+		hh->hh_max = value;
+}
+
+
+/**
+ * Add the contents of src to dst.
+ */
+void
+hdr_merge(struct hdr_hist *dst, const struct hdr_hist *src)
+{
+	int x;
+
+	for (x = 0; x < HDR_COUNTS; x++)
+		dst->hh_counts[x] += src->hh_counts[x];
+	dst->hh_count += src->hh_count;
+	dst->hh_total += src->hh_total;
+	if (src->hh_min < dst->hh_min)
+		dst->hh_min = src->hh_min;
+	if (src->hh_max > dst->hh_max)
+		dst->hh_max = src->hh_max;
+}
+
+
+/**
+ * Value at a percentile: the smallest recorded value (to the histogram's
+ * precision) which at least pct percent of the recorded values do not
+ * exceed.
+ *
+ * @param hh		Histogram.
+ * @param pct		Percentile, 0-100.
+ * @return		Value, or 0 if nothing was recorded.
+ */
+uint64_t
+hdr_percentile(const struct hdr_hist *hh, double pct)
+{
+	uint64_t want, seen = 0, value;
+	int x;
+
+	if (!hh->hh_count)
+		return 0;
+	if (pct >= 100.0)
+		return hh->hh_max;
+
+	want = (uint64_t)(pct / 100.0 * (double)hh->hh_count + 0.5);
+	if (want < 1)
+		want = 1;
+
+	for (x = 0; x < HDR_COUNTS; x++) {
+		seen += hh->hh_counts[x];
+		if (seen >= want)
+			break;
+	}
+
+	/* Never report beyond what was actually seen */
+	value = hdr_value(x);
+	if (value > hh->hh_max)
+		value = hh->hh_max;
+	if (value < hh->hh_min)
+		value = hh->hh_min;
+	return value;
+}
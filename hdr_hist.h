@@ -0,0 +1,59 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Header for hdr_hist.c.
+ */
+#ifndef __HDR_HIST_H
+#define __HDR_HIST_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HDR_SUB_BITS	8			/* 1/128 resolution */
+#define HDR_SUB		(1 << HDR_SUB_BITS)
+#define HDR_HALF	(HDR_SUB / 2)
+#define HDR_MAX_BITS	40			/* values up to 2^40 */
+#define HDR_COUNTS	(HDR_SUB + (HDR_MAX_BITS - HDR_SUB_BITS) * HDR_HALF)
+
+/**
+ * High dynamic range histogram: exact below HDR_SUB, and within 1/128
+ * (under 0.8%) of the true value above, up to 2^40.  Fixed size, so
+ * recording never allocates.
+ */
+struct hdr_hist {
+	uint64_t	hh_count;
+	uint64_t	hh_min;
+	uint64_t	hh_max;
+	uint64_t	hh_total;
+	uint64_t	hh_counts[HDR_COUNTS];
+};
+
+void hdr_init(struct hdr_hist *hh);
+void hdr_record(struct hdr_hist *hh, uint64_t value);
+void hdr_merge(struct hdr_hist *dst, const struct hdr_hist *src);
+uint64_t hdr_percentile(const struct hdr_hist *hh, double pct);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,11 +2,46 @@
 #define _NET_TIE_H
 
 #define TOTEM_TOKEN_DEFAULT 10000
+#define NET_MAX_PATHS 8
+#define MIN_TOKEN 5000		/* Minimum token timeout (milliseconds) */
+#define MIN_INTERVAL 250	/* Ping interval minimum (milliseconds) */
+
+/* net_tiebreaker_peer */
+#define NET_PEER_UNKNOWN	0
+#define NET_PEER_UP		1
+#define NET_PEER_DOWN		2
+
+#define NET_GRADE_MAX		4	/* net_tiebreaker_grade */
+
+/* net_tiebreaker_state */
+#define NET_TB_OFFLINE		0
+#define NET_TB_DEGRADED		1
+#define NET_TB_ONLINE		2
 
 /* from cluquorumd_NET.c */
 int net_create_quorum_thread(pthread_t * thread);
 int net_cancel_quorum_thread(void);
 int net_tiebreaker_init(char *tiebreaker_ip, int totem, int interval);
+int net_tiebreaker_timing(int totem, int interval);
+int net_tiebreaker_load(char *file);
+int net_tiebreaker_interval(void);
 int net_tiebreaker(void);
+int net_tiebreaker_degraded(void);
+int net_tiebreaker_add_path(char *spec);
+int net_tiebreaker_add_peer(char *spec);
+int net_tiebreaker_peer(void);
+int net_tiebreaker_grade(void);
+int net_tiebreaker_state(void);
+int net_tiebreaker_gray(char *spec);
+void net_tiebreaker_policy(int all);
+int net_tiebreaker_marking(int dscp, int priority);
+void net_tiebreaker_rate(double rate);
+int net_tiebreaker_backend(char *name);
+void net_tiebreaker_busy_poll(int usec);
+int net_tiebreaker_timeout(char *spec);
+int net_tiebreaker_hedge(char *spec);
+void net_tiebreaker_dump(void);
+int net_tiebreaker_trace(char *file);
+int net_tiebreaker_replay(char *file, double speed, int token, int interval);
 
 #endif
@@ -26,6 +26,13 @@
  
 #include <ping.h>
 #include <ctype.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/filter.h>
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL	69
+#endif
 
 /**
  * From RFC 777:
@@ -44,7 +51,7 @@ uint16_t
 icmp_checksum(uint16_t *buf, uint32_t buflen)
 {
 	uint32_t remain = buflen, sum = 0;
-	char *data = (char *)buf;
+	uint8_t *data = (uint8_t *)buf;
 
 	while (remain > 1) {
 		sum += *((uint16_t *)data);
@@ -79,19 +86,242 @@ icmp_socket(void)
 
 
 /**
- * Call gethostbyname and return an appropriate PING return value based on
- * the response we get.  Fill in sin_send.
+ * Set up an ICMP socket which is pinned to a particular path: an
+ * interface (SO_BINDTODEVICE), a source address, and/or a firewall mark
+ * for policy routing (SO_MARK).  The latter two require CAP_NET_ADMIN
+ * or CAP_NET_RAW, which we have anyway if we can open a raw socket.
+ *
+ * Probes may also be marked so they survive a congested uplink: a DSCP
+ * code point (IP_TOS) for the network, and SO_PRIORITY for the local
+ * qdisc.  SO_PRIORITY is set last, since setting IP_TOS also resets the
+ * socket priority.
+ *
+ * Sockets which send DF probes (or full-size probes, which are always
+ * DF) use IP_PMTUDISC_PROBE: DF is set on every packet and the kernel's
+ * path MTU cache is ignored, so a probe too big for the path is dropped
+ * or bounced rather than quietly fragmented.
+ *
+ * @param opts		Path options; NULL means no binding at all.
+ * @return		New socket, or -1 on error (errno is preserved).
+ * @see icmp_socket icmp_opts_parse
+ */
+int32_t
+icmp_socket_opts(const struct icmp_opts *opts)
+{
+	struct sockaddr_in sin;
+	int32_t sock, esv;
+	int tos, pmtu = IP_PMTUDISC_PROBE;
+
+	sock = icmp_socket();
+	if (sock < 0 || !opts)
+		return sock;
+
+	if (opts->io_ifname[0] &&
+	    setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, opts->io_ifname,
+		       strlen(opts->io_ifname) + 1) < 0)
+		goto fail;
+
+	if (opts->io_mark &&
+	    setsockopt(sock, SOL_SOCKET, SO_MARK, &opts->io_mark,
+		       sizeof(opts->io_mark)) < 0)
+		goto fail;
+
+	if (opts->io_dscp) {
+		tos = opts->io_dscp << 2;
+		if (setsockopt(sock, IPPROTO_IP, IP_TOS, &tos,
+			       sizeof(tos)) < 0)
+			goto fail;
+	}
+
+	if ((opts->io_df || opts->io_mtu) &&
+	    setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu,
+		       sizeof(pmtu)) < 0)
+		goto fail;
+
+	if (opts->io_priority &&
+	    setsockopt(sock, SOL_SOCKET, SO_PRIORITY, &opts->io_priority,
+		       sizeof(opts->io_priority)) < 0)
+		goto fail;
+
+	if (opts->io_src.s_addr != htonl(INADDR_ANY)) {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr = opts->io_src;
+		if (bind(sock, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+			goto fail;
+	}
+
+	return sock;
+
+fail:
+	esv = errno;
+	close(sock);
+	errno = esv;
+	return -1;
+}
+
+
+/**
+ * Make a socket discard everything it receives.  Useful for probe
+ * sockets which only send, since every raw ICMP socket otherwise gets a
+ * copy of every ICMP message the host receives.
+ *
+ * @param sock		Socket.
+ * @return		See setsockopt(2).
+ */
+int
+icmp_socket_mute(int32_t sock)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = { 1, code };
+
+	return setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+			  sizeof(prog));
+}
+
+
+/**
+ * Ask the kernel to busy-poll the device queue when this socket is read
+ * with nothing queued, rather than waiting for the interrupt, and to
+ * prefer that over interrupt-driven processing while we do.  Raising
+ * SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN.
+ *
+ * @param sock		Socket.
+ * @param usec		How long one blocking read may spin; 0 to turn
+ *			busy polling off.
+ * @return		See setsockopt(2).
+ */
+int
+icmp_socket_busy_poll(int32_t sock, uint32_t usec)
+{
+	int prefer = usec ? 1 : 0;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usec,
+		       sizeof(usec)) < 0)
+		return -1;
+	/* Older kernels only have the former; that will do */
+	setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer,
+		   sizeof(prefer));
+	return 0;
+}
+
+
+/**
+ * Parse a path specification of the form
+ *
+ *	[dev=]<ifname>,src=<a.b.c.d>,mark=<n>,dscp=<n>,prio=<n>,
+ *	size=<n>,df,mtu=<n>,every=<n>
+ *
+ * Every element is optional; a bare word other than "df" is taken as an
+ * interface name.  dscp accepts 0-63 (e.g. 46 for EF, 48 for CS6).
+ * size is the echo data length (8 by default, as ping -s); df forbids
+ * fragmentation.  mtu adds full-size probes, mtu bytes of IP datagram
+ * with DF set, as one probe in every (default 10).  Neither may make a
+ * probe bigger than ICMP_MAX_PROBE, so that its reply is received (and
+ * checksummed) whole.
+ *
+ * @param spec		Specification string.
+ * @param opts		Options to fill in (zeroed first).
+ * @return		0 on success, -1 (errno = EINVAL) on a bad spec.
+ */
+int
+icmp_opts_parse(const char *spec, struct icmp_opts *opts)
+{
+	char *str, *tok, *val, *save = NULL, *end;
+	unsigned long num;
+	int ret = 0;
+
+	memset(opts, 0, sizeof(*opts));
+
+	str = strdup(spec);
+	if (!str)
+		return -1;
+
+	for (tok = strtok_r(str, ",", &save); tok && !ret;
+	     tok = strtok_r(NULL, ",", &save)) {
+		val = strchr(tok, '=');
+		if (val)
+			*val++ = 0;
+		else if (!strcmp(tok, "df"))
+			val = "1";
+		else {
+			val = tok;
+			tok = "dev";
+		}
+
+		if (!strcmp(tok, "dev")) {
+			if (strlen(val) >= sizeof(opts->io_ifname))
+				ret = -1;
+			else
+				strcpy(opts->io_ifname, val);
+		} else if (!strcmp(tok, "src")) {
+			if (inet_pton(AF_INET, val, &opts->io_src) <= 0)
+				ret = -1;
+		} else if (!strcmp(tok, "mark")) {
+			opts->io_mark = strtoul(val, &end, 0);
+			if (*end || end == val)
+				ret = -1;
+		} else if (!strcmp(tok, "dscp")) {
+			num = strtoul(val, &end, 0);
+			if (*end || end == val || num > 63)
+				ret = -1;
+			opts->io_dscp = num;
+		} else if (!strcmp(tok, "prio")) {
+			opts->io_priority = strtoul(val, &end, 0);
+			if (*end || end == val)
+				ret = -1;
+		} else if (!strcmp(tok, "size")) {
+			num = strtoul(val, &end, 0);
+			if (*end || end == val || num < ICMP_DATALEN ||
+			    num > ICMP_MAX_PROBE - 20 - ICMP_MINLEN)
+				ret = -1;
+			opts->io_size = num;
+		} else if (!strcmp(tok, "df")) {
+			num = strtoul(val, &end, 0);
+			if (*end || end == val || num > 1)
+				ret = -1;
+			opts->io_df = num;
+		} else if (!strcmp(tok, "mtu")) {
+			num = strtoul(val, &end, 0);
+			if (*end || end == val || num < 68 ||
+			    num > ICMP_MAX_PROBE)
+				ret = -1;
+			opts->io_mtu = num;
+		} else if (!strcmp(tok, "every")) {
+			num = strtoul(val, &end, 0);
+			if (*end || end == val || num < 2 || num > 65535)
+				ret = -1;
+			opts->io_every = num;
+		} else {
+			ret = -1;
+		}
+	}
+
+	free(str);
+	if (ret)
+		errno = EINVAL;
+	return ret;
+}
+
+
+/**
+ * Resolve a host name and return an appropriate PING return value based on
+ * the response we get.  Fill in sin_send.  Uses getaddrinfo(), so it is
+ * safe to call from several threads at once.
  *
  * @param hostname	Hostname to look up.
  * @param sin_send	IP address structure (pre-allocated).
  * @return		PING_HOST_NOT_FOUND if the host is not found, 0
  *			on success, -1 on other error.
- * @see gethostbyname
+ * @see getaddrinfo
  */
 int32_t
-icmp_ping_getaddr(char *hostname, struct sockaddr_in *sin_send)
+icmp_ping_getaddr(const char *hostname, struct sockaddr_in *sin_send)
 {
-	struct hostent *hp;
+	struct addrinfo hints, *res;
+	int ret, tries = 0;
 
 	memset(sin_send, 0, sizeof(*sin_send));
 	sin_send->sin_family = AF_INET;
@@ -113,156 +343,493 @@ icmp_ping_getaddr(char *hostname, struct sockaddr_in *sin_send)
 	/*
 	 * Grab the hostname
 	 */
-	while ((hp = gethostbyname(hostname)) == NULL) {
-		switch(h_errno) {
-		case TRY_AGAIN:
-			continue;
-		case HOST_NOT_FOUND:
-		case NO_ADDRESS:
-		case NO_RECOVERY:
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_RAW;
+	hints.ai_protocol = IPPROTO_ICMP;
+
+	while ((ret = getaddrinfo(hostname, NULL, &hints, &res)) != 0) {
+		switch(ret) {
+		case EAI_AGAIN:
+			/* Not for ever; the resolver may be unreachable */
+			if (++tries < 3)
+				continue;
+			errno = EAGAIN;
+			return -1;
+		case EAI_NONAME:
+		case EAI_FAIL:
+#ifdef EAI_NODATA
+		case EAI_NODATA:
+#endif
+#ifdef EAI_ADDRFAMILY
+		case EAI_ADDRFAMILY:
+#endif
 			return PING_HOST_NOT_FOUND;
+		case EAI_SYSTEM:
+			return -1;
 		}
+		errno = EINVAL;
 		return -1;
 	}
 
 	/*
 	 * Copy in target address from DNS/hosts/etc.
 	 */
-	memcpy(&sin_send->sin_addr, hp->h_addr, sizeof(sin_send->sin_addr));
+	memcpy(&sin_send->sin_addr,
+	       &((struct sockaddr_in *)res->ai_addr)->sin_addr,
+	       sizeof(sin_send->sin_addr));
+	freeaddrinfo(res);
 
 	return 0;
 }
 
 
 /**
- * Send a ping (ICMP_ECHO) to a given IP address and file descriptor.
- * This is set up so that a daemon can drop privileges after binding to a raw
- * socket (perhaps preserving a static ping socket), but still be able to use
- * ping.  This is a pretty long function.
+ * Hand out an ICMP echo identifier.  The first one is the process ID,
+ * as the icmp_ping_* functions have always used; each call after that
+ * gets a different one, so that several engines or contexts in one
+ * process do not answer to each other's replies.
+ *
+ * @return		Echo identifier.
+ */
+uint16_t
+icmp_alloc_id(void)
+{
+	static uint32_t next = 0;
+	uint32_t n;
+
+	n = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+	/* Spread them out, so neighbouring PIDs do not overlap either */
+	return (uint16_t)getpid() ^ (uint16_t)(n * 0x9e37);
+}
+
+
+/**
+ * Build an ICMP_ECHO with a given amount of data, for callers which do
+ * their own sending.  The first ICMP_DATALEN bytes of data are zero, as
+ * they always were; the rest is a counting pattern, so that nothing on
+ * the way can compress it.
+ *
+ * @param buf		Buffer of at least ICMP_MINLEN + datalen bytes.
+ * @param id		ICMP echo identifier.
+ * @param seq		ICMP echo sequence number.
+ * @param datalen	Bytes of data after the ICMP header.
+ * @return		Length of the packet.
+ */
+size_t
+icmp_build_echo_size(void *buf, uint16_t id, uint16_t seq, size_t datalen)
+{
+	struct icmp *packetp = (struct icmp *)buf;
+	size_t x, packetlen = ICMP_MINLEN + datalen;
+
+	for (x = 0; x < packetlen; x++)
+		((uint8_t *)buf)[x] = x < ICMP_MINLEN + ICMP_DATALEN ? 0 :
+				      (uint8_t)x;
+	packetp->icmp_type = ICMP_ECHO;
+	packetp->icmp_seq = seq;
+	packetp->icmp_id = id;
+	packetp->icmp_cksum = icmp_checksum((uint16_t *)packetp, packetlen);
+	return packetlen;
+}
+
+
+/**
+ * Build a standard-size ICMP_ECHO.
+ *
+ * @param buf		Buffer of at least ICMP_MINLEN * 2 bytes.
+ * @param id		ICMP echo identifier.
+ * @param seq		ICMP echo sequence number.
+ * @return		Length of the packet.
+ */
+size_t
+icmp_build_echo(void *buf, uint16_t id, uint16_t seq)
+{
+	return icmp_build_echo_size(buf, id, seq, ICMP_DATALEN);
+}
+
+
+/**
+ * Send a single ICMP_ECHO without waiting for the reply.  The caller is
+ * responsible for picking id/seq values it can match replies against.
  *
  * @param sock		Socket to send on.
  * @param sin_send	Address to send to.
- * @param seq		Sequence number.
- * @param timeout	Timeout (in seconds)
+ * @param id		ICMP echo identifier.
+ * @param seq		ICMP echo sequence number.
  * @return		-1 on syscall error, 0 on success.
- *			See ping.h for list of return values >0.
- * @see	icmp_ping_host icmp_ping_hostfd icmp_ping_addr
+ * @see icmp_recv icmp_send_echo_size
  */
 int32_t
-icmp_ping_addrfd(int32_t sock, struct sockaddr_in *sin_send, uint32_t seq,
-	    uint32_t timeout)
+icmp_send_echo(int32_t sock, const struct sockaddr_in *sin_send, uint16_t id,
+	       uint16_t seq)
+{
+	return icmp_send_echo_size(sock, sin_send, id, seq, ICMP_DATALEN);
+}
+
+
+/**
+ * Send a single ICMP_ECHO carrying datalen bytes of data.  On a DF
+ * socket, an echo too big for the outgoing interface fails with
+ * EMSGSIZE.
+ *
+ * @param sock		Socket to send on.
+ * @param sin_send	Address to send to.
+ * @param id		ICMP echo identifier.
+ * @param seq		ICMP echo sequence number.
+ * @param datalen	Bytes of data, at most ICMP_MAX_DATALEN; 0 means
+ *			ICMP_DATALEN.
+ * @return		-1 on syscall error, 0 on success.
+ */
+int32_t
+icmp_send_echo_size(int32_t sock, const struct sockaddr_in *sin_send,
+		    uint16_t id, uint16_t seq, size_t datalen)
 {
-	char buffer[256]; /* XXX */
-	struct icmp *packetp;
-	struct ip *ipp;
-	struct sockaddr_in sin_recv;
-	struct timeval tv;
-	fd_set rfds;
-	uint16_t checksum;
-	uint16_t packetlen = sizeof(uint16_t) * ICMP_MINLEN;
-	uint32_t x, sin_recv_len = sizeof(sin_recv);
+	char small[64], *buffer = small;
+	size_t packetlen;
+	ssize_t x;
+	int esv;
+
+	if (!datalen)
+		datalen = ICMP_DATALEN;
+	if (datalen > ICMP_MAX_DATALEN) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if (ICMP_MINLEN + datalen > sizeof(small)) {
+		buffer = malloc(ICMP_MINLEN + datalen);
+		if (!buffer)
+			return -1;
+	}
 
 	/*
 	 * Set up ICMP echo packet
 	 */
-	packetp = (struct icmp *)buffer;
-
-	memset(buffer, 0, sizeof(buffer));
-	packetp->icmp_type = ICMP_ECHO;
-	packetp->icmp_seq = seq;
-	packetp->icmp_id = getpid();
-	packetp->icmp_cksum = icmp_checksum((uint16_t *)packetp,
-						ICMP_MINLEN);
+	packetlen = icmp_build_echo_size(buffer, id, seq, datalen);
 
 	/*
 	 * Send the packet
 	 */
-	while ((x = sendto(sock, packetp, packetlen, 0,
-	    		   (struct sockaddr *)sin_send,
-			   sizeof(*sin_send))) < packetlen)
-		if (x < 0)
-			return -1;
+	do {
+		x = sendto(sock, buffer, packetlen, 0,
+			   (struct sockaddr *)sin_send, sizeof(*sin_send));
+	} while (x < 0 && errno == EINTR);
+
+	if (buffer != small) {
+		esv = errno;
+		free(buffer);
+		errno = esv;
+	}
 
-	if (timeout) {
-		tv.tv_sec = timeout;
-		tv.tv_usec = 0;
+	if (x < 0)
+		return -1;
+	if ((size_t)x < packetlen) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Is this ICMP type an error message, i.e. one which quotes the IP
+ * header and first 8 bytes of the datagram which caused it?
+ */
+int
+icmp_is_error(uint8_t type)
+{
+	switch(type) {
+	case ICMP_DEST_UNREACH:
+	case ICMP_SOURCE_QUENCH:
+	case ICMP_REDIRECT:
+	case ICMP_TIME_EXCEEDED:
+	case ICMP_PARAMETERPROB:
+		return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * Map an ICMP error message to a PING_* return value.
+ *
+ * @param reply		Message from icmp_recv.
+ * @return		PING_NET_UNREACH, PING_HOST_UNREACH,
+ *			PING_ADMIN_PROHIBITED, PING_FRAG_NEEDED,
+ *			PING_TTL_EXCEEDED, PING_REDIRECT, or
+ *			PING_INVALID_RESPONSE.
+ */
+int32_t
+icmp_classify(const struct icmp_reply *reply)
+{
+	switch(reply->ir_type) {
+	case ICMP_DEST_UNREACH:
+		switch(reply->ir_code) {
+		case ICMP_NET_UNREACH:
+		case ICMP_NET_UNKNOWN:
+		case ICMP_NET_ANO:
+		case ICMP_NET_UNR_TOS:
+			return PING_NET_UNREACH;
+		case ICMP_HOST_ANO:
+		case ICMP_PKT_FILTERED:
+		case ICMP_PREC_VIOLATION:
+		case ICMP_PREC_CUTOFF:
+			return PING_ADMIN_PROHIBITED;
+		case ICMP_FRAG_NEEDED:
+			return PING_FRAG_NEEDED;
+		}
+		return PING_HOST_UNREACH;
+	case ICMP_TIME_EXCEEDED:
+		return PING_TTL_EXCEEDED;
+	case ICMP_REDIRECT:
+		return PING_REDIRECT;
+	}
+	return PING_INVALID_RESPONSE;
+}
+
+
+/**
+ * Validate and decode one IP datagram carrying an ICMP message.  The
+ * buffer is not modified, so this can be run directly on packets in a
+ * shared ring.
+ *
+ * Error messages carry the IP header and first 8 bytes of the packet
+ * which caused them.  If that was one of our echoes, the quoted
+ * destination, id and sequence number are returned too, so that the
+ * error can be pinned on the exact probe it belongs to rather than on
+ * whatever happens to be outstanding.
+ *
+ * A datagram which was cut short on the way in (a full-size reply read
+ * into a small buffer, or a ring's snap length) is still decoded, from
+ * the IP total length, as long as the headers are there; only its
+ * checksum goes unchecked, as we do not have all it covers.
+ *
+ * @param buf		IP datagram.
+ * @param len		Length of buf.
+ * @param reply		Filled in with the sender and ICMP header fields.
+ * @return		PING_SUCCESS if reply was filled in,
+ *			PING_INVALID_SIZE or PING_INVALID_CHECKSUM if the
+ *			message was garbage.
+ */
+int32_t
+icmp_parse(const void *buf, size_t len, struct icmp_reply *reply)
+{
+	const struct icmp *packetp, *origp;
+	const struct ip *ipp, *origipp;
+	ssize_t icmplen;
+
+	/*
+	 * Ensure it's the proper size...
+	 * - (ipp->ip_hl << 2) is because IP header length is in
+	 * 32-bit words instead of bytes.
+	 * - ICMP_MINLEN is defined in netinet/ip_icmp.h.
+	 */
+	ipp = (const struct ip *)buf;
+	if (len < sizeof(struct ip) || ipp->ip_p != IPPROTO_ICMP)
+		return PING_INVALID_SIZE;
+	icmplen = (ssize_t)len - (ipp->ip_hl << 2);
+	if (icmplen < ICMP_MINLEN)
+		return PING_INVALID_SIZE;
+
+	/*
+	 * Validate the checksum.  It covers the whole ICMP message, and
+	 * summing a message including a correct checksum yields zero.
+	 */
+	packetp = (const struct icmp *)((const char *)buf + (ipp->ip_hl << 2));
+	if (len >= ntohs(ipp->ip_len) &&
+	    icmp_checksum((uint16_t *)packetp, icmplen) != 0)
+		return PING_INVALID_CHECKSUM;
+
+	memset(reply, 0, sizeof(*reply));
+	reply->ir_from = ipp->ip_src;
+	reply->ir_type = packetp->icmp_type;
+	reply->ir_code = packetp->icmp_code;
+	reply->ir_id = packetp->icmp_id;
+	reply->ir_seq = packetp->icmp_seq;
+
+	if (!icmp_is_error(packetp->icmp_type))
+		return PING_SUCCESS;
+
+	/*
+	 * Dig out the quoted datagram: 8 bytes of ICMP error header, then
+	 * the original IP header, then (at least) 8 bytes of its payload.
+	 */
+	origipp = &packetp->icmp_ip;
+	if (icmplen < ICMP_MINLEN + (ssize_t)sizeof(struct ip) ||
+	    icmplen < ICMP_MINLEN + (origipp->ip_hl << 2) + ICMP_MINLEN ||
+	    origipp->ip_p != IPPROTO_ICMP)
+		return PING_SUCCESS;
+
+	origp = (const struct icmp *)((const char *)origipp +
+				      (origipp->ip_hl << 2));
+	if (origp->icmp_type != ICMP_ECHO)
+		return PING_SUCCESS;
+
+	reply->ir_quoted = 1;
+	reply->ir_orig_dst = origipp->ip_dst;
+	reply->ir_orig_id = origp->icmp_id;
+	reply->ir_orig_seq = origp->icmp_seq;
+
+	return PING_SUCCESS;
+}
+
+
+/**
+ * Read one ICMP message from a probe socket and validate it.  This does
+ * not block unless the socket does; callers normally select()/poll()
+ * first.
+ *
+ * @param sock		Socket to receive on.
+ * @param reply		Filled in with the sender and ICMP header fields.
+ * @return		-1 on syscall error, otherwise see icmp_parse.
+ */
+int32_t
+icmp_recv(int32_t sock, struct icmp_reply *reply)
+{
+	char buffer[ICMP_RECV_LEN];
+	ssize_t x;
+
+	/*
+	 * Receive response
+	 */
+	if ((x = recv(sock, buffer, sizeof(buffer), 0)) < 0)
+		return -1;
+
+	return icmp_parse(buffer, x, reply);
+}
+
+
+/**
+ * Wait for the reply to one echo.  Replies to other echoes (and errors
+ * caused by other traffic) are skipped while there is time left; with
+ * no timeout, the first one which is not ours is reported instead.
+ *
+ * @param sock		Socket the echo went out on.
+ * @param sin_send	Where it went.
+ * @param id		Its ICMP echo identifier.
+ * @param seq		Its sequence number.
+ * @param timeout_ms	How long to wait (milliseconds); -1 for ever.
+ * @return		-1 on syscall error, 0 on success.
+ *			See ping.h for list of return values >0.
+ */
+int32_t
+icmp_ping_wait(int32_t sock, const struct sockaddr_in *sin_send, uint16_t id,
+	       uint16_t seq, int timeout_ms)
+{
+	struct icmp_reply reply;
+	struct pollfd pfd;
+	struct timespec ts;
+	int64_t deadline = 0, left = -1;
+	int32_t x;
+	int timed = timeout_ms >= 0;
+
+	if (timed) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		deadline = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 +
+			   timeout_ms;
 	}
 
 	/*
 	 * Wait for response
 	 */
 	while (1) {
-		
-		/*
-		 * Set up select call...
-		 */
-		FD_ZERO(&rfds);
-		FD_SET(sock,&rfds);
-		while ((x = select(sock+1, &rfds, NULL, NULL,
-		   		   timeout ? &tv : NULL)) <= 0) {
-			if (!x)
-				return PING_TIMEOUT;
+		if (timed) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			left = deadline - ((int64_t)ts.tv_sec * 1000 +
+					   ts.tv_nsec / 1000000);
+			if (left < 0)
+				left = 0;
+		}
+
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		x = poll(&pfd, 1, (int)left);
+		if (x == 0)
+			return PING_TIMEOUT;
+		if (x < 0) {
+			if (errno == EINTR)
+				continue;
 			return -1;
 		}
 		
-		/*
-		 * Receive response
-		 */
-		if ((x = recvfrom(sock, buffer, sizeof(buffer), 0,
-				  (struct sockaddr *)&sin_recv,
-				  &sin_recv_len)) < 0) {
+		x = icmp_recv(sock, &reply);
+		if (x < 0)
 			return -1;
-		}
-
-		/*
-		 * Ensure it's the proper size...
-		 * - (ipp->ip_hl << 2) is because IP header length is in
-		 * 32-bit words instead of bytes.
-		 * - ICMP_MINLEN is defined in netinet/ip_icmp.h.
-		 */
-		ipp = (struct ip *)buffer;
-		if (x < ((ipp->ip_hl << 2) + ICMP_MINLEN)) {
-			if (timeout)
+		if (x != PING_SUCCESS) {
+			if (timed)
 				continue;
-			return PING_INVALID_SIZE;
+			return x;
 		}
-		
+
 		/*
-		 * Validate the checksum.  The checksum needs to be set to
-		 * 0 for validation purposes.
+		 * Errors only count if they quote the echo we just sent;
+		 * anything else was caused by someone else's traffic.
 		 */
-		packetp = (struct icmp *)((buffer + (ipp->ip_hl << 2)));
-		checksum = packetp->icmp_cksum;
-		packetp->icmp_cksum = 0;
-		if (checksum != icmp_checksum((uint16_t*)packetp,
-					      ICMP_MINLEN)) {
-			if (timeout)
+		if (icmp_is_error(reply.ir_type)) {
+			if (!reply.ir_quoted ||
+			    reply.ir_orig_dst.s_addr !=
+			    		sin_send->sin_addr.s_addr ||
+			    reply.ir_orig_id != id ||
+			    reply.ir_orig_seq != seq) {
+				if (timed)
+					continue;
+				return PING_INVALID_ID;
+			}
+			x = icmp_classify(&reply);
+			if (x == PING_REDIRECT)
 				continue;
-			return PING_INVALID_CHECKSUM;
+			return x;
 		}
 
 		/*
 		 * Ensure it's the proper id...
 		 */
-		switch (packetp->icmp_type) {
+		switch (reply.ir_type) {
 		case ICMP_ECHO:
 		case ICMP_ECHOREPLY:
-			if (packetp->icmp_id != getpid()) {
-				if (timeout)
+			if (reply.ir_id != id || reply.ir_seq != seq) {
+				if (timed)
 					continue;
 				return PING_INVALID_ID;
 			}
 			return PING_SUCCESS;
-		case ICMP_DEST_UNREACH:
-			return PING_HOST_UNREACH;
 		}
 
 		/* XXX */
+		if (timed)
+			continue;
 		return PING_INVALID_RESPONSE;
 	}
 }
 
 
+/**
+ * Send a ping (ICMP_ECHO) to a given IP address and file descriptor.
+ * This is set up so that a daemon can drop privileges after binding to a raw
+ * socket (perhaps preserving a static ping socket), but still be able to use
+ * ping.  The echo identifier is the process ID, so concurrent callers in
+ * one process may see each other's replies; see struct qnet_ping_ctx.
+ *
+ * @param sock		Socket to send on.
+ * @param sin_send	Address to send to.
+ * @param seq		Sequence number.
+ * @param timeout	Timeout (in seconds)
+ * @return		-1 on syscall error, 0 on success.
+ *			See ping.h for list of return values >0.
+ * @see	icmp_ping_host icmp_ping_hostfd icmp_ping_addr
+ */
+int32_t
+icmp_ping_addrfd(int32_t sock, struct sockaddr_in *sin_send, uint32_t seq,
+	    uint32_t timeout)
+{
+	if (icmp_send_echo(sock, sin_send, getpid(), seq) < 0)
+		return -1;
+
+	return icmp_ping_wait(sock, sin_send, (uint16_t)getpid(),
+			      (uint16_t)seq, timeout ? (int)timeout * 1000 : -1);
+}
+
+
 /**
  * Send a ping (ICMP_ECHO) to a given IP address.  This is set up so that a
  * daemon can drop privileges after binding to a raw socket (perhaps
@@ -348,139 +915,507 @@ icmp_ping_host(char *hostname, uint32_t seq, uint32_t timeout)
 }
 
 
-/* WARNING: Not reentrant */
+/**
+ * Describe a PING_* return value, without static buffers.
+ *
+ * @param rv		Return value.
+ * @param buf		Buffer for the message.
+ * @param len		Size of buf.
+ * @return		buf
+ */
 char *
-icmp_ping_strerror(int rv)
+icmp_ping_strerror_r(int rv, char *buf, size_t len)
 {
-	static char buf[80];
+	const char *msg = NULL;
+	int err = 0;
 
 	switch(rv) {
 	case PING_ERRNO:
-		return strerror(errno);
+		err = errno;
+		break;
 	case PING_SUCCESS:
-		return strerror(0);
+		err = 0;
+		break;
 	case PING_TIMEOUT:
-		return strerror(ETIMEDOUT);
+		err = ETIMEDOUT;
+		break;
 	case PING_HOST_UNREACH:
-		return strerror(EHOSTUNREACH);
+		err = EHOSTUNREACH;
+		break;
+	case PING_NET_UNREACH:
+		err = ENETUNREACH;
+		break;
+	case PING_ADMIN_PROHIBITED:
+		msg = "Administratively prohibited";
+		break;
+	case PING_TTL_EXCEEDED:
+		msg = "Time to live exceeded";
+		break;
+	case PING_REDIRECT:
+		msg = "Redirected";
+		break;
+	case PING_RXQ_OVERFLOW:
+		msg = "Timed out; local receive queue overflowed";
+		break;
+	case PING_FRAG_NEEDED:
+		msg = "Too big for the path MTU";
+		break;
+	case PING_LINK_DOWN:
+		msg = "Link down";
+		break;
 	case PING_HOST_NOT_FOUND:
-		snprintf(buf, sizeof(buf), "Host not found");
-		return buf;
+		msg = "Host not found";
+		break;
 	case PING_INVALID_CHECKSUM:
-		snprintf(buf, sizeof(buf), "Invalid checksum");
+		msg = "Invalid checksum";
 		break;
 	case PING_INVALID_SIZE:
-		snprintf(buf, sizeof(buf), "Invalid size of reply packet");
-		return buf;
+		msg = "Invalid size of reply packet";
+		break;
 	case PING_INVALID_RESPONSE:
-		snprintf(buf, sizeof(buf), "Invalid response");
-		return buf;
+		msg = "Invalid response";
+		break;
 	case PING_INVALID_ID:
-		snprintf(buf, sizeof(buf), "Invalid ID in response");
-		return buf;
-	default:
+		msg = "Invalid ID in response";
 		break;
+	default:
+		snprintf(buf, len, "Unkown (%d)", rv);
+		return buf;
 	}
 
-	snprintf(buf, sizeof(buf), "Unkown (%d)", rv);
+	if (msg)
+		snprintf(buf, len, "%s", msg);
+	else if (strerror_r(err, buf, len) != 0)
+		snprintf(buf, len, "Error %d", err);
 	return buf;
 }
 
 
+/**
+ * Describe a PING_* return value.  The buffer is per thread, so this is
+ * safe to call from several threads, but the result is overwritten by
+ * the next call in the same thread.
+ */
+char *
+icmp_ping_strerror(int rv)
+{
+	static __thread char buf[80];
+
+	return icmp_ping_strerror_r(rv, buf, sizeof(buf));
+}
+
+
 #ifdef STANDALONE
-int signaled = 0;
+/*
+ * qping: a measurement tool for prospective tiebreakers.  Probes one or
+ * more hosts in parallel on the probe engine, at any interval down to a
+ * microsecond (or back to back, with -f), and reports loss and RTT
+ * percentiles when it is done.
+ */
+#include <probe.h>
+#include <hdr_hist.h>
+#include <probe_trace.h>
+#include <signal.h>
+
+#define QPING_TEXT	0
+#define QPING_JSON	1
+#define QPING_CSV	2
+
+static volatile sig_atomic_t signaled = 0;
 
-void
-signal_handler(int sig)
+static void
+signal_handler(int sig __attribute__((unused)))
 {
 	signaled = 1;
 }
 
-#include <signal.h>
-#include <sys/time.h>
 
-static inline void
-__diff_tv(struct timeval *dest, struct timeval *start, struct timeval *end)
+static void
+usage(const char *prog)
 {
-	dest->tv_sec = end->tv_sec - start->tv_sec;
-	dest->tv_usec = end->tv_usec - start->tv_usec;
+	printf("usage: %s [options] <host> [host ...]\n"
+	       "       %s <host> [timeout]\n"
+	       "  -i <time>    Interval between rounds (default 1s)\n"
+	       "  -f           Flood: start each round as soon as the last "
+	       "is done\n"
+	       "  -c <n>       Stop after n rounds\n"
+	       "  -w <time>    Stop after this long\n"
+	       "  -W <time>    Reply timeout (default 2s)\n"
+	       "  -I <spec>    Path options for every host; see "
+	       "icmp_opts_parse\n"
+	       "  -b <name>    I/O backend (poll, select, epoll, uring, "
+	       "ring)\n"
+	       "  -o <format>  Summary format: text, json or csv\n"
+	       "  -q           No per-reply output\n"
+	       "  -T <file>    Record every probe outcome to a trace file, "
+	       "for qnet -r\n"
+	       "Times are in seconds unless suffixed with us, ms or s.\n",
+	       prog, prog);
+}
 
-	if (dest->tv_usec < 0) {
-		dest->tv_usec += 1000000;
-		dest->tv_sec--;
-	}
+
+/**
+ * Parse a time such as "0.5", "200ms" or "50us".
+ *
+ * @return		Microseconds, or -1 if it does not parse.
+ */
+static int64_t
+qping_time(const char *arg)
+{
+	char *end;
+	double val;
+
+	val = strtod(arg, &end);
+	if (end == arg || val < 0)
+		return -1;
+	if (!strcmp(end, "us"))
+		return (int64_t)val;
+	if (!strcmp(end, "ms"))
+		return (int64_t)(val * 1000);
+	if (!*end || !strcmp(end, "s"))
+		return (int64_t)(val * 1000000);
+	return -1;
 }
 
 
-int
-main(int argc, char **argv)
+static void
+qping_sleep_until(uint64_t when)
 {
-	struct timeval begin, end, delta;
-	int timeout = 2, rv, sent = 0, received = 0;
+	struct timespec ts;
 
-	if (argc < 2) {
-		printf("usage: %s <host> [timeout]\n", argv[0]);
-		return 2;
-	}
+	ts.tv_sec = when / 1000000;
+	ts.tv_nsec = (when % 1000000) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR && !signaled)
+		;
+}
 
-	if (argc == 3)
-		timeout = atoi(argv[2]);
 
-	signal(SIGINT, signal_handler);
-	signal(SIGTERM, signal_handler);
+/**
+ * Print a string as a JSON string literal.
+ */
+static void
+qping_json_str(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			putchar('\\');
+		if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
+}
 
-	printf("Pinging %s\n", argv[1]);
 
-	while (!signaled) {
+static void
+qping_report(struct probe_engine *pe, struct hdr_hist *hists, int format,
+	     uint64_t elapsed)
+{
+	static const double pcts[] = { 50.0, 90.0, 99.0, 99.9 };
+	static const char *pct_names[] = { "p50", "p90", "p99", "p99.9" };
+	struct probe_stats *ps;
+	struct hdr_hist *hh;
+	uint64_t sent, lost, avg;
+	double loss;
+	int x, y;
+
+	if (format == QPING_JSON)
+		printf("{\"elapsed_us\": %llu, \"targets\": [",
+		       (unsigned long long)elapsed);
+	else if (format == QPING_CSV)
+		printf("host,sent,received,lost,errors,loss_pct,min_us,avg_us,"
+		       "max_us,p50_us,p90_us,p99_us,p99_9_us,mtu_sent,"
+		       "mtu_lost\n");
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		ps = &pe->pe_paths[x].pp_stats;
+		hh = &hists[x];
+		lost = ps->ps_lost + ps->ps_rxq_overflow;
+		/* A failed full-size probe is mtu_lost, not loss */
+		sent = ps->ps_sent - ps->ps_mtu_lost;
+		loss = sent ? 100.0 * (double)(sent - ps->ps_received) /
+			      (double)sent : 0;
+		avg = hh->hh_count ? hh->hh_total / hh->hh_count : 0;
+
+		switch(format) {
+		case QPING_TEXT:
+			printf("--- %s ---\n", pe->pe_paths[x].pp_host);
+			printf("%llu sent; %llu received; %.2f%% loss; "
+			       "%llu errors; time %.3fs\n",
+			       (unsigned long long)ps->ps_sent,
+			       (unsigned long long)ps->ps_received, loss,
+			       (unsigned long long)ps->ps_errors,
+			       (double)elapsed / 1000000);
+			if (ps->ps_mtu_sent)
+				printf("%u byte probes: %llu sent; %llu lost\n",
+				       pe->pe_paths[x].pp_opts.io_mtu,
+				       (unsigned long long)ps->ps_mtu_sent,
+				       (unsigned long long)ps->ps_mtu_lost);
+			if (!hh->hh_count)
+				break;
+			printf("rtt min/avg/max = %llu/%llu/%llu us",
+			       (unsigned long long)hh->hh_min,
+			       (unsigned long long)avg,
+			       (unsigned long long)hh->hh_max);
+			for (y = 0; y < 4; y++)
+				printf(" %s %llu", pct_names[y],
+				       (unsigned long long)
+				       hdr_percentile(hh, pcts[y]));
+			printf(" us\n");
+			break;
+		case QPING_JSON:
+			printf("%s{\"host\": ", x ? ", " : "");
+			qping_json_str(pe->pe_paths[x].pp_host);
+			printf(", \"sent\": %llu, \"received\": %llu, "
+			       "\"lost\": %llu, \"errors\": %llu, "
+			       "\"loss_pct\": %.3f",
+			       (unsigned long long)ps->ps_sent,
+			       (unsigned long long)ps->ps_received,
+			       (unsigned long long)lost,
+			       (unsigned long long)ps->ps_errors, loss);
+			if (ps->ps_mtu_sent)
+				printf(", \"mtu_sent\": %llu, \"mtu_lost\": %llu",
+				       (unsigned long long)ps->ps_mtu_sent,
+				       (unsigned long long)ps->ps_mtu_lost);
+			if (hh->hh_count) {
+				printf(", \"rtt_us\": {\"min\": %llu, "
+				       "\"avg\": %llu, \"max\": %llu",
+				       (unsigned long long)hh->hh_min,
+				       (unsigned long long)avg,
+				       (unsigned long long)hh->hh_max);
+				for (y = 0; y < 4; y++)
+					printf(", \"%s\": %llu", pct_names[y],
+					       (unsigned long long)
+					       hdr_percentile(hh, pcts[y]));
+				printf("}");
+			}
+			printf("}");
+			break;
+		case QPING_CSV:
+			printf("%s,%llu,%llu,%llu,%llu,%.3f",
+			       pe->pe_paths[x].pp_host,
+			       (unsigned long long)ps->ps_sent,
+			       (unsigned long long)ps->ps_received,
+			       (unsigned long long)lost,
+			       (unsigned long long)ps->ps_errors, loss);
+			if (hh->hh_count) {
+				printf(",%llu,%llu,%llu",
+				       (unsigned long long)hh->hh_min,
+				       (unsigned long long)avg,
+				       (unsigned long long)hh->hh_max);
+				for (y = 0; y < 4; y++)
+					printf(",%llu", (unsigned long long)
+					       hdr_percentile(hh, pcts[y]));
+			} else {
+				printf(",,,,,,,");
+			}
+			printf(",%llu,%llu\n",
+			       (unsigned long long)ps->ps_mtu_sent,
+			       (unsigned long long)ps->ps_mtu_lost);
+			break;
+		}
+	}
 
-		gettimeofday(&begin, NULL);
-		rv = icmp_ping_host(argv[1], 1, timeout);
-		++sent;
-		gettimeofday(&end, NULL);
-		__diff_tv(&delta, &begin, &end);
+	if (format == QPING_JSON)
+		printf("]}\n");
+}
 
-		switch(rv) {
-		case PING_ERRNO:
-			perror("icmp_ping_host");
-			return 1;
+
+int
+main(int argc, char **argv)
+{
+	struct probe_engine pe;
+	struct icmp_opts opts, *optsp = NULL;
+	struct sockaddr_in sin;
+	struct probe_path *pp;
+	struct hdr_hist *hists;
+	struct probe_trace trace;
+	char *trace_file = NULL, *end;
+	uint64_t start, next, now, count = 0, round;
+	int64_t interval = 1000000, timeout = 2000000, deadline = 0;
+	int c, x, flood = 0, quiet = 0, format = QPING_TEXT, nhosts, ret = 0;
+	int backend = PROBE_BACKEND_POLL;
+
+	while ((c = getopt(argc, argv, "i:fc:w:W:I:b:o:qT:h?")) != EOF) {
+		switch(c) {
+		case 'i':
+			interval = qping_time(optarg);
 			break;
-		case PING_SUCCESS:
-			++received;
-			printf("Reply #%d RTT = %d.%06d seconds\n", received,
-			       (int)delta.tv_sec, (int)delta.tv_usec );
+		case 'f':
+			flood = 1;
 			break;
-		case PING_TIMEOUT:
-			printf("%s timed out\n", argv[1]);
+		case 'c':
+			/* strtoull() would take "-5" as 2^64 - 5 */
+			count = strtoull(optarg, &end, 0);
+			if (*end || end == optarg || count < 1 ||
+			    strchr(optarg, '-')) {
+				usage(argv[0]);
+				return 2;
+			}
 			break;
-		case PING_HOST_UNREACH:
-			printf("%s is unreachable\n", argv[1]);
+		case 'w':
+			deadline = qping_time(optarg);
 			break;
-		case PING_HOST_NOT_FOUND:
-			printf("Host %s not found!\n", argv[1]);
-			return 1;
+		case 'W':
+			timeout = qping_time(optarg);
 			break;
-		case PING_INVALID_CHECKSUM:
-			printf("Invalid checksum in reply.\n");
+		case 'I':
+			if (icmp_opts_parse(optarg, &opts) < 0) {
+				printf("Bad path options: %s\n", optarg);
+				return 2;
+			}
+			optsp = &opts;
+			break;
+		case 'b':
+			backend = probe_backend_parse(optarg);
 			break;
-		case PING_INVALID_SIZE:
-			printf("Invalid size of reply packet.\n");
+		case 'o':
+			if (!strcmp(optarg, "json"))
+				format = QPING_JSON;
+			else if (!strcmp(optarg, "csv"))
+				format = QPING_CSV;
+			else if (strcmp(optarg, "text"))
+				format = -1;
 			break;
-		case PING_INVALID_RESPONSE:
-			printf("Invalid response.\n");
+		case 'q':
+			quiet = 1;
 			break;
-		case PING_INVALID_ID:
-			printf("Invalid ID in response.\n");
+		case 'T':
+			trace_file = optarg;
 			break;
+		default:
+			usage(argv[0]);
+			return 2;
 		}
+	}
 
-		sleep(1);
+	nhosts = argc - optind;
+	/* The old "qping <host> [timeout]" form */
+	if (nhosts == 2 && strspn(argv[optind + 1], "0123456789") ==
+	    strlen(argv[optind + 1])) {
+		timeout = (int64_t)atoi(argv[optind + 1]) * 1000000;
+		nhosts = 1;
 	}
 
-	printf("%d sent; %d received\n", sent, received);
+	if (nhosts < 1 || interval < 0 || deadline < 0 || timeout <= 0 ||
+	    timeout > UINT32_MAX || backend < 0 || format < 0) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (format != QPING_TEXT)
+		quiet = 1;
 
-	if (sent > received) {
+	hists = malloc(sizeof(*hists) * nhosts);
+	if (!hists || probe_engine_init(&pe) < 0) {
+		perror("probe_engine_init");
 		return 1;
 	}
-	return 0;
+	if (probe_set_backend(&pe, backend) < 0)
+		perror("probe_set_backend");
+	memset(&trace, 0, sizeof(trace));
+	if (trace_file) {
+		if (probe_trace_open(&trace, trace_file, 0) < 0) {
+			perror(trace_file);
+			return 1;
+		}
+		probe_trace_attach(&pe, &trace);
+	}
+
+	for (x = 0; x < nhosts; x++) {
+		if (icmp_ping_getaddr(argv[optind + x], &sin) != 0) {
+			printf("Host %s not found!\n", argv[optind + x]);
+			return 1;
+		}
+		if (probe_add_path(&pe, argv[optind + x], optsp, NULL) < 0 ||
+		    pe.pe_paths[x].pp_sock < 0) {
+			perror("icmp_socket");
+			return 1;
+		}
+		hdr_init(&hists[x]);
+	}
+
+	/* Spread a round's sends over at most the interval */
+	if (flood)
+		pe.pe_spread = 0;
+	else if ((uint64_t)interval / nhosts < pe.pe_spread)
+		pe.pe_spread = (uint32_t)(interval / nhosts);
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	if (!quiet)
+		printf("Pinging %d host%s\n", nhosts, nhosts > 1 ? "s" : "");
+
+	start = next = probe_now();
+	for (round = 0; !signaled && (!count || round < count); round++) {
+		if (deadline && probe_now() - start >= (uint64_t)deadline)
+			break;
+
+		if (probe_round(&pe, (uint32_t)timeout) < 0) {
+			perror("probe_round");
+			ret = 1;
+			break;
+		}
+		if (trace_file && !pe.pe_trace) {
+			printf("%s: %s\n", trace_file,
+			       strerror(trace.tf_error));
+			trace_file = NULL;
+		}
+
+		for (x = 0; x < nhosts; x++) {
+			pp = &pe.pe_paths[x];
+			if ((pp->pp_events & PROBE_EV_MTU_LOST) && !quiet)
+				printf("%s: %u byte probes fail: %s\n",
+				       pp->pp_host, pp->pp_opts.io_mtu,
+				       icmp_ping_strerror(pp->pp_mtu_result));
+			if ((pp->pp_events & PROBE_EV_MTU_OK) && !quiet)
+				printf("%s: %u byte probes get through again\n",
+				       pp->pp_host, pp->pp_opts.io_mtu);
+			if (!pp->pp_fresh)
+				continue;
+			if (pp->pp_result == PING_SUCCESS)
+				hdr_record(&hists[x], pp->pp_stats.ps_rtt_last);
+			if (quiet || flood)
+				continue;
+			if (pp->pp_result == PING_SUCCESS)
+				printf("%s: reply #%llu RTT = %u us\n",
+				       pp->pp_host, (unsigned long long)
+				       pp->pp_stats.ps_received,
+				       pp->pp_stats.ps_rtt_last);
+			else
+				printf("%s: %s\n", pp->pp_host,
+				       icmp_ping_strerror(pp->pp_result));
+		}
+		if (!quiet)
+			fflush(stdout);
+
+		if (flood)
+			continue;
+		next += interval;
+		now = probe_now();
+		if (next < now)
+			next = now;
+		if (deadline && next > start + deadline)
+			next = start + deadline;
+		qping_sleep_until(next);
+	}
+
+	qping_report(&pe, hists, format, probe_now() - start);
+
+	for (x = 0; x < nhosts; x++) {
+		if (pe.pe_paths[x].pp_stats.ps_sent -
+		    pe.pe_paths[x].pp_stats.ps_mtu_lost >
+		    pe.pe_paths[x].pp_stats.ps_received)
+			ret = 1;
+	}
+
+	probe_engine_destroy(&pe);
+	if (trace.tf_fp)
+		probe_trace_close(&trace);
+	free(hists);
+	return ret;
 }
 #endif
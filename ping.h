@@ -23,6 +23,7 @@
 #define __PING_H
 
 #include <netinet/ip_icmp.h>
+#include <net/if.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -35,6 +36,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define PING_ERRNO		-1
 #define PING_SUCCESS		0
 #define PING_ALIVE		PING_SUCCESS
@@ -45,8 +50,116 @@
 #define PING_INVALID_RESPONSE	5
 #define PING_INVALID_SIZE	6
 #define PING_INVALID_ID		7
+#define PING_NET_UNREACH	8
+#define PING_ADMIN_PROHIBITED	9
+#define PING_TTL_EXCEEDED	10
+#define PING_REDIRECT		11	/* informational; probe continues */
+#define PING_RXQ_OVERFLOW	12	/* timed out; our receive queue
+					   was dropping packets */
+#define PING_FRAG_NEEDED	13	/* too big for the path MTU, and
+					   DF was set */
+#define PING_LINK_DOWN		14	/* not sent; the egress link is
+					   down */
+
+#define ICMP_DATALEN		ICMP_MINLEN	/* default echo data bytes */
+#define ICMP_MAX_DATALEN	(IP_MAXPACKET - 20 - ICMP_MINLEN)
+#define ICMP_RECV_LEN		2048	/* whole replies up to 1500 MTU */
+/* Largest probe (IP datagram) whose reply, IP options and all, fits */
+#define ICMP_MAX_PROBE		(ICMP_RECV_LEN - 40)
+
+/**
+ * Path selection for a probe socket.  Zeroed fields are left alone, so
+ * an all-zero icmp_opts yields the same socket as icmp_socket().
+ */
+struct icmp_opts {
+	char		io_ifname[IFNAMSIZ];	/* SO_BINDTODEVICE */
+	struct in_addr	io_src;			/* bind()ed source address */
+	uint32_t	io_mark;		/* SO_MARK, for policy routing */
+	uint8_t		io_dscp;		/* IP_TOS (DSCP << 2) */
+	uint32_t	io_priority;		/* SO_PRIORITY (qdisc band) */
+	uint16_t	io_size;		/* echo data bytes; 0 = 8 */
+	uint8_t		io_df;			/* never fragment */
+	uint16_t	io_mtu;			/* full-size probes: IP bytes */
+	uint16_t	io_every;		/* one in this many; 0 = 10 */
+};
+
+/**
+ * One ICMP message as read off a probe socket.  For error messages
+ * (unreachable, time exceeded, redirect, ...) ir_quoted is set if the
+ * message quotes an ICMP echo, and the ir_orig_* fields say which.
+ */
+struct icmp_reply {
+	struct in_addr	ir_from;
+	uint8_t		ir_type;
+	uint8_t		ir_code;
+	uint16_t	ir_id;
+	uint16_t	ir_seq;
+	int		ir_quoted;
+	struct in_addr	ir_orig_dst;
+	uint16_t	ir_orig_id;
+	uint16_t	ir_orig_seq;
+};
+
+#define QNET_PING_CACHE		8	/* resolver cache entries */
+#define QNET_PING_CACHE_TTL	60000	/* msec */
+#define QNET_PING_CACHE_NEG	5000	/* msec, for unknown hosts */
+
+struct qnet_ping_stats {
+	uint64_t	qs_sent;
+	uint64_t	qs_received;
+	uint64_t	qs_timeouts;
+	uint64_t	qs_errors;	/* everything else */
+	uint32_t	qs_rtt_min;	/* microseconds */
+	uint32_t	qs_rtt_max;
+	uint64_t	qs_rtt_total;
+	uint64_t	qs_lookups;
+	uint64_t	qs_cache_hits;
+};
+
+struct qnet_ping_cache {
+	char		qc_name[64];
+	struct in_addr	qc_addr;
+	int32_t		qc_result;	/* 0 or PING_HOST_NOT_FOUND */
+	uint64_t	qc_expires;	/* msec, monotonic */
+};
+
+/**
+ * Pinger state for one thread (or one user) of the library.  Contexts
+ * share nothing: each has its own socket, echo identifier, sequence
+ * numbers, resolver cache and statistics, so any number of them can be
+ * used in one process, each from its own thread, without locking.  A
+ * single context is not safe to use from two threads at once.
+ */
+struct qnet_ping_ctx {
+	int32_t			qp_sock;
+	struct icmp_opts	qp_opts;
+	uint16_t		qp_id;
+	uint16_t		qp_seq;
+	struct qnet_ping_cache	qp_cache[QNET_PING_CACHE];
+	int			qp_cache_next;
+	struct qnet_ping_stats	qp_stats;
+};
 
 int32_t icmp_socket(void);
+int32_t icmp_socket_opts(const struct icmp_opts *opts);
+int icmp_socket_mute(int32_t sock);
+int icmp_socket_busy_poll(int32_t sock, uint32_t usec);
+int icmp_opts_parse(const char *spec, struct icmp_opts *opts);
+int32_t icmp_ping_getaddr(const char *hostname, struct sockaddr_in *sin_send);
+uint16_t icmp_alloc_id(void);
+size_t icmp_build_echo(void *buf, uint16_t id, uint16_t seq);
+size_t icmp_build_echo_size(void *buf, uint16_t id, uint16_t seq,
+			    size_t datalen);
+int32_t icmp_send_echo(int32_t sock, const struct sockaddr_in *sin_send,
+		       uint16_t id, uint16_t seq);
+int32_t icmp_send_echo_size(int32_t sock, const struct sockaddr_in *sin_send,
+			    uint16_t id, uint16_t seq, size_t datalen);
+int32_t icmp_parse(const void *buf, size_t len, struct icmp_reply *reply);
+int32_t icmp_recv(int32_t sock, struct icmp_reply *reply);
+int icmp_is_error(uint8_t type);
+int32_t icmp_classify(const struct icmp_reply *reply);
+int32_t icmp_ping_wait(int32_t sock, const struct sockaddr_in *sin_send,
+		       uint16_t id, uint16_t seq, int timeout_ms);
 int32_t icmp_ping_hostfd(int32_t sock, char *hostname, uint32_t seq,
 			uint32_t timeout);
 int32_t icmp_ping_host(char *hostname, uint32_t seq,uint32_t timeout);
@@ -55,9 +168,25 @@ int32_t icmp_ping_addrfd(int32_t sock, struct sockaddr_in *sin_send, uint32_t se
 		    uint32_t timeout);
 int32_t icmp_ping_addr(struct sockaddr_in *sin_send, uint32_t seq,uint32_t timeout);
 
-/* NOT reentrant - uses static buffers */
+int qnet_ping_ctx_init(struct qnet_ping_ctx *ctx,
+		       const struct icmp_opts *opts);
+void qnet_ping_ctx_destroy(struct qnet_ping_ctx *ctx);
+int32_t qnet_ping_resolve(struct qnet_ping_ctx *ctx, const char *hostname,
+			  struct sockaddr_in *sin);
+int32_t qnet_ping_addr(struct qnet_ping_ctx *ctx,
+		       const struct sockaddr_in *sin, int timeout_ms,
+		       uint32_t *rtt_us);
+int32_t qnet_ping_host(struct qnet_ping_ctx *ctx, const char *hostname,
+		       int timeout_ms, uint32_t *rtt_us);
+
+/* Per-thread buffer; overwritten by the next call */
 char *icmp_ping_strerror(int rv);
+char *icmp_ping_strerror_r(int rv, char *buf, size_t len);
 
 #define net_icmp_close(sock) close(sock)
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,220 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+*/
+/** @file
+ * Reentrant pinger contexts (libqnetping).
+ *
+ * The icmp_ping_* calls in ping.c use the process ID as the echo
+ * identifier and open a socket per call, so two threads pinging at once
+ * can take each other's replies.  A qnet_ping_ctx owns everything a
+ * pinger needs instead, and nothing here touches global state except
+ * icmp_alloc_id(), which is atomic.
+ */
+
+#include <ping.h>
+#include <time.h>
+
+
+static uint64_t
+qnet_ping_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/**
+ * Set up a pinger context: open its socket and pick an echo identifier
+ * no other context in this process is using.
+ *
+ * @param ctx		Context to initialize.
+ * @param opts		Socket options (interface, source, marking), or
+ *			NULL for the default route.
+ * @return		0 on success, -1 on error (errno set; opening a
+ *			raw socket needs CAP_NET_RAW).
+ */
+int
+qnet_ping_ctx_init(struct qnet_ping_ctx *ctx, const struct icmp_opts *opts)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	if (opts)
+		ctx->qp_opts = *opts;
+
+	ctx->qp_sock = icmp_socket_opts(opts);
+	if (ctx->qp_sock < 0)
+		return -1;
+
+	ctx->qp_id = icmp_alloc_id();
+	ctx->qp_stats.qs_rtt_min = (uint32_t)-1;
+	return 0;
+}
+
+
+/**
+ * Close a context's socket.
+ */
+void
+qnet_ping_ctx_destroy(struct qnet_ping_ctx *ctx)
+{
+	if (ctx->qp_sock >= 0)
+		net_icmp_close(ctx->qp_sock);
+	ctx->qp_sock = -1;
+}
+
+
+/**
+ * Resolve a host name through the context's cache.  Answers are kept
+ * for QNET_PING_CACHE_TTL (unknown hosts for QNET_PING_CACHE_NEG), so
+ * that pinging by name does not cost a lookup every time.
+ *
+ * @param ctx		Context.
+ * @param hostname	Host name or dotted quad.
+ * @param sin		Filled in with the address.
+ * @return		0 on success, PING_HOST_NOT_FOUND, or -1 on
+ *			other error.
+ */
+int32_t
+qnet_ping_resolve(struct qnet_ping_ctx *ctx, const char *hostname,
+		  struct sockaddr_in *sin)
+{
+	struct qnet_ping_cache *qc;
+	uint64_t now = qnet_ping_msec();
+	int32_t ret;
+	int x;
+
+	++ctx->qp_stats.qs_lookups;
+
+	for (x = 0; x < QNET_PING_CACHE; x++) {
+		qc = &ctx->qp_cache[x];
+		if (qc->qc_expires <= now || strcmp(qc->qc_name, hostname))
+			continue;
+		++ctx->qp_stats.qs_cache_hits;
+		memset(sin, 0, sizeof(*sin));
+		sin->sin_family = AF_INET;
+		sin->sin_addr = qc->qc_addr;
+		return qc->qc_result;
+	}
+
+	ret = icmp_ping_getaddr(hostname, sin);
+	if (ret < 0 || strlen(hostname) >= sizeof(qc->qc_name))
+		return ret;
+
+	/* Reuse an expired entry, or else the next one round-robin */
+	qc = NULL;
+	for (x = 0; x < QNET_PING_CACHE && !qc; x++) {
+		if (ctx->qp_cache[x].qc_expires <= now)
+			qc = &ctx->qp_cache[x];
+	}
+	if (!qc) {
+		qc = &ctx->qp_cache[ctx->qp_cache_next];
+		ctx->qp_cache_next = (ctx->qp_cache_next + 1) %
+				     QNET_PING_CACHE;
+	}
+
+	strcpy(qc->qc_name, hostname);
+	qc->qc_addr = sin->sin_addr;
+	qc->qc_result = ret;
+	qc->qc_expires = now + (ret ? QNET_PING_CACHE_NEG :
+				      QNET_PING_CACHE_TTL);
+	return ret;
+}
+
+
+/**
+ * Ping an address and wait for the answer.
+ *
+ * @param ctx		Context.
+ * @param sin		Address to ping.
+ * @param timeout_ms	How long to wait (milliseconds).
+ * @param rtt_us	If not NULL, set to the round trip time (usec)
+ *			on success.
+ * @return		-1 on syscall error, 0 on success.
+ *			See ping.h for list of return values >0.
+ */
+int32_t
+qnet_ping_addr(struct qnet_ping_ctx *ctx, const struct sockaddr_in *sin,
+	       int timeout_ms, uint32_t *rtt_us)
+{
+	struct qnet_ping_stats *qs = &ctx->qp_stats;
+	struct timespec start, end;
+	uint32_t rtt;
+	int32_t ret;
+
+	if (ctx->qp_sock < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	++ctx->qp_seq;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (icmp_send_echo_size(ctx->qp_sock, sin, ctx->qp_id, ctx->qp_seq,
+				ctx->qp_opts.io_size) < 0) {
+		++qs->qs_errors;
+		return -1;
+	}
+	++qs->qs_sent;
+
+	ret = icmp_ping_wait(ctx->qp_sock, sin, ctx->qp_id, ctx->qp_seq,
+			     timeout_ms);
+
+	switch(ret) {
+	case PING_SUCCESS:
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		rtt = (uint32_t)((end.tv_sec - start.tv_sec) * 1000000 +
+				 (end.tv_nsec - start.tv_nsec) / 1000);
+		++qs->qs_received;
+		qs->qs_rtt_total += rtt;
+		if (rtt < qs->qs_rtt_min)
+			qs->qs_rtt_min = rtt;
+		if (rtt > qs->qs_rtt_max)
+			qs->qs_rtt_max = rtt;
+		if (rtt_us)
+			*rtt_us = rtt;
+		break;
+	case PING_TIMEOUT:
+		++qs->qs_timeouts;
+		break;
+	default:
+		++qs->qs_errors;
+		break;
+	}
+
+	return ret;
+}
+
+
+/**
+ * Ping a host by name or address, resolving through the context's cache.
+ *
+ * @see qnet_ping_addr qnet_ping_resolve
+ */
+int32_t
+qnet_ping_host(struct qnet_ping_ctx *ctx, const char *hostname,
+	       int timeout_ms, uint32_t *rtt_us)
+{
+	struct sockaddr_in sin;
+	int32_t ret;
+
+	ret = qnet_ping_resolve(ctx, hostname, &sin);
+	if (ret)
+		return ret;
+
+	return qnet_ping_addr(ctx, &sin, timeout_ms, rtt_us);
+}
@@ -0,0 +1,1855 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+*/
+/** @file
+ * Probe engine.  Sends ICMP echoes down several paths at once (one socket
+ * per path) and collects the answers on a single event loop, keeping
+ * statistics for each path separately.
+ *
+ * The engine decides what to send when, matches replies and keeps track
+ * of deadlines; moving the packets is up to an I/O backend (struct
+ * probe_ops): select/poll/epoll on the path sockets (probe_io.c), a
+ * shared packet ring (probe_ring.c), or io_uring (probe_uring.c).
+ *
+ * Each path also has a probe budget (see struct probe_budget), so that
+ * we do not provoke an ICMP rate limiter into dropping our echoes and
+ * then mistake the drops for a dead path.
+ *
+ * Optionally (probe_set_busy_poll), the engine spins instead of
+ * sleeping for a short window around each reply's expected arrival,
+ * trading CPU for interrupt and wakeup latency.
+ */
+
+#define _GNU_SOURCE		/* ppoll */
+#include <probe.h>
+#include <probe_trace.h>
+#include <linux/sock_diag.h>
+#include <poll.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL		40
+#endif
+#ifndef SO_MEMINFO
+#define SO_MEMINFO		55
+#endif
+
+
+static const struct probe_ops *probe_backends[PROBE_BACKEND_MAX] = {
+	[PROBE_BACKEND_POLL] = &probe_poll_ops,
+	[PROBE_BACKEND_RING] = &probe_ring_ops,
+	[PROBE_BACKEND_SELECT] = &probe_select_ops,
+	[PROBE_BACKEND_EPOLL] = &probe_epoll_ops,
+	[PROBE_BACKEND_URING] = &probe_uring_ops,
+};
+
+static void probe_send_next(struct tw_timer *t, uint64_t now);
+static void probe_expire(struct tw_timer *t, uint64_t now);
+static void probe_hedge(struct tw_timer *t, uint64_t now);
+
+
+/**
+ * Monotonic clock, in microseconds.
+ */
+uint64_t
+probe_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * Set up an empty probe engine.
+ *
+ * @param pe		Engine to initialize.
+ * @return		0
+ */
+int
+probe_engine_init(struct probe_engine *pe)
+{
+	memset(pe, 0, sizeof(*pe));
+	pe->pe_id = icmp_alloc_id();
+	pe->pe_spread = PROBE_SPREAD;
+	pe->pe_backend = PROBE_BACKEND_POLL;
+	pe->pe_ops = probe_backends[PROBE_BACKEND_POLL];
+	pe->pe_wake_fd = -1;
+	tw_init(&pe->pe_wheel, PROBE_TICK, probe_now());
+	tw_timer_init(&pe->pe_send_timer, probe_send_next, pe);
+	return pe->pe_ops->po_init(pe);
+}
+
+
+/**
+ * Close a path's socket, telling the backend first.
+ */
+static void
+probe_close(struct probe_engine *pe, struct probe_path *pp)
+{
+	if (pp->pp_sock < 0)
+		return;
+	if (pe->pe_ops->po_close)
+		pe->pe_ops->po_close(pe, pp);
+	net_icmp_close(pp->pp_sock);
+	pp->pp_sock = -1;
+	pp->pp_listen = 0;
+	pp->pp_shared = 0;
+}
+
+
+/**
+ * Close all path sockets, shut down the backend, and free the path
+ * table.
+ *
+ * @param pe		Engine to tear down.
+ */
+void
+probe_engine_destroy(struct probe_engine *pe)
+{
+	int x;
+
+	for (x = 0; x < pe->pe_npaths; x++)
+		probe_close(pe, &pe->pe_paths[x]);
+	if (pe->pe_ops) {
+		pe->pe_ops->po_fini(pe);
+		pe->pe_ops = NULL;
+	}
+	free(pe->pe_paths);
+	pe->pe_paths = NULL;
+	free(pe->pe_seqmap);
+	pe->pe_seqmap = NULL;
+	pe->pe_npaths = 0;
+}
+
+
+/**
+ * Size a listening socket's receive buffer so that it can hold
+ * PROBE_RCVBUF_SECS worth of replies from every path at the budgeted
+ * probe rate, in case the thread falls behind or foreign ICMP competes
+ * for room.  Never shrinks the buffer below the system default, and
+ * asks for no more than INT_MAX (however many paths there are).
+ */
+static void
+probe_rcvbuf(struct probe_engine *pe, struct probe_path *pp)
+{
+	socklen_t len = sizeof(int);
+	double rate, bytes;
+	int want, cur = 0, x, size = 0;
+
+	/* Big probes, big replies */
+	for (x = 0; x < pe->pe_npaths; x++) {
+		if (pe->pe_paths[x].pp_opts.io_size > size)
+			size = pe->pe_paths[x].pp_opts.io_size;
+		if (pe->pe_paths[x].pp_opts.io_mtu > size)
+			size = pe->pe_paths[x].pp_opts.io_mtu;
+	}
+
+	rate = pe->pe_max_rate > 1 ? pe->pe_max_rate : 1;
+	bytes = pe->pe_npaths * rate * PROBE_RCVBUF_SECS *
+		(PROBE_TRUESIZE + size);
+	want = bytes < INT_MAX ? (int)bytes : INT_MAX;
+	if (getsockopt(pp->pp_sock, SOL_SOCKET, SO_RCVBUF, &cur, &len) == 0 &&
+	    cur >= want)
+		return;
+
+	/* The kernel doubles this for its own overhead */
+	want /= 2;
+	if (setsockopt(pp->pp_sock, SOL_SOCKET, SO_RCVBUFFORCE, &want,
+		       sizeof(want)) < 0)
+		setsockopt(pp->pp_sock, SOL_SOCKET, SO_RCVBUF, &want,
+			   sizeof(want));
+}
+
+
+/**
+ * Would two paths' sockets be set up identically?
+ */
+static int
+probe_same_opts(const struct icmp_opts *a, const struct icmp_opts *b)
+{
+	return !strncmp(a->io_ifname, b->io_ifname, sizeof(a->io_ifname)) &&
+	       a->io_src.s_addr == b->io_src.s_addr &&
+	       a->io_mark == b->io_mark && a->io_dscp == b->io_dscp &&
+	       a->io_priority == b->io_priority &&
+	       !(a->io_df || a->io_mtu) == !(b->io_df || b->io_mtu);
+}
+
+
+/**
+ * Open (or reopen) the socket for a path.  Paths whose options are
+ * identical (typically many targets reached the same way) send on one
+ * socket, each holding a dup() of it: every raw ICMP socket gets a copy
+ * of every ICMP message the host receives, so with thousands of paths
+ * that fan-out, not the engine, is what costs.  Otherwise, only one
+ * socket per distinct interface/source binding needs to receive, since
+ * they would all get the same ICMP; the rest (and all of them, if the
+ * backend does not receive on path sockets) are muted and only send.
+ */
+static int
+probe_open(struct probe_engine *pe, struct probe_path *pp)
+{
+	struct probe_path *other;
+	int x;
+
+	pp->pp_drops = 0;
+	pp->pp_shared = 0;
+	for (x = 0; x < pe->pe_npaths; x++) {
+		other = &pe->pe_paths[x];
+		if (other == pp || other->pp_sock < 0 || other->pp_shared ||
+		    !probe_same_opts(&other->pp_opts, &pp->pp_opts))
+			continue;
+		pp->pp_sock = fcntl(other->pp_sock, F_DUPFD_CLOEXEC, 0);
+		if (pp->pp_sock < 0)
+			break;
+		pp->pp_shared = 1;
+		pp->pp_listen = 0;
+		if (pe->pe_ops->po_open)
+			pe->pe_ops->po_open(pe, pp);
+		return 0;
+	}
+
+	pp->pp_sock = icmp_socket_opts(&pp->pp_opts);
+	if (pp->pp_sock < 0)
+		return -1;
+	fcntl(pp->pp_sock, F_SETFL, fcntl(pp->pp_sock, F_GETFL) | O_NONBLOCK);
+
+	pp->pp_listen = pe->pe_ops->po_sockrecv;
+	for (x = 0; x < pe->pe_npaths && pp->pp_listen; x++) {
+		other = &pe->pe_paths[x];
+		if (other != pp && other->pp_listen &&
+		    !strcmp(other->pp_opts.io_ifname, pp->pp_opts.io_ifname) &&
+		    other->pp_opts.io_src.s_addr == pp->pp_opts.io_src.s_addr)
+			pp->pp_listen = 0;
+	}
+
+	if (!pp->pp_listen) {
+		icmp_socket_mute(pp->pp_sock);
+	} else {
+		x = 1;
+		setsockopt(pp->pp_sock, SOL_SOCKET, SO_RXQ_OVFL, &x, sizeof(x));
+		setsockopt(pp->pp_sock, SOL_SOCKET, SO_TIMESTAMPNS, &x,
+			   sizeof(x));
+		probe_rcvbuf(pe, pp);
+		if (pe->pe_busy_poll)
+			icmp_socket_busy_poll(pp->pp_sock, pe->pe_busy_poll);
+	}
+	if (pe->pe_ops->po_open)
+		pe->pe_ops->po_open(pe, pp);
+	return 0;
+}
+
+
+/**
+ * Look up a backend by name.
+ *
+ * @return		PROBE_BACKEND_*, or -1 if there is no such backend.
+ */
+int
+probe_backend_parse(const char *name)
+{
+	int x;
+
+	for (x = 0; x < PROBE_BACKEND_MAX; x++) {
+		if (!strcmp(name, probe_backends[x]->po_name))
+			return x;
+	}
+	return -1;
+}
+
+
+/**
+ * Switch I/O backends.  If the backend cannot be set up (e.g. no
+ * io_uring in this kernel, or no CAP_NET_RAW for the packet ring), the
+ * engine is left as it was, except that io_uring falls back to epoll;
+ * check pe_backend to see what was actually chosen.
+ *
+ * @param pe		Engine.
+ * @param backend	PROBE_BACKEND_*.
+ * @return		0 on success, -1 on error (errno set).
+ */
+int
+probe_set_backend(struct probe_engine *pe, int backend)
+{
+	int x, ret, esv = 0;
+
+	if (backend < 0 || backend >= PROBE_BACKEND_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (backend == pe->pe_backend)
+		return 0;
+
+	for (x = 0; x < pe->pe_npaths; x++)
+		probe_close(pe, &pe->pe_paths[x]);
+	pe->pe_ops->po_fini(pe);
+
+	pe->pe_ops = probe_backends[backend];
+	ret = pe->pe_ops->po_init(pe);
+	if (ret < 0 && backend == PROBE_BACKEND_URING) {
+		/* Not an error; pe_backend says what we got */
+		backend = PROBE_BACKEND_EPOLL;
+		pe->pe_ops = probe_backends[backend];
+		ret = pe->pe_ops->po_init(pe);
+	}
+
+	if (ret < 0) {
+		esv = errno;
+		/* Back to what we had; it worked before */
+		pe->pe_ops = probe_backends[pe->pe_backend];
+		pe->pe_ops->po_init(pe);
+		backend = pe->pe_backend;
+	}
+	pe->pe_backend = backend;
+	pe->pe_drops_backend = 0;
+
+	for (x = 0; x < pe->pe_npaths; x++)
+		probe_open(pe, &pe->pe_paths[x]);
+
+	if (esv) {
+		errno = esv;
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Reset a path's budget.
+ */
+static void
+probe_budget_init(struct probe_budget *pb, double min_rate, double max_rate)
+{
+	memset(pb, 0, sizeof(*pb));
+	pb->pb_min = min_rate;
+	pb->pb_max = max_rate;
+	pb->pb_ceiling = max_rate;
+	pb->pb_rate = max_rate;
+	pb->pb_tokens = PROBE_BURST;
+	pb->pb_last = probe_now();
+}
+
+
+/**
+ * Set the probe budget for every path.  Each path may send at most
+ * max_rate probes per second; on signs of an ICMP rate limiter it backs
+ * off, but never below min_rate, so detection stays within the caller's
+ * latency budget.
+ *
+ * @param pe		Engine.
+ * @param min_rate	Floor, in probes/second.
+ * @param max_rate	Ceiling, in probes/second; 0 disables budgeting.
+ */
+void
+probe_set_budget(struct probe_engine *pe, double min_rate, double max_rate)
+{
+	int x;
+
+	if (min_rate > max_rate)
+		min_rate = max_rate;
+	pe->pe_min_rate = min_rate;
+	pe->pe_max_rate = max_rate;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		probe_budget_init(&pe->pe_paths[x].pp_budget, min_rate,
+				  max_rate);
+		if (pe->pe_paths[x].pp_sock >= 0 && pe->pe_paths[x].pp_listen)
+			probe_rcvbuf(pe, &pe->pe_paths[x]);
+	}
+}
+
+
+/**
+ * Give paths of a rebuilt engine the history of their counterparts in
+ * the old one (same host, name, group and options): statistics, latest
+ * result, MTU state, RTT estimate, and the probe budget if its bounds
+ * have not changed.  Call after probe_set_budget.
+ *
+ * @param pe		Rebuilt engine.
+ * @param old		Copy of the old engine's paths.
+ * @param nold		Number of them.
+ * @return		Number of paths which kept their history.
+ */
+int
+probe_carry_over(struct probe_engine *pe, const struct probe_path *old,
+		 int nold)
+{
+	struct probe_path *pp;
+	const struct probe_path *op;
+	int x, y, kept = 0;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		pp = &pe->pe_paths[x];
+		op = NULL;
+		for (y = 0; y < nold && !op; y++) {
+			if (old[y].pp_group == pp->pp_group &&
+			    !strcmp(old[y].pp_host, pp->pp_host) &&
+			    !strcmp(old[y].pp_name, pp->pp_name) &&
+			    !memcmp(&old[y].pp_opts, &pp->pp_opts,
+				    sizeof(pp->pp_opts)))
+				op = &old[y];
+		}
+		if (!op)
+			continue;
+
+		pp->pp_result = op->pp_result;
+		pp->pp_stats = op->pp_stats;
+		pp->pp_nth = op->pp_nth;
+		pp->pp_degraded = op->pp_degraded;
+		pp->pp_mtu_result = op->pp_mtu_result;
+		pp->pp_srtt = op->pp_srtt;
+		pp->pp_rttvar = op->pp_rttvar;
+		pp->pp_cp_mean = op->pp_cp_mean;
+		pp->pp_cp_dev = op->pp_cp_dev;
+		pp->pp_cp_n = op->pp_cp_n;
+		if (op->pp_budget.pb_min == pp->pp_budget.pb_min &&
+		    op->pp_budget.pb_max == pp->pp_budget.pb_max)
+			pp->pp_budget = op->pp_budget;
+		++kept;
+	}
+
+	return kept;
+}
+
+
+/**
+ * Give the engine a descriptor to watch alongside its sockets, such as
+ * an eventfd which another thread writes to when it wants us to stop.
+ * Once it is readable, probe_round gives up on the round at once and
+ * fails with EINTR, until the caller reads it empty again.
+ *
+ * @param pe		Engine.
+ * @param fd		Descriptor; -1 for none.
+ */
+void
+probe_set_wake(struct probe_engine *pe, int fd)
+{
+	pe->pe_wake_fd = fd;
+}
+
+
+/**
+ * Let the paths of a group send a few probes over their budget, for
+ * settling a suspected failure (or recovery) quickly.  The grant does
+ * not add up: it replaces whatever is left of the last one.
+ *
+ * @param pe		Engine.
+ * @param group		Paths with this pp_group; -1 for all.
+ * @param probes	Probes each path may send regardless of budget.
+ */
+void
+probe_grant(struct probe_engine *pe, int group, int probes)
+{
+	int x;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		if (group < 0 || pe->pe_paths[x].pp_group == group)
+			pe->pe_paths[x].pp_budget.pb_grant = probes;
+	}
+}
+
+
+/**
+ * Give each probe a timeout of its own, adapted to its path's RTT the
+ * way TCP adapts its retransmission timeout, so that a miss on a fast
+ * path is known in milliseconds rather than after a fixed timeout.
+ *
+ * @param pe		Engine.
+ * @param min_us	Floor; 0 turns adaptive timeouts off, and every
+ *			probe gets probe_round's timeout.
+ * @param max_us	Ceiling, and the timeout of paths which have not
+ *			answered yet.
+ */
+void
+probe_set_rto(struct probe_engine *pe, uint32_t min_us, uint32_t max_us)
+{
+	if (max_us < min_us)
+		max_us = min_us;
+	pe->pe_rto_min = min_us;
+	pe->pe_rto_max = max_us;
+}
+
+
+/**
+ * A path's probe timeout: the smoothed RTT plus PROBE_RTO_K times its
+ * mean deviation (RFC 6298), at least the engine's floor, doubled for
+ * every timeout in a row, at most its ceiling.
+ *
+ * @param pe		Engine.
+ * @param pp		Path.
+ * @return		Timeout (usec); probe_round's if adaptive
+ *			timeouts are off.
+ */
+uint32_t
+probe_rto(struct probe_engine *pe, struct probe_path *pp)
+{
+	uint64_t rto;
+
+	if (!pe->pe_rto_min)
+		return pe->pe_timeout;
+	if (!pp->pp_srtt)
+		return pe->pe_rto_max;
+
+	rto = (uint64_t)pp->pp_rttvar * PROBE_RTO_K;
+	if (rto < PROBE_TICK)
+		rto = PROBE_TICK;
+	rto += pp->pp_srtt;
+	if (rto < pe->pe_rto_min)
+		rto = pe->pe_rto_min;
+	rto <<= pp->pp_backoff;
+	if (rto > pe->pe_rto_max)
+		rto = pe->pe_rto_max;
+	return (uint32_t)rto;
+}
+
+
+/**
+ * Send every probe more than once: copies - 1 extra echoes follow the
+ * first, spacing_us apart, each with its own sequence number.  Whichever
+ * reply comes back first answers the probe, so a single lost echo (or
+ * reply) no longer costs a round.  The probe's timeout runs from the
+ * last copy.
+ *
+ * @param pe		Engine.
+ * @param copies	Echoes per probe, 1 (the default: no hedging) to
+ *			PROBE_HEDGE_MAX.
+ * @param spacing_us	Gap between copies; 0 for PROBE_HEDGE_SPACING.
+ */
+void
+probe_set_hedge(struct probe_engine *pe, int copies, uint32_t spacing_us)
+{
+	if (copies < 1)
+		copies = 1;
+	if (copies > PROBE_HEDGE_MAX)
+		copies = PROBE_HEDGE_MAX;
+	pe->pe_hedge = copies;
+	pe->pe_hedge_spacing = spacing_us ? spacing_us : PROBE_HEDGE_SPACING;
+}
+
+
+/**
+ * Leave ICMP errors quoting echoes with the given id alone, rather than
+ * counting them as foreign: they answer another prober of ours sharing
+ * the host's ICMP (probe_hops_sweep), which does its own matching.
+ *
+ * @param pe		Engine.
+ * @param id		ICMP echo identifier of the other prober.
+ */
+void
+probe_skip_id(struct probe_engine *pe, uint16_t id)
+{
+	pe->pe_skip_id = id;
+	pe->pe_skipping = 1;
+}
+
+
+/**
+ * Whether seq belongs to one of the copies of a path's current (or
+ * last) probe.
+ *
+ * @return		Copy number, or -1 if not.
+ */
+static int
+probe_copy(const struct probe_path *pp, uint16_t seq)
+{
+	uint16_t n = (uint16_t)(seq - pp->pp_seq0);
+
+	return n < pp->pp_copies ? (int)n : -1;
+}
+
+
+/**
+ * Feed an RTT to a path's timeout estimator.
+ */
+static void
+probe_rto_sample(struct probe_path *pp, uint32_t rtt)
+{
+	uint64_t delta;
+
+	if (!rtt)
+		rtt = 1;
+	if (!pp->pp_srtt) {
+		pp->pp_srtt = rtt;
+		pp->pp_rttvar = rtt / 2;
+		return;
+	}
+
+	delta = rtt > pp->pp_srtt ? rtt - pp->pp_srtt : pp->pp_srtt - rtt;
+	pp->pp_rttvar = (uint32_t)((3 * (uint64_t)pp->pp_rttvar + delta) / 4);
+	pp->pp_srtt = (uint32_t)((7 * (uint64_t)pp->pp_srtt + rtt) / 8);
+}
+
+
+/**
+ * Change detection: a one-sided CUSUM (Page-Hinkley) on each path's RTT
+ * and on its losses, O(1) per probe, so that a path which starts to
+ * slow down or drop probes is noticed after a few of them rather than
+ * after it has failed outright.
+ *
+ * The RTT baseline is a slow average (1/16) and its mean deviation; the
+ * CUSUM adds up how far each RTT is above the baseline by more than a
+ * slack of one deviation (at least PROBE_CP_SLACK, and an eighth of the
+ * baseline), and raises PROBE_EV_RTT_RISE once that passes PROBE_CP_H
+ * slacks.  The baseline then restarts from the new level, so a lasting
+ * shift is reported once.  The loss CUSUM goes up PROBE_CP_LOSS_UP for
+ * a loss and down PROBE_CP_LOSS_DOWN for a reply; it drifts upwards
+ * once the loss rate is above 20%, and raises PROBE_EV_LOSS_RISE at
+ * PROBE_CP_LOSS_H (two losses close together).  After firing, each
+ * sits out PROBE_CP_QUIET probes.
+ *
+ * @param pp		Path.
+ * @param lost		The probe was lost.
+ * @param rtt		Its RTT (usec), if not.
+ */
+static void
+probe_change(struct probe_path *pp, int lost, uint32_t rtt)
+{
+	uint64_t slack;
+	uint32_t delta;
+
+	if (pp->pp_cp_loss_quiet > 0)
+		--pp->pp_cp_loss_quiet;
+	if (pp->pp_cp_rtt_quiet > 0)
+		--pp->pp_cp_rtt_quiet;
+
+	if (lost) {
+		pp->pp_cp_loss += PROBE_CP_LOSS_UP;
+		if (pp->pp_cp_loss >= PROBE_CP_LOSS_H &&
+		    !pp->pp_cp_loss_quiet) {
+			pp->pp_events |= PROBE_EV_LOSS_RISE;
+			++pp->pp_stats.ps_loss_rises;
+			pp->pp_cp_loss = 0;
+			pp->pp_cp_loss_quiet = PROBE_CP_QUIET;
+		}
+		return;
+	}
+	pp->pp_cp_loss -= PROBE_CP_LOSS_DOWN;
+	if (pp->pp_cp_loss < 0)
+		pp->pp_cp_loss = 0;
+
+	if (pp->pp_cp_n < PROBE_CP_WARMUP) {
+		/* Plain average until there are enough to go on */
+		++pp->pp_cp_n;
+		pp->pp_cp_mean += (int32_t)(rtt - pp->pp_cp_mean) /
+				  pp->pp_cp_n;
+		delta = rtt > pp->pp_cp_mean ? rtt - pp->pp_cp_mean :
+					       pp->pp_cp_mean - rtt;
+		pp->pp_cp_dev += (int32_t)(delta - pp->pp_cp_dev) /
+				 pp->pp_cp_n;
+		return;
+	}
+
+	slack = pp->pp_cp_dev;
+	if (slack < pp->pp_cp_mean / 8)
+		slack = pp->pp_cp_mean / 8;
+	if (slack < PROBE_CP_SLACK)
+		slack = PROBE_CP_SLACK;
+
+	if (rtt > pp->pp_cp_mean + slack)
+		pp->pp_cp_rtt += rtt - pp->pp_cp_mean - slack;
+	else if (pp->pp_cp_rtt > pp->pp_cp_mean + slack - rtt)
+		pp->pp_cp_rtt -= pp->pp_cp_mean + slack - rtt;
+	else
+		pp->pp_cp_rtt = 0;
+
+	if (pp->pp_cp_rtt > slack * PROBE_CP_H && !pp->pp_cp_rtt_quiet) {
+		pp->pp_events |= PROBE_EV_RTT_RISE;
+		++pp->pp_stats.ps_rtt_rises;
+		pp->pp_cp_alarm = pp->pp_cp_mean;
+		pp->pp_cp_rtt = 0;
+		pp->pp_cp_rtt_quiet = PROBE_CP_QUIET;
+		/* Start again from here */
+		pp->pp_cp_mean = rtt;
+		return;
+	}
+
+	delta = rtt > pp->pp_cp_mean ? rtt - pp->pp_cp_mean :
+				       pp->pp_cp_mean - rtt;
+	pp->pp_cp_dev = (uint32_t)((15 * (uint64_t)pp->pp_cp_dev + delta) /
+				   16);
+	pp->pp_cp_mean = (uint32_t)((15 * (uint64_t)pp->pp_cp_mean + rtt) /
+				    16);
+}
+
+
+/**
+ * Sleep until wake (usec, monotonic), or until the wake descriptor is
+ * readable.
+ */
+static void
+probe_nap(struct probe_engine *pe, uint64_t now, uint64_t wake)
+{
+	struct pollfd pfd;
+	struct timespec ts;
+
+	if (pe->pe_wake_fd < 0) {
+		usleep(wake - now);
+		return;
+	}
+
+	ts.tv_sec = (wake - now) / 1000000;
+	ts.tv_nsec = (long)((wake - now) % 1000000) * 1000;
+	pfd.fd = pe->pe_wake_fd;
+	pfd.events = POLLIN;
+	if (ppoll(&pfd, 1, &ts, NULL) > 0 && (pfd.revents & POLLIN))
+		pe->pe_woken = 1;
+}
+
+
+/**
+ * Turn busy polling on or off.  When on, listening sockets get
+ * SO_BUSY_POLL/SO_PREFER_BUSY_POLL, and rather than blocking until a
+ * reply's interrupt is delivered, the engine spins for a window of usec
+ * centered on the reply's expected arrival (the path's mean RTT).  It
+ * still blocks outside those windows, and for paths with no RTT history.
+ * Spinning costs a CPU for the length of each window; probe_dump reports
+ * how much, and what it bought.
+ *
+ * @param pe		Engine.
+ * @param usec		Spin window; 0 turns busy polling off.
+ */
+void
+probe_set_busy_poll(struct probe_engine *pe, uint32_t usec)
+{
+	struct probe_path *pp;
+	int x;
+
+	pe->pe_busy_poll = usec;
+	for (x = 0; x < pe->pe_npaths; x++) {
+		pp = &pe->pe_paths[x];
+		if (pp->pp_sock >= 0 && pp->pp_listen)
+			icmp_socket_busy_poll(pp->pp_sock, usec);
+	}
+}
+
+
+/**
+ * Refill a path's token bucket and take a token if there is one.
+ *
+ * @return		1 if the path may send now, 2 if only on a grant
+ *			(see probe_grant), 0 if it is over budget.
+ */
+static int
+probe_budget_take(struct probe_budget *pb, uint64_t now)
+{
+	if (pb->pb_rate <= 0)
+		return 1;
+	if (pb->pb_grant > 0) {
+		--pb->pb_grant;
+		return 2;
+	}
+
+	pb->pb_tokens += (double)(now - pb->pb_last) * pb->pb_rate / 1000000;
+	pb->pb_last = now;
+	if (pb->pb_tokens > PROBE_BURST)
+		pb->pb_tokens = PROBE_BURST;
+
+	if (pb->pb_tokens < 1)
+		return 0;
+	pb->pb_tokens -= 1;
+	return 1;
+}
+
+
+/**
+ * Account for a finished probe and, once per window, adjust the path's
+ * rate (AIMD).  Partial loss halves the rate.  If the next window is
+ * clean, the loss followed the send rate: that is a rate limiter, and
+ * the ceiling is kept below the rate which set it off.  If slowing down
+ * did not help, the loss is real and the old rate is restored.  Total
+ * loss means the path is down, which is the detector's business, so the
+ * rate is left alone.  Granted probes are sent at the caller's pace,
+ * not ours, and do not count.  Not static, for testing.
+ */
+void
+probe_budget_update(struct probe_path *pp, int lost, uint64_t now)
+{
+	struct probe_budget *pb = &pp->pp_budget;
+	double rate, loss;
+
+	if (pb->pb_max <= 0 || pp->pp_granted)
+		return;
+
+	if (!pb->pb_wsent)
+		pb->pb_wstart = pp->pp_sent;
+	++pb->pb_wsent;
+	if (lost)
+		++pb->pb_wlost;
+	if (pb->pb_wsent < PROBE_WINDOW)
+		return;
+
+	rate = pb->pb_wsent * 1000000.0 / (double)(now - pb->pb_wstart + 1);
+	loss = (double)pb->pb_wlost / pb->pb_wsent;
+
+	if (pb->pb_wlost == pb->pb_wsent) {
+		pb->pb_suspect = 0;
+	} else if (pb->pb_wlost) {
+		if (pb->pb_suspect && loss >= pb->pb_suspect_loss / 2) {
+			pb->pb_rate = pb->pb_suspect < pb->pb_ceiling ?
+				      pb->pb_suspect : pb->pb_ceiling;
+			pb->pb_suspect = 0;
+		} else if (rate > pb->pb_min) {
+			pb->pb_suspect = rate;
+			pb->pb_suspect_loss = loss;
+			pb->pb_rate = rate / 2 > pb->pb_min ?
+				      rate / 2 : pb->pb_min;
+			++pp->pp_stats.ps_backoffs;
+			pp->pp_events |= PROBE_EV_BACKOFF;
+		}
+	} else if (pb->pb_suspect) {
+		pb->pb_ceiling = pb->pb_suspect * 3 / 4;
+		if (pb->pb_ceiling < pb->pb_min)
+			pb->pb_ceiling = pb->pb_min;
+		pb->pb_suspect = 0;
+		pb->pb_limited = 1;
+		++pp->pp_stats.ps_ratelimited;
+		pp->pp_events |= PROBE_EV_RATELIMIT;
+	} else if (pb->pb_rate < pb->pb_ceiling) {
+		pb->pb_rate += pb->pb_min ? pb->pb_min : 1;
+		if (pb->pb_rate > pb->pb_ceiling)
+			pb->pb_rate = pb->pb_ceiling;
+	}
+
+	pb->pb_wsent = 0;
+	pb->pb_wlost = 0;
+}
+
+
+/**
+ * Add a path to a target.  The socket is opened (and bound) right away
+ * so that permission problems show up at startup; a path whose socket
+ * cannot be opened (e.g. its interface does not exist yet) is kept and
+ * retried on every round, and so is name resolution.
+ *
+ * @param pe		Engine.
+ * @param host		Target host name or address.
+ * @param opts		Path options, or NULL for the default route.
+ * @param name		Label for log messages; NULL to use the host.
+ * @return		Index of the new path, or -1 on error.  Check
+ *			pp_sock to see whether the socket was opened.
+ */
+int
+probe_add_path(struct probe_engine *pe, char *host,
+	       const struct icmp_opts *opts, const char *name)
+{
+	struct probe_path *pp, *paths;
+	int x, idx;
+
+	paths = realloc(pe->pe_paths, sizeof(*paths) * (pe->pe_npaths + 1));
+	if (!paths)
+		return -1;
+	pe->pe_paths = paths;
+
+	pp = &paths[pe->pe_npaths];
+	memset(pp, 0, sizeof(*pp));
+	if (opts)
+		pp->pp_opts = *opts;
+	strncpy(pp->pp_host, host, sizeof(pp->pp_host) - 1);
+	strncpy(pp->pp_name, name ? name : host, sizeof(pp->pp_name) - 1);
+	pp->pp_result = PING_TIMEOUT;
+	pp->pp_stats.ps_rtt_min = (uint32_t)-1;
+	probe_budget_init(&pp->pp_budget, pe->pe_min_rate, pe->pe_max_rate);
+	tw_timer_init(&pp->pp_timer, probe_expire, pe);
+	tw_timer_init(&pp->pp_hedge_timer, probe_hedge, pe);
+	pp->pp_sock = -1;
+
+	/* A replayed path never touches the network */
+	if (!pe->pe_trace || !pe->pe_trace->tf_replay) {
+		probe_open(pe, pp);
+		if (icmp_ping_getaddr(pp->pp_host, &pp->pp_addr) != 0)
+			pp->pp_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	}
+
+	/* More paths, more replies to queue */
+	idx = pe->pe_npaths++;
+	if (pe->pe_npaths >= PROBE_SEQMAP_PATHS && !pe->pe_seqmap)
+		pe->pe_seqmap = calloc(65536, sizeof(*pe->pe_seqmap));
+	for (x = 0; x < pe->pe_npaths; x++) {
+		if (paths[x].pp_sock >= 0 && paths[x].pp_listen)
+			probe_rcvbuf(pe, &paths[x]);
+	}
+	return idx;
+}
+
+
+/**
+ * Match a reply to the outstanding probe it answers.  Echo replies are
+ * matched on id, sequence number and source; ICMP errors on the echo
+ * they quote, whoever sent them (usually a router along the way).
+ */
+static struct probe_path *
+probe_match(struct probe_engine *pe, struct icmp_reply *reply)
+{
+	struct probe_path *pp;
+	struct in_addr dst;
+	uint16_t id, seq;
+	int x;
+
+	if (reply->ir_type == ICMP_ECHOREPLY) {
+		dst = reply->ir_from;
+		id = reply->ir_id;
+		seq = reply->ir_seq;
+	} else if (reply->ir_quoted) {
+		dst = reply->ir_orig_dst;
+		id = reply->ir_orig_id;
+		seq = reply->ir_orig_seq;
+	} else {
+		return NULL;
+	}
+
+	if (id != pe->pe_id)
+		return NULL;
+
+	if (pe->pe_seqmap) {
+		/* Stale entries are caught by the checks below */
+		x = pe->pe_seqmap[seq];
+		if (x >= pe->pe_npaths)
+			return NULL;
+		pp = &pe->pe_paths[x];
+		if (pp->pp_pending && probe_copy(pp, seq) >= 0 &&
+		    pp->pp_addr.sin_addr.s_addr == dst.s_addr)
+			return pp;
+		return NULL;
+	}
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		pp = &pe->pe_paths[x];
+		if (pp->pp_pending && probe_copy(pp, seq) >= 0 &&
+		    pp->pp_addr.sin_addr.s_addr == dst.s_addr)
+			return pp;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Record the end of a probe on a path.
+ */
+static void
+probe_complete(struct probe_engine *pe, struct probe_path *pp,
+	       int32_t result, uint64_t now)
+{
+	struct probe_stats *ps = &pp->pp_stats;
+	uint32_t rtt;
+
+	if (pp->pp_pending) {
+		tw_del(&pe->pe_wheel, &pp->pp_timer);
+		tw_del(&pe->pe_wheel, &pp->pp_hedge_timer);
+		--pe->pe_pending;
+	}
+	pp->pp_pending = 0;
+
+	if (pp->pp_big) {
+		pp->pp_big = 0;
+		if (result == PING_TIMEOUT || result == PING_FRAG_NEEDED) {
+			/*
+			 * Says nothing about whether ordinary probes get
+			 * through, so the path keeps its last result and
+			 * this round does not count for it.
+			 */
+			++ps->ps_mtu_lost;
+			pp->pp_mtu_result = result;
+			pp->pp_fresh = 0;
+			if (!pp->pp_degraded)
+				pp->pp_events |= PROBE_EV_MTU_LOST;
+			pp->pp_degraded = 1;
+			return;
+		}
+		if (result == PING_SUCCESS && pp->pp_degraded) {
+			pp->pp_events |= PROBE_EV_MTU_OK;
+			pp->pp_degraded = 0;
+		}
+	}
+
+	pp->pp_result = result;
+
+	switch(result) {
+	case PING_SUCCESS:
+		probe_budget_update(pp, 0, now);
+		/* From the copy which was answered */
+		rtt = (uint32_t)(now - pp->pp_sent -
+				 pp->pp_copy_at[pp->pp_copy]);
+		if (pp->pp_copy)
+			++ps->ps_hedge_saved;
+		probe_rto_sample(pp, rtt);
+		probe_change(pp, 0, rtt);
+		pp->pp_backoff = 0;
+		pp->pp_late_sent = 0;
+		++ps->ps_received;
+		ps->ps_rtt_last = rtt;
+		ps->ps_rtt_total += rtt;
+		if (rtt < ps->ps_rtt_min)
+			ps->ps_rtt_min = rtt;
+		if (rtt > ps->ps_rtt_max)
+			ps->ps_rtt_max = rtt;
+		break;
+	case PING_TIMEOUT:
+		probe_budget_update(pp, 1, now);
+		++ps->ps_lost;
+		if (pp->pp_backoff < PROBE_RTO_BACKOFF)
+			++pp->pp_backoff;
+		pp->pp_late_seq = pp->pp_seq0;
+		pp->pp_late_copies = pp->pp_copies;
+		pp->pp_late_sent = pp->pp_sent;
+		memcpy(pp->pp_late_at, pp->pp_copy_at,
+		       pp->pp_copies * sizeof(pp->pp_copy_at[0]));
+		probe_change(pp, 1, 0);
+		break;
+	case PING_RXQ_OVERFLOW:
+		/* Not the network's fault; leave the budget alone */
+		++ps->ps_rxq_overflow;
+		pp->pp_events |= PROBE_EV_RXQ_OVERFLOW;
+		break;
+	default:
+		++ps->ps_errors;
+		break;
+	}
+}
+
+
+/**
+ * An echo reply to a probe which has already timed out.  It is too late
+ * to count, but its RTT still tells us about the path: fed to the
+ * estimator, it stretches the timeout so the next probe is not cut short
+ * as well.  Any of the probe's hedged copies will do; the RTT is taken
+ * from the one answered.
+ *
+ * @return		1 if that is what it was, 0 if not.
+ */
+static int
+probe_late(struct probe_engine *pe, const struct icmp_reply *reply,
+	   uint64_t when)
+{
+	struct probe_path *pp;
+	uint16_t copy;
+	int x, n;
+
+	if (reply->ir_type != ICMP_ECHOREPLY || reply->ir_id != pe->pe_id)
+		return 0;
+
+	x = 0;
+	n = pe->pe_npaths;
+	if (pe->pe_seqmap) {
+		x = pe->pe_seqmap[reply->ir_seq];
+		n = x < pe->pe_npaths ? x + 1 : 0;
+	}
+	for (; x < n; x++) {
+		pp = &pe->pe_paths[x];
+		copy = (uint16_t)(reply->ir_seq - pp->pp_late_seq);
+		if (!pp->pp_late_sent || copy >= pp->pp_late_copies ||
+		    pp->pp_addr.sin_addr.s_addr != reply->ir_from.s_addr ||
+		    when < pp->pp_late_sent + pp->pp_late_at[copy])
+			continue;
+		++pp->pp_stats.ps_late;
+		probe_rto_sample(pp, (uint32_t)(when - pp->pp_late_sent -
+						 pp->pp_late_at[copy]));
+		pp->pp_late_sent = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Deal with one ICMP message, whichever way it was received.
+ *
+ * @param pe		Engine.
+ * @param pkt		IP datagram.
+ * @param len		Length of pkt.
+ * @param when		Receive time (usec, monotonic).
+ * @return		1 if it completed a probe, 0 if not.
+ */
+int
+probe_input(struct probe_engine *pe, const void *pkt, size_t len,
+	    uint64_t when)
+{
+	struct icmp_reply reply;
+	struct probe_path *pp;
+	int32_t rv;
+
+	if (icmp_parse(pkt, len, &reply) != PING_SUCCESS)
+		return 0;
+
+	pp = probe_match(pe, &reply);
+	if (!pp) {
+		if (probe_late(pe, &reply, when))
+			return 0;
+		/*
+		 * Errors caused by other traffic (or by probes
+		 * we have already given up on) are not ours to
+		 * act upon.
+		 */
+		if (icmp_is_error(reply.ir_type) &&
+		    !(pe->pe_skipping && reply.ir_quoted &&
+		      reply.ir_orig_id == pe->pe_skip_id))
+			++pe->pe_foreign;
+		return 0;
+	}
+
+	if (reply.ir_type == ICMP_ECHOREPLY) {
+		rv = PING_SUCCESS;
+	} else {
+		rv = icmp_classify(&reply);
+		if (rv == PING_REDIRECT || rv == PING_INVALID_RESPONSE) {
+			/* Not fatal; the echo went on its way */
+			if (rv == PING_REDIRECT)
+				++pp->pp_stats.ps_redirects;
+			return 0;
+		}
+	}
+
+	pp->pp_copy = probe_copy(pp, reply.ir_type == ICMP_ECHOREPLY ?
+				 reply.ir_seq : reply.ir_orig_seq);
+
+	/*
+	 * An error kills one copy, not the probe: another may yet be
+	 * answered.  It is the probe's result once every copy has been
+	 * sent and failed, or at the deadline (see probe_expire).
+	 */
+	if (rv != PING_SUCCESS) {
+		pp->pp_failed |= 1U << pp->pp_copy;
+		pp->pp_error = rv;
+		if (pp->pp_failed != (1U << (pe->pe_hedge > 1 ?
+					      pe->pe_hedge : 1)) - 1)
+			return 0;
+	}
+	/* A kernel stamp, microseconds rounded, may beat our send time */
+	if (when < pp->pp_sent + pp->pp_copy_at[pp->pp_copy])
+		when = pp->pp_sent + pp->pp_copy_at[pp->pp_copy];
+
+	if (rv == PING_SUCCESS && pe->pe_busy_poll) {
+		if (pe->pe_spinning) {
+			++pe->pe_spin_hits;
+			pe->pe_spin_rtt += when - pp->pp_sent -
+					   pp->pp_copy_at[pp->pp_copy];
+		} else {
+			++pe->pe_wait_hits;
+			pe->pe_wait_rtt += when - pp->pp_sent -
+					   pp->pp_copy_at[pp->pp_copy];
+		}
+	}
+
+	probe_complete(pe, pp, rv, when);
+	return 1;
+}
+
+
+/**
+ * Note a socket's cumulative drop counter.
+ */
+static void
+probe_note_drops(struct probe_engine *pe, struct probe_path *pp,
+		 uint32_t drops, uint64_t now)
+{
+	if (drops == pp->pp_drops)
+		return;
+	pe->pe_drops += (uint32_t)(drops - pp->pp_drops);
+	pe->pe_drop_when = now;
+	pp->pp_drops = drops;
+}
+
+
+/**
+ * Bring the drop counters up to date before deciding how to account a
+ * timeout.  SO_RXQ_OVFL only tells us about drops when the next packet
+ * is read, and backends which do not use recvmsg() never see it, so ask
+ * the sockets (and the backend) directly.
+ */
+static void
+probe_check_drops(struct probe_engine *pe, uint64_t now)
+{
+	struct probe_path *pp;
+	uint32_t mem[SK_MEMINFO_VARS];
+	socklen_t len;
+	uint64_t drops;
+	int x;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		pp = &pe->pe_paths[x];
+		if (pp->pp_sock < 0 || !pp->pp_listen)
+			continue;
+		len = sizeof(mem);
+		if (getsockopt(pp->pp_sock, SOL_SOCKET, SO_MEMINFO, mem,
+			       &len) == 0 && len > SK_MEMINFO_DROPS * sizeof(uint32_t))
+			probe_note_drops(pe, pp, mem[SK_MEMINFO_DROPS], now);
+	}
+
+	if (pe->pe_ops->po_drops) {
+		drops = pe->pe_ops->po_drops(pe);
+		if (drops != pe->pe_drops_backend) {
+			pe->pe_drops += drops - pe->pe_drops_backend;
+			pe->pe_drops_backend = drops;
+			pe->pe_drop_when = now;
+		}
+	}
+}
+
+
+/**
+ * Read everything queued on one path socket.  Replies are matched
+ * against all paths, since an unbound raw socket sees every ICMP
+ * message the host receives.  The socket's drop counter comes along
+ * with each packet (SO_RXQ_OVFL) once it has dropped anything.  Each
+ * packet is timed by the kernel's receive stamp (SO_TIMESTAMPNS), not
+ * by when we got around to reading it: a late reply may sit here until
+ * the next round.
+ *
+ * @return		Number of probes completed, or -1 on error.
+ */
+int
+probe_drain(struct probe_engine *pe, int32_t sock)
+{
+	struct probe_path *pp = NULL;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		char		buf[CMSG_SPACE(sizeof(uint32_t)) +
+				    CMSG_SPACE(sizeof(struct timespec))];
+		struct cmsghdr	align;
+	} ctl;
+	struct timespec real, *ts;
+	uint8_t buf[ICMP_RECV_LEN];
+	uint64_t now, when, realnow, stamp;
+	ssize_t len;
+	int x, done = 0;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		if (pe->pe_paths[x].pp_sock == sock) {
+			pp = &pe->pe_paths[x];
+			break;
+		}
+	}
+
+	while (1) {
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctl.buf;
+		msg.msg_controllen = sizeof(ctl.buf);
+
+		len = recvmsg(sock, &msg, 0);
+		if (len < 0)
+			break;
+		now = probe_now();
+		when = now;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET)
+				continue;
+			if (cmsg->cmsg_type == SO_RXQ_OVFL && pp)
+				probe_note_drops(pe, pp,
+					*(uint32_t *)CMSG_DATA(cmsg), now);
+			if (cmsg->cmsg_type != SO_TIMESTAMPNS)
+				continue;
+			/* Both clocks read back to back, realtime first */
+			ts = (struct timespec *)CMSG_DATA(cmsg);
+			clock_gettime(CLOCK_REALTIME, &real);
+			when = probe_now();
+			realnow = (uint64_t)real.tv_sec * 1000000 +
+				  real.tv_nsec / 1000;
+			stamp = (uint64_t)ts->tv_sec * 1000000 +
+				ts->tv_nsec / 1000;
+			if (stamp < realnow && realnow - stamp < when)
+				when -= realnow - stamp;
+		}
+
+		done += probe_input(pe, buf, (size_t)len, when);
+	}
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		return done;
+	return -1;
+}
+
+
+/**
+ * Finish an outstanding probe without a reply, for backends which learn
+ * about send errors or timeouts themselves.  Stale reports (the probe
+ * was already answered, or the path has moved on) are ignored.
+ *
+ * @param pe		Engine.
+ * @param idx		Path index.
+ * @param seq		Sequence number of the probe.
+ * @param result	PING_* result to record.
+ * @param when		Time (usec, monotonic).
+ * @return		1 if it completed a probe, 0 if not.
+ */
+int
+probe_fail(struct probe_engine *pe, int idx, uint16_t seq, int32_t result,
+	   uint64_t when)
+{
+	struct probe_path *pp;
+
+	if (idx < 0 || idx >= pe->pe_npaths)
+		return 0;
+	pp = &pe->pe_paths[idx];
+	/* A hedge copy which did not make it leaves the others to try */
+	if (!pp->pp_pending || pp->pp_seq0 != seq)
+		return 0;
+
+	probe_complete(pe, pp, result, when);
+	return 1;
+}
+
+
+/**
+ * Start a probe on one path, budget permitting.  A path whose caller
+ * has set pp_link_down fails at once with PING_LINK_DOWN, unsent.
+ *
+ * @return		1 if an echo went out and is awaiting a reply,
+ *			0 if the path was skipped or failed outright.
+ */
+static int
+probe_send(struct probe_engine *pe, struct probe_path *pp, uint64_t now)
+{
+	int ret, copies;
+
+	/* The caller knows better than to wait for this one */
+	if (pp->pp_link_down) {
+		pp->pp_fresh = 1;
+		probe_complete(pe, pp, PING_LINK_DOWN, now);
+		return 0;
+	}
+
+	ret = probe_budget_take(&pp->pp_budget, now);
+	if (!ret) {
+		++pp->pp_stats.ps_deferred;
+		return 0;
+	}
+	pp->pp_granted = ret == 2;
+	pp->pp_fresh = 1;
+
+	if (pp->pp_sock < 0 && probe_open(pe, pp) < 0) {
+		probe_complete(pe, pp, PING_ERRNO, now);
+		return 0;
+	}
+
+	if (pp->pp_addr.sin_addr.s_addr == htonl(INADDR_ANY) &&
+	    icmp_ping_getaddr(pp->pp_host, &pp->pp_addr) != 0) {
+		pp->pp_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		probe_complete(pe, pp, PING_HOST_NOT_FOUND, now);
+		return 0;
+	}
+
+	/* Every so often, a full-size probe in place of the usual one */
+	pp->pp_size = pp->pp_opts.io_size;
+	if (pp->pp_opts.io_mtu && ++pp->pp_nth >= (pp->pp_opts.io_every ?
+			pp->pp_opts.io_every : PROBE_MTU_EVERY)) {
+		pp->pp_nth = 0;
+		pp->pp_big = 1;
+		pp->pp_size = pp->pp_opts.io_mtu - sizeof(struct ip) -
+			      ICMP_MINLEN;
+		++pp->pp_stats.ps_mtu_sent;
+	}
+
+	/* Sequence numbers for all of its copies, in a row */
+	copies = pe->pe_hedge > 1 ? pe->pe_hedge : 1;
+	pp->pp_seq0 = pp->pp_seq = ++pe->pe_seq;
+	pe->pe_seq += copies - 1;
+	pp->pp_copies = 1;
+	pp->pp_copy = 0;
+	pp->pp_failed = 0;
+	pp->pp_copy_at[0] = 0;
+	if (pe->pe_seqmap)
+		pe->pe_seqmap[pp->pp_seq] = pp - pe->pe_paths;
+	pp->pp_sent = now;
+	++pp->pp_stats.ps_sent;
+	pp->pp_pending = 1;
+	++pe->pe_pending;
+	pp->pp_timeout = probe_rto(pe, pp);
+	tw_add(&pe->pe_wheel, &pp->pp_timer, now + pp->pp_timeout +
+	       (uint64_t)(copies - 1) * pe->pe_hedge_spacing);
+	if (pe->pe_ops->po_send)
+		ret = pe->pe_ops->po_send(pe, pp);
+	else
+		ret = icmp_send_echo_size(pp->pp_sock, &pp->pp_addr,
+					  pe->pe_id, pp->pp_seq, pp->pp_size);
+	if (ret < 0) {
+		/* DF, and bigger than the interface MTU */
+		probe_complete(pe, pp, errno == EMSGSIZE ?
+			       PING_FRAG_NEEDED : PING_ERRNO, now);
+		return 0;
+	}
+	if (copies > 1)
+		tw_add(&pe->pe_wheel, &pp->pp_hedge_timer,
+		       now + pe->pe_hedge_spacing);
+
+	return 1;
+}
+
+
+/**
+ * Hedge timer: send the next copy of a path's probe, unless a reply has
+ * beaten it to it.  A copy which cannot be sent is not the probe's
+ * failure; the first copy already went out.
+ */
+static void
+probe_hedge(struct tw_timer *t, uint64_t now)
+{
+	struct probe_engine *pe = t->tt_arg;
+	struct probe_path *pp = (struct probe_path *)
+		((char *)t - offsetof(struct probe_path, pp_hedge_timer));
+
+	if (!pp->pp_pending)
+		return;
+
+	pp->pp_seq = (uint16_t)(pp->pp_seq0 + pp->pp_copies);
+	if (pe->pe_seqmap)
+		pe->pe_seqmap[pp->pp_seq] = pp - pe->pe_paths;
+	pp->pp_copy_at[pp->pp_copies++] = (uint32_t)(now - pp->pp_sent);
+	++pp->pp_stats.ps_hedge_sent;
+
+	if (pe->pe_ops->po_send)
+		pe->pe_ops->po_send(pe, pp);
+	else
+		icmp_send_echo_size(pp->pp_sock, &pp->pp_addr, pe->pe_id,
+				    pp->pp_seq, pp->pp_size);
+
+	if (pp->pp_copies < pe->pe_hedge)
+		tw_add(&pe->pe_wheel, t, now + pe->pe_hedge_spacing);
+}
+
+
+/**
+ * Work out whether we are inside some pending reply's spin window.
+ *
+ * @param pe		Engine.
+ * @param now		Current time.
+ * @param wake		In: when we would otherwise wake up.  Out: pulled
+ *			in to the start of the next spin window, if that
+ *			comes first.
+ * @return		End of the current spin window, or 0 if we should
+ *			block.
+ */
+static uint64_t
+probe_spin_window(struct probe_engine *pe, uint64_t now, uint64_t *wake)
+{
+	struct probe_path *pp;
+	uint64_t expect, start, end, until = 0;
+	uint32_t half = pe->pe_busy_poll / 2;
+	int x;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		pp = &pe->pe_paths[x];
+		if (!pp->pp_pending || !pp->pp_stats.ps_received)
+			continue;
+
+		expect = pp->pp_sent + pp->pp_stats.ps_rtt_total /
+					pp->pp_stats.ps_received;
+		start = expect > pp->pp_sent + half ? expect - half :
+						      pp->pp_sent;
+		end = expect + half;
+
+		if (now >= start && now < end) {
+			if (end > until)
+				until = end;
+		} else if (now < start && start < *wake) {
+			*wake = start;
+		}
+	}
+
+	return until;
+}
+
+
+/**
+ * Spin on the backend without blocking until a probe completes or the
+ * deadline passes.
+ *
+ * @return		Number of probes completed, or -1 on error.
+ */
+static int
+probe_spin(struct probe_engine *pe, uint64_t now, uint64_t until)
+{
+	uint64_t start = now;
+	int done;
+
+	pe->pe_spinning = 1;
+	++pe->pe_spin_windows;
+	do {
+		if (pe->pe_ops->po_spin)
+			done = pe->pe_ops->po_spin(pe);
+		else
+			done = pe->pe_ops->po_wait(pe, now, now);
+		now = probe_now();
+	} while (!done && now < until);
+	pe->pe_spinning = 0;
+	pe->pe_spin_time += now - start;
+
+	return done;
+}
+
+
+/**
+ * Send timer: start the next probe of the round, then come back
+ * pe_spread later for the one after.  Paths which are over budget are
+ * skipped without using up a slot.
+ */
+static void
+probe_send_next(struct tw_timer *t, uint64_t now)
+{
+	struct probe_engine *pe = t->tt_arg;
+
+	while (pe->pe_next < pe->pe_npaths) {
+		if (probe_send(pe, &pe->pe_paths[pe->pe_next++], now)) {
+			tw_add(&pe->pe_wheel, t, now + pe->pe_spread);
+			return;
+		}
+	}
+}
+
+
+/**
+ * Reply deadline of a path's probe.
+ */
+static void
+probe_expire(struct tw_timer *t, uint64_t now)
+{
+	struct probe_engine *pe = t->tt_arg;
+	struct probe_path *pp = (struct probe_path *)
+		((char *)t - offsetof(struct probe_path, pp_timer));
+
+	/* Once per batch of timeouts, not once per path */
+	if (pe->pe_drops_checked != now) {
+		probe_check_drops(pe, now);
+		pe->pe_drops_checked = now;
+	}
+
+	/*
+	 * If we were dropping packets ourselves while this probe was
+	 * out, the reply may well have been one of them.  Otherwise, an
+	 * error on one of its copies says more than a timeout.
+	 */
+	probe_complete(pe, pp, pe->pe_drop_when >= pp->pp_sent ?
+		       PING_RXQ_OVERFLOW : pp->pp_failed ? pp->pp_error :
+		       PING_TIMEOUT, now);
+}
+
+
+/**
+ * Play the next round of the attached trace: every path gets the
+ * outcome it had in that round, as if it had just happened, at the
+ * trace's own times, and the full-size probe state it was left in.
+ *
+ * @return		As probe_round; -1 with errno ENODATA at the end
+ *			of the trace.
+ */
+static int
+probe_replay(struct probe_engine *pe)
+{
+	struct probe_trace_rec rec;
+	struct probe_path *pp;
+	int x, ret, alive = 0;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		ret = probe_trace_read(pe->pe_trace, &rec);
+		if (ret <= 0) {
+			if (!ret)
+				errno = ENODATA;
+			return -1;
+		}
+		if (rec.tr_path != x) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		pp = &pe->pe_paths[x];
+		if (rec.tr_flags & PROBE_TRACE_FRESH) {
+			pp->pp_fresh = 1;
+			pp->pp_sent = rec.tr_sent;
+			++pp->pp_stats.ps_sent;
+			probe_complete(pe, pp, rec.tr_result,
+				       rec.tr_sent + rec.tr_rtt);
+		}
+		pp->pp_events = rec.tr_flags & PROBE_TRACE_EVENTS;
+		/* A failed full-size probe was not fresh; see probe_complete */
+		pp->pp_degraded = !!(rec.tr_mtu & PROBE_TRACE_DEGRADED);
+		pp->pp_mtu_result = rec.tr_mtu_result;
+		if (pp->pp_result == PING_SUCCESS)
+			++alive;
+	}
+
+	return alive;
+}
+
+
+/**
+ * Send one echo down every path and wait for the answers.  Sends are
+ * spaced pe_spread apart rather than fired in one burst, since the
+ * paths usually converge on the same router.  Returns when every path
+ * has answered, failed or timed out (each probe gets timeout_us from its
+ * own send time, or its own timeout; see probe_set_rto).  Paths which
+ * were over budget are not probed, keep their previous pp_result, and
+ * have pp_fresh cleared.
+ *
+ * The send schedule and the reply deadlines are timers on pe_wheel, so
+ * the cost of a wakeup does not grow with the number of paths, and we
+ * sleep until the nearest of them.
+ *
+ * With a trace attached, the round is recorded, or (when replaying)
+ * taken from the trace instead; see probe_trace_attach.  A trace which
+ * cannot be written is detached, with the error in its tf_error.
+ *
+ * @param pe		Engine.
+ * @param timeout_us	How long to wait for replies (microseconds).
+ * @return		Number of paths whose latest result is a reply,
+ *			or -1 on error (EINTR if the wake descriptor
+ *			went off; see probe_set_wake).
+ */
+int
+probe_round(struct probe_engine *pe, uint32_t timeout_us)
+{
+	struct probe_path *pp;
+	uint64_t now, wake, spin;
+	int x, alive = 0, done;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		pp = &pe->pe_paths[x];
+		/* Left over if the last round failed */
+		tw_del(&pe->pe_wheel, &pp->pp_timer);
+		tw_del(&pe->pe_wheel, &pp->pp_hedge_timer);
+		pp->pp_pending = 0;
+		pp->pp_copy = 0;
+		pp->pp_big = 0;
+		pp->pp_fresh = 0;
+		pp->pp_events = 0;
+	}
+
+	if (pe->pe_trace && pe->pe_trace->tf_replay)
+		return probe_replay(pe);
+
+	pe->pe_timeout = timeout_us;
+	pe->pe_next = 0;
+	pe->pe_pending = 0;
+	pe->pe_woken = 0;
+	tw_add(&pe->pe_wheel, &pe->pe_send_timer, probe_now());
+
+	while (1) {
+		now = probe_now();
+		tw_advance(&pe->pe_wheel, now);
+		if (!pe->pe_pending && !tw_armed(&pe->pe_send_timer))
+			break;
+
+		wake = tw_next(&pe->pe_wheel);
+		spin = 0;
+		if (!pe->pe_pending) {
+			/* Nothing to listen for until the next send */
+			if (wake > now)
+				probe_nap(pe, now, wake);
+			done = 0;
+		} else {
+			if (pe->pe_busy_poll)
+				spin = probe_spin_window(pe, now, &wake);
+
+			if (spin)
+				done = probe_spin(pe, now,
+						  spin < wake ? spin : wake);
+			else
+				done = pe->pe_ops->po_wait(pe, now, wake);
+		}
+
+		if (done >= 0 && pe->pe_woken) {
+			errno = EINTR;
+			done = -1;
+		}
+		if (done < 0) {
+			tw_del(&pe->pe_wheel, &pe->pe_send_timer);
+			return -1;
+		}
+	}
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		if (pe->pe_paths[x].pp_result == PING_SUCCESS)
+			++alive;
+	}
+
+	if (pe->pe_trace && probe_trace_write(pe->pe_trace, pe) < 0)
+		pe->pe_trace = NULL;
+
+	return alive;
+}
+
+
+/**
+ * Apply a path policy to the results of the last round.
+ *
+ * @param pe		Engine.
+ * @param policy	PROBE_POLICY_ANY or PROBE_POLICY_ALL.
+ * @return		1 if the target counts as alive, 0 if not.
+ */
+int
+probe_alive(struct probe_engine *pe, int policy)
+{
+	return probe_alive_group(pe, -1, policy);
+}
+
+
+/**
+ * Apply a path policy to one group of paths, for engines which probe
+ * more than one thing (a tiebreaker and a peer, say).  Groups are
+ * whatever the caller puts in pp_group; they start out as 0.
+ *
+ * @param pe		Engine.
+ * @param group		Paths with this pp_group count; -1 for all.
+ * @param policy	PROBE_POLICY_ANY or PROBE_POLICY_ALL.
+ * @return		1 if the group counts as alive, 0 if not (or if
+ *			it has no paths).
+ */
+int
+probe_alive_group(struct probe_engine *pe, int group, int policy)
+{
+	int x, alive = 0, n = 0;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		if (group >= 0 && pe->pe_paths[x].pp_group != group)
+			continue;
+		++n;
+		if (pe->pe_paths[x].pp_result == PING_SUCCESS)
+			++alive;
+	}
+
+	if (policy == PROBE_POLICY_ALL)
+		return n && alive == n;
+	return alive > 0;
+}
+
+
+/**
+ * Report per-path statistics, one line per path.
+ *
+ * @param pe		Engine.
+ * @param out		Called once per line.
+ * @param arg		Passed to out.
+ */
+void
+probe_dump(struct probe_engine *pe,
+	   void (*out)(void *arg, const char *line), void *arg)
+{
+	struct probe_path *pp;
+	struct probe_stats *ps;
+	char line[512];
+	int x;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		pp = &pe->pe_paths[x];
+		ps = &pp->pp_stats;
+
+		snprintf(line, sizeof(line),
+			 "path %s: sent %llu recv %llu lost %llu err %llu "
+			 "rtt min/avg/max/last %u/%llu/%u/%u us "
+			 "rate %.2f/s%s deferred %llu backoffs %llu "
+			 "ratelimited %llu redirects %llu "
+			 "rxq-overflow misses %llu",
+			 pp->pp_name,
+			 (unsigned long long)ps->ps_sent,
+			 (unsigned long long)ps->ps_received,
+			 (unsigned long long)ps->ps_lost,
+			 (unsigned long long)ps->ps_errors,
+			 ps->ps_received ? ps->ps_rtt_min : 0,
+			 (unsigned long long)(ps->ps_received ?
+				ps->ps_rtt_total / ps->ps_received : 0),
+			 ps->ps_rtt_max, ps->ps_rtt_last,
+			 pp->pp_budget.pb_rate,
+			 pp->pp_budget.pb_limited ? " (limited)" : "",
+			 (unsigned long long)ps->ps_deferred,
+			 (unsigned long long)ps->ps_backoffs,
+			 (unsigned long long)ps->ps_ratelimited,
+			 (unsigned long long)ps->ps_redirects,
+			 (unsigned long long)ps->ps_rxq_overflow);
+		out(arg, line);
+
+		if (pe->pe_rto_min) {
+			snprintf(line, sizeof(line),
+				 "path %s: timeout %u us (srtt %u rttvar %u "
+				 "us, backoff %d) late replies %llu",
+				 pp->pp_name, probe_rto(pe, pp), pp->pp_srtt,
+				 pp->pp_rttvar, pp->pp_backoff,
+				 (unsigned long long)ps->ps_late);
+			out(arg, line);
+		}
+
+		snprintf(line, sizeof(line),
+			 "path %s: rtt baseline %u us (dev %u us); early "
+			 "warnings: rtt rise %llu, loss rise %llu",
+			 pp->pp_name, pp->pp_cp_mean, pp->pp_cp_dev,
+			 (unsigned long long)ps->ps_rtt_rises,
+			 (unsigned long long)ps->ps_loss_rises);
+		out(arg, line);
+
+		if (pe->pe_hedge > 1) {
+			snprintf(line, sizeof(line),
+				 "path %s: %d copies %u us apart: extra sent "
+				 "%llu, saved %llu probes",
+				 pp->pp_name, pe->pe_hedge,
+				 pe->pe_hedge_spacing,
+				 (unsigned long long)ps->ps_hedge_sent,
+				 (unsigned long long)ps->ps_hedge_saved);
+			out(arg, line);
+		}
+
+		if (!pp->pp_opts.io_mtu)
+			continue;
+		snprintf(line, sizeof(line),
+			 "path %s: %u byte probes: sent %llu lost %llu%s",
+			 pp->pp_name, pp->pp_opts.io_mtu,
+			 (unsigned long long)ps->ps_mtu_sent,
+			 (unsigned long long)ps->ps_mtu_lost,
+			 pp->pp_degraded ? " (degraded)" : "");
+		out(arg, line);
+	}
+
+	snprintf(line, sizeof(line), "foreign ICMP errors ignored: %llu",
+		 (unsigned long long)pe->pe_foreign);
+	out(arg, line);
+
+	probe_check_drops(pe, probe_now());
+	snprintf(line, sizeof(line), "kernel receive drops: %llu",
+		 (unsigned long long)pe->pe_drops);
+	out(arg, line);
+
+	if (pe->pe_ops->po_stats) {
+		pe->pe_ops->po_stats(pe, line, sizeof(line));
+		out(arg, line);
+	}
+
+	if (pe->pe_busy_poll) {
+		snprintf(line, sizeof(line),
+			 "busy-poll %u us: spun %llu us in %llu windows; "
+			 "%llu replies while spinning (avg rtt %llu us), "
+			 "%llu while blocked (avg rtt %llu us)",
+			 pe->pe_busy_poll,
+			 (unsigned long long)pe->pe_spin_time,
+			 (unsigned long long)pe->pe_spin_windows,
+			 (unsigned long long)pe->pe_spin_hits,
+			 (unsigned long long)(pe->pe_spin_hits ?
+				pe->pe_spin_rtt / pe->pe_spin_hits : 0),
+			 (unsigned long long)pe->pe_wait_hits,
+			 (unsigned long long)(pe->pe_wait_hits ?
+				pe->pe_wait_rtt / pe->pe_wait_hits : 0));
+		out(arg, line);
+	}
+}
@@ -0,0 +1,312 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Header for probe.c.
+ */
+#ifndef __PROBE_H
+#define __PROBE_H
+
+#include <ping.h>
+#include <timer_wheel.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROBE_NAMELEN		64
+
+#define PROBE_WINDOW		8	/* probes per rate-limit check */
+#define PROBE_BURST		2	/* token bucket depth */
+#define PROBE_SPREAD		2000	/* usec between sends in a round */
+#define PROBE_TICK		100	/* timer wheel resolution, usec */
+#define PROBE_SEQMAP_PATHS	32	/* index replies by seq from here */
+#define PROBE_MTU_EVERY		10	/* default for icmp_opts io_every */
+#define PROBE_RTO_K		4	/* RTTVARs of headroom, as TCP */
+#define PROBE_RTO_BACKOFF	6	/* at most 64x after timeouts */
+#define PROBE_HEDGE_MAX		4	/* copies of a probe; see probe_set_hedge */
+#define PROBE_HEDGE_SPACING	5000	/* usec between copies, by default */
+
+/* Change detection on RTT and loss; see probe_change */
+#define PROBE_CP_WARMUP		8	/* RTTs before the baseline counts */
+#define PROBE_CP_SLACK		500	/* usec; least RTT rise that counts */
+#define PROBE_CP_H		5	/* alarm at this many slacks */
+#define PROBE_CP_LOSS_UP	4	/* loss CUSUM: + per loss, */
+#define PROBE_CP_LOSS_DOWN	1	/* - per reply (p1 = 20%), */
+#define PROBE_CP_LOSS_H		8	/* alarm at this */
+#define PROBE_CP_QUIET		8	/* probes an alarm sits out after */
+
+/* pp_events: things which happened to a path during the last round */
+#define PROBE_EV_BACKOFF	0x1	/* rate cut on partial loss */
+#define PROBE_EV_RATELIMIT	0x2	/* rate limiter detected */
+#define PROBE_EV_RXQ_OVERFLOW	0x4	/* a miss may be our own drop */
+#define PROBE_EV_MTU_LOST	0x8	/* full-size probes started failing */
+#define PROBE_EV_MTU_OK		0x10	/* ... and got through again */
+#define PROBE_EV_RTT_RISE	0x20	/* RTT moved up; early warning */
+#define PROBE_EV_LOSS_RISE	0x40	/* loss picked up; early warning */
+
+#define PROBE_RCVBUF_SECS	2	/* replies to absorb if we stall */
+#define PROBE_TRUESIZE		1024	/* kernel cost of one queued reply */
+
+/* I/O backends; see struct probe_ops */
+#define PROBE_BACKEND_POLL	0	/* poll() + recv() */
+#define PROBE_BACKEND_RING	1	/* AF_PACKET TPACKET_V3 ring */
+#define PROBE_BACKEND_SELECT	2	/* select() + recv() */
+#define PROBE_BACKEND_EPOLL	3	/* epoll + recv() */
+#define PROBE_BACKEND_URING	4	/* io_uring; falls back to epoll */
+#define PROBE_BACKEND_MAX	5
+
+/* How path results combine into a single alive/dead answer */
+#define PROBE_POLICY_ANY	0	/* alive if any path answered */
+#define PROBE_POLICY_ALL	1	/* alive only if every path answered */
+
+struct probe_stats {
+	uint64_t	ps_sent;
+	uint64_t	ps_received;
+	uint64_t	ps_lost;	/* timeouts */
+	uint64_t	ps_errors;	/* everything else */
+	uint64_t	ps_redirects;
+	uint32_t	ps_rtt_last;	/* microseconds */
+	uint32_t	ps_rtt_min;
+	uint32_t	ps_rtt_max;
+	uint64_t	ps_rtt_total;
+	uint64_t	ps_deferred;	/* skipped; over budget */
+	uint64_t	ps_backoffs;	/* rate cut on partial loss */
+	uint64_t	ps_ratelimited;	/* back-offs which cured the loss */
+	uint64_t	ps_rxq_overflow; /* misses while we were dropping */
+	uint64_t	ps_mtu_sent;	/* full-size probes */
+	uint64_t	ps_mtu_lost;	/* ... lost or too big */
+	uint64_t	ps_late;	/* replies after their timeout */
+	uint64_t	ps_hedge_sent;	/* extra copies */
+	uint64_t	ps_hedge_saved;	/* answered by an extra copy only */
+	uint64_t	ps_rtt_rises;	/* PROBE_EV_RTT_RISE */
+	uint64_t	ps_loss_rises;	/* PROBE_EV_LOSS_RISE */
+};
+
+/**
+ * Probe budget for one path.  A token bucket caps the send rate; the
+ * rate is cut when a window shows partial loss, and if the loss goes
+ * away at the lower rate we have the signature of an ICMP rate limiter
+ * (as opposed to a failing path) and keep the ceiling below the rate
+ * which triggered it.  The rate never drops below pb_min, which the
+ * caller derives from its detection budget.
+ */
+struct probe_budget {
+	double		pb_rate;	/* probes/second; 0 = unlimited */
+	double		pb_min;
+	double		pb_max;
+	double		pb_ceiling;	/* pb_max, or below a limiter */
+	double		pb_tokens;
+	uint64_t	pb_last;	/* last refill, usec */
+	uint64_t	pb_wstart;	/* window start, usec */
+	uint32_t	pb_wsent;
+	uint32_t	pb_wlost;
+	double		pb_suspect;	/* rate which saw partial loss */
+	double		pb_suspect_loss;
+	int		pb_limited;	/* rate limiter detected */
+	int		pb_grant;	/* probes allowed regardless */
+};
+
+/**
+ * One way of reaching a target: the target address plus the socket
+ * options which pin the probe to an interface, source or routing mark.
+ */
+struct probe_path {
+	char			pp_name[PROBE_NAMELEN];
+	char			pp_host[PROBE_NAMELEN];
+	struct icmp_opts	pp_opts;
+	struct sockaddr_in	pp_addr;
+	int32_t			pp_sock;
+	int			pp_listen;	/* receives for its binding */
+	int			pp_shared;	/* dup of another path's socket */
+	uint32_t		pp_drops;	/* socket's drop counter */
+	uint16_t		pp_seq;		/* last sequence # sent */
+	uint16_t		pp_seq0;	/* ... of this probe's first copy */
+	int			pp_copies;	/* copies sent so far */
+	int			pp_copy;	/* which one answered */
+	uint32_t		pp_failed;	/* copies an ICMP error hit */
+	int32_t			pp_error;	/* ... the latest one */
+	uint32_t		pp_copy_at[PROBE_HEDGE_MAX]; /* usec after
+							pp_sent */
+	int			pp_pending;
+	uint64_t		pp_sent;	/* usec, monotonic */
+	int32_t			pp_result;	/* latest outcome */
+	int			pp_fresh;	/* probed in the last round */
+	int			pp_events;	/* PROBE_EV_* */
+	uint16_t		pp_size;	/* echo data, this probe */
+	int			pp_big;		/* this probe is full-size */
+	uint16_t		pp_nth;		/* probes since a full-size one */
+	int			pp_degraded;	/* last full-size one failed */
+	int32_t			pp_mtu_result;	/* ... and how */
+	int			pp_group;	/* caller's; see probe_alive */
+	int			pp_link_down;	/* caller's; see probe_send */
+	int			pp_granted;	/* this probe is over budget */
+	uint32_t		pp_srtt;	/* usec; see probe_set_rto */
+	uint32_t		pp_rttvar;
+	int			pp_backoff;	/* timeouts in a row */
+	uint32_t		pp_timeout;	/* this probe's, usec */
+	uint16_t		pp_late_seq;	/* last probe which timed out */
+	int			pp_late_copies;	/* ... its copies, from there on */
+	uint64_t		pp_late_sent;	/* ... and when it went; 0 = none */
+	uint32_t		pp_late_at[PROBE_HEDGE_MAX]; /* ... pp_copy_at */
+	uint32_t		pp_cp_mean;	/* RTT baseline, usec */
+	uint32_t		pp_cp_dev;	/* ... its mean deviation */
+	uint32_t		pp_cp_alarm;	/* ... as of the last RTT rise */
+	int			pp_cp_n;	/* RTTs in the baseline */
+	uint64_t		pp_cp_rtt;	/* RTT CUSUM, usec */
+	int			pp_cp_loss;	/* loss CUSUM */
+	int			pp_cp_rtt_quiet; /* probes until it may fire */
+	int			pp_cp_loss_quiet;
+	struct tw_timer		pp_timer;	/* reply deadline */
+	struct tw_timer		pp_hedge_timer;	/* next copy */
+	struct probe_budget	pp_budget;
+	struct probe_stats	pp_stats;
+};
+
+struct probe_engine;
+struct probe_trace;
+
+/**
+ * I/O backend.  The engine decides what to send and when, and keeps
+ * track of deadlines; a backend moves packets.  Any socket backend
+ * receives on the "listener" path sockets only (one per distinct
+ * interface/source binding, since every raw socket with the same
+ * binding sees the same ICMP); the others are muted.
+ */
+struct probe_ops {
+	const char	*po_name;
+	int		po_sockrecv;	/* replies arrive on path sockets */
+	int		(*po_init)(struct probe_engine *pe);
+	void		(*po_fini)(struct probe_engine *pe);
+	/* a path socket was just opened / is about to be closed */
+	void		(*po_open)(struct probe_engine *pe,
+				   struct probe_path *pp);
+	void		(*po_close)(struct probe_engine *pe,
+				    struct probe_path *pp);
+	/* NULL: icmp_send_echo() right away */
+	int		(*po_send)(struct probe_engine *pe,
+				   struct probe_path *pp);
+	/*
+	 * wait until input or wake (usec, monotonic), or until pe_wake_fd
+	 * is readable (set pe_woken); process input
+	 */
+	int		(*po_wait)(struct probe_engine *pe, uint64_t now,
+				   uint64_t wake);
+	/* process input without blocking; NULL: po_wait(pe, now, now) */
+	int		(*po_spin)(struct probe_engine *pe);
+	void		(*po_stats)(struct probe_engine *pe, char *buf,
+				    size_t len);
+	/* packets dropped by a receive path the backend owns, so far */
+	uint64_t	(*po_drops)(struct probe_engine *pe);
+};
+
+struct probe_engine {
+	struct probe_path	*pe_paths;
+	int			pe_npaths;
+	uint16_t		pe_id;
+	uint16_t		pe_seq;
+	int32_t			*pe_seqmap;	/* seq -> path; NULL if few */
+	uint32_t		pe_spread;	/* usec between sends */
+	uint32_t		pe_timeout;	/* this round's, usec */
+	uint32_t		pe_rto_min;	/* usec; 0 = fixed timeout */
+	uint32_t		pe_rto_max;
+	int			pe_hedge;	/* copies per probe */
+	uint32_t		pe_hedge_spacing; /* usec between them */
+	double			pe_min_rate;	/* budget for new paths */
+	double			pe_max_rate;
+	uint64_t		pe_foreign;	/* ICMP errors not ours */
+	uint16_t		pe_skip_id;	/* ... nor foreign either */
+	int			pe_skipping;	/* see probe_skip_id */
+	uint64_t		pe_drops;	/* kernel receive drops */
+	uint64_t		pe_drops_backend; /* po_drops, last seen */
+	uint64_t		pe_drop_when;	/* last seen dropping */
+	int			pe_backend;	/* PROBE_BACKEND_* */
+	const struct probe_ops	*pe_ops;
+	void			*pe_priv;	/* backend state */
+
+	/* Deadlines and the send schedule of the current round */
+	struct timer_wheel	pe_wheel;
+	struct tw_timer		pe_send_timer;
+	int			pe_next;	/* next path to send on */
+	int			pe_pending;	/* probes awaiting replies */
+	uint64_t		pe_drops_checked; /* when, for this batch */
+
+	struct probe_trace	*pe_trace;	/* recording or replaying */
+
+	/* See probe_set_wake */
+	int			pe_wake_fd;	/* -1 = none */
+	int			pe_woken;	/* readable; set by po_wait */
+
+	/* Busy polling; see probe_set_busy_poll */
+	uint32_t		pe_busy_poll;	/* spin window, usec; 0 = off */
+	int			pe_spinning;
+	uint64_t		pe_spin_windows;
+	uint64_t		pe_spin_time;	/* usec spent spinning */
+	uint64_t		pe_spin_hits;	/* replies caught spinning */
+	uint64_t		pe_spin_rtt;	/* ... and their total RTT */
+	uint64_t		pe_wait_hits;	/* replies caught blocking */
+	uint64_t		pe_wait_rtt;
+};
+
+int probe_engine_init(struct probe_engine *pe);
+void probe_engine_destroy(struct probe_engine *pe);
+int probe_add_path(struct probe_engine *pe, char *host,
+		   const struct icmp_opts *opts, const char *name);
+int probe_set_backend(struct probe_engine *pe, int backend);
+int probe_backend_parse(const char *name);
+void probe_set_budget(struct probe_engine *pe, double min_rate,
+		      double max_rate);
+void probe_set_busy_poll(struct probe_engine *pe, uint32_t usec);
+void probe_set_wake(struct probe_engine *pe, int fd);
+void probe_grant(struct probe_engine *pe, int group, int probes);
+void probe_set_rto(struct probe_engine *pe, uint32_t min_us, uint32_t max_us);
+uint32_t probe_rto(struct probe_engine *pe, struct probe_path *pp);
+void probe_set_hedge(struct probe_engine *pe, int copies, uint32_t spacing_us);
+void probe_skip_id(struct probe_engine *pe, uint16_t id);
+int probe_carry_over(struct probe_engine *pe, const struct probe_path *old,
+		     int nold);
+int probe_round(struct probe_engine *pe, uint32_t timeout_us);
+int probe_alive(struct probe_engine *pe, int policy);
+int probe_alive_group(struct probe_engine *pe, int group, int policy);
+void probe_dump(struct probe_engine *pe,
+		void (*out)(void *arg, const char *line), void *arg);
+
+uint64_t probe_now(void);
+
+/* For backends */
+int probe_input(struct probe_engine *pe, const void *pkt, size_t len,
+		uint64_t when);
+int probe_drain(struct probe_engine *pe, int32_t sock);
+int probe_fail(struct probe_engine *pe, int idx, uint16_t seq,
+	       int32_t result, uint64_t when);
+
+extern const struct probe_ops probe_poll_ops;
+extern const struct probe_ops probe_select_ops;
+extern const struct probe_ops probe_epoll_ops;
+extern const struct probe_ops probe_ring_ops;
+extern const struct probe_ops probe_uring_ops;
+
+struct sock_fprog;
+void probe_ring_filter(struct sock_fprog *prog);
+void probe_budget_update(struct probe_path *pp, int lost, uint64_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,240 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Hop sweeps: where along the way does a path stop answering?
+ *
+ * Unlike traceroute, which waits for each hop before trying the next,
+ * one echo per TTL goes out at once, with the TTL as its sequence
+ * number.  A router which sees one expire sends back a time exceeded
+ * quoting it, and the quote says which TTL (so which hop) answered.
+ * The whole sweep takes one timeout at most, which is what we can
+ * afford while the tiebreaker is failing.
+ */
+
+#include <probe_hops.h>
+#include <probe.h>
+#include <poll.h>
+
+
+/**
+ * Probe every hop of a path at once.
+ *
+ * @param dst		Target.
+ * @param opts		Path options (the same binding as the path's
+ *			probes, so the sweep takes the same route); NULL
+ *			for the default route.
+ * @param id		ICMP echo identifier (icmp_alloc_id()), for the
+ *			caller to tell its own engine to skip.
+ * @param max_ttl	Highest TTL to try, at most PROBE_HOPS_MAX.
+ * @param timeout_us	How long to wait for answers.
+ * @param wake_fd	Descriptor which, once readable, cuts the wait
+ *			short (see probe_set_wake); -1 for none.
+ * @param hs		Filled in, with what came back so far if cut short.
+ * @return		Number of hops which answered, or -1 if the
+ *			sweep could not be started.
+ */
+int
+probe_hops_sweep(const struct sockaddr_in *dst, const struct icmp_opts *opts,
+		 uint16_t id, int max_ttl, uint32_t timeout_us, int wake_fd,
+		 struct probe_hops *hs)
+{
+	struct icmp_reply reply;
+	struct probe_hop *ph;
+	struct pollfd pfd[2];
+	uint64_t sent[PROBE_HOPS_MAX], now, deadline;
+	int32_t sock, rv;
+	int ttl, left, answered = 0, esv;
+
+	memset(hs, 0, sizeof(*hs));
+	hs->hs_target = dst->sin_addr;
+	if (max_ttl > PROBE_HOPS_MAX)
+		max_ttl = PROBE_HOPS_MAX;
+	if (max_ttl < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sock = icmp_socket_opts(opts);
+	if (sock < 0)
+		return -1;
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	for (ttl = 1; ttl <= max_ttl; ttl++) {
+		ph = &hs->hs_hops[ttl - 1];
+		ph->ph_result = PING_TIMEOUT;
+		if (setsockopt(sock, IPPROTO_IP, IP_TTL, &ttl,
+			       sizeof(ttl)) < 0 ||
+		    icmp_send_echo(sock, dst, id, (uint16_t)ttl) < 0) {
+			/* Not going anywhere, at any TTL */
+			ph->ph_result = PING_ERRNO;
+			break;
+		}
+		sent[ttl - 1] = probe_now();
+		hs->hs_nhops = ttl;
+	}
+
+	deadline = probe_now() + timeout_us;
+	while (hs->hs_nhops && (now = probe_now()) < deadline) {
+		/* Done once everything up to the target has answered */
+		left = hs->hs_reached ? hs->hs_reached : hs->hs_nhops;
+		for (ttl = 1; ttl <= left; ttl++) {
+			if (hs->hs_hops[ttl - 1].ph_result == PING_TIMEOUT)
+				break;
+		}
+		if (ttl > left)
+			break;
+
+		pfd[0].fd = sock;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = wake_fd;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		left = (int)((deadline - now + 999) / 1000);
+		if (poll(pfd, 2, left) < 0 && errno != EINTR)
+			break;
+		if (pfd[1].revents & POLLIN)
+			break;
+
+		while ((rv = icmp_recv(sock, &reply)) >= 0) {
+			if (rv != PING_SUCCESS)
+				continue;
+			now = probe_now();
+
+			if (reply.ir_type == ICMP_ECHOREPLY) {
+				if (reply.ir_id != id ||
+				    reply.ir_from.s_addr !=
+				    dst->sin_addr.s_addr)
+					continue;
+				ttl = reply.ir_seq;
+				rv = PING_SUCCESS;
+			} else if (reply.ir_quoted &&
+				   reply.ir_orig_id == id &&
+				   reply.ir_orig_dst.s_addr ==
+				   dst->sin_addr.s_addr) {
+				ttl = reply.ir_orig_seq;
+				rv = icmp_classify(&reply);
+				if (rv == PING_REDIRECT)
+					continue;
+			} else {
+				continue;
+			}
+			if (ttl < 1 || ttl > hs->hs_nhops)
+				continue;
+
+			ph = &hs->hs_hops[ttl - 1];
+			if (ph->ph_result != PING_TIMEOUT)
+				continue;
+			ph->ph_addr = reply.ir_from;
+			ph->ph_result = rv;
+			ph->ph_rtt = (uint32_t)(now - sent[ttl - 1]);
+			++answered;
+			if (rv == PING_SUCCESS &&
+			    (!hs->hs_reached || ttl < hs->hs_reached))
+				hs->hs_reached = ttl;
+		}
+	}
+
+	esv = errno;
+	net_icmp_close(sock);
+	errno = esv;
+
+	/* Past the target, everything is the target again */
+	if (hs->hs_reached)
+		hs->hs_nhops = hs->hs_reached;
+	return answered;
+}
+
+
+/**
+ * @return		The highest TTL anything answered at, or 0.
+ */
+int
+probe_hops_last(const struct probe_hops *hs)
+{
+	int x;
+
+	for (x = hs->hs_nhops; x > 0; x--) {
+		if (hs->hs_hops[x - 1].ph_addr.s_addr)
+			return x;
+	}
+	return 0;
+}
+
+
+/**
+ * Describe a sweep on one line, traceroute style: each hop up to the
+ * last which answered, then where the silence starts.
+ *
+ * @return		buf
+ */
+char *
+probe_hops_format(const struct probe_hops *hs, char *buf, size_t len)
+{
+	const struct probe_hop *ph;
+	char addr[INET_ADDRSTRLEN];
+	const char *flag;
+	size_t off = 0;
+	int x, last;
+
+	buf[0] = 0;
+	last = probe_hops_last(hs);
+
+	for (x = 1; x <= last && off < len; x++) {
+		ph = &hs->hs_hops[x - 1];
+		if (!ph->ph_addr.s_addr) {
+			off += snprintf(buf + off, len - off, "%s%d *",
+					off ? ", " : "", x);
+			continue;
+		}
+
+		switch(ph->ph_result) {
+		case PING_HOST_UNREACH:
+			flag = " !H";
+			break;
+		case PING_NET_UNREACH:
+			flag = " !N";
+			break;
+		case PING_ADMIN_PROHIBITED:
+			flag = " !X";
+			break;
+		case PING_FRAG_NEEDED:
+			flag = " !F";
+			break;
+		default:
+			flag = "";
+			break;
+		}
+		inet_ntop(AF_INET, &ph->ph_addr, addr, sizeof(addr));
+		off += snprintf(buf + off, len - off, "%s%d %s%s %u.%03ums",
+				off ? ", " : "", x, addr, flag,
+				ph->ph_rtt / 1000, ph->ph_rtt % 1000);
+	}
+
+	if (off >= len)
+		return buf;
+	if (hs->hs_reached)
+		snprintf(buf + off, len - off, "%starget reached",
+			 off ? "; " : "");
+	else if (last < hs->hs_nhops)
+		snprintf(buf + off, len - off, "%sno answer from hop %d on",
+			 off ? "; " : "", last + 1);
+	else if (!hs->hs_nhops)
+		snprintf(buf + off, len - off, "could not send");
+	return buf;
+}
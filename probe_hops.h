@@ -0,0 +1,64 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Header for probe_hops.c.
+ */
+#ifndef __PROBE_HOPS_H
+#define __PROBE_HOPS_H
+
+#include <ping.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROBE_HOPS_MAX		30
+
+struct probe_hop {
+	struct in_addr	ph_addr;	/* who answered; 0 = nobody */
+	int32_t		ph_result;	/* PING_TTL_EXCEEDED from a router,
+					   PING_SUCCESS from the target,
+					   another error, or PING_TIMEOUT */
+	uint32_t	ph_rtt;		/* usec */
+};
+
+/**
+ * Result of a hop sweep: hs_hops[n] is what came back from the echo
+ * sent with TTL n + 1.
+ */
+struct probe_hops {
+	struct in_addr		hs_target;
+	int			hs_nhops;	/* TTLs probed */
+	int			hs_reached;	/* TTL the target answered
+						   at; 0 = it did not */
+	struct probe_hop	hs_hops[PROBE_HOPS_MAX];
+};
+
+int probe_hops_sweep(const struct sockaddr_in *dst,
+		     const struct icmp_opts *opts, uint16_t id, int max_ttl,
+		     uint32_t timeout_us, int wake_fd,
+		     struct probe_hops *hs);
+int probe_hops_last(const struct probe_hops *hs);
+char *probe_hops_format(const struct probe_hops *hs, char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
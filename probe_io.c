@@ -0,0 +1,367 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+*/
+/** @file
+ * Socket backends for the probe engine: wait for the listening path
+ * sockets with select(), poll() or epoll, then read them dry.
+ */
+
+#define _GNU_SOURCE		/* ppoll */
+#include <probe.h>
+#include <poll.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#define PROBE_EPOLL_EVENTS	64
+
+
+struct probe_epoll {
+	int		ep_fd;
+	int		ep_nfds;	/* registered */
+	int		ep_coarse;	/* no epoll_pwait2 */
+	int		ep_wake_fd;	/* registered pe_wake_fd, or -1 */
+	uint64_t	ep_waits;
+	uint64_t	ep_events;
+};
+
+
+static int
+probe_io_init(struct probe_engine *pe)
+{
+	pe->pe_priv = NULL;
+	return 0;
+}
+
+
+static void
+probe_io_fini(struct probe_engine *pe)
+{
+	pe->pe_priv = NULL;
+}
+
+
+/**
+ * Time from now until wake, for ppoll and epoll_pwait2.  (A millisecond
+ * timeout would oversleep busy-poll windows and sub-millisecond probe
+ * deadlines.)
+ */
+static void
+probe_io_timespec(uint64_t now, uint64_t wake, struct timespec *ts)
+{
+	uint64_t usec = wake > now ? wake - now : 0;
+
+	if (usec > 1000000000ULL)
+		usec = 1000000000ULL;
+	ts->tv_sec = usec / 1000000;
+	ts->tv_nsec = (long)(usec % 1000000) * 1000;
+}
+
+
+/**
+ * Milliseconds from now until wake, rounded up so we do not spin.
+ */
+static int
+probe_io_msec(uint64_t now, uint64_t wake)
+{
+	if (wake <= now)
+		return 0;
+	if (wake - now > 1000000000ULL)
+		return 1000000;
+	return (int)((wake - now + 999) / 1000);
+}
+
+
+/**
+ * Read whatever the listening sockets have, without waiting.  On a
+ * socket with SO_BUSY_POLL, each empty read also polls the device queue
+ * once, which is the point of spinning here rather than in poll().
+ */
+static int
+probe_io_spin(struct probe_engine *pe)
+{
+	int x, done, total = 0;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		if (pe->pe_paths[x].pp_sock < 0 || !pe->pe_paths[x].pp_listen)
+			continue;
+		done = probe_drain(pe, pe->pe_paths[x].pp_sock);
+		if (done < 0)
+			return -1;
+		total += done;
+	}
+
+	return total;
+}
+
+
+static int
+probe_poll_wait(struct probe_engine *pe, uint64_t now, uint64_t wake)
+{
+	struct pollfd pfds[pe->pe_npaths + 1];
+	struct timespec ts;
+	int x, n = 0, ret, done, total = 0;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		if (pe->pe_paths[x].pp_sock < 0 || !pe->pe_paths[x].pp_listen)
+			continue;
+		pfds[n].fd = pe->pe_paths[x].pp_sock;
+		pfds[n].events = POLLIN;
+		++n;
+	}
+	/* Last, so that it does not shift the sockets' slots */
+	pfds[n].fd = pe->pe_wake_fd;
+	pfds[n].events = POLLIN;
+	pfds[n].revents = 0;
+
+	probe_io_timespec(now, wake, &ts);
+	ret = ppoll(pfds, n + 1, &ts, NULL);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -1;
+	if (pfds[n].revents & POLLIN)
+		pe->pe_woken = 1;
+
+	for (x = 0; x < n && ret > 0; x++) {
+		if (!(pfds[x].revents & POLLIN))
+			continue;
+		--ret;
+		done = probe_drain(pe, pfds[x].fd);
+		if (done < 0)
+			return -1;
+		total += done;
+	}
+
+	return total;
+}
+
+
+static int
+probe_select_wait(struct probe_engine *pe, uint64_t now, uint64_t wake)
+{
+	struct timeval tv;
+	fd_set rfds;
+	int32_t sock;
+	int x, max = -1, ret, done, total = 0;
+
+	FD_ZERO(&rfds);
+	for (x = 0; x < pe->pe_npaths; x++) {
+		sock = pe->pe_paths[x].pp_sock;
+		if (sock < 0 || !pe->pe_paths[x].pp_listen)
+			continue;
+		if (sock >= FD_SETSIZE) {
+			errno = EMFILE;
+			return -1;
+		}
+		FD_SET(sock, &rfds);
+		if (sock > max)
+			max = sock;
+	}
+	if (pe->pe_wake_fd >= 0 && pe->pe_wake_fd < FD_SETSIZE) {
+		FD_SET(pe->pe_wake_fd, &rfds);
+		if (pe->pe_wake_fd > max)
+			max = pe->pe_wake_fd;
+	}
+
+	now = wake > now ? wake - now : 0;
+	if (now > 1000000000ULL)
+		now = 1000000000ULL;
+	tv.tv_sec = now / 1000000;
+	tv.tv_usec = now % 1000000;
+
+	ret = select(max + 1, &rfds, NULL, NULL, &tv);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -1;
+	if (pe->pe_wake_fd >= 0 && pe->pe_wake_fd < FD_SETSIZE &&
+	    FD_ISSET(pe->pe_wake_fd, &rfds))
+		pe->pe_woken = 1;
+
+	for (x = 0; x < pe->pe_npaths && ret > 0; x++) {
+		sock = pe->pe_paths[x].pp_sock;
+		if (sock < 0 || !pe->pe_paths[x].pp_listen ||
+		    !FD_ISSET(sock, &rfds))
+			continue;
+		--ret;
+		done = probe_drain(pe, sock);
+		if (done < 0)
+			return -1;
+		total += done;
+	}
+
+	return total;
+}
+
+
+static int
+probe_epoll_init(struct probe_engine *pe)
+{
+	struct probe_epoll *ep;
+
+	ep = calloc(1, sizeof(*ep));
+	if (!ep)
+		return -1;
+	ep->ep_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ep->ep_fd < 0) {
+		free(ep);
+		return -1;
+	}
+	ep->ep_wake_fd = -1;
+	pe->pe_priv = ep;
+	return 0;
+}
+
+
+static void
+probe_epoll_fini(struct probe_engine *pe)
+{
+	struct probe_epoll *ep = pe->pe_priv;
+
+	if (!ep)
+		return;
+	close(ep->ep_fd);
+	free(ep);
+	pe->pe_priv = NULL;
+}
+
+
+static void
+probe_epoll_open(struct probe_engine *pe, struct probe_path *pp)
+{
+	struct probe_epoll *ep = pe->pe_priv;
+	struct epoll_event ev;
+
+	if (!pp->pp_listen)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = pp->pp_sock;
+	if (epoll_ctl(ep->ep_fd, EPOLL_CTL_ADD, pp->pp_sock, &ev) == 0)
+		++ep->ep_nfds;
+}
+
+
+static void
+probe_epoll_close(struct probe_engine *pe, struct probe_path *pp)
+{
+	struct probe_epoll *ep = pe->pe_priv;
+
+	if (!pp->pp_listen)
+		return;
+	if (epoll_ctl(ep->ep_fd, EPOLL_CTL_DEL, pp->pp_sock, NULL) == 0)
+		--ep->ep_nfds;
+}
+
+
+static int
+probe_epoll_wait(struct probe_engine *pe, uint64_t now, uint64_t wake)
+{
+	struct probe_epoll *ep = pe->pe_priv;
+	struct epoll_event evs[PROBE_EPOLL_EVENTS];
+	struct timespec ts;
+	int x, ret = -1, done, total = 0;
+
+	/* The wake descriptor may have come along since the last wait */
+	if (ep->ep_wake_fd != pe->pe_wake_fd) {
+		if (ep->ep_wake_fd >= 0)
+			epoll_ctl(ep->ep_fd, EPOLL_CTL_DEL, ep->ep_wake_fd,
+				  NULL);
+		ep->ep_wake_fd = -1;
+		memset(&evs[0], 0, sizeof(evs[0]));
+		evs[0].events = EPOLLIN;
+		evs[0].data.fd = pe->pe_wake_fd;
+		if (pe->pe_wake_fd >= 0 &&
+		    epoll_ctl(ep->ep_fd, EPOLL_CTL_ADD, pe->pe_wake_fd,
+			      &evs[0]) == 0)
+			ep->ep_wake_fd = pe->pe_wake_fd;
+	}
+
+#ifdef __NR_epoll_pwait2
+	if (!ep->ep_coarse) {
+		probe_io_timespec(now, wake, &ts);
+		ret = (int)syscall(__NR_epoll_pwait2, ep->ep_fd, evs,
+				   PROBE_EPOLL_EVENTS, &ts, NULL, 0);
+		if (ret < 0 && errno == ENOSYS)
+			ep->ep_coarse = 1;
+	}
+#else
+	ep->ep_coarse = 1;
+#endif
+	if (ep->ep_coarse)
+		ret = epoll_wait(ep->ep_fd, evs, PROBE_EPOLL_EVENTS,
+				 probe_io_msec(now, wake));
+	++ep->ep_waits;
+	if (ret < 0)
+		return errno == EINTR ? 0 : -1;
+
+	ep->ep_events += ret;
+	for (x = 0; x < ret; x++) {
+		if (evs[x].data.fd == ep->ep_wake_fd) {
+			pe->pe_woken = 1;
+			continue;
+		}
+		done = probe_drain(pe, evs[x].data.fd);
+		if (done < 0)
+			return -1;
+		total += done;
+	}
+
+	return total;
+}
+
+
+static void
+probe_epoll_stats(struct probe_engine *pe, char *buf, size_t len)
+{
+	struct probe_epoll *ep = pe->pe_priv;
+
+	snprintf(buf, len, "epoll: %d sockets, %llu waits, %llu events",
+		 ep->ep_nfds, (unsigned long long)ep->ep_waits,
+		 (unsigned long long)ep->ep_events);
+}
+
+
+const struct probe_ops probe_poll_ops = {
+	.po_name = "poll",
+	.po_sockrecv = 1,
+	.po_init = probe_io_init,
+	.po_fini = probe_io_fini,
+	.po_wait = probe_poll_wait,
+	.po_spin = probe_io_spin,
+};
+
+const struct probe_ops probe_select_ops = {
+	.po_name = "select",
+	.po_sockrecv = 1,
+	.po_init = probe_io_init,
+	.po_fini = probe_io_fini,
+	.po_wait = probe_select_wait,
+	.po_spin = probe_io_spin,
+};
+
+const struct probe_ops probe_epoll_ops = {
+	.po_name = "epoll",
+	.po_sockrecv = 1,
+	.po_init = probe_epoll_init,
+	.po_fini = probe_epoll_fini,
+	.po_open = probe_epoll_open,
+	.po_close = probe_epoll_close,
+	.po_wait = probe_epoll_wait,
+	.po_spin = probe_io_spin,
+	.po_stats = probe_epoll_stats,
+};
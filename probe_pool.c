@@ -0,0 +1,482 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Sharded probe engine, for probing many targets at once.
+ *
+ * Each shard is an ordinary probe engine driven by its own thread,
+ * pinned to its own CPU where possible.  Shards share no state, so
+ * nothing on the probing path takes a lock.  Targets with the same
+ * socket options share one socket within a shard (see probe_open), so
+ * the host delivers each reply to one socket per shard rather than one
+ * per target.
+ *
+ * Results leave a shard in one direction only.  After every round the
+ * shard thread sums its paths into sh_totals under a sequence counter
+ * (sh_gen), and stores each path's result in sh_results.  Readers add
+ * up the shards without ever blocking a shard; a reader which catches
+ * a shard mid-update just reads that shard again.
+ */
+
+#define _GNU_SOURCE		/* pthread_setaffinity_np */
+#include <probe_pool.h>
+#include <sched.h>
+#include <time.h>
+
+
+/**
+ * Set up a pool of shards.  Add targets with probe_pool_add, then call
+ * probe_pool_start.
+ *
+ * @param pl		Pool to initialize.
+ * @param nshards	Number of shards; <= 0 for one per online CPU.
+ * @param backend	PROBE_BACKEND_* for every shard.
+ * @return		0 on success, -1 on error (errno set).
+ */
+int
+probe_pool_init(struct probe_pool *pl, int nshards, int backend)
+{
+	struct probe_shard *sh;
+	cpu_set_t cpus;
+	int x, cpu, ncpus = 0, esv;
+
+	memset(pl, 0, sizeof(*pl));
+	if (nshards <= 0)
+		nshards = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (nshards <= 0)
+		nshards = 1;
+
+	if (posix_memalign((void **)&pl->pl_shards, 64,
+			   sizeof(*sh) * nshards)) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(pl->pl_shards, 0, sizeof(*sh) * nshards);
+
+	/* Only pin if there is a CPU we may use for every shard */
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+		ncpus = CPU_COUNT(&cpus);
+
+	for (x = 0, cpu = 0; x < nshards; x++) {
+		sh = &pl->pl_shards[x];
+		sh->sh_pool = pl;
+		sh->sh_cpu = -1;
+		if (nshards <= ncpus) {
+			while (!CPU_ISSET(cpu, &cpus))
+				++cpu;
+			sh->sh_cpu = cpu++;
+		}
+
+		if (probe_engine_init(&sh->sh_engine) < 0 ||
+		    probe_set_backend(&sh->sh_engine, backend) < 0) {
+			esv = errno;
+			pl->pl_nshards = x + 1;
+			probe_pool_destroy(pl);
+			errno = esv;
+			return -1;
+		}
+	}
+
+	pl->pl_nshards = nshards;
+	return 0;
+}
+
+
+/**
+ * Stop the shards if need be and free everything.
+ */
+void
+probe_pool_destroy(struct probe_pool *pl)
+{
+	int x;
+
+	probe_pool_stop(pl);
+	for (x = 0; x < pl->pl_nshards; x++) {
+		probe_engine_destroy(&pl->pl_shards[x].sh_engine);
+		free(pl->pl_shards[x].sh_results);
+	}
+	free(pl->pl_shards);
+	free(pl->pl_targets);
+	memset(pl, 0, sizeof(*pl));
+}
+
+
+/**
+ * FNV-1a, to spread targets over shards.
+ */
+static uint32_t
+probe_pool_hash(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint32_t h = 2166136261u;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+
+/**
+ * Add a target.  Must be called before probe_pool_start.
+ *
+ * @param pl		Pool.
+ * @param host		Host name or address.
+ * @param opts		Path options, or NULL for the default route.
+ * @param name		Label for log messages; NULL to use the host.
+ * @return		Target number (for probe_pool_result), or -1 on
+ *			error.
+ */
+int
+probe_pool_add(struct probe_pool *pl, char *host,
+	       const struct icmp_opts *opts, const char *name)
+{
+	struct probe_pool_target *targets, *tg;
+	struct sockaddr_in sin;
+	uint32_t h;
+	int path;
+
+	if (pl->pl_shards[0].sh_started) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	targets = realloc(pl->pl_targets,
+			  sizeof(*targets) * (pl->pl_ntargets + 1));
+	if (!targets)
+		return -1;
+	pl->pl_targets = targets;
+
+	/* By address if we can, so that aliases land together */
+	if (icmp_ping_getaddr(host, &sin) == 0)
+		h = probe_pool_hash(&sin.sin_addr, sizeof(sin.sin_addr));
+	else
+		h = probe_pool_hash(host, strlen(host));
+
+	tg = &targets[pl->pl_ntargets];
+	tg->tg_shard = (int)(h % (uint32_t)pl->pl_nshards);
+	path = probe_add_path(&pl->pl_shards[tg->tg_shard].sh_engine, host,
+			      opts, name);
+	if (path < 0)
+		return -1;
+	tg->tg_path = path;
+
+	return pl->pl_ntargets++;
+}
+
+
+/**
+ * Publish a shard's results for other threads.  Only the shard's own
+ * thread writes here, so a sequence counter is all the readers need.
+ */
+static void
+probe_shard_publish(struct probe_shard *sh, int alive)
+{
+	struct probe_engine *pe = &sh->sh_engine;
+	struct probe_totals *pt = &sh->sh_totals;
+	struct probe_stats *ps;
+	uint64_t sent = 0, received = 0, lost = 0, errors = 0, rtt = 0;
+	int x;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		ps = &pe->pe_paths[x].pp_stats;
+		sent += ps->ps_sent;
+		received += ps->ps_received;
+		lost += ps->ps_lost + ps->ps_rxq_overflow;
+		errors += ps->ps_errors;
+		rtt += ps->ps_rtt_total;
+		__atomic_store_n(&sh->sh_results[x], pe->pe_paths[x].pp_result,
+				 __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&sh->sh_gen, sh->sh_gen + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&pt->pt_rounds, pt->pt_rounds + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&pt->pt_sent, sent, __ATOMIC_RELAXED);
+	__atomic_store_n(&pt->pt_received, received, __ATOMIC_RELAXED);
+	__atomic_store_n(&pt->pt_lost, lost, __ATOMIC_RELAXED);
+	__atomic_store_n(&pt->pt_errors, errors, __ATOMIC_RELAXED);
+	__atomic_store_n(&pt->pt_rtt_total, rtt, __ATOMIC_RELAXED);
+	__atomic_store_n(&pt->pt_targets, pe->pe_npaths, __ATOMIC_RELAXED);
+	__atomic_store_n(&pt->pt_alive, alive, __ATOMIC_RELAXED);
+	__atomic_store_n(&sh->sh_gen, sh->sh_gen + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Sleep until an absolute time (usec, monotonic), waking now and then
+ * to see whether we have been asked to stop.
+ */
+static void
+probe_pool_sleep(struct probe_pool *pl, uint64_t until)
+{
+	struct timespec ts;
+	uint64_t now, nap;
+
+	while (!__atomic_load_n(&pl->pl_stop, __ATOMIC_ACQUIRE)) {
+		now = probe_now();
+		if (now >= until)
+			break;
+		nap = until - now;
+		if (nap > PROBE_POOL_NAP)
+			nap = PROBE_POOL_NAP;
+		ts.tv_sec = nap / 1000000;
+		ts.tv_nsec = (nap % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+	}
+}
+
+
+static void *
+probe_shard_thread(void *arg)
+{
+	struct probe_shard *sh = arg;
+	struct probe_pool *pl = sh->sh_pool;
+	uint64_t next = probe_now(), now;
+	cpu_set_t cpus;
+	int alive;
+
+	if (sh->sh_cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(sh->sh_cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+
+	while (!__atomic_load_n(&pl->pl_stop, __ATOMIC_ACQUIRE)) {
+		alive = probe_round(&sh->sh_engine, pl->pl_timeout);
+		probe_shard_publish(sh, alive < 0 ? 0 : alive);
+
+		/* If we fell behind, start again from now; do not burst */
+		now = probe_now();
+		next += pl->pl_interval;
+		if (next < now)
+			next = now;
+		probe_pool_sleep(pl, next);
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Start one thread per shard, each probing its targets every
+ * interval_us.
+ *
+ * @param pl		Pool.
+ * @param interval_us	Time from the start of one round to the start
+ *			of the next (usec).
+ * @param timeout_us	How long each probe waits for its reply (usec).
+ * @return		0 on success, -1 on error (errno set; shards
+ *			already started are stopped again).
+ */
+int
+probe_pool_start(struct probe_pool *pl, uint32_t interval_us,
+		 uint32_t timeout_us)
+{
+	struct probe_shard *sh;
+	int x, y, ret;
+
+	pl->pl_interval = interval_us;
+	pl->pl_timeout = timeout_us;
+	pl->pl_stop = 0;
+
+	for (x = 0; x < pl->pl_nshards; x++) {
+		sh = &pl->pl_shards[x];
+		free(sh->sh_results);
+		sh->sh_results = calloc(sh->sh_engine.pe_npaths + 1,
+					sizeof(*sh->sh_results));
+		if (!sh->sh_results)
+			goto fail;
+		for (y = 0; y < sh->sh_engine.pe_npaths; y++)
+			sh->sh_results[y] = PING_TIMEOUT;
+
+		ret = pthread_create(&sh->sh_thread, NULL, probe_shard_thread,
+				     sh);
+		if (ret) {
+			errno = ret;
+			goto fail;
+		}
+		sh->sh_started = 1;
+	}
+
+	return 0;
+
+fail:
+	ret = errno;
+	probe_pool_stop(pl);
+	errno = ret;
+	return -1;
+}
+
+
+/**
+ * Ask the shards to stop, and wait for them.  A shard finishes the
+ * round it is in first, so this takes up to one probe timeout plus
+ * PROBE_POOL_NAP.
+ */
+void
+probe_pool_stop(struct probe_pool *pl)
+{
+	int x;
+
+	__atomic_store_n(&pl->pl_stop, 1, __ATOMIC_RELEASE);
+	for (x = 0; x < pl->pl_nshards; x++) {
+		if (!pl->pl_shards[x].sh_started)
+			continue;
+		pthread_join(pl->pl_shards[x].sh_thread, NULL);
+		pl->pl_shards[x].sh_started = 0;
+	}
+}
+
+
+/**
+ * Latest result for one target.  Safe from any thread.
+ *
+ * @param pl		Pool.
+ * @param target	Target number from probe_pool_add.
+ * @return		PING_* result of its last probe.
+ */
+int32_t
+probe_pool_result(struct probe_pool *pl, int target)
+{
+	struct probe_pool_target *tg;
+	struct probe_shard *sh;
+
+	if (target < 0 || target >= pl->pl_ntargets) {
+		errno = EINVAL;
+		return PING_ERRNO;
+	}
+	tg = &pl->pl_targets[target];
+	sh = &pl->pl_shards[tg->tg_shard];
+	if (!sh->sh_results)
+		return PING_TIMEOUT;
+	return __atomic_load_n(&sh->sh_results[tg->tg_path], __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Read one shard's published totals, consistently.
+ */
+static void
+probe_shard_totals(struct probe_shard *sh, struct probe_totals *pt)
+{
+	struct probe_totals *src = &sh->sh_totals;
+	uint32_t gen;
+
+	do {
+		while ((gen = __atomic_load_n(&sh->sh_gen,
+					      __ATOMIC_ACQUIRE)) & 1)
+			sched_yield();
+		pt->pt_rounds = __atomic_load_n(&src->pt_rounds,
+						__ATOMIC_RELAXED);
+		pt->pt_sent = __atomic_load_n(&src->pt_sent, __ATOMIC_RELAXED);
+		pt->pt_received = __atomic_load_n(&src->pt_received,
+						  __ATOMIC_RELAXED);
+		pt->pt_lost = __atomic_load_n(&src->pt_lost, __ATOMIC_RELAXED);
+		pt->pt_errors = __atomic_load_n(&src->pt_errors,
+						__ATOMIC_RELAXED);
+		pt->pt_rtt_total = __atomic_load_n(&src->pt_rtt_total,
+						   __ATOMIC_RELAXED);
+		pt->pt_targets = __atomic_load_n(&src->pt_targets,
+						 __ATOMIC_RELAXED);
+		pt->pt_alive = __atomic_load_n(&src->pt_alive,
+					       __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&sh->sh_gen, __ATOMIC_RELAXED) != gen);
+}
+
+
+/**
+ * Totals for one shard, or summed over all of them.  Safe from any
+ * thread, and never waits for a shard to finish its round.
+ *
+ * @param pl		Pool.
+ * @param shard		Shard number, or -1 for the whole pool.
+ * @param pt		Filled in with the totals.
+ */
+void
+probe_pool_totals(struct probe_pool *pl, int shard, struct probe_totals *pt)
+{
+	struct probe_totals one;
+	int x;
+
+	memset(pt, 0, sizeof(*pt));
+	if (shard >= 0) {
+		if (shard < pl->pl_nshards)
+			probe_shard_totals(&pl->pl_shards[shard], pt);
+		return;
+	}
+
+	for (x = 0; x < pl->pl_nshards; x++) {
+		probe_shard_totals(&pl->pl_shards[x], &one);
+		/* Shards run independently; report the slowest */
+		if (!x || one.pt_rounds < pt->pt_rounds)
+			pt->pt_rounds = one.pt_rounds;
+		pt->pt_sent += one.pt_sent;
+		pt->pt_received += one.pt_received;
+		pt->pt_lost += one.pt_lost;
+		pt->pt_errors += one.pt_errors;
+		pt->pt_rtt_total += one.pt_rtt_total;
+		pt->pt_targets += one.pt_targets;
+		pt->pt_alive += one.pt_alive;
+	}
+}
+
+
+static void
+probe_pool_line(const char *label, struct probe_totals *pt, char *buf,
+		size_t len)
+{
+	snprintf(buf, len, "%s: %llu/%llu targets alive, %llu rounds, "
+		 "sent %llu recv %llu lost %llu err %llu rtt avg %llu us",
+		 label, (unsigned long long)pt->pt_alive,
+		 (unsigned long long)pt->pt_targets,
+		 (unsigned long long)pt->pt_rounds,
+		 (unsigned long long)pt->pt_sent,
+		 (unsigned long long)pt->pt_received,
+		 (unsigned long long)pt->pt_lost,
+		 (unsigned long long)pt->pt_errors,
+		 (unsigned long long)(pt->pt_received ?
+				      pt->pt_rtt_total / pt->pt_received : 0));
+}
+
+
+/**
+ * Report per-shard and pool totals, one line each.
+ */
+void
+probe_pool_dump(struct probe_pool *pl,
+		void (*out)(void *arg, const char *line), void *arg)
+{
+	struct probe_totals pt;
+	char label[32], buf[256];
+	int x;
+
+	for (x = 0; x < pl->pl_nshards; x++) {
+		probe_pool_totals(pl, x, &pt);
+		snprintf(label, sizeof(label), "shard %d (cpu %d)", x,
+			 pl->pl_shards[x].sh_cpu);
+		probe_pool_line(label, &pt, buf, sizeof(buf));
+		out(arg, buf);
+	}
+
+	probe_pool_totals(pl, -1, &pt);
+	probe_pool_line("pool", &pt, buf, sizeof(buf));
+	out(arg, buf);
+}
@@ -0,0 +1,107 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Header for probe_pool.c.
+ */
+#ifndef __PROBE_POOL_H
+#define __PROBE_POOL_H
+
+#include <probe.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROBE_POOL_NAP		100000	/* usec; longest sleep between
+					   checks for probe_pool_stop */
+
+/**
+ * Totals over a shard's (or the whole pool's) targets, as of the end of
+ * the last round.
+ */
+struct probe_totals {
+	uint64_t	pt_rounds;
+	uint64_t	pt_sent;
+	uint64_t	pt_received;
+	uint64_t	pt_lost;
+	uint64_t	pt_errors;
+	uint64_t	pt_rtt_total;	/* usec, over pt_received */
+	uint64_t	pt_targets;
+	uint64_t	pt_alive;	/* answered in the last round */
+};
+
+struct probe_pool;
+
+/**
+ * One shard: an engine and the thread which runs it.  Everything in
+ * sh_engine belongs to that thread; other threads only read sh_totals
+ * and sh_results, which the shard publishes after each round.
+ */
+struct probe_shard {
+	struct probe_engine	sh_engine;
+	struct probe_pool	*sh_pool;
+	pthread_t		sh_thread;
+	int			sh_cpu;		/* pinned to; -1 = not */
+	int			sh_started;
+	int32_t			*sh_results;	/* pp_result, by path */
+
+	/* Published totals; even sh_gen means consistent */
+	uint32_t		sh_gen __attribute__((aligned(64)));
+	struct probe_totals	sh_totals;
+};
+
+struct probe_pool_target {
+	int		tg_shard;
+	int		tg_path;
+};
+
+/**
+ * A set of probe engines, one per CPU, which share nothing: each has
+ * its own socket, echo identifier, timer wheel, statistics and thread.
+ * Targets are spread over the shards by a hash of their address.
+ */
+struct probe_pool {
+	struct probe_shard	*pl_shards;
+	int			pl_nshards;
+	struct probe_pool_target *pl_targets;
+	int			pl_ntargets;
+	uint32_t		pl_interval;	/* usec between rounds */
+	uint32_t		pl_timeout;	/* usec */
+	int			pl_stop;
+};
+
+int probe_pool_init(struct probe_pool *pl, int nshards, int backend);
+void probe_pool_destroy(struct probe_pool *pl);
+int probe_pool_add(struct probe_pool *pl, char *host,
+		   const struct icmp_opts *opts, const char *name);
+int probe_pool_start(struct probe_pool *pl, uint32_t interval_us,
+		     uint32_t timeout_us);
+void probe_pool_stop(struct probe_pool *pl);
+int32_t probe_pool_result(struct probe_pool *pl, int target);
+void probe_pool_totals(struct probe_pool *pl, int shard,
+		       struct probe_totals *pt);
+void probe_pool_dump(struct probe_pool *pl,
+		     void (*out)(void *arg, const char *line), void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
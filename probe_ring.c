@@ -0,0 +1,317 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+*/
+/** @file
+ * Packet ring receive path for the probe engine.
+ *
+ * With many paths, the plain socket path is expensive: every raw ICMP
+ * socket gets its own copy of every ICMP message the host receives, and
+ * each one is copied again by recvfrom().  Instead, one AF_PACKET socket
+ * with a TPACKET_V3 ring and a BPF filter for ICMP hands us whole blocks
+ * of packets, which are parsed in place and handed back to the kernel.
+ * The probe sockets themselves get a drop-everything filter (see
+ * icmp_socket_mute()), since they are only used for sending.
+ */
+
+#define _GNU_SOURCE		/* ppoll */
+#include <probe.h>
+#include <sys/mman.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <poll.h>
+#include <time.h>
+
+#define RING_BLOCK_SIZE		(1 << 14)
+#define RING_FRAME_SIZE		2048
+#define RING_BLOCKS		64
+#define RING_TOV		1	/* block retire timeout, msec */
+
+
+struct probe_ring {
+	int			pr_fd;
+	uint8_t			*pr_map;
+	size_t			pr_maplen;
+	struct tpacket_req3	pr_req;
+	unsigned		pr_block;	/* next block to look at */
+	uint64_t		pr_blocks;
+	uint64_t		pr_packets;
+	uint64_t		pr_drops;
+	uint64_t		pr_freezes;
+};
+
+
+static void probe_ring_fini(struct probe_engine *pe);
+
+
+/*
+ * Accept incoming ICMP echo replies and the error types which can quote
+ * an echo; drop everything else, including our own transmissions,
+ * before it takes up room in the ring.  SOCK_DGRAM: offsets are from
+ * the start of the IP header.
+ */
+static struct sock_filter ring_filter[] = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 11, 0),
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 9),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 0, 9),
+	BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+	BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 5, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_DEST_UNREACH, 4, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_SOURCE_QUENCH, 3, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_REDIRECT, 2, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_TIME_EXCEEDED, 1, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_PARAMETERPROB, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, 256),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+
+/**
+ * The ring's socket filter, for probe_ring_init and for testing.
+ */
+void
+probe_ring_filter(struct sock_fprog *prog)
+{
+	prog->len = sizeof(ring_filter) / sizeof(ring_filter[0]);
+	prog->filter = ring_filter;
+}
+
+
+/**
+ * Set up a receive ring for ICMP.
+ */
+static int
+probe_ring_init(struct probe_engine *pe)
+{
+	struct sock_fprog prog;
+	struct sockaddr_ll sll;
+	struct probe_ring *pr;
+	int version = TPACKET_V3, esv;
+
+	pr = calloc(1, sizeof(*pr));
+	if (!pr)
+		return -1;
+	pe->pe_priv = pr;
+
+	probe_ring_filter(&prog);
+	pr->pr_fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_IP));
+	if (pr->pr_fd < 0)
+		goto fail;
+
+	if (setsockopt(pr->pr_fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+		       sizeof(prog)) < 0)
+		goto fail;
+
+	if (setsockopt(pr->pr_fd, SOL_PACKET, PACKET_VERSION, &version,
+		       sizeof(version)) < 0)
+		goto fail;
+
+	pr->pr_req.tp_block_size = RING_BLOCK_SIZE;
+	pr->pr_req.tp_block_nr = RING_BLOCKS;
+	pr->pr_req.tp_frame_size = RING_FRAME_SIZE;
+	pr->pr_req.tp_frame_nr = (RING_BLOCK_SIZE / RING_FRAME_SIZE) *
+				 pr->pr_req.tp_block_nr;
+	pr->pr_req.tp_retire_blk_tov = RING_TOV;
+	if (setsockopt(pr->pr_fd, SOL_PACKET, PACKET_RX_RING, &pr->pr_req,
+		       sizeof(pr->pr_req)) < 0)
+		goto fail;
+
+	pr->pr_maplen = (size_t)pr->pr_req.tp_block_size *
+			pr->pr_req.tp_block_nr;
+	pr->pr_map = mmap(NULL, pr->pr_maplen, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, pr->pr_fd, 0);
+	if (pr->pr_map == MAP_FAILED) {
+		pr->pr_map = NULL;
+		goto fail;
+	}
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_IP);
+	if (bind(pr->pr_fd, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+		goto fail;
+
+	fcntl(pr->pr_fd, F_SETFL, fcntl(pr->pr_fd, F_GETFL) | O_NONBLOCK);
+	return 0;
+
+fail:
+	esv = errno;
+	probe_ring_fini(pe);
+	errno = esv;
+	return -1;
+}
+
+
+/**
+ * Tear down a ring.
+ */
+static void
+probe_ring_fini(struct probe_engine *pe)
+{
+	struct probe_ring *pr = pe->pe_priv;
+
+	if (!pr)
+		return;
+	if (pr->pr_map)
+		munmap(pr->pr_map, pr->pr_maplen);
+	if (pr->pr_fd >= 0)
+		close(pr->pr_fd);
+	free(pr);
+	pe->pe_priv = NULL;
+}
+
+
+/**
+ * Hand every packet in every completed block to the engine, then give
+ * the blocks back to the kernel.  Packets are not copied.
+ *
+ * The kernel's receive timestamp (CLOCK_REALTIME) is translated to the
+ * monotonic clock the engine uses, so RTTs do not include the time a
+ * block spent waiting to be retired.
+ *
+ * @return		Number of probes completed.
+ */
+static int
+probe_ring_drain(struct probe_engine *pe)
+{
+	struct probe_ring *pr = pe->pe_priv;
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *ppd;
+	struct sockaddr_ll *sll;
+	struct timespec real;
+	uint64_t mono, realnow, stamp;
+	uint32_t x;
+	int done = 0;
+
+	clock_gettime(CLOCK_REALTIME, &real);
+	mono = probe_now();
+	realnow = (uint64_t)real.tv_sec * 1000000 + real.tv_nsec / 1000;
+
+	while (1) {
+		bd = (struct tpacket_block_desc *)(pr->pr_map +
+			(size_t)pr->pr_block * pr->pr_req.tp_block_size);
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status,
+				      __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			break;
+
+		ppd = (struct tpacket3_hdr *)((uint8_t *)bd +
+				bd->hdr.bh1.offset_to_first_pkt);
+		for (x = 0; x < bd->hdr.bh1.num_pkts; x++) {
+			sll = (struct sockaddr_ll *)((uint8_t *)ppd +
+				TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+			/* The filter should have caught these */
+			if (sll->sll_pkttype != PACKET_OUTGOING) {
+				stamp = (uint64_t)ppd->tp_sec * 1000000 +
+					ppd->tp_nsec / 1000;
+				if (stamp > realnow)
+					stamp = realnow;
+				done += probe_input(pe,
+						    (uint8_t *)ppd + ppd->tp_net,
+						    ppd->tp_snaplen,
+						    mono - (realnow - stamp));
+				++pr->pr_packets;
+			}
+			ppd = (struct tpacket3_hdr *)((uint8_t *)ppd +
+						      ppd->tp_next_offset);
+		}
+
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+				 __ATOMIC_RELEASE);
+		pr->pr_block = (pr->pr_block + 1) % pr->pr_req.tp_block_nr;
+		++pr->pr_blocks;
+	}
+
+	return done;
+}
+
+
+static int
+probe_ring_wait(struct probe_engine *pe, uint64_t now, uint64_t wake)
+{
+	struct probe_ring *pr = pe->pe_priv;
+	struct pollfd pfd[2];
+	struct timespec ts;
+
+	now = wake > now ? wake - now : 0;
+	ts.tv_sec = now / 1000000;
+	ts.tv_nsec = (long)(now % 1000000) * 1000;
+	pfd[0].fd = pr->pr_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = pe->pe_wake_fd;
+	pfd[1].events = POLLIN;
+	pfd[1].revents = 0;
+	if (ppoll(pfd, 2, &ts, NULL) < 0 && errno != EINTR)
+		return -1;
+	if (pfd[1].revents & POLLIN)
+		pe->pe_woken = 1;
+	return probe_ring_drain(pe);
+}
+
+
+/**
+ * Packets the ring had no room for, so far.
+ */
+static uint64_t
+probe_ring_drops(struct probe_engine *pe)
+{
+	struct probe_ring *pr = pe->pe_priv;
+	struct tpacket_stats_v3 st;
+	socklen_t stlen = sizeof(st);
+
+	memset(&st, 0, sizeof(st));
+	/* Reading the counters resets them */
+	if (getsockopt(pr->pr_fd, SOL_PACKET, PACKET_STATISTICS, &st,
+		       &stlen) == 0) {
+		pr->pr_drops += st.tp_drops;
+		pr->pr_freezes += st.tp_freeze_q_cnt;
+	}
+	return pr->pr_drops;
+}
+
+
+/**
+ * Report ring statistics.
+ */
+static void
+probe_ring_stats(struct probe_engine *pe, char *buf, size_t len)
+{
+	struct probe_ring *pr = pe->pe_priv;
+
+	probe_ring_drops(pe);
+
+	snprintf(buf, len, "ring: %llu packets in %llu blocks, %llu dropped, "
+		 "%llu queue freezes",
+		 (unsigned long long)pr->pr_packets,
+		 (unsigned long long)pr->pr_blocks,
+		 (unsigned long long)pr->pr_drops,
+		 (unsigned long long)pr->pr_freezes);
+}
+
+
+const struct probe_ops probe_ring_ops = {
+	.po_name = "ring",
+	.po_sockrecv = 0,
+	.po_init = probe_ring_init,
+	.po_fini = probe_ring_fini,
+	.po_wait = probe_ring_wait,
+	.po_stats = probe_ring_stats,
+	.po_drops = probe_ring_drops,
+};
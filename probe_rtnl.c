@@ -0,0 +1,564 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Link, route and neighbour events from the kernel (rtnetlink), matched
+ * against the paths of a probe engine.
+ *
+ * The kernel knows within microseconds when an uplink loses carrier,
+ * when the route to a target goes away or when the gateway stops
+ * answering ARP; the probes need a timeout or several to find out.  Each
+ * path's route is looked up the way its probes are sent (interface,
+ * source and mark), which gives the egress interface and the next hop
+ * to watch.  Any IPv4 route change means looking every path up again;
+ * there are only a few, and a lookup is one system call.
+ */
+
+#include <probe_rtnl.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/time.h>
+
+
+/**
+ * Append an attribute to a request.  The caller sees to the space.
+ */
+static void
+probe_rtnl_attr(struct nlmsghdr *nh, int type, const void *data, int len)
+{
+	struct rtattr *rta;
+
+	rta = (struct rtattr *)((char *)nh + NLMSG_ALIGN(nh->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+
+/**
+ * Send a request and wait for the answer to it.
+ *
+ * @param sock		Query socket (not the subscribed one).
+ * @param req		Request; nlmsg_seq must be set.
+ * @param buf		Buffer for the reply.
+ * @param len		Size of buf.
+ * @return		The reply, or NULL with errno set (from the
+ *			kernel's error, if it sent one).
+ */
+static struct nlmsghdr *
+probe_rtnl_query(int sock, struct nlmsghdr *req, void *buf, size_t len)
+{
+	struct nlmsghdr *nh;
+	struct nlmsgerr *err;
+	int n;
+
+	if (send(sock, req, req->nlmsg_len, 0) < 0)
+		return NULL;
+
+	while (1) {
+		n = (int)recv(sock, buf, len, 0);
+		if (n < 0)
+			return NULL;
+		for (nh = buf; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+			if (nh->nlmsg_seq != req->nlmsg_seq)
+				continue;
+			if (nh->nlmsg_type != NLMSG_ERROR)
+				return nh;
+			err = NLMSG_DATA(nh);
+			errno = err->error ? -err->error : EPROTO;
+			return NULL;
+		}
+	}
+}
+
+
+static int
+probe_rtnl_flags_up(unsigned flags)
+{
+	return (flags & IFF_UP) && (flags & IFF_RUNNING);
+}
+
+
+/**
+ * Is an interface up, with carrier?
+ *
+ * @return		1 if so, 0 if not (or if it is gone), -1 if we
+ *			could not find out.
+ */
+static int
+probe_rtnl_link_up(int sock, uint32_t seq, int ifindex)
+{
+	struct {
+		struct nlmsghdr		nh;
+		struct ifinfomsg	ifi;
+	} req;
+	union {
+		char			buf[4096];
+		struct nlmsghdr		align;
+	} rep;
+	struct nlmsghdr *nh;
+	struct ifinfomsg *ifi;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+	req.nh.nlmsg_type = RTM_GETLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST;
+	req.nh.nlmsg_seq = seq;
+	req.ifi.ifi_family = AF_UNSPEC;
+	req.ifi.ifi_index = ifindex;
+
+	nh = probe_rtnl_query(sock, &req.nh, rep.buf, sizeof(rep.buf));
+	if (!nh)
+		return errno == ENODEV ? 0 : -1;
+	if (nh->nlmsg_type != RTM_NEWLINK)
+		return -1;
+	ifi = NLMSG_DATA(nh);
+	return probe_rtnl_flags_up(ifi->ifi_flags);
+}
+
+
+/**
+ * Look up the route a path's probes take, and the state of its link.
+ */
+static void
+probe_rtnl_lookup(struct probe_rtnl *rt, int sock, struct probe_path *pp,
+		  struct probe_rtnl_path *rl)
+{
+	struct {
+		struct nlmsghdr		nh;
+		struct rtmsg		rtm;
+		char			attrs[64];
+	} req;
+	union {
+		char			buf[4096];
+		struct nlmsghdr		align;
+	} rep;
+	struct nlmsghdr *nh;
+	struct rtmsg *rtm;
+	struct rtattr *rta;
+	int len, oif = 0, up;
+
+	rl->rl_state = PROBE_RTNL_UNKNOWN;
+	rl->rl_ifindex = 0;
+	rl->rl_nexthop.s_addr = 0;
+
+	/* Not resolved yet; nothing to look up */
+	if (pp->pp_addr.sin_addr.s_addr == htonl(INADDR_ANY))
+		return;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rtm));
+	req.nh.nlmsg_type = RTM_GETROUTE;
+	req.nh.nlmsg_flags = NLM_F_REQUEST;
+	req.nh.nlmsg_seq = ++rt->rt_seq;
+	req.rtm.rtm_family = AF_INET;
+	req.rtm.rtm_dst_len = 32;
+	probe_rtnl_attr(&req.nh, RTA_DST, &pp->pp_addr.sin_addr,
+			sizeof(struct in_addr));
+	if (pp->pp_opts.io_ifname[0]) {
+		oif = (int)if_nametoindex(pp->pp_opts.io_ifname);
+		if (!oif) {
+			/* The interface is gone; as good as down */
+			rl->rl_state = PROBE_RTNL_DOWN;
+			return;
+		}
+		probe_rtnl_attr(&req.nh, RTA_OIF, &oif, sizeof(oif));
+	}
+	if (pp->pp_opts.io_src.s_addr) {
+		req.rtm.rtm_src_len = 32;
+		probe_rtnl_attr(&req.nh, RTA_SRC, &pp->pp_opts.io_src,
+				sizeof(struct in_addr));
+	}
+	if (pp->pp_opts.io_mark)
+		probe_rtnl_attr(&req.nh, RTA_MARK, &pp->pp_opts.io_mark,
+				sizeof(pp->pp_opts.io_mark));
+
+	nh = probe_rtnl_query(sock, &req.nh, rep.buf, sizeof(rep.buf));
+	if (!nh) {
+		if (errno == ENETUNREACH || errno == EHOSTUNREACH) {
+			rl->rl_state = PROBE_RTNL_NOROUTE;
+		} else if (errno == ENETDOWN) {
+			rl->rl_state = PROBE_RTNL_DOWN;
+			rl->rl_ifindex = oif;
+		}
+		return;
+	}
+	if (nh->nlmsg_type != RTM_NEWROUTE)
+		return;
+
+	rtm = NLMSG_DATA(nh);
+	len = (int)RTM_PAYLOAD(nh);
+	rl->rl_nexthop = pp->pp_addr.sin_addr;
+	for (rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == RTA_OIF)
+			memcpy(&rl->rl_ifindex, RTA_DATA(rta),
+			       sizeof(rl->rl_ifindex));
+		else if (rta->rta_type == RTA_GATEWAY)
+			memcpy(&rl->rl_nexthop, RTA_DATA(rta),
+			       sizeof(rl->rl_nexthop));
+	}
+
+	if (rtm->rtm_type != RTN_UNICAST && rtm->rtm_type != RTN_LOCAL) {
+		rl->rl_state = PROBE_RTNL_NOROUTE;
+		return;
+	}
+	if (rtm->rtm_flags & RTNH_F_LINKDOWN) {
+		rl->rl_state = PROBE_RTNL_DOWN;
+		return;
+	}
+
+	up = rl->rl_ifindex ? probe_rtnl_link_up(sock, ++rt->rt_seq,
+						 rl->rl_ifindex) : 1;
+	if (up == 0)
+		rl->rl_state = PROBE_RTNL_DOWN;
+	else if (up > 0)
+		rl->rl_state = PROBE_RTNL_UP;
+}
+
+
+/**
+ * Note that a path changed, and tell the engine if its link is down.
+ *
+ * @return		1 if the path has new events, 0 if not.
+ */
+static int
+probe_rtnl_note(struct probe_engine *pe, int x, struct probe_rtnl_path *rl,
+		int events)
+{
+	pe->pe_paths[x].pp_link_down = rl->rl_state == PROBE_RTNL_DOWN;
+	if (!events)
+		return 0;
+	rl->rl_events |= events;
+	return 1;
+}
+
+
+/**
+ * Look up every path again.
+ *
+ * @param rt		Monitor.
+ * @param pe		Engine.
+ * @param compare	Flag what changed since the last lookup.
+ * @return		Number of paths which changed, or -1 on error.
+ */
+static int
+probe_rtnl_update(struct probe_rtnl *rt, struct probe_engine *pe,
+		  int compare)
+{
+	struct probe_rtnl_path *rl, old;
+	struct timeval tv = { 1, 0 };
+	int sock, x, events, changed = 0;
+
+	sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (sock < 0)
+		return -1;
+	/* The kernel answers at once; this is only in case it does not */
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	for (x = 0; x < rt->rt_npaths; x++) {
+		rl = &rt->rt_paths[x];
+		old = *rl;
+		probe_rtnl_lookup(rt, sock, &pe->pe_paths[x], rl);
+		if (rl->rl_ifindex != old.rl_ifindex ||
+		    rl->rl_nexthop.s_addr != old.rl_nexthop.s_addr)
+			rl->rl_neigh_failed = 0;
+
+		events = 0;
+		if ((old.rl_state == PROBE_RTNL_DOWN) !=
+		    (rl->rl_state == PROBE_RTNL_DOWN))
+			events = PROBE_RTNL_EV_LINK;
+		else if (rl->rl_state != old.rl_state ||
+			 rl->rl_ifindex != old.rl_ifindex ||
+			 rl->rl_nexthop.s_addr != old.rl_nexthop.s_addr)
+			events = PROBE_RTNL_EV_ROUTE;
+		changed += probe_rtnl_note(pe, x, rl, compare ? events : 0);
+	}
+
+	close(sock);
+	return changed;
+}
+
+
+/**
+ * Subscribe to link, IPv4 route and neighbour events.
+ *
+ * @param rt		Monitor; initialized here.
+ * @return		0, or -1 on error (rt_sock is then -1, and the
+ *			other calls are harmless).
+ */
+int
+probe_rtnl_open(struct probe_rtnl *rt)
+{
+	struct sockaddr_nl sa;
+	int size = PROBE_RTNL_RCVBUF, esv;
+
+	memset(rt, 0, sizeof(*rt));
+	rt->rt_sock = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK |
+			     SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (rt->rt_sock < 0)
+		return -1;
+
+	/* A flapping uplink makes a lot of noise */
+	setsockopt(rt->rt_sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_ROUTE | RTMGRP_NEIGH;
+	if (bind(rt->rt_sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		esv = errno;
+		close(rt->rt_sock);
+		rt->rt_sock = -1;
+		errno = esv;
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Unsubscribe, and forget the paths.
+ */
+void
+probe_rtnl_close(struct probe_rtnl *rt)
+{
+	if (rt->rt_sock >= 0)
+		close(rt->rt_sock);
+	rt->rt_sock = -1;
+	free(rt->rt_paths);
+	rt->rt_paths = NULL;
+	rt->rt_npaths = 0;
+}
+
+
+/**
+ * Look up the route and link of every path of an engine, from scratch;
+ * call whenever the engine's paths change.  Sets pp_link_down on the
+ * paths whose egress link is down.  No events are flagged.
+ *
+ * @param rt		Monitor.
+ * @param pe		Engine.
+ * @return		0, or -1 on error.
+ */
+int
+probe_rtnl_map(struct probe_rtnl *rt, struct probe_engine *pe)
+{
+	struct probe_rtnl_path *paths;
+
+	if (rt->rt_sock < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	paths = realloc(rt->rt_paths, sizeof(*paths) * (pe->pe_npaths + 1));
+	if (!paths)
+		return -1;
+	memset(paths, 0, sizeof(*paths) * (pe->pe_npaths + 1));
+	rt->rt_paths = paths;
+	rt->rt_npaths = pe->pe_npaths;
+
+	return probe_rtnl_update(rt, pe, 0) < 0 ? -1 : 0;
+}
+
+
+/**
+ * A link changed.  Paths going out over it are down if it is; if it came
+ * up, the routes over it may have too, and everything is looked up again.
+ *
+ * @return		Number of paths with new events; *remap set if
+ *			a lookup is due.
+ */
+static int
+probe_rtnl_link(struct probe_rtnl *rt, struct probe_engine *pe,
+		struct nlmsghdr *nh, int *remap)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	struct probe_rtnl_path *rl;
+	int x, up, changed = 0;
+
+	if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+		return 0;
+	up = nh->nlmsg_type == RTM_NEWLINK &&
+	     probe_rtnl_flags_up(ifi->ifi_flags);
+
+	for (x = 0; x < rt->rt_npaths; x++) {
+		rl = &rt->rt_paths[x];
+		if (up && rl->rl_state != PROBE_RTNL_UP)
+			*remap = 1;
+		if (up || rl->rl_ifindex != ifi->ifi_index ||
+		    rl->rl_state == PROBE_RTNL_DOWN)
+			continue;
+		rl->rl_state = PROBE_RTNL_DOWN;
+		changed += probe_rtnl_note(pe, x, rl, PROBE_RTNL_EV_LINK);
+	}
+
+	return changed;
+}
+
+
+/**
+ * A neighbour entry changed.  If it is a path's next hop, note when it
+ * fails to resolve, and when it answers again.
+ *
+ * @return		Number of paths with new events.
+ */
+static int
+probe_rtnl_neigh(struct probe_rtnl *rt, struct probe_engine *pe,
+		 struct nlmsghdr *nh)
+{
+	struct ndmsg *ndm = NLMSG_DATA(nh);
+	struct probe_rtnl_path *rl;
+	struct rtattr *rta;
+	struct in_addr dst;
+	int x, len, failed, changed = 0;
+
+	if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ndm)) ||
+	    ndm->ndm_family != AF_INET)
+		return 0;
+	if (ndm->ndm_state & NUD_FAILED)
+		failed = 1;
+	else if (ndm->ndm_state & NUD_REACHABLE)
+		failed = 0;
+	else
+		return 0;
+
+	dst.s_addr = 0;
+	len = (int)NLMSG_PAYLOAD(nh, sizeof(*ndm));
+	for (rta = (struct rtattr *)((char *)ndm + NLMSG_ALIGN(sizeof(*ndm)));
+	     RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == NDA_DST &&
+		    RTA_PAYLOAD(rta) == sizeof(dst))
+			memcpy(&dst, RTA_DATA(rta), sizeof(dst));
+	}
+
+	for (x = 0; x < rt->rt_npaths; x++) {
+		rl = &rt->rt_paths[x];
+		if (rl->rl_ifindex != ndm->ndm_ifindex ||
+		    rl->rl_nexthop.s_addr != dst.s_addr ||
+		    rl->rl_neigh_failed == failed)
+			continue;
+		rl->rl_neigh_failed = failed;
+		changed += probe_rtnl_note(pe, x, rl, PROBE_RTNL_EV_NEIGH);
+	}
+
+	return changed;
+}
+
+
+/**
+ * Read every pending event and match it against the paths.  Events
+ * which concern a path are or'ed into its rl_events, for the caller to
+ * clear once it has dealt with them, and pp_link_down follows the
+ * state of its egress link.  If the kernel dropped events (the receive
+ * buffer overflowed), every path is looked up again.
+ *
+ * @param rt		Monitor; probe_rtnl_map must have been called
+ *			since the engine's paths last changed.
+ * @param pe		Engine.
+ * @return		Number of paths with new events, or -1 on error.
+ */
+int
+probe_rtnl_read(struct probe_rtnl *rt, struct probe_engine *pe)
+{
+	union {
+		char		buf[8192];
+		struct nlmsghdr	align;
+	} msg;
+	struct nlmsghdr *nh;
+	struct rtmsg *rtm;
+	int n, ret, remap = 0, changed = 0;
+
+	if (rt->rt_sock < 0 || rt->rt_npaths != pe->pe_npaths) {
+		errno = EBADF;
+		return -1;
+	}
+
+	while (1) {
+		n = (int)recv(rt->rt_sock, msg.buf, sizeof(msg.buf), 0);
+		if (n < 0) {
+			if (errno == ENOBUFS) {
+				/* Lost some; no telling what changed */
+				++rt->rt_overruns;
+				remap = 1;
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		for (nh = &msg.align; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+			++rt->rt_messages;
+			switch (nh->nlmsg_type) {
+			case RTM_NEWLINK:
+			case RTM_DELLINK:
+				changed += probe_rtnl_link(rt, pe, nh, &remap);
+				break;
+			case RTM_NEWROUTE:
+			case RTM_DELROUTE:
+				rtm = NLMSG_DATA(nh);
+				if (rtm->rtm_family == AF_INET &&
+				    rtm->rtm_table != RT_TABLE_LOCAL)
+					remap = 1;
+				break;
+			case RTM_NEWNEIGH:
+				changed += probe_rtnl_neigh(rt, pe, nh);
+				break;
+			}
+		}
+	}
+
+	if (remap) {
+		ret = probe_rtnl_update(rt, pe, 1);
+		if (ret > 0)
+			changed += ret;
+	}
+	rt->rt_relevant += changed;
+	return changed;
+}
+
+
+/**
+ * Apply a path policy to what the kernel says about a group's links.
+ *
+ * @param pe		Engine.
+ * @param group		Paths with this pp_group count; -1 for all.
+ * @param policy	PROBE_POLICY_ANY or PROBE_POLICY_ALL.
+ * @return		1 if the links alone rule the group out (every
+ *			path's link is down, or for PROBE_POLICY_ALL,
+ *			any), 0 if not.
+ */
+int
+probe_rtnl_down(struct probe_engine *pe, int group, int policy)
+{
+	int x, down = 0, n = 0;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		if (group >= 0 && pe->pe_paths[x].pp_group != group)
+			continue;
+		++n;
+		if (pe->pe_paths[x].pp_link_down)
+			++down;
+	}
+
+	if (policy == PROBE_POLICY_ALL)
+		return down > 0;
+	return n && down == n;
+}
@@ -0,0 +1,79 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Header for probe_rtnl.c.
+ */
+#ifndef __PROBE_RTNL_H
+#define __PROBE_RTNL_H
+
+#include <probe.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROBE_RTNL_RCVBUF	(1 << 20)	/* events to absorb */
+
+/* rl_state: what the kernel says about a path's egress */
+#define PROBE_RTNL_UNKNOWN	0	/* not looked up, or lookup failed */
+#define PROBE_RTNL_UP		1
+#define PROBE_RTNL_DOWN		2	/* link down or without carrier */
+#define PROBE_RTNL_NOROUTE	3
+
+/* rl_events: what changed; cleared by the caller */
+#define PROBE_RTNL_EV_LINK	0x1	/* egress link went down or up */
+#define PROBE_RTNL_EV_ROUTE	0x2	/* egress or next hop changed */
+#define PROBE_RTNL_EV_NEIGH	0x4	/* next hop failed or came back */
+
+struct probe_rtnl_path {
+	int		rl_state;	/* PROBE_RTNL_* */
+	int		rl_ifindex;	/* egress; 0 = unknown */
+	struct in_addr	rl_nexthop;	/* gateway, or the target if
+					   it is on the link */
+	int		rl_neigh_failed;
+	int		rl_events;	/* PROBE_RTNL_EV_* */
+};
+
+/**
+ * Routing netlink monitor for the paths of a probe engine.  Each path's
+ * route is looked up the way its probes are sent (interface, source and
+ * mark), and link, route and neighbour events are matched against the
+ * result.  rt_paths runs parallel to the engine's pe_paths.
+ */
+struct probe_rtnl {
+	int			rt_sock;	/* subscribed; -1 = closed */
+	uint32_t		rt_seq;
+	struct probe_rtnl_path	*rt_paths;
+	int			rt_npaths;
+	uint64_t		rt_messages;	/* events read */
+	uint64_t		rt_relevant;	/* ... which changed a path */
+	uint64_t		rt_overruns;	/* times events were lost */
+};
+
+int probe_rtnl_open(struct probe_rtnl *rt);
+void probe_rtnl_close(struct probe_rtnl *rt);
+int probe_rtnl_map(struct probe_rtnl *rt, struct probe_engine *pe);
+int probe_rtnl_read(struct probe_rtnl *rt, struct probe_engine *pe);
+int probe_rtnl_down(struct probe_engine *pe, int group, int policy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,267 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Probe traces: a compact record of every probe outcome (send time,
+ * round trip time or loss, error class) of an engine, round by round,
+ * and replay of such a record into an engine in place of the network.
+ * A replayed engine looks to its caller exactly like a live one, so the
+ * same decision logic can be run over a bad night on a flaky link with
+ * different settings, as fast as the CPU allows.
+ */
+
+#include <probe_trace.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+
+/**
+ * Open a trace file.
+ *
+ * @param tf		Trace to set up.
+ * @param file		File name.
+ * @param replay	0 to record (the file is created or truncated),
+ *			1 to replay (the header is read and checked).
+ * @return		0, or -1 with errno set.
+ */
+int
+probe_trace_open(struct probe_trace *tf, const char *file, int replay)
+{
+	size_t n, size;
+
+	memset(tf, 0, sizeof(*tf));
+	tf->tf_replay = replay;
+	tf->tf_fp = fopen(file, replay ? "r" : "w");
+	if (!tf->tf_fp)
+		return -1;
+
+	if (!replay) {
+		tf->tf_base = probe_now();
+		return 0;
+	}
+
+	if (fread(&tf->tf_hdr, sizeof(tf->tf_hdr), 1, tf->tf_fp) != 1 ||
+	    tf->tf_hdr.th_magic != PROBE_TRACE_MAGIC ||
+	    tf->tf_hdr.th_version < 1 ||
+	    tf->tf_hdr.th_version > PROBE_TRACE_VERSION ||
+	    !tf->tf_hdr.th_npaths) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	n = tf->tf_hdr.th_npaths;
+	tf->tf_paths = calloc(n, sizeof(*tf->tf_paths));
+	if (!tf->tf_paths)
+		goto fail;
+	/* Version 1 paths stop short of tp_group, which is then 0 */
+	size = tf->tf_hdr.th_version == 1 ?
+	       offsetof(struct probe_trace_path, tp_group) :
+	       sizeof(*tf->tf_paths);
+	for (n = 0; n < tf->tf_hdr.th_npaths; n++) {
+		if (fread(&tf->tf_paths[n], size, 1, tf->tf_fp) != 1) {
+			errno = EINVAL;
+			goto fail;
+		}
+		tf->tf_paths[n].tp_name[PROBE_NAMELEN - 1] = 0;
+		tf->tf_paths[n].tp_host[PROBE_NAMELEN - 1] = 0;
+	}
+	return 0;
+
+fail:
+	probe_trace_close(tf);
+	return -1;
+}
+
+
+/**
+ * Close a trace file.  Engines it is attached to must be detached (or
+ * destroyed) first.
+ */
+void
+probe_trace_close(struct probe_trace *tf)
+{
+	int err = errno;
+
+	if (tf->tf_fp)
+		fclose(tf->tf_fp);
+	tf->tf_fp = NULL;
+	free(tf->tf_paths);
+	tf->tf_paths = NULL;
+	errno = err;
+}
+
+
+/**
+ * Attach a trace to an engine.  When recording, every probe_round is
+ * appended to the trace.  When replaying, the engine must be empty: it
+ * gets the trace's paths (without sockets), and every probe_round plays
+ * the next recorded round instead of probing, failing with ENODATA at
+ * the end of the trace.
+ *
+ * @return		0, or -1 if the paths could not be added.
+ */
+int
+probe_trace_attach(struct probe_engine *pe, struct probe_trace *tf)
+{
+	struct probe_trace_path *tp;
+	int x, idx;
+
+	pe->pe_trace = tf;
+	if (!tf->tf_replay)
+		return 0;
+
+	if (pe->pe_npaths) {
+		errno = EBUSY;
+		return -1;
+	}
+	for (x = 0; x < tf->tf_hdr.th_npaths; x++) {
+		tp = &tf->tf_paths[x];
+		idx = probe_add_path(pe, tp->tp_host, NULL, tp->tp_name);
+		if (idx < 0)
+			return -1;
+		pe->pe_paths[idx].pp_group = tp->tp_group;
+	}
+	return 0;
+}
+
+
+static int
+probe_trace_header(struct probe_trace *tf, struct probe_engine *pe)
+{
+	struct probe_trace_path tp;
+	struct timeval tv;
+	int x;
+
+	gettimeofday(&tv, NULL);
+	tf->tf_hdr.th_magic = PROBE_TRACE_MAGIC;
+	tf->tf_hdr.th_version = PROBE_TRACE_VERSION;
+	tf->tf_hdr.th_npaths = (uint16_t)pe->pe_npaths;
+	tf->tf_hdr.th_start = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec -
+			      (probe_now() - tf->tf_base);
+	if (fwrite(&tf->tf_hdr, sizeof(tf->tf_hdr), 1, tf->tf_fp) != 1)
+		return -1;
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		/* Same sizes, and always terminated */
+		memcpy(tp.tp_name, pe->pe_paths[x].pp_name, sizeof(tp.tp_name));
+		memcpy(tp.tp_host, pe->pe_paths[x].pp_host, sizeof(tp.tp_host));
+		tp.tp_group = pe->pe_paths[x].pp_group;
+		if (fwrite(&tp, sizeof(tp), 1, tf->tf_fp) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Append the round the engine just finished.  The header goes out with
+ * the first round, since that is when the paths are known; the path
+ * set must not change after that.  Flushed every round, so a trace
+ * survives its recorder being killed.
+ *
+ * @return		0, or -1 with errno set (and also in tf_error).
+ */
+int
+probe_trace_write(struct probe_trace *tf, struct probe_engine *pe)
+{
+	struct probe_trace_rec rec;
+	struct probe_path *pp;
+	int x;
+
+	if (!tf->tf_fp || tf->tf_replay) {
+		errno = EBADF;
+		goto fail;
+	}
+	if (!tf->tf_rounds) {
+		if (pe->pe_npaths < 1 || pe->pe_npaths > UINT16_MAX) {
+			errno = EINVAL;
+			goto fail;
+		}
+		if (probe_trace_header(tf, pe) < 0)
+			goto fail;
+	} else if (pe->pe_npaths != tf->tf_hdr.th_npaths) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	for (x = 0; x < pe->pe_npaths; x++) {
+		pp = &pe->pe_paths[x];
+		memset(&rec, 0, sizeof(rec));
+		rec.tr_sent = pp->pp_sent > tf->tf_base ?
+			      pp->pp_sent - tf->tf_base : 0;
+		rec.tr_path = (uint16_t)x;
+		rec.tr_result = (int8_t)pp->pp_result;
+		rec.tr_flags = pp->pp_events & PROBE_TRACE_EVENTS;
+		if (pp->pp_degraded)
+			rec.tr_mtu |= PROBE_TRACE_DEGRADED;
+		rec.tr_mtu_result = (int8_t)pp->pp_mtu_result;
+		if (pp->pp_fresh) {
+			rec.tr_flags |= PROBE_TRACE_FRESH;
+			if (pp->pp_result == PING_SUCCESS)
+				rec.tr_rtt = pp->pp_stats.ps_rtt_last;
+		}
+		if (fwrite(&rec, sizeof(rec), 1, tf->tf_fp) != 1)
+			goto fail;
+	}
+	if (fflush(tf->tf_fp) != 0)
+		goto fail;
+
+	++tf->tf_rounds;
+	tf->tf_clock = probe_now() - tf->tf_base;
+	return 0;
+
+fail:
+	tf->tf_error = errno;
+	return -1;
+}
+
+
+/**
+ * Read the next record of a trace being replayed, and move the trace
+ * clock up to its send time.
+ *
+ * @return		1, 0 at the end of the trace, or -1 on error.
+ */
+int
+probe_trace_read(struct probe_trace *tf, struct probe_trace_rec *rec)
+{
+	if (!tf->tf_fp || !tf->tf_replay) {
+		errno = EBADF;
+		return -1;
+	}
+	/* Version 1 and 2 records stop short of tr_mtu, which is then 0 */
+	memset(rec, 0, sizeof(*rec));
+	if (fread(rec, tf->tf_hdr.th_version < 3 ?
+		  offsetof(struct probe_trace_rec, tr_mtu) : sizeof(*rec),
+		  1, tf->tf_fp) != 1) {
+		if (ferror(tf->tf_fp)) {
+			tf->tf_error = errno;
+			return -1;
+		}
+		return 0;
+	}
+
+	if (rec->tr_path == tf->tf_hdr.th_npaths - 1)
+		++tf->tf_rounds;
+	if (rec->tr_sent + rec->tr_rtt > tf->tf_clock)
+		tf->tf_clock = rec->tr_sent + rec->tr_rtt;
+	return 1;
+}
@@ -0,0 +1,96 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Header for probe_trace.c.
+ */
+#ifndef __PROBE_TRACE_H
+#define __PROBE_TRACE_H
+
+#include <probe.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROBE_TRACE_MAGIC	0x52544e51	/* "QNTR" */
+#define PROBE_TRACE_VERSION	3	/* 1 had no tp_group, 2 no tr_mtu */
+
+/* tr_flags */
+#define PROBE_TRACE_EVENTS	0x7f	/* PROBE_EV_* of that round */
+#define PROBE_TRACE_FRESH	0x80	/* probed in that round */
+
+/* tr_mtu */
+#define PROBE_TRACE_DEGRADED	0x1	/* pp_degraded, after that round */
+
+/*
+ * A trace file is a header, then th_npaths path descriptions, then one
+ * record per path per round, in path order.  Everything is in host
+ * byte order.
+ */
+struct probe_trace_hdr {
+	uint32_t	th_magic;
+	uint16_t	th_version;
+	uint16_t	th_npaths;
+	uint64_t	th_start;	/* wall clock, usec since the epoch */
+};
+
+struct probe_trace_path {
+	char		tp_name[PROBE_NAMELEN];
+	char		tp_host[PROBE_NAMELEN];
+	int32_t		tp_group;	/* pp_group */
+};
+
+struct probe_trace_rec {
+	uint64_t	tr_sent;	/* usec since the trace began */
+	uint32_t	tr_rtt;		/* usec; replies only */
+	uint16_t	tr_path;
+	int8_t		tr_result;	/* PING_* */
+	uint8_t		tr_flags;
+	uint8_t		tr_mtu;		/* full-size probe state */
+	int8_t		tr_mtu_result;	/* pp_mtu_result */
+	uint8_t		tr_pad[6];
+};
+
+/**
+ * An open trace, being either recorded from an engine's rounds or
+ * replayed into an engine in place of real probes.
+ */
+struct probe_trace {
+	FILE			*tf_fp;
+	int			tf_replay;
+	int			tf_error;	/* errno which stopped us */
+	struct probe_trace_hdr	tf_hdr;		/* valid once written/read */
+	struct probe_trace_path	*tf_paths;
+	uint64_t		tf_base;	/* probe_now() at trace start */
+	uint64_t		tf_clock;	/* trace time, last round */
+	uint64_t		tf_rounds;
+};
+
+int probe_trace_open(struct probe_trace *tf, const char *file, int replay);
+void probe_trace_close(struct probe_trace *tf);
+int probe_trace_attach(struct probe_engine *pe, struct probe_trace *tf);
+int probe_trace_write(struct probe_trace *tf, struct probe_engine *pe);
+int probe_trace_read(struct probe_trace *tf, struct probe_trace_rec *rec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
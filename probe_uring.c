@@ -0,0 +1,660 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+*/
+/** @file
+ * io_uring backend for the probe engine.
+ *
+ * Each listening path socket has one multishot receive armed on it,
+ * drawing from a ring of provided buffers, so replies keep arriving as
+ * completions without any per-packet request.  Echoes go out as SENDMSG
+ * requests, each linked to a timeout equal to the probe timeout so that
+ * a send which cannot get out before its probe would expire is cancelled
+ * (and counted as a timeout) rather than going out late.  A round's
+ * sends are queued and submitted together by the same io_uring_enter()
+ * which then waits for completions, so a busy round costs one syscall
+ * per wakeup rather than one per packet.
+ *
+ * No liburing; the handful of syscalls are made directly.  Needs 5.19
+ * for provided buffer rings; multishot receive (6.0) is used if the
+ * kernel accepts it and falls back to rearming single receives if not.
+ * probe_set_backend() falls back to epoll if setup fails.
+ */
+
+#include <probe.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES		256
+#define URING_CQ_ENTRIES	4096
+#define URING_BUFS		256		/* power of 2 */
+#define URING_BUFSZ		ICMP_RECV_LEN	/* whole full-size replies */
+#define URING_BGID		0
+
+/* user_data: type << 56 | aux (seq, or fd for receives) << 32 | path */
+#define UR_RECV			1
+#define UR_SEND			2
+#define UR_LINKTO		3
+#define UR_CANCEL		4
+#define UR_WAKE			5	/* poll on pe_wake_fd (aux) */
+#define UR_DATA(type, aux, idx)	(((uint64_t)(type) << 56) | \
+				 ((uint64_t)((aux) & 0xffffff) << 32) | \
+				 (uint32_t)(idx))
+#define UR_TYPE(data)		((int)((data) >> 56))
+#define UR_AUX(data)		((uint32_t)((data) >> 32) & 0xffffff)
+#define UR_IDX(data)		((int)(uint32_t)(data))
+
+
+/**
+ * Per-path send state.  The kernel reads these when the request is
+ * issued, which is after po_send returns, so they cannot live on the
+ * stack; and they are allocated one at a time so that adding paths
+ * (which moves the path table) does not move them.
+ */
+struct uring_slot {
+	struct msghdr		us_msg;
+	struct iovec		us_iov;
+	struct sockaddr_in	us_addr;
+	struct __kernel_timespec us_ts;
+	uint8_t			us_pkt[64];
+	int			us_busy;	/* send in flight */
+};
+
+struct probe_uring {
+	int			ur_fd;
+	struct io_uring_params	ur_params;
+
+	void			*ur_sqmap;
+	size_t			ur_sqlen;
+	void			*ur_cqmap;
+	size_t			ur_cqlen;
+	struct io_uring_sqe	*ur_sqes;
+	size_t			ur_sqeslen;
+
+	unsigned		*ur_sq_head;
+	unsigned		*ur_sq_tail;
+	unsigned		*ur_sq_array;
+	unsigned		ur_sq_mask;
+	unsigned		ur_tail;	/* our copy of *ur_sq_tail */
+	unsigned		ur_queued;	/* not yet submitted */
+
+	unsigned		*ur_cq_head;
+	unsigned		*ur_cq_tail;
+	unsigned		ur_cq_mask;
+	struct io_uring_cqe	*ur_cqes;
+
+	struct io_uring_buf_ring *ur_br;
+	size_t			ur_brlen;
+	uint8_t			*ur_bufs;
+	unsigned short		ur_brtail;
+	int			ur_multishot;
+	int			ur_wake_armed;
+
+	struct uring_slot	**ur_slots;
+	int			ur_nslots;
+
+	uint64_t		ur_enters;
+	uint64_t		ur_cqes_seen;
+	uint64_t		ur_rearms;
+	uint64_t		ur_nobufs;
+};
+
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int
+uring_register(int fd, unsigned op, void *arg, unsigned nargs)
+{
+	return (int)syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+
+/**
+ * Submit whatever is queued and optionally wait for completions.
+ */
+static int
+uring_enter(struct probe_uring *ur, unsigned min_complete, unsigned flags,
+	    void *arg, size_t argsz)
+{
+	int ret;
+
+	__atomic_store_n(ur->ur_sq_tail, ur->ur_tail, __ATOMIC_RELEASE);
+	ret = (int)syscall(__NR_io_uring_enter, ur->ur_fd, ur->ur_queued,
+			   min_complete, flags, arg, argsz);
+	++ur->ur_enters;
+	if (ret > 0)
+		ur->ur_queued -= (unsigned)ret;
+	return ret;
+}
+
+
+/**
+ * Get a submission queue entry, submitting what is queued if the ring is
+ * full.
+ */
+static struct io_uring_sqe *
+uring_sqe(struct probe_uring *ur)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head, idx;
+
+	head = __atomic_load_n(ur->ur_sq_head, __ATOMIC_ACQUIRE);
+	if (ur->ur_tail - head >= ur->ur_params.sq_entries) {
+		uring_enter(ur, 0, 0, NULL, 0);
+		head = __atomic_load_n(ur->ur_sq_head, __ATOMIC_ACQUIRE);
+		if (ur->ur_tail - head >= ur->ur_params.sq_entries)
+			return NULL;
+	}
+
+	idx = ur->ur_tail & ur->ur_sq_mask;
+	sqe = &ur->ur_sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ur->ur_sq_array[idx] = idx;
+	++ur->ur_tail;
+	++ur->ur_queued;
+	return sqe;
+}
+
+
+/**
+ * Hand a receive buffer back to the kernel.  Made visible to the kernel
+ * by uring_buf_commit().
+ */
+static void
+uring_buf_recycle(struct probe_uring *ur, unsigned short bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &ur->ur_br->bufs[ur->ur_brtail & (URING_BUFS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(ur->ur_bufs + (size_t)bid * URING_BUFSZ);
+	buf->len = URING_BUFSZ;
+	buf->bid = bid;
+	++ur->ur_brtail;
+}
+
+
+static void
+uring_buf_commit(struct probe_uring *ur)
+{
+	__atomic_store_n(&ur->ur_br->tail, ur->ur_brtail, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Arm a receive on a listening path socket.
+ */
+static void
+uring_arm_recv(struct probe_uring *ur, struct probe_path *pp, int idx)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(ur);
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = pp->pp_sock;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	if (ur->ur_multishot)
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	else
+		sqe->len = URING_BUFSZ;
+	sqe->user_data = UR_DATA(UR_RECV, pp->pp_sock, idx);
+}
+
+
+static void probe_uring_fini(struct probe_engine *pe);
+
+
+static int
+probe_uring_init(struct probe_engine *pe)
+{
+	struct probe_uring *ur;
+	struct io_uring_params *p;
+	struct io_uring_buf_reg reg;
+	int x, esv;
+
+	ur = calloc(1, sizeof(*ur));
+	if (!ur)
+		return -1;
+	ur->ur_fd = -1;
+	ur->ur_multishot = 1;
+	pe->pe_priv = ur;
+
+	p = &ur->ur_params;
+	p->flags = IORING_SETUP_CQSIZE;
+	p->cq_entries = URING_CQ_ENTRIES;
+	ur->ur_fd = uring_setup(URING_ENTRIES, p);
+	if (ur->ur_fd < 0)
+		goto fail;
+	if (!(p->features & IORING_FEAT_EXT_ARG) ||
+	    !(p->features & IORING_FEAT_NODROP)) {
+		errno = ENOSYS;
+		goto fail;
+	}
+
+	ur->ur_sqlen = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ur->ur_cqlen = p->cq_off.cqes +
+		       p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->ur_cqlen > ur->ur_sqlen)
+			ur->ur_sqlen = ur->ur_cqlen;
+		ur->ur_cqlen = 0;
+	}
+
+	ur->ur_sqmap = mmap(NULL, ur->ur_sqlen, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ur->ur_fd,
+			    IORING_OFF_SQ_RING);
+	if (ur->ur_sqmap == MAP_FAILED) {
+		ur->ur_sqmap = NULL;
+		goto fail;
+	}
+	if (ur->ur_cqlen) {
+		ur->ur_cqmap = mmap(NULL, ur->ur_cqlen, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ur->ur_fd,
+				    IORING_OFF_CQ_RING);
+		if (ur->ur_cqmap == MAP_FAILED) {
+			ur->ur_cqmap = NULL;
+			goto fail;
+		}
+	} else {
+		ur->ur_cqmap = ur->ur_sqmap;
+	}
+
+	ur->ur_sqeslen = p->sq_entries * sizeof(struct io_uring_sqe);
+	ur->ur_sqes = mmap(NULL, ur->ur_sqeslen, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ur->ur_fd,
+			   IORING_OFF_SQES);
+	if (ur->ur_sqes == MAP_FAILED) {
+		ur->ur_sqes = NULL;
+		goto fail;
+	}
+
+	ur->ur_sq_head = (unsigned *)((uint8_t *)ur->ur_sqmap + p->sq_off.head);
+	ur->ur_sq_tail = (unsigned *)((uint8_t *)ur->ur_sqmap + p->sq_off.tail);
+	ur->ur_sq_array = (unsigned *)((uint8_t *)ur->ur_sqmap +
+				       p->sq_off.array);
+	ur->ur_sq_mask = *(unsigned *)((uint8_t *)ur->ur_sqmap +
+				       p->sq_off.ring_mask);
+	ur->ur_tail = *ur->ur_sq_tail;
+
+	ur->ur_cq_head = (unsigned *)((uint8_t *)ur->ur_cqmap + p->cq_off.head);
+	ur->ur_cq_tail = (unsigned *)((uint8_t *)ur->ur_cqmap + p->cq_off.tail);
+	ur->ur_cq_mask = *(unsigned *)((uint8_t *)ur->ur_cqmap +
+				       p->cq_off.ring_mask);
+	ur->ur_cqes = (struct io_uring_cqe *)((uint8_t *)ur->ur_cqmap +
+					      p->cq_off.cqes);
+
+	/* Provided buffer ring for receives */
+	ur->ur_brlen = URING_BUFS * sizeof(struct io_uring_buf);
+	ur->ur_br = mmap(NULL, ur->ur_brlen, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ur->ur_br == MAP_FAILED) {
+		ur->ur_br = NULL;
+		goto fail;
+	}
+	ur->ur_bufs = malloc((size_t)URING_BUFS * URING_BUFSZ);
+	if (!ur->ur_bufs)
+		goto fail;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ur->ur_br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (uring_register(ur->ur_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+
+	for (x = 0; x < URING_BUFS; x++)
+		uring_buf_recycle(ur, (unsigned short)x);
+	uring_buf_commit(ur);
+
+	return 0;
+
+fail:
+	esv = errno;
+	probe_uring_fini(pe);
+	errno = esv;
+	return -1;
+}
+
+
+static void
+probe_uring_fini(struct probe_engine *pe)
+{
+	struct probe_uring *ur = pe->pe_priv;
+	int x;
+
+	if (!ur)
+		return;
+
+	/* Closing the ring cancels anything still in flight */
+	if (ur->ur_fd >= 0)
+		close(ur->ur_fd);
+	if (ur->ur_sqes)
+		munmap(ur->ur_sqes, ur->ur_sqeslen);
+	if (ur->ur_cqmap && ur->ur_cqmap != ur->ur_sqmap)
+		munmap(ur->ur_cqmap, ur->ur_cqlen);
+	if (ur->ur_sqmap)
+		munmap(ur->ur_sqmap, ur->ur_sqlen);
+	if (ur->ur_br)
+		munmap(ur->ur_br, ur->ur_brlen);
+	free(ur->ur_bufs);
+	for (x = 0; x < ur->ur_nslots; x++)
+		free(ur->ur_slots[x]);
+	free(ur->ur_slots);
+	free(ur);
+	pe->pe_priv = NULL;
+}
+
+
+static void
+probe_uring_open(struct probe_engine *pe, struct probe_path *pp)
+{
+	if (pp->pp_listen)
+		uring_arm_recv(pe->pe_priv, pp, (int)(pp - pe->pe_paths));
+}
+
+
+/**
+ * Cancel the receive on a socket which is about to be closed.  This has
+ * to reach the kernel now: the request holds a reference to the socket,
+ * which would otherwise live on after close().
+ */
+static void
+probe_uring_close(struct probe_engine *pe, struct probe_path *pp)
+{
+	struct probe_uring *ur = pe->pe_priv;
+	struct io_uring_sqe *sqe;
+
+	if (!pp->pp_listen)
+		return;
+
+	sqe = uring_sqe(ur);
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = UR_DATA(UR_RECV, pp->pp_sock, pp - pe->pe_paths);
+	sqe->user_data = UR_DATA(UR_CANCEL, 0, pp - pe->pe_paths);
+	uring_enter(ur, 0, 0, NULL, 0);
+}
+
+
+static struct uring_slot *
+uring_slot(struct probe_uring *ur, int idx)
+{
+	struct uring_slot **slots;
+
+	if (idx >= ur->ur_nslots) {
+		slots = realloc(ur->ur_slots, sizeof(*slots) * (idx + 1));
+		if (!slots)
+			return NULL;
+		memset(slots + ur->ur_nslots, 0,
+		       sizeof(*slots) * (idx + 1 - ur->ur_nslots));
+		ur->ur_slots = slots;
+		ur->ur_nslots = idx + 1;
+	}
+	if (!ur->ur_slots[idx])
+		ur->ur_slots[idx] = calloc(1, sizeof(struct uring_slot));
+	return ur->ur_slots[idx];
+}
+
+
+/**
+ * Queue an echo, linked to a timeout.  It is submitted by the next
+ * po_wait (or earlier, if the submission queue fills up).
+ */
+static int
+probe_uring_send(struct probe_engine *pe, struct probe_path *pp)
+{
+	struct probe_uring *ur = pe->pe_priv;
+	struct io_uring_sqe *sqe, *tsqe;
+	struct uring_slot *us;
+	int idx = (int)(pp - pe->pe_paths);
+
+	us = uring_slot(ur, idx);
+	if (!us || us->us_busy || (size_t)ICMP_MINLEN + pp->pp_size >
+	    sizeof(us->us_pkt) || ur->ur_params.sq_entries -
+	    (ur->ur_tail - __atomic_load_n(ur->ur_sq_head, __ATOMIC_ACQUIRE))
+	    < 2) {
+		/*
+		 * Last send still stuck, no room, or too big for the
+		 * slot: do it the old way
+		 */
+		return icmp_send_echo_size(pp->pp_sock, &pp->pp_addr,
+					   pe->pe_id, pp->pp_seq,
+					   pp->pp_size);
+	}
+
+	us->us_addr = pp->pp_addr;
+	us->us_iov.iov_base = us->us_pkt;
+	us->us_iov.iov_len = icmp_build_echo_size(us->us_pkt, pe->pe_id,
+						  pp->pp_seq, pp->pp_size ?
+						  pp->pp_size : ICMP_DATALEN);
+	memset(&us->us_msg, 0, sizeof(us->us_msg));
+	us->us_msg.msg_name = &us->us_addr;
+	us->us_msg.msg_namelen = sizeof(us->us_addr);
+	us->us_msg.msg_iov = &us->us_iov;
+	us->us_msg.msg_iovlen = 1;
+	/* The probe's own deadline; see probe_set_rto */
+	us->us_ts.tv_sec = pp->pp_timeout / 1000000;
+	us->us_ts.tv_nsec = (long long)(pp->pp_timeout % 1000000) * 1000;
+
+	sqe = uring_sqe(ur);
+	tsqe = uring_sqe(ur);
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = pp->pp_sock;
+	sqe->addr = (uint64_t)(uintptr_t)&us->us_msg;
+	sqe->len = 1;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = UR_DATA(UR_SEND, pp->pp_seq, idx);
+
+	tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+	tsqe->fd = -1;
+	tsqe->addr = (uint64_t)(uintptr_t)&us->us_ts;
+	tsqe->len = 1;
+	tsqe->user_data = UR_DATA(UR_LINKTO, pp->pp_seq, idx);
+
+	us->us_busy = 1;
+	return 0;
+}
+
+
+/**
+ * Process one completion.
+ *
+ * @return		1 if it completed a probe, 0 if not.
+ */
+static int
+uring_complete(struct probe_engine *pe, struct probe_uring *ur,
+	       struct io_uring_cqe *cqe, uint64_t now, int *recycled)
+{
+	struct probe_path *pp;
+	unsigned short bid;
+	int idx = UR_IDX(cqe->user_data), done = 0;
+
+	switch (UR_TYPE(cqe->user_data)) {
+	case UR_RECV:
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			bid = (unsigned short)(cqe->flags >>
+					       IORING_CQE_BUFFER_SHIFT);
+			if (cqe->res > 0)
+				done = probe_input(pe, ur->ur_bufs +
+						   (size_t)bid * URING_BUFSZ,
+						   (size_t)cqe->res, now);
+			uring_buf_recycle(ur, bid);
+			*recycled = 1;
+		}
+
+		if (cqe->flags & IORING_CQE_F_MORE)
+			break;
+		if (cqe->res == -ECANCELED)
+			break;
+		if (cqe->res == -EINVAL && ur->ur_multishot)
+			ur->ur_multishot = 0;
+		else if (cqe->res == -ENOBUFS)
+			++ur->ur_nobufs;
+
+		/* Rearm, unless the socket has gone away meanwhile */
+		if (idx >= pe->pe_npaths)
+			break;
+		pp = &pe->pe_paths[idx];
+		if (pp->pp_sock < 0 || !pp->pp_listen ||
+		    (uint32_t)(pp->pp_sock & 0xffffff) != UR_AUX(cqe->user_data))
+			break;
+		++ur->ur_rearms;
+		uring_arm_recv(ur, pp, idx);
+		break;
+
+	case UR_SEND:
+		if (idx < ur->ur_nslots && ur->ur_slots[idx])
+			ur->ur_slots[idx]->us_busy = 0;
+		if (cqe->res >= 0)
+			break;
+		/* Cancelled by its linked timeout: never went out in time */
+		errno = -cqe->res;
+		done = probe_fail(pe, idx, (uint16_t)UR_AUX(cqe->user_data),
+				  cqe->res == -ECANCELED ? PING_TIMEOUT :
+				  PING_ERRNO, now);
+		break;
+
+	case UR_WAKE:
+		ur->ur_wake_armed = 0;
+		if (cqe->res > 0 && pe->pe_wake_fd >= 0 &&
+		    (uint32_t)(pe->pe_wake_fd & 0xffffff) ==
+		    UR_AUX(cqe->user_data))
+			pe->pe_woken = 1;
+		break;
+
+	default:
+		/* UR_LINKTO, UR_CANCEL: nothing to do */
+		break;
+	}
+
+	return done;
+}
+
+
+/**
+ * Reap every completion currently in the queue.
+ */
+static int
+uring_reap(struct probe_engine *pe, struct probe_uring *ur)
+{
+	unsigned head, tail;
+	uint64_t now;
+	int done = 0, recycled = 0;
+
+	head = *ur->ur_cq_head;
+	tail = __atomic_load_n(ur->ur_cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return 0;
+
+	now = probe_now();
+	while (head != tail) {
+		done += uring_complete(pe, ur,
+				       &ur->ur_cqes[head & ur->ur_cq_mask],
+				       now, &recycled);
+		++head;
+		++ur->ur_cqes_seen;
+	}
+	__atomic_store_n(ur->ur_cq_head, head, __ATOMIC_RELEASE);
+
+	if (recycled)
+		uring_buf_commit(ur);
+	return done;
+}
+
+
+static int
+probe_uring_wait(struct probe_engine *pe, uint64_t now, uint64_t wake)
+{
+	struct probe_uring *ur = pe->pe_priv;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+	uint64_t usec;
+	int ret, done;
+
+	/* One-shot, so re-armed after it goes off */
+	if (pe->pe_wake_fd >= 0 && !ur->ur_wake_armed &&
+	    (sqe = uring_sqe(ur)) != NULL) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = pe->pe_wake_fd;
+		sqe->poll32_events = POLLIN;
+		sqe->user_data = UR_DATA(UR_WAKE, pe->pe_wake_fd, 0);
+		ur->ur_wake_armed = 1;
+	}
+
+	/* Anything already there can be had without a syscall */
+	done = uring_reap(pe, ur);
+	if (done && !ur->ur_queued)
+		return done;
+
+	usec = wake > now ? wake - now : 0;
+	if (done)
+		usec = 0;
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (long long)(usec % 1000000) * 1000;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+
+	ret = uring_enter(ur, usec ? 1 : 0,
+			  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			  &arg, sizeof(arg));
+	if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+		return -1;
+
+	return done + uring_reap(pe, ur);
+}
+
+
+static void
+probe_uring_stats(struct probe_engine *pe, char *buf, size_t len)
+{
+	struct probe_uring *ur = pe->pe_priv;
+
+	snprintf(buf, len, "uring: %llu enters, %llu completions, "
+		 "%llu rearms, %llu buffer shortages, multishot %s",
+		 (unsigned long long)ur->ur_enters,
+		 (unsigned long long)ur->ur_cqes_seen,
+		 (unsigned long long)ur->ur_rearms,
+		 (unsigned long long)ur->ur_nobufs,
+		 ur->ur_multishot ? "on" : "off");
+}
+
+
+const struct probe_ops probe_uring_ops = {
+	.po_name = "uring",
+	.po_sockrecv = 1,
+	.po_init = probe_uring_init,
+	.po_fini = probe_uring_fini,
+	.po_open = probe_uring_open,
+	.po_close = probe_uring_close,
+	.po_send = probe_uring_send,
+	.po_wait = probe_uring_wait,
+	.po_stats = probe_uring_stats,
+};
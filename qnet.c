@@ -7,26 +7,72 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <qnet_vote.h>
 
 #define DEFAULT_TOKEN 10000
 #define DEFAULT_INTERVAL 1000
-#define MIN_TOKEN 5000		/* Minimum token timeout (milliseconds) */
-#define MIN_INTERVAL 250	/* Ping interval minimum (milliseconds) */
+#define QNET_PORT 178		/* cman port for vote grades (-G) */
 
 
 static int allow_soft = 0;
 static int running = 1;
+static struct qnet_vote votes;
+static int claim_logged = -2;
+static volatile sig_atomic_t reload = 0;
 
 
 void
 usage(char *name, int retval)
 {
-	printf("usage: %s -a <host> [options]\n", name);
+	printf("usage: %s -a <host> | -c <file> [options]\n", name);
 	printf(" -s       Make one node + IP tiebreaker sufficient to \n");
 	printf("          form a quorum (DANGEROUS)\n");
 	printf(" -f       Do not fork\n");
 	printf(" -i <x>   Starting ping interval hint (milliseconds)\n");
 	printf(" -t <x>   Token timeout (milliseconds)\n");
+	printf(" -p <p>   Add a probe path to the tiebreaker; may be given\n");
+	printf("          up to %d times.  <p> is [dev=]<ifname>,\n",
+	       NET_MAX_PATHS);
+	printf("          src=<address>,mark=<fwmark>,dscp=<x>,prio=<x>,\n");
+	printf("          size=<bytes>,df,mtu=<bytes>,every=<n> (all\n");
+	printf("          optional; mtu= sends one full-size DF probe in\n");
+	printf("          every <n>, default 10)\n");
+	printf(" -A       Require all paths to answer (default: any)\n");
+	printf(" -G       Graded vote: trade tiebreaker link quality with\n");
+	printf("          the other nodes; when split, only the side with\n");
+	printf("          the better path may use the tiebreaker (with\n");
+	printf("          -s; -G alone never lets a lone node claim it)\n");
+	printf(" -n <p>   Probe the peer node at <p>, <address>[,<path\n");
+	printf("          options>], over a non-cluster network, to tell\n");
+	printf("          a dead peer from a network split; may be given\n");
+	printf("          up to %d times\n", NET_MAX_PATHS);
+	printf(" -D <x>   DSCP code point for probes (e.g. 48 = CS6)\n");
+	printf(" -P <x>   Socket priority for probes (qdisc band)\n");
+	printf(" -R <x>   Max probes/second per path (default: one per\n");
+	printf("          interval); backs off if ICMP is rate limited\n");
+	printf(" -b <x>   I/O backend: poll (default), select, epoll,\n");
+	printf("          uring (io_uring) or ring (AF_PACKET ring)\n");
+	printf(" -B <x>   Busy-poll for <x> usec around each expected\n");
+	printf("          reply (costs CPU; lowers RTT jitter)\n");
+	printf(" -W <x>   Probe timeout: <min>[,<max>] milliseconds,\n");
+	printf("          adapted to each path's RTT (default 20,1000);\n");
+	printf("          0[,<max>] for a fixed timeout\n");
+	printf(" -H <x>   Send each probe <copies>[,<spacing ms>] times\n");
+	printf("          (default 1; spacing 5); first reply counts\n");
+	printf(" -L <x>   Degraded above <loss %%>[,<p90 rtt ms>]\n");
+	printf("          (default 10,200; 0 turns a test off)\n");
+	printf(" -d       Treat a degraded tiebreaker as offline when\n");
+	printf("          deciding quorum\n");
+	printf(" -c <f>   Read settings from file <f>; reread on SIGHUP\n");
+	printf("          or when the file changes\n");
+	printf(" -T <f>   Record every probe outcome to trace file <f>\n");
+	printf(" -r <f>   Replay trace file <f> through the tiebreaker\n");
+	printf("          logic with these settings, then exit\n");
+	printf(" -X <x>   Replay at <x> times real time (default: as\n");
+	printf("          fast as possible)\n");
 	exit(retval);
 }
 
@@ -38,6 +84,20 @@ sigusr1_handler(int sig)
 }
 
 
+void
+sigusr2_handler(int sig __attribute__((unused)))
+{
+	net_tiebreaker_dump();
+}
+
+
+void
+hup_handler(int sig __attribute__((unused)))
+{
+	reload = 1;
+}
+
+
 void
 exit_handler(int sig)
 {
@@ -45,6 +105,62 @@ exit_handler(int sig)
 }
 
 
+/**
+  Watch the configuration file's directory, since editors tend to
+  replace the file rather than write to it.
+
+  @return		inotify descriptor, or -1.
+ */
+int
+config_watch(char *file)
+{
+	char *dir, *slash;
+	int fd;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	dir = strdup(file);
+	slash = dir ? strrchr(dir, '/') : NULL;
+	if (slash)
+		slash[slash == dir] = 0;
+	if (!dir || inotify_add_watch(fd, slash ? dir : ".",
+				      IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	free(dir);
+	return fd;
+}
+
+
+/**
+  Did the configuration file change?  Reads every pending event.
+ */
+int
+config_changed(int fd, char *file)
+{
+	char buf[4096] __attribute__((aligned(8)));
+	const struct inotify_event *ev;
+	char *base, *p;
+	ssize_t len;
+	int ret = 0;
+
+	base = strrchr(file, '/');
+	base = base ? base + 1 : file;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->len && !strcmp(ev->name, base))
+				ret = 1;
+		}
+	}
+	return ret;
+}
+
+
 int
 node_count(cman_handle_t ch)
 {
@@ -74,17 +190,89 @@ node_count(cman_handle_t ch)
 }
 
 
+/**
+  Classify the loss of a member by what the peer paths see: if the peer
+  still answers over some other network, the cluster network split; if
+  it answers nowhere, it is most likely dead.
+ */
+void
+log_member_loss(int was, int now)
+{
+	const char *why;
+
+	switch (net_tiebreaker_peer()) {
+	case NET_PEER_UP:
+		why = "network partition (peer still reachable)";
+		break;
+	case NET_PEER_DOWN:
+		why = "peer down (unreachable on every path)";
+		break;
+	default:
+		why = "unknown";
+		break;
+	}
+
+	syslog(LOG_NOTICE, "QNet: Members %d -> %d: %s\n", was, now, why);
+	printf("QNet: Members %d -> %d: %s\n", was, now, why);
+}
+
+
+void
+vote_recv(cman_handle_t ch __attribute__((unused)),
+	  void *priv __attribute__((unused)), char *buf, int len,
+	  uint8_t port __attribute__((unused)),
+	  int nodeid __attribute__((unused)))
+{
+	qv_receive(&votes, buf, len);
+}
+
+
+/**
+  May a lone node use the tiebreaker's vote?  With graded votes, only if
+  it beats every peer it traded grades with; see qnet_vote.c.  Until it
+  has heard from one, soft decides.  This only ever narrows -s: without
+  it, a lone node never claims the vote, graded or not.
+ */
+int
+graded_claim(int soft)
+{
+	int ret, grade = 0, peer_grade = 0, peer = 0;
+
+	ret = qv_wins(&votes, &grade, &peer_grade, &peer);
+	if (ret != claim_logged && ret >= 0) {
+		syslog(LOG_NOTICE, "QNet: Split; tiebreaker vote %s (grade "
+		       "%d vs %d from node %d)\n", ret ? "claimed" : "ceded",
+		       grade, peer_grade, peer);
+		printf("QNet: Split; tiebreaker vote %s (grade %d vs %d from "
+		       "node %d)\n", ret ? "claimed" : "ceded", grade,
+		       peer_grade, peer);
+	}
+	claim_logged = ret;
+
+	return ret < 0 ? soft : ret;
+}
+
+
 int
 main(int argc, char **argv)
 {
-	char *ip_addr = NULL;
+	char *ip_addr = NULL, *trace = NULL, *replay = NULL, *config = NULL;
+	double speed = 0, rate;
+	char *end;
+	long num;
 	int op;
-	int allow_soft = 0, quorum = 0, count = 0, have_net;
+	int allow_soft = 0, quorum = 0, count = 0, have_net, last_count = 0;
+	int graded = 0, len, watch = -1, gray_offline = 0;
+	struct pollfd pfd;
+	struct qv_msg msg;
+	cman_node_t us;
+	int dscp = 0, priority = 0;
 	int x, token = DEFAULT_TOKEN, interval = DEFAULT_INTERVAL, errors = 0;
 	pthread_t thread;
 	cman_handle_t ch;
 
-	while ((op = getopt(argc, argv, "a:t:i:sfh?")) != EOF) {
+	while ((op = getopt(argc, argv, "a:t:i:p:n:AGD:P:R:b:B:W:H:L:d"
+				 "c:T:r:X:sfh?")) != EOF) {
 		switch(op) {
 		case 'a':
 			ip_addr = strdup(optarg);
@@ -105,6 +293,110 @@ main(int argc, char **argv)
 				errors++;
 			}
 			break;
+		case 'p':
+			if (net_tiebreaker_add_path(optarg) < 0) {
+				printf("Invalid probe path '%s'\n", optarg);
+				errors++;
+			}
+			break;
+		case 'n':
+			if (net_tiebreaker_add_peer(optarg) < 0) {
+				printf("Invalid peer path '%s'\n", optarg);
+				errors++;
+			}
+			break;
+		case 'A':
+			net_tiebreaker_policy(1);
+			break;
+		case 'G':
+			graded = 1;
+			break;
+		case 'D':
+			num = strtol(optarg, &end, 0);
+			if (*end || end == optarg || num < 0 || num > 63) {
+				printf("DSCP must be between 0 and 63\n");
+				errors++;
+				break;
+			}
+			dscp = (int)num;
+			break;
+		case 'P':
+			num = strtol(optarg, &end, 0);
+			if (*end || end == optarg || num < 0 ||
+			    num > 0x7fffffffL) {
+				printf("Priority must be a number, at "
+				       "least 0\n");
+				errors++;
+				break;
+			}
+			priority = (int)num;
+			break;
+		case 'R':
+			rate = strtod(optarg, &end);
+			if (*end || end == optarg || rate < 0) {
+				printf("Probe rate must be a number, at "
+				       "least 0\n");
+				errors++;
+				break;
+			}
+			net_tiebreaker_rate(rate);
+			break;
+		case 'b':
+			if (net_tiebreaker_backend(optarg) < 0) {
+				printf("Unknown backend '%s'\n", optarg);
+				errors++;
+			}
+			break;
+		case 'B':
+			num = strtol(optarg, &end, 0);
+			if (*end || end == optarg || num < 0 ||
+			    num > 0x7fffffffL) {
+				printf("Busy poll time must be at least "
+				       "0us\n");
+				errors++;
+				break;
+			}
+			net_tiebreaker_busy_poll((int)num);
+			break;
+		case 'W':
+			if (net_tiebreaker_timeout(optarg) < 0) {
+				printf("Invalid probe timeout '%s'\n", optarg);
+				errors++;
+			}
+			break;
+		case 'L':
+			if (net_tiebreaker_gray(optarg) < 0) {
+				printf("Invalid degraded thresholds '%s'\n",
+				       optarg);
+				errors++;
+			}
+			break;
+		case 'd':
+			gray_offline = 1;
+			break;
+		case 'H':
+			if (net_tiebreaker_hedge(optarg) < 0) {
+				printf("Invalid hedging '%s'\n", optarg);
+				errors++;
+			}
+			break;
+		case 'c':
+			config = optarg;
+			break;
+		case 'T':
+			trace = optarg;
+			break;
+		case 'r':
+			replay = optarg;
+			break;
+		case 'X':
+			speed = strtod(optarg, &end);
+			if (*end || end == optarg || speed < 0) {
+				printf("Replay speed must be a number, at "
+				       "least 0\n");
+				errors++;
+			}
+			break;
 		case 's':
 			allow_soft = 1;
 			break;
@@ -114,11 +406,22 @@ main(int argc, char **argv)
 		}
 	}
 
-	if (!ip_addr)
+	if (!ip_addr && !replay && !config)
+		++errors;
+	if (trace && replay)
 		++errors;
 	if (errors)
 		usage(argv[0], 1);
 
+	if (replay) {
+		if (net_tiebreaker_replay(replay, speed, token * 1000,
+					  interval * 1000) < 0) {
+			perror(replay);
+			return 1;
+		}
+		return 0;
+	}
+
 	if (geteuid() != 0) {
 		printf("You are not root.\n");
 		return 1;
@@ -134,8 +437,46 @@ main(int argc, char **argv)
 	signal(SIGQUIT, exit_handler);
 	signal(SIGTERM, exit_handler);
 	signal(SIGUSR1, sigusr1_handler);
+	signal(SIGUSR2, sigusr2_handler);
+	signal(SIGHUP, hup_handler);
+
+	if (trace && net_tiebreaker_trace(trace) < 0) {
+		perror(trace);
+		return 1;
+	}
+
+	if (graded) {
+		if (cman_get_node(ch, CMAN_NODEID_US, &us) < 0 ||
+		    cman_start_recv_data(ch, vote_recv, QNET_PORT) < 0) {
+			perror("cman");
+			return 1;
+		}
+		/* A new epoch every start; see qnet_vote.c */
+		qv_init(&votes, us.cn_nodeid, (uint32_t)time(NULL) ^
+			((uint32_t)getpid() << 16));
+	}
 
-	net_tiebreaker_init(ip_addr, token * 1000, interval * 1000);
+	if (net_tiebreaker_marking(dscp, priority) < 0) {
+		perror("marking");
+		return 1;
+	}
+	if (ip_addr)
+		x = net_tiebreaker_init(ip_addr, token * 1000,
+					interval * 1000);
+	else
+		x = net_tiebreaker_timing(token * 1000, interval * 1000);
+	if (x < 0) {
+		printf("Ping interval %dms does not fit token %dms\n",
+		       interval, token);
+		return 1;
+	}
+	if (config) {
+		if (net_tiebreaker_load(config) < 0) {
+			perror(config);
+			return 1;
+		}
+		watch = config_watch(config);
+	}
 	net_create_quorum_thread(&thread);
 	if (cman_register_quorum_device(ch, "QNet", 1) < 0) {
 		printf("CMAN registration failed...!?\n");
@@ -143,17 +484,54 @@ main(int argc, char **argv)
 	}
 
 	while (running) {
-		usleep(interval*1000);
+		/* A reload may have changed it */
+		interval = net_tiebreaker_interval();
+		if (watch >= 0) {
+			pfd.fd = watch;
+			pfd.events = POLLIN;
+			poll(&pfd, 1, interval);
+		} else {
+			usleep(interval*1000);
+		}
+
+		if (config && (reload || (watch >= 0 &&
+					  config_changed(watch, config)))) {
+			reload = 0;
+			if (net_tiebreaker_load(config) < 0) {
+				syslog(LOG_ERR, "QNet: Keeping the old "
+				       "configuration\n");
+				printf("QNet: Keeping the old configuration\n");
+			}
+		}
 		quorum = cman_is_quorate(ch);
 		count = node_count(ch);
 		have_net = net_tiebreaker();
+		/* A brownout: do not wait for it to become a blackout */
+		if (gray_offline && have_net &&
+		    net_tiebreaker_state() == NET_TB_DEGRADED)
+			have_net = 0;
+
+		if (graded) {
+			cman_dispatch(ch, CMAN_DISPATCH_ALL);
+			len = qv_message(&votes, net_tiebreaker_grade(), &msg);
+			cman_send_data(ch, &msg, len, 0, QNET_PORT, 0);
+			if (count != 1)
+				claim_logged = -2;
+		}
+
+		/* Say why a member left, if the peer paths can tell */
+		if (count < last_count)
+			log_member_loss(last_count, count);
+		last_count = count;
 
 		if (!quorum) {
-			if (have_net && count == 1 && allow_soft) {
+			if (have_net && count == 1 &&
+			    allow_soft && (!graded || graded_claim(1))) {
 				quorum = 1;
 			}
 		} else {
-			if (!have_net && count == 1) {
+			if (count == 1 &&
+			    (!have_net || (graded && !graded_claim(1)))) {
 				quorum = 0;
 				/* take some action for loss of quorum */
 			}
@@ -0,0 +1,556 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * C++20 coroutine interface to libqnetping.  Header only; link with
+ * libqnetping.
+ *
+ *	qnet::Task check(qnet::Prober &p, sockaddr_in addr)
+ *	{
+ *		qnet::PingResult r = co_await p.ping(addr, 200ms);
+ *		if (r)
+ *			printf("%lld usec\n", (long long)r.rtt().count());
+ *	}
+ *
+ *	qnet::Prober p;
+ *	for (auto &a : addrs)
+ *		check(p, a);
+ *	p.run();
+ *
+ * A Prober owns one socket and echo identifier and can have up to 65536
+ * pings outstanding, all driven from the thread which calls run() (or
+ * poll(), or dispatch() from an existing event loop).  Each outstanding
+ * ping lives in the awaiting coroutine's frame; the Prober itself only
+ * keeps pointers to them, in a sequence number table allocated once and
+ * a deadline heap, so starting a ping does not allocate.
+ */
+#ifndef __QNET_PROBER_HPP
+#define __QNET_PROBER_HPP
+
+#include <probe.h>
+#include <poll.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace qnet {
+
+using Clock = std::chrono::steady_clock;	/* CLOCK_MONOTONIC */
+
+class Prober;
+
+
+/**
+ * Outcome of one ping.  Move-only, so that a result is handled in one
+ * place.
+ */
+class PingResult {
+public:
+	PingResult() = default;
+	PingResult(int32_t result, std::chrono::microseconds rtt,
+		   const sockaddr_in &addr, int err)
+		: rs_result(result), rs_rtt(rtt), rs_addr(addr), rs_errno(err)
+	{
+	}
+	PingResult(const PingResult &) = delete;
+	PingResult &operator=(const PingResult &) = delete;
+	PingResult(PingResult &&) = default;
+	PingResult &operator=(PingResult &&) = default;
+
+	/** PING_SUCCESS, PING_TIMEOUT, ..., or PING_ERRNO (see error()) */
+	int32_t result() const { return rs_result; }
+	bool ok() const { return rs_result == PING_SUCCESS; }
+	explicit operator bool() const { return ok(); }
+
+	/** Round trip time; zero unless ok() */
+	std::chrono::microseconds rtt() const { return rs_rtt; }
+	const sockaddr_in &addr() const { return rs_addr; }
+
+	/** errno, if result() is PING_ERRNO */
+	int error() const { return rs_errno; }
+
+	const char *
+	strerror(char *buf, size_t len) const
+	{
+		if (rs_result == PING_ERRNO)
+			errno = rs_errno;
+		return icmp_ping_strerror_r(rs_result, buf, len);
+	}
+
+private:
+	int32_t				rs_result = PING_ERRNO;
+	std::chrono::microseconds	rs_rtt{0};
+	sockaddr_in			rs_addr{};
+	int				rs_errno = 0;
+};
+
+
+/**
+ * Awaitable returned by Prober::ping().  The echo is sent when the
+ * coroutine suspends on it, and the coroutine is resumed (from
+ * Prober::dispatch) with the reply, the ICMP error which quoted the
+ * echo, or PING_TIMEOUT at the deadline.  Not copyable or movable: the
+ * Prober points at it while it is outstanding.
+ */
+class PingAwaiter {
+public:
+	PingAwaiter(const PingAwaiter &) = delete;
+	PingAwaiter &operator=(const PingAwaiter &) = delete;
+
+	bool await_ready() const noexcept { return false; }
+	inline bool await_suspend(std::coroutine_handle<> h) noexcept;
+
+	PingResult
+	await_resume() noexcept
+	{
+		return PingResult(pa_result, pa_rtt, pa_addr, pa_errno);
+	}
+
+private:
+	friend class Prober;
+
+	PingAwaiter(Prober *p, const sockaddr_in &addr, Clock::time_point dl)
+		: pa_prober(p), pa_addr(addr), pa_deadline(dl)
+	{
+	}
+
+	Prober			*pa_prober;
+	sockaddr_in		pa_addr;
+	Clock::time_point	pa_deadline;
+	Clock::time_point	pa_sent;
+	std::coroutine_handle<>	pa_handle;
+	uint16_t		pa_seq = 0;
+	size_t			pa_heap = 0;	/* index in pr_heap */
+	PingAwaiter		*pa_next = nullptr; /* completed list */
+	int32_t			pa_result = PING_ERRNO;
+	std::chrono::microseconds pa_rtt{0};
+	int			pa_errno = 0;
+};
+
+
+/**
+ * A pinger: one raw ICMP socket, one echo identifier, and every ping
+ * outstanding on it.  Constructing one needs CAP_NET_RAW and throws
+ * std::system_error if the socket cannot be opened.  A Prober must
+ * outlive the pings started on it; pings still outstanding when it is
+ * destroyed are never resumed.  Not thread-safe; use one per thread.
+ */
+class Prober {
+public:
+	static constexpr size_t SEQS = 65536;
+
+	/**
+	 * @param opts		Socket options, or NULL for the default route.
+	 * @param depth		How many pings are expected to be in flight
+	 *			at once; the receive buffer is sized to hold
+	 *			that many replies, should they all arrive
+	 *			together.
+	 */
+	explicit
+	Prober(const struct icmp_opts *opts = nullptr, size_t depth = 256)
+		: pr_slots(new PingAwaiter *[SEQS]())
+	{
+		int want = (int)(std::min(depth, SEQS) * PROBE_TRUESIZE / 2);
+
+		pr_sock = icmp_socket_opts(opts);
+		if (pr_sock < 0)
+			throw std::system_error(errno, std::system_category(),
+						"icmp_socket_opts");
+		if (fcntl(pr_sock, F_SETFL,
+			  fcntl(pr_sock, F_GETFL) | O_NONBLOCK) < 0) {
+			int err = errno;
+
+			net_icmp_close(pr_sock);
+			throw std::system_error(err, std::system_category(),
+						"fcntl");
+		}
+		/* The kernel doubles this for its own overhead */
+		if (setsockopt(pr_sock, SOL_SOCKET, SO_RCVBUFFORCE, &want,
+			       sizeof(want)) < 0)
+			setsockopt(pr_sock, SOL_SOCKET, SO_RCVBUF, &want,
+				   sizeof(want));
+		pr_id = icmp_alloc_id();
+		pr_heap.reserve(std::min(depth, SEQS));
+		pr_stats = qnet_ping_stats();
+		pr_stats.qs_rtt_min = (uint32_t)-1;
+	}
+
+	~Prober()
+	{
+		net_icmp_close(pr_sock);
+	}
+
+	Prober(const Prober &) = delete;
+	Prober &operator=(const Prober &) = delete;
+
+	/**
+	 * Ping addr; co_await the result.
+	 *
+	 * @param addr		Address to ping.
+	 * @param deadline	When to give up and report PING_TIMEOUT.
+	 */
+	PingAwaiter
+	ping(const sockaddr_in &addr, Clock::time_point deadline)
+	{
+		return PingAwaiter(this, addr, deadline);
+	}
+
+	template <class Rep, class Period>
+	PingAwaiter
+	ping(const sockaddr_in &addr,
+	     std::chrono::duration<Rep, Period> timeout)
+	{
+		return PingAwaiter(this, addr, Clock::now() +
+			std::chrono::duration_cast<Clock::duration>(timeout));
+	}
+
+	/** For an outside event loop: wait for this to become readable */
+	int fd() const { return pr_sock; }
+
+	/** Pings outstanding */
+	size_t pending() const { return pr_heap.size(); }
+
+	/** Earliest deadline of an outstanding ping; max() if none */
+	Clock::time_point
+	next_deadline() const
+	{
+		return pr_heap.empty() ? Clock::time_point::max() :
+					 pr_heap[0]->pa_deadline;
+	}
+
+	const struct qnet_ping_stats &stats() const { return pr_stats; }
+
+	inline int dispatch();
+	inline int poll(Clock::time_point until);
+	inline int run();
+
+private:
+	friend class PingAwaiter;
+
+	inline bool start(PingAwaiter *pa);
+	inline void input(const struct icmp_reply *reply,
+			  Clock::time_point now);
+	inline void complete(PingAwaiter *pa, int32_t result,
+			     Clock::time_point now);
+	inline void heap_up(size_t i);
+	inline void heap_down(size_t i);
+	inline void heap_remove(PingAwaiter *pa);
+	void
+	heap_set(size_t i, PingAwaiter *pa)
+	{
+		pr_heap[i] = pa;
+		pa->pa_heap = i;
+	}
+
+	int32_t				pr_sock;
+	uint16_t			pr_id;
+	uint16_t			pr_seq = 0;	/* next to try */
+	std::unique_ptr<PingAwaiter *[]> pr_slots;	/* by sequence # */
+	std::vector<PingAwaiter *>	pr_heap;	/* by deadline */
+	PingAwaiter			*pr_done = nullptr;
+	struct qnet_ping_stats		pr_stats;
+};
+
+
+/**
+ * Fire-and-forget coroutine type, for callers which do not have their
+ * own.  Starts running straight away and frees its frame when it
+ * returns.
+ */
+struct Task {
+	struct promise_type {
+		Task get_return_object() noexcept { return Task(); }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+
+bool
+PingAwaiter::await_suspend(std::coroutine_handle<> h) noexcept
+{
+	pa_handle = h;
+	/* On failure the result is already set; carry on without waiting */
+	return pa_prober->start(this);
+}
+
+
+/**
+ * Send the echo for pa and file it.  Sequence numbers are handed out
+ * round-robin, skipping any still outstanding.
+ */
+bool
+Prober::start(PingAwaiter *pa)
+{
+	size_t x;
+
+	for (x = 0; x < SEQS && pr_slots[pr_seq]; x++)
+		++pr_seq;
+	if (x == SEQS) {
+		pa->pa_errno = EBUSY;
+		++pr_stats.qs_errors;
+		return false;
+	}
+
+	pa->pa_seq = pr_seq++;
+	pa->pa_sent = Clock::now();
+	if (icmp_send_echo(pr_sock, &pa->pa_addr, pr_id, pa->pa_seq) < 0) {
+		pa->pa_errno = errno;
+		++pr_stats.qs_errors;
+		return false;
+	}
+	++pr_stats.qs_sent;
+
+	pr_slots[pa->pa_seq] = pa;
+	pr_heap.push_back(pa);
+	heap_set(pr_heap.size() - 1, pa);
+	heap_up(pa->pa_heap);
+	return true;
+}
+
+
+/**
+ * Take pa off the books and queue it to be resumed.  Coroutines are
+ * resumed only once dispatch() is done with the socket and the heap,
+ * since they will usually start another ping straight away.
+ */
+void
+Prober::complete(PingAwaiter *pa, int32_t result, Clock::time_point now)
+{
+	uint32_t rtt;
+
+	pr_slots[pa->pa_seq] = nullptr;
+	heap_remove(pa);
+	pa->pa_result = result;
+
+	switch(result) {
+	case PING_SUCCESS:
+		pa->pa_rtt = std::chrono::duration_cast<
+				std::chrono::microseconds>(now - pa->pa_sent);
+		rtt = (uint32_t)pa->pa_rtt.count();
+		++pr_stats.qs_received;
+		pr_stats.qs_rtt_total += rtt;
+		if (rtt < pr_stats.qs_rtt_min)
+			pr_stats.qs_rtt_min = rtt;
+		if (rtt > pr_stats.qs_rtt_max)
+			pr_stats.qs_rtt_max = rtt;
+		break;
+	case PING_TIMEOUT:
+		++pr_stats.qs_timeouts;
+		break;
+	default:
+		++pr_stats.qs_errors;
+		break;
+	}
+
+	pa->pa_next = pr_done;
+	pr_done = pa;
+}
+
+
+/**
+ * Match one ICMP message to the ping it answers: echo replies on id,
+ * sequence number and source, errors on the echo they quote.
+ */
+void
+Prober::input(const struct icmp_reply *reply, Clock::time_point now)
+{
+	PingAwaiter *pa;
+	struct in_addr dst;
+	uint16_t id, seq;
+	int32_t result;
+
+	if (reply->ir_type == ICMP_ECHOREPLY) {
+		dst = reply->ir_from;
+		id = reply->ir_id;
+		seq = reply->ir_seq;
+		result = PING_SUCCESS;
+	} else if (reply->ir_quoted) {
+		dst = reply->ir_orig_dst;
+		id = reply->ir_orig_id;
+		seq = reply->ir_orig_seq;
+		result = icmp_classify(reply);
+		if (result == PING_REDIRECT)
+			return;
+	} else {
+		return;
+	}
+
+	if (id != pr_id)
+		return;
+	pa = pr_slots[seq];
+	if (!pa || pa->pa_addr.sin_addr.s_addr != dst.s_addr)
+		return;
+
+	complete(pa, result, now);
+}
+
+
+/**
+ * Process whatever has arrived, time out pings whose deadline has
+ * passed, then resume the coroutines which were waiting on them.  Does
+ * not block.
+ *
+ * @return		Pings completed, or -1 on error (errno set).
+ */
+int
+Prober::dispatch()
+{
+	struct icmp_reply reply;
+	Clock::time_point now;
+	PingAwaiter *pa;
+	int32_t x;
+	int done = 0;
+
+	now = Clock::now();
+	while ((x = icmp_recv(pr_sock, &reply)) >= 0) {
+		if (x == PING_SUCCESS)
+			input(&reply, now);
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		return -1;
+
+	while (!pr_heap.empty() && pr_heap[0]->pa_deadline <= now)
+		complete(pr_heap[0], PING_TIMEOUT, now);
+
+	while (pr_done) {
+		pa = pr_done;
+		pr_done = pa->pa_next;
+		++done;
+		/* pa is gone once its coroutine runs */
+		pa->pa_handle.resume();
+	}
+
+	return done;
+}
+
+
+/**
+ * Wait until a reply arrives, the next deadline passes, or until,
+ * whichever is first, then dispatch().
+ *
+ * @param until		Latest time to return.
+ * @return		Pings completed, or -1 on error (errno set).
+ */
+int
+Prober::poll(Clock::time_point until)
+{
+	struct pollfd pfd;
+	struct timespec ts, *tsp = nullptr;
+	Clock::time_point wake = std::min(until, next_deadline());
+	Clock::duration left;
+
+	if (wake != Clock::time_point::max()) {
+		left = wake - Clock::now();
+		if (left < Clock::duration::zero())
+			left = Clock::duration::zero();
+		auto ns = std::chrono::duration_cast<
+				std::chrono::nanoseconds>(left).count();
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		tsp = &ts;
+	}
+
+	pfd.fd = pr_sock;
+	pfd.events = POLLIN;
+	if (::ppoll(&pfd, 1, tsp, nullptr) < 0 && errno != EINTR)
+		return -1;
+
+	return dispatch();
+}
+
+
+/**
+ * Drive pings until none are outstanding, including any which the
+ * resumed coroutines start.
+ *
+ * @return		0, or -1 on error (errno set).
+ */
+int
+Prober::run()
+{
+	while (!pr_heap.empty() || pr_done) {
+		if (poll(Clock::time_point::max()) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+
+void
+Prober::heap_up(size_t i)
+{
+	PingAwaiter *pa = pr_heap[i];
+	size_t parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (pr_heap[parent]->pa_deadline <= pa->pa_deadline)
+			break;
+		heap_set(i, pr_heap[parent]);
+		i = parent;
+	}
+	heap_set(i, pa);
+}
+
+
+void
+Prober::heap_down(size_t i)
+{
+	PingAwaiter *pa = pr_heap[i];
+	size_t n = pr_heap.size(), child;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n && pr_heap[child + 1]->pa_deadline <
+				     pr_heap[child]->pa_deadline)
+			++child;
+		if (pa->pa_deadline <= pr_heap[child]->pa_deadline)
+			break;
+		heap_set(i, pr_heap[child]);
+		i = child;
+	}
+	heap_set(i, pa);
+}
+
+
+void
+Prober::heap_remove(PingAwaiter *pa)
+{
+	size_t i = pa->pa_heap;
+	PingAwaiter *last = pr_heap.back();
+
+	pr_heap.pop_back();
+	if (last == pa)
+		return;
+	heap_set(i, last);
+	heap_up(i);
+	heap_down(last->pa_heap);
+}
+
+} /* namespace qnet */
+
+#endif
@@ -0,0 +1,270 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Graded tiebreaker votes, and which side of a split gets to use one.
+ *
+ * Both sides of a split may see the tiebreaker perfectly well, so
+ * nothing measured on one side alone can keep both from claiming its
+ * vote.  Instead, the nodes trade vote grades while they can still talk,
+ * and after a split a node claims the vote only if it beats every peer
+ * on what it knows of them, highest grade winning and the lower node ID
+ * breaking ties.
+ *
+ * Knowledge is never quite current: our latest grade may or may not
+ * have reached a peer.  So a node credits itself with the lowest grade
+ * it has sent since the last one a peer confirmed having, and credits
+ * the peer with the latest grade it has from that peer.  The peer's own
+ * credit can be no higher than that grade, since the grade is among the
+ * ones the peer takes the lowest of.  If both A and B claimed, then:
+ *
+ *	A's credit > B's grade as A has it >= B's credit
+ *	B's credit > A's grade as B has it >= A's credit
+ *
+ * (ties going by node ID), which cannot both hold.
+ *
+ * The lowest grade sent since a peer's last confirmation is kept as a
+ * running minimum, so a node left alone for however long still knows
+ * it.  When a confirmation comes in, the minimum is worked out again
+ * from the grades remembered since the confirmed one, or if that was
+ * too long ago, left as it is: lower than it need be, never higher.
+ *
+ * Every start of qnet is a new epoch, and sequence numbers start again.
+ * A peer's messages from a new epoch wipe what we knew of it, and
+ * confirmations of our messages count only if they are for our current
+ * epoch.
+ */
+
+#include <qnet_vote.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <string.h>
+
+
+/**
+ * Set up the vote state.
+ *
+ * @param qv		Vote state.
+ * @param nodeid	Our node ID.
+ * @param epoch		Different each time qnet starts.
+ */
+void
+qv_init(struct qnet_vote *qv, int nodeid, uint32_t epoch)
+{
+	memset(qv, 0, sizeof(*qv));
+	qv->qv_nodeid = nodeid;
+	qv->qv_epoch = epoch;
+}
+
+
+static struct qv_peer *
+qv_peer(struct qnet_vote *qv, int nodeid, int add)
+{
+	struct qv_peer *vp;
+	int x;
+
+	for (x = 0; x < qv->qv_npeers; x++) {
+		if (qv->qv_peers[x].vp_nodeid == nodeid)
+			return &qv->qv_peers[x];
+	}
+	if (!add || qv->qv_npeers >= QV_MAX_PEERS)
+		return NULL;
+
+	vp = &qv->qv_peers[qv->qv_npeers++];
+	memset(vp, 0, sizeof(*vp));
+	vp->vp_nodeid = nodeid;
+	return vp;
+}
+
+
+/**
+ * Build the next message to broadcast, and remember the grade in it.
+ *
+ * @param qv		Vote state.
+ * @param grade		Our current grade (net_tiebreaker_grade).
+ * @param msg		Filled in.
+ * @return		Length of the message.
+ */
+int
+qv_message(struct qnet_vote *qv, int grade, struct qv_msg *msg)
+{
+	int x;
+
+	++qv->qv_seq;
+	qv->qv_sent[qv->qv_seq % QV_HISTORY] = (uint8_t)grade;
+	for (x = 0; x < qv->qv_npeers; x++) {
+		if (grade < qv->qv_peers[x].vp_low)
+			qv->qv_peers[x].vp_low = grade;
+	}
+
+	msg->qm_magic = htonl(QV_MAGIC);
+	msg->qm_nodeid = htonl((uint32_t)qv->qv_nodeid);
+	msg->qm_epoch = htonl(qv->qv_epoch);
+	msg->qm_seq = htonl(qv->qv_seq);
+	msg->qm_grade = htonl((uint32_t)grade);
+	msg->qm_nacks = htonl((uint32_t)qv->qv_npeers);
+	for (x = 0; x < qv->qv_npeers; x++) {
+		msg->qm_acks[x].qa_nodeid =
+			htonl((uint32_t)qv->qv_peers[x].vp_nodeid);
+		msg->qm_acks[x].qa_epoch = htonl(qv->qv_peers[x].vp_epoch);
+		msg->qm_acks[x].qa_seq = htonl(qv->qv_peers[x].vp_seq);
+	}
+
+	return (int)(offsetof(struct qv_msg, qm_acks) +
+		     qv->qv_npeers * sizeof(struct qv_ack));
+}
+
+
+/**
+ * A peer has confirmed our message seq: work out the lowest grade we
+ * have sent since.  If it is too far back to remember, the minimum we
+ * kept since the last confirmation covers it; without one, we cannot
+ * tell and wait for the next.
+ */
+static void
+qv_ack(struct qnet_vote *qv, struct qv_peer *vp, uint32_t seq)
+{
+	int low;
+
+	if (qv->qv_seq - seq >= QV_HISTORY) {
+		if (vp->vp_has_ack)
+			vp->vp_acked = seq;
+		return;
+	}
+
+	vp->vp_acked = seq;
+	vp->vp_has_ack = 1;
+	low = qv->qv_sent[seq % QV_HISTORY];
+	for (++seq; seq <= qv->qv_seq; seq++) {
+		if (qv->qv_sent[seq % QV_HISTORY] < low)
+			low = qv->qv_sent[seq % QV_HISTORY];
+	}
+	vp->vp_low = low;
+}
+
+
+/**
+ * Take in a peer's message.  Stale and duplicate messages are ignored.
+ *
+ * @return		0, or -1 if it was not a valid message.
+ */
+int
+qv_receive(struct qnet_vote *qv, const void *buf, int len)
+{
+	const struct qv_msg *msg = buf;
+	struct qv_peer *vp;
+	uint32_t seq, epoch, nacks, x;
+	int nodeid;
+
+	if (len < (int)offsetof(struct qv_msg, qm_acks) ||
+	    ntohl(msg->qm_magic) != QV_MAGIC)
+		return -1;
+	nacks = ntohl(msg->qm_nacks);
+	if (nacks > QV_MAX_PEERS ||
+	    len < (int)(offsetof(struct qv_msg, qm_acks) +
+			nacks * sizeof(struct qv_ack)))
+		return -1;
+
+	nodeid = (int)ntohl(msg->qm_nodeid);
+	if (nodeid == qv->qv_nodeid)
+		return 0;
+	vp = qv_peer(qv, nodeid, 1);
+	if (!vp)
+		return -1;
+
+	/* Restarted: it knows nothing of us, nor we of it */
+	epoch = ntohl(msg->qm_epoch);
+	if (epoch != vp->vp_epoch) {
+		vp->vp_epoch = epoch;
+		vp->vp_seq = 0;
+		vp->vp_acked = 0;
+		vp->vp_has_ack = 0;
+	}
+
+	seq = ntohl(msg->qm_seq);
+	if (seq <= vp->vp_seq)
+		return 0;
+	vp->vp_seq = seq;
+	vp->vp_grade = (int)ntohl(msg->qm_grade);
+
+	for (x = 0; x < nacks; x++) {
+		if ((int)ntohl(msg->qm_acks[x].qa_nodeid) != qv->qv_nodeid ||
+		    ntohl(msg->qm_acks[x].qa_epoch) != qv->qv_epoch)
+			continue;
+		seq = ntohl(msg->qm_acks[x].qa_seq);
+		if (seq && seq <= qv->qv_seq &&
+		    (!vp->vp_has_ack || seq > vp->vp_acked))
+			qv_ack(qv, vp, seq);
+	}
+
+	return 0;
+}
+
+
+/**
+ * The lowest grade we have sent since the last one this peer confirmed;
+ * what the peer might hold us to.  0 if it never confirmed one.
+ */
+static int
+qv_credit(struct qv_peer *vp)
+{
+	return vp->vp_has_ack ? vp->vp_low : 0;
+}
+
+
+/**
+ * Do we get the tiebreaker vote, with the peers we traded grades with
+ * gone?  Only meaningful after a split; while the peers are around,
+ * everybody gets it.
+ *
+ * @param qv		Vote state.
+ * @param grade		Set to our credit against the toughest peer.
+ * @param peer_grade	Set to that peer's grade.
+ * @param peer		Set to its node ID.
+ * @return		1 if we win against every peer, 0 if not, -1 if
+ *			we never heard from any.
+ */
+int
+qv_wins(struct qnet_vote *qv, int *grade, int *peer_grade, int *peer)
+{
+	struct qv_peer *vp;
+	int x, credit, beats;
+
+	if (!qv->qv_npeers)
+		return -1;
+
+	for (x = 0; x < qv->qv_npeers; x++) {
+		vp = &qv->qv_peers[x];
+		credit = qv_credit(vp);
+		beats = credit > 0 &&
+			(credit > vp->vp_grade ||
+			 (credit == vp->vp_grade &&
+			  qv->qv_nodeid < vp->vp_nodeid));
+
+		/* Report the first peer, or the one we lose to */
+		if (!x || !beats) {
+			*grade = credit;
+			*peer_grade = vp->vp_grade;
+			*peer = vp->vp_nodeid;
+		}
+		if (!beats)
+			return 0;
+	}
+
+	return 1;
+}
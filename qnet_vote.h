@@ -0,0 +1,88 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Header for qnet_vote.c.
+ */
+#ifndef __QNET_VOTE_H
+#define __QNET_VOTE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define QV_MAGIC	0x544f5651	/* "QVOT" */
+#define QV_MAX_PEERS	16
+#define QV_HISTORY	64		/* grades sent, remembered */
+
+struct qv_ack {
+	uint32_t	qa_nodeid;
+	uint32_t	qa_epoch;	/* its epoch, as of ... */
+	uint32_t	qa_seq;		/* latest of its messages we have */
+};
+
+/**
+ * What each node broadcasts, once per interval: its grade, and how far
+ * it has heard from everybody else.  Sequence numbers start again from
+ * 1 with every new epoch (each time qnet starts).  Network byte order.
+ */
+struct qv_msg {
+	uint32_t	qm_magic;
+	uint32_t	qm_nodeid;
+	uint32_t	qm_epoch;
+	uint32_t	qm_seq;
+	uint32_t	qm_grade;
+	uint32_t	qm_nacks;
+	struct qv_ack	qm_acks[QV_MAX_PEERS];
+};
+
+struct qv_peer {
+	int		vp_nodeid;
+	uint32_t	vp_epoch;	/* its current epoch */
+	uint32_t	vp_seq;		/* its latest message */
+	int		vp_grade;	/* ... and the grade in it */
+	uint32_t	vp_acked;	/* our latest message it has */
+	int		vp_has_ack;
+	int		vp_low;		/* lowest grade we sent since */
+};
+
+/**
+ * Grade exchange and split arbitration for one node.
+ */
+struct qnet_vote {
+	int		qv_nodeid;
+	uint32_t	qv_epoch;
+	uint32_t	qv_seq;			/* our latest message */
+	uint8_t		qv_sent[QV_HISTORY];	/* grade, by seq */
+	struct qv_peer	qv_peers[QV_MAX_PEERS];
+	int		qv_npeers;
+};
+
+void qv_init(struct qnet_vote *qv, int nodeid, uint32_t epoch);
+int qv_message(struct qnet_vote *qv, int grade, struct qv_msg *msg);
+int qv_receive(struct qnet_vote *qv, const void *buf, int len);
+int qv_wins(struct qnet_vote *qv, int *grade, int *peer_grade,
+	    int *peer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+#  Copyright Red Hat, Inc. 2008
+#
+#  This program is free software; you can redistribute it and/or modify it
+#  under the terms of the GNU General Public License as published by the
+#  Free Software Foundation; either version 2, or (at your option) any
+#  later version.
+#
+#  This program is distributed in the hope that it will be useful, but
+#  WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+#  General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this program; see the file COPYING.  If not, write to the
+#  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+#  MA 02139, USA.
+#
+# Flood a host through every receive backend, one after the other, with
+# a fixed number of rounds, and print one CSV line per backend.  Needs
+# root (raw sockets).
+#
+# usage: tests/flood.sh [host [rounds [backend ...]]]
+#
+
+QPING=${QPING:-./qping}
+HOST=${1:-127.0.0.1}
+ROUNDS=${2:-100000}
+[ $# -gt 2 ] && shift 2 && BACKENDS="$*"
+BACKENDS=${BACKENDS:-poll select epoll uring ring}
+
+header=1
+for b in $BACKENDS; do
+	out=$($QPING -f -c "$ROUNDS" -q -b "$b" -o csv "$HOST") || {
+		echo "$b: qping failed" >&2
+		exit 1
+	}
+	if [ $header -eq 1 ]; then
+		echo "$out" | sed -n '1s/^/backend,/p'
+		header=0
+	fi
+	line=$(echo "$out" | sed -n 2p)
+	echo "$b,$line"
+	# Nothing back at all means the backend is broken, not the network
+	if [ "$(echo "$line" | cut -d, -f3)" = 0 ]; then
+		echo "$b: no replies" >&2
+		exit 1
+	fi
+done
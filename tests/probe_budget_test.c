@@ -0,0 +1,148 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Tests for the probe budget's rate-limit detector
+ * (probe_budget_update()).
+ *
+ * One path sends at its budgeted rate on a simulated clock, through a
+ * simulated ICMP rate limiter (a token bucket one probe deep) or a path
+ * which loses everything.  Loss which follows the send rate must end
+ * with the path flagged as rate limited and its ceiling under the
+ * limiter; total loss must never back off; and whatever happens, the
+ * rate must stay at or above the floor the caller derives from its
+ * longest allowed gap between probes (probe_max_gap in
+ * cluquorumd_net.c).
+ */
+
+#include <probe.h>
+#include <stdio.h>
+#include <string.h>
+
+#define WINDOWS		200		/* rate-limit checks per run */
+#define RTT		1000		/* usec */
+
+static struct probe_engine pe;
+static struct probe_path path;
+static uint64_t now;
+static double lowest;			/* rate, over the last run */
+static int failures = 0;
+
+#define CHECK(cond, fmt, args...) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__, \
+		       ##args); \
+		++failures; \
+	} } while(0)
+
+
+static void
+setup(double min_rate, double max_rate)
+{
+	memset(&pe, 0, sizeof(pe));
+	memset(&path, 0, sizeof(path));
+	path.pp_sock = -1;
+	pe.pe_paths = &path;
+	pe.pe_npaths = 1;
+	probe_set_budget(&pe, min_rate, max_rate);
+	now = 1000000;
+}
+
+
+/*
+ * Send WINDOWS windows of probes at the path's current rate.  limit is
+ * the limiter's rate in replies/second; 0 drops everything.  Returns
+ * the number lost in the last window, and leaves the lowest rate the
+ * path went down to in lowest.
+ */
+static int
+run(double limit, const char *name)
+{
+	struct probe_budget *pb = &path.pp_budget;
+	double tokens = limit > 0, floor = pb->pb_min;
+	uint64_t last = now;
+	int x, lost, last_lost = 0;
+
+	lowest = pb->pb_rate;
+	for (x = 0; x < WINDOWS * PROBE_WINDOW; x++) {
+		now += (uint64_t)(1000000 / pb->pb_rate);
+		tokens += (double)(now - last) * limit / 1000000;
+		last = now;
+		if (tokens > 1)
+			tokens = 1;
+		lost = tokens < 1;
+		if (!lost)
+			tokens -= 1;
+
+		path.pp_sent = now;
+		probe_budget_update(&path, lost, now + RTT);
+		if (x % PROBE_WINDOW == 0)
+			last_lost = 0;
+		last_lost += lost;
+
+		if (pb->pb_rate < lowest)
+			lowest = pb->pb_rate;
+		CHECK(pb->pb_rate >= floor && pb->pb_ceiling >= floor,
+		      "%s: rate %.2f ceiling %.2f under the floor %.2f",
+		      name, pb->pb_rate, pb->pb_ceiling, floor);
+	}
+	return last_lost;
+}
+
+
+int
+main(void)
+{
+	struct probe_budget *pb = &path.pp_budget;
+	int lost;
+
+	/* A limiter at 60/s: halving from 100/s cures the loss */
+	setup(2.5, 100);
+	lost = run(60, "limiter");
+	CHECK(pb->pb_limited, "limiter: not flagged");
+	CHECK(path.pp_stats.ps_ratelimited > 0, "limiter: not counted");
+	CHECK(path.pp_stats.ps_backoffs > 0, "limiter: never backed off");
+	CHECK(pb->pb_ceiling <= 60, "limiter: ceiling %.2f over it",
+	      pb->pb_ceiling);
+	CHECK(!lost, "limiter: still losing %d/%d", lost, PROBE_WINDOW);
+
+	/* A dead path is the detector's business, not the budget's */
+	setup(2.5, 100);
+	run(0, "total loss");
+	CHECK(pb->pb_rate == 100, "total loss: rate %.2f", pb->pb_rate);
+	CHECK(!path.pp_stats.ps_backoffs, "total loss: %llu back-offs",
+	      (unsigned long long)path.pp_stats.ps_backoffs);
+	CHECK(!pb->pb_limited, "total loss: flagged as rate limited");
+
+	/*
+	 * A limiter under the floor (a 400ms gap, 2.5/s): back off to the
+	 * floor, but no further, and keep probing there.
+	 */
+	setup(1000000.0 / 400000, 4);
+	run(2, "floor");
+	CHECK(path.pp_stats.ps_backoffs > 0, "floor: never backed off");
+	CHECK(lowest == pb->pb_min, "floor: lowest rate %.2f, floor %.2f",
+	      lowest, pb->pb_min);
+
+	if (failures) {
+		printf("probe_budget: %d failures\n", failures);
+		return 1;
+	}
+	printf("probe_budget: OK\n");
+	return 0;
+}
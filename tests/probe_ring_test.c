@@ -0,0 +1,342 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Tests for the packet ring's socket filter (probe_ring_filter()), and
+ * for what is done with the packets it lets through: icmp_parse(),
+ * icmp_classify() and probe_input().
+ *
+ * The filter is attached to one end of an AF_UNIX datagram pair, which
+ * runs socket filters on whatever it receives, so no privileges are
+ * needed.  Each datagram is an IP packet, as the ring's SOCK_DGRAM
+ * socket sees it; what the filter drops never arrives.
+ *
+ * ICMP errors are built quoting an echo, and handed to an engine with
+ * one probe outstanding: only an error which quotes that probe's exact
+ * destination, id and sequence number may complete it, and with hedging,
+ * only once every copy of the probe has failed.
+ */
+
+#include <probe.h>
+#include <ping.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <arpa/inet.h>
+
+#define TARGET		"192.0.2.1"
+#define ROUTER		"198.51.100.1"
+#define SEQ		1234
+
+static int failures = 0;
+
+#define CHECK(cond, fmt, args...) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__, \
+		       ##args); \
+		++failures; \
+	} } while(0)
+
+
+/*
+ * Send an IPv4 packet of the given protocol (and ICMP type) through the
+ * filter; 1 if it comes out the other side.
+ */
+static int
+passes(int fds[2], int proto, int type)
+{
+	uint8_t pkt[64], buf[64];
+	struct ip *ip = (struct ip *)pkt;
+
+	memset(pkt, 0, sizeof(pkt));
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_len = htons(sizeof(pkt));
+	ip->ip_ttl = 64;
+	ip->ip_p = proto;
+	pkt[sizeof(*ip)] = type;
+
+	if (send(fds[0], pkt, sizeof(pkt), 0) != sizeof(pkt)) {
+		perror("send");
+		return -1;
+	}
+	return recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT) > 0;
+}
+
+
+static uint16_t
+cksum(const void *buf, size_t len)
+{
+	const uint16_t *w = buf;
+	uint32_t sum = 0;
+
+	for (; len > 1; len -= 2)
+		sum += *w++;
+	if (len)
+		sum += *(const uint8_t *)w;
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += sum >> 16;
+	return (uint16_t)~sum;
+}
+
+
+/*
+ * Build an ICMP error from ROUTER quoting an echo to dst with id and
+ * seq, of which quote bytes are kept (8 is all a router must send).
+ */
+static size_t
+icmp_error(uint8_t *pkt, int type, int code, const char *dst, uint16_t id,
+	   uint16_t seq, size_t quote)
+{
+	struct ip *ip = (struct ip *)pkt, *orig;
+	struct icmp *icmp;
+	uint8_t echo[ICMP_MINLEN * 2];
+	size_t len;
+
+	len = sizeof(*ip) + ICMP_MINLEN + sizeof(*orig) + quote;
+	memset(pkt, 0, len);
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_len = htons(len);
+	ip->ip_ttl = 64;
+	ip->ip_p = IPPROTO_ICMP;
+	inet_aton(ROUTER, &ip->ip_src);
+
+	icmp = (struct icmp *)(pkt + sizeof(*ip));
+	icmp->icmp_type = type;
+	icmp->icmp_code = code;
+
+	orig = &icmp->icmp_ip;
+	orig->ip_v = 4;
+	orig->ip_hl = 5;
+	orig->ip_len = htons(sizeof(*orig) + sizeof(echo));
+	orig->ip_ttl = 1;
+	orig->ip_p = IPPROTO_ICMP;
+	inet_aton(dst, &orig->ip_dst);
+	icmp_build_echo(echo, id, seq);
+	memcpy((uint8_t *)orig + sizeof(*orig), echo, quote);
+
+	icmp->icmp_cksum = cksum(icmp, len - sizeof(*ip));
+	return len;
+}
+
+
+/*
+ * Build an echo reply from TARGET with id and seq.
+ */
+static size_t
+echo_reply(uint8_t *pkt, uint16_t id, uint16_t seq)
+{
+	struct ip *ip = (struct ip *)pkt;
+	struct icmp *icmp = (struct icmp *)(pkt + sizeof(*ip));
+	size_t len;
+
+	memset(pkt, 0, sizeof(*ip));
+	len = sizeof(*ip) + icmp_build_echo(icmp, id, seq);
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_len = htons(len);
+	ip->ip_ttl = 64;
+	ip->ip_p = IPPROTO_ICMP;
+	inet_aton(TARGET, &ip->ip_src);
+
+	icmp->icmp_type = ICMP_ECHOREPLY;
+	icmp->icmp_cksum = 0;
+	icmp->icmp_cksum = cksum(icmp, len - sizeof(*ip));
+	return len;
+}
+
+
+/*
+ * Put one probe (id, SEQ on) outstanding to TARGET, as if copies of it
+ * had been sent.
+ */
+static void
+outstanding(struct probe_engine *pe, int copies)
+{
+	struct probe_path *pp = &pe->pe_paths[0];
+
+	pp->pp_pending = 1;
+	pp->pp_seq0 = SEQ;
+	pp->pp_copies = copies;
+	memset(pp->pp_copy_at, 0, sizeof(pp->pp_copy_at));
+	pp->pp_failed = 0;
+	pp->pp_sent = probe_now();
+	pp->pp_result = PING_TIMEOUT;
+	pe->pe_pending = 1;
+}
+
+
+/*
+ * Hand an error to an engine with one probe (id, SEQ) outstanding to
+ * TARGET; 1 if it completed that probe.
+ */
+static int
+complete(struct probe_engine *pe, const uint8_t *pkt, size_t len)
+{
+	outstanding(pe, 1);
+	return probe_input(pe, pkt, len, pe->pe_paths[0].pp_sent + 100);
+}
+
+
+static void
+test_errors(void)
+{
+	struct probe_engine pe;
+	struct probe_path *pp;
+	struct icmp_reply reply;
+	uint8_t pkt[128];
+	uint16_t id;
+	size_t len;
+
+	if (probe_engine_init(&pe) < 0 ||
+	    probe_add_path(&pe, TARGET, NULL, NULL) < 0) {
+		perror("probe_engine");
+		++failures;
+		return;
+	}
+	pp = &pe.pe_paths[0];
+	id = pe.pe_id;
+
+	/* Ours: the quoted echo comes out, exactly */
+	len = icmp_error(pkt, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH, TARGET,
+			 id, SEQ, ICMP_MINLEN);
+	CHECK(icmp_parse(pkt, len, &reply) == PING_SUCCESS,
+	      "unreachable not parsed");
+	CHECK(reply.ir_quoted, "unreachable: quote not found");
+	CHECK(reply.ir_orig_dst.s_addr == inet_addr(TARGET) &&
+	      reply.ir_orig_id == id && reply.ir_orig_seq == SEQ,
+	      "unreachable: quoted %s id %u seq %u",
+	      inet_ntoa(reply.ir_orig_dst), reply.ir_orig_id,
+	      reply.ir_orig_seq);
+	CHECK(reply.ir_from.s_addr == inet_addr(ROUTER),
+	      "unreachable: from %s", inet_ntoa(reply.ir_from));
+	CHECK(icmp_classify(&reply) == PING_HOST_UNREACH,
+	      "unreachable classified as %d", icmp_classify(&reply));
+	CHECK(complete(&pe, pkt, len) == 1 &&
+	      pp->pp_result == PING_HOST_UNREACH && !pp->pp_pending,
+	      "unreachable did not fail the probe (result %d)",
+	      pp->pp_result);
+
+	len = icmp_error(pkt, ICMP_DEST_UNREACH, ICMP_FRAG_NEEDED, TARGET,
+			 id, SEQ, ICMP_MINLEN);
+	CHECK(icmp_parse(pkt, len, &reply) == PING_SUCCESS &&
+	      icmp_classify(&reply) == PING_FRAG_NEEDED,
+	      "fragmentation needed misclassified");
+
+	/* Someone else's: another id, sequence number or destination */
+	len = icmp_error(pkt, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH, TARGET,
+			 (uint16_t)(id + 1), SEQ, ICMP_MINLEN);
+	CHECK(complete(&pe, pkt, len) == 0 && pp->pp_pending,
+	      "error for another id taken");
+	len = icmp_error(pkt, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH, TARGET,
+			 id, SEQ + 1, ICMP_MINLEN);
+	CHECK(complete(&pe, pkt, len) == 0 && pp->pp_pending,
+	      "error for another sequence number taken");
+	len = icmp_error(pkt, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH,
+			 "192.0.2.2", id, SEQ, ICMP_MINLEN);
+	CHECK(complete(&pe, pkt, len) == 0 && pp->pp_pending,
+	      "error for another destination taken");
+	CHECK(pe.pe_foreign == 3, "%llu foreign errors counted, not 3",
+	      (unsigned long long)pe.pe_foreign);
+
+	/* A redirect is counted, and the echo left to go on its way */
+	len = icmp_error(pkt, ICMP_REDIRECT, ICMP_REDIR_HOST, TARGET, id,
+			 SEQ, ICMP_MINLEN);
+	CHECK(icmp_parse(pkt, len, &reply) == PING_SUCCESS &&
+	      icmp_classify(&reply) == PING_REDIRECT,
+	      "redirect misclassified");
+	CHECK(complete(&pe, pkt, len) == 0 && pp->pp_pending &&
+	      pp->pp_stats.ps_redirects == 1,
+	      "redirect: pending %d, %llu redirects", pp->pp_pending,
+	      (unsigned long long)pp->pp_stats.ps_redirects);
+
+	/* Too short to hold the echo's id and sequence: cannot be ours */
+	len = icmp_error(pkt, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH, TARGET,
+			 id, SEQ, 4);
+	CHECK(icmp_parse(pkt, len, &reply) == PING_SUCCESS &&
+	      !reply.ir_quoted, "truncated quote taken as one");
+	CHECK(complete(&pe, pkt, len) == 0 && pp->pp_pending,
+	      "error with a truncated quote taken");
+
+	/* Hedged: an error on one copy leaves the other to answer */
+	probe_set_hedge(&pe, 2, 0);
+	outstanding(&pe, 2);
+	len = icmp_error(pkt, ICMP_TIME_EXCEEDED, ICMP_EXC_TTL, TARGET, id,
+			 SEQ, ICMP_MINLEN);
+	CHECK(probe_input(&pe, pkt, len, pp->pp_sent + 100) == 0 &&
+	      pp->pp_pending, "hedged: an error on copy 1 ended the probe");
+	len = echo_reply(pkt, id, SEQ + 1);
+	CHECK(probe_input(&pe, pkt, len, pp->pp_sent + 200) == 1 &&
+	      pp->pp_result == PING_SUCCESS && pp->pp_copy == 1,
+	      "hedged: copy 2's reply did not answer it (result %d)",
+	      pp->pp_result);
+
+	/* ... but once both have failed, so has the probe */
+	outstanding(&pe, 2);
+	len = icmp_error(pkt, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH, TARGET,
+			 id, SEQ + 1, ICMP_MINLEN);
+	CHECK(probe_input(&pe, pkt, len, pp->pp_sent + 100) == 0 &&
+	      pp->pp_pending, "hedged: an error on copy 2 ended the probe");
+	len = icmp_error(pkt, ICMP_TIME_EXCEEDED, ICMP_EXC_TTL, TARGET, id,
+			 SEQ, ICMP_MINLEN);
+	CHECK(probe_input(&pe, pkt, len, pp->pp_sent + 200) == 1 &&
+	      pp->pp_result == PING_TTL_EXCEEDED,
+	      "hedged: both copies failed, result %d", pp->pp_result);
+
+	probe_engine_destroy(&pe);
+}
+
+
+int
+main(void)
+{
+	struct sock_fprog prog;
+	int fds[2];
+
+	probe_ring_filter(&prog);
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0 ||
+	    setsockopt(fds[1], SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+		       sizeof(prog)) < 0) {
+		perror("probe_ring_test");
+		return 1;
+	}
+
+	CHECK(passes(fds, IPPROTO_ICMP, ICMP_ECHOREPLY) == 1,
+	      "echo reply dropped");
+	CHECK(passes(fds, IPPROTO_ICMP, ICMP_DEST_UNREACH) == 1,
+	      "destination unreachable dropped");
+	CHECK(passes(fds, IPPROTO_ICMP, ICMP_TIME_EXCEEDED) == 1,
+	      "time exceeded dropped");
+	CHECK(passes(fds, IPPROTO_ICMP, ICMP_ECHO) == 0,
+	      "echo request let through");
+	CHECK(passes(fds, IPPROTO_UDP, 0) == 0, "UDP let through");
+	CHECK(passes(fds, IPPROTO_TCP, 0) == 0, "TCP let through");
+
+	test_errors();
+
+	if (failures) {
+		printf("probe_ring: %d failures\n", failures);
+		return 1;
+	}
+	printf("probe_ring: OK\n");
+	return 0;
+}
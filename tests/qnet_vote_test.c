@@ -0,0 +1,295 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Tests for qnet_vote.c: split arbitration between simulated nodes.
+ *
+ * Each interval, every live node broadcasts its grade (qv_message) and
+ * asks whether it would claim the tiebreaker vote (qv_wins).  Messages
+ * may be lost, delayed and reordered.  The property which matters is
+ * that after a split, no two nodes ever claim at the same time; the
+ * rest is that the right one does, and keeps doing so.
+ */
+
+#include <qnet_vote.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NODES		2
+#define INFLIGHT	256
+#define MAX_DELAY	3		/* intervals */
+
+struct sim_msg {
+	int		sm_to;
+	int		sm_due;		/* interval it arrives in */
+	int		sm_len;
+	struct qv_msg	sm_msg;
+};
+
+struct sim {
+	struct qnet_vote s_votes[NODES];
+	int		s_grade[NODES];
+	int		s_alive[NODES];
+	int		s_now;
+	int		s_loss;		/* percent */
+	int		s_split;	/* nothing sent gets through */
+	struct sim_msg	s_msgs[INFLIGHT];
+	int		s_nmsgs;
+	uint32_t	s_epoch;
+};
+
+static int failures = 0;
+
+#define CHECK(cond, fmt, args...) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__, \
+		       ##args); \
+		++failures; \
+	} } while(0)
+
+
+static void
+sim_init(struct sim *s, int loss)
+{
+	int x;
+
+	memset(s, 0, sizeof(*s));
+	s->s_loss = loss;
+	for (x = 0; x < NODES; x++) {
+		qv_init(&s->s_votes[x], x + 1, ++s->s_epoch);
+		s->s_grade[x] = 4;
+		s->s_alive[x] = 1;
+	}
+}
+
+
+static void
+sim_restart(struct sim *s, int node)
+{
+	qv_init(&s->s_votes[node], node + 1, ++s->s_epoch);
+	s->s_alive[node] = 1;
+}
+
+
+/**
+ * One interval: deliver what is due, then every live node broadcasts.
+ */
+static void
+sim_step(struct sim *s)
+{
+	struct sim_msg *sm;
+	struct qv_msg msg;
+	int x, y, len;
+
+	for (x = 0; x < s->s_nmsgs; ) {
+		sm = &s->s_msgs[x];
+		if (sm->sm_due > s->s_now) {
+			x++;
+			continue;
+		}
+		if (s->s_alive[sm->sm_to])
+			qv_receive(&s->s_votes[sm->sm_to], &sm->sm_msg,
+				   sm->sm_len);
+		*sm = s->s_msgs[--s->s_nmsgs];
+	}
+
+	for (x = 0; x < NODES; x++) {
+		if (!s->s_alive[x])
+			continue;
+		len = qv_message(&s->s_votes[x], s->s_grade[x], &msg);
+		for (y = 0; y < NODES; y++) {
+			if (y == x || s->s_split ||
+			    rand() % 100 < s->s_loss ||
+			    s->s_nmsgs >= INFLIGHT)
+				continue;
+			sm = &s->s_msgs[s->s_nmsgs++];
+			sm->sm_to = y;
+			sm->sm_due = s->s_now + rand() % (MAX_DELAY + 1);
+			sm->sm_len = len;
+			sm->sm_msg = msg;
+		}
+	}
+
+	++s->s_now;
+}
+
+
+static int
+sim_wins(struct sim *s, int node)
+{
+	int grade, peer_grade, peer;
+
+	if (!s->s_alive[node])
+		return 0;
+	return qv_wins(&s->s_votes[node], &grade, &peer_grade, &peer) == 1;
+}
+
+
+/**
+ * Lossy, delayed exchange with grades changing all the while; split at
+ * a random moment, messages already sent still arriving, and grades
+ * changing on after.  Never may both sides claim.
+ */
+static void
+test_split(int runs)
+{
+	struct sim s;
+	int run, t, x, claims = 0, both = 0;
+
+	for (run = 0; run < runs; run++) {
+		sim_init(&s, rand() % 50);
+		for (t = rand() % 100 + 5; t > 0; t--) {
+			for (x = 0; x < NODES; x++)
+				if (rand() % 4 == 0)
+					s.s_grade[x] = rand() % 4 + 1;
+			sim_step(&s);
+		}
+
+		s.s_split = 1;
+		for (t = 0; t < 150; t++) {
+			for (x = 0; x < NODES; x++)
+				if (rand() % 50 == 0)
+					s.s_grade[x] = rand() % 4 + 1;
+			sim_step(&s);
+			if (sim_wins(&s, 0) && sim_wins(&s, 1))
+				++both;
+		}
+		claims += sim_wins(&s, 0) || sim_wins(&s, 1);
+	}
+
+	CHECK(!both, "split: both sides claimed %d times", both);
+	CHECK(claims > runs / 4, "split: only %d of %d runs had a claim",
+	      claims, runs);
+	printf("split: %d runs, %d with a claim at the end\n", runs, claims);
+}
+
+
+/**
+ * Clean exchange, then one node dies.  The survivor, with the better
+ * (or tied, lower node ID) grade, claims, and goes on claiming long
+ * after the grades it sent have left the history ring.
+ */
+static void
+test_peer_death(void)
+{
+	struct sim s;
+	int t, won = 1;
+
+	sim_init(&s, 0);
+	s.s_grade[0] = 3;
+	s.s_grade[1] = 2;
+	for (t = 0; t < 20; t++)
+		sim_step(&s);
+	CHECK(!sim_wins(&s, 1), "peer death: the worse node claims");
+
+	s.s_alive[1] = 0;
+	for (t = 0; t < QV_HISTORY * 10; t++) {
+		sim_step(&s);
+		won &= sim_wins(&s, 0);
+	}
+	CHECK(won, "peer death: the survivor gave up its claim");
+
+	/* A lower grade sent while alone holds it down */
+	s.s_grade[0] = 1;
+	sim_step(&s);
+	CHECK(!sim_wins(&s, 0), "peer death: claimed on a grade it lost");
+	s.s_grade[0] = 4;
+	for (t = 0; t < QV_HISTORY * 2; t++)
+		sim_step(&s);
+	CHECK(!sim_wins(&s, 0), "peer death: a better grade since counted");
+}
+
+
+/**
+ * Tied grades: the lower node ID wins, over the split and for good.
+ */
+static void
+test_tie(void)
+{
+	struct sim s;
+	int t, won = 1, lost = 1;
+
+	sim_init(&s, 0);
+	for (t = 0; t < 20; t++)
+		sim_step(&s);
+	s.s_split = 1;
+	for (t = 0; t < QV_HISTORY * 4; t++) {
+		sim_step(&s);
+		won &= sim_wins(&s, 0);
+		lost &= !sim_wins(&s, 1);
+	}
+	CHECK(won && lost, "tie: node 1 %s, node 2 %s",
+	      won ? "claims" : "does not claim",
+	      lost ? "does not" : "claims");
+}
+
+
+/**
+ * A peer restarts after a long run (its old sequence numbers far above
+ * its new ones).  Arbitration works again once the exchange resumes,
+ * both ways round.
+ */
+static void
+test_restart(void)
+{
+	struct sim s;
+	int t, node;
+
+	for (node = 0; node < NODES; node++) {
+		sim_init(&s, 0);
+		for (t = 0; t < 500; t++)
+			sim_step(&s);
+
+		sim_restart(&s, node);
+		/* The restarted one is now the better */
+		s.s_grade[node] = 4;
+		s.s_grade[!node] = 2;
+		for (t = 0; t < 10; t++)
+			sim_step(&s);
+
+		s.s_split = 1;
+		for (t = 0; t < 5; t++)
+			sim_step(&s);
+		CHECK(sim_wins(&s, node), "restart of node %d: it does not "
+		      "claim", node + 1);
+		CHECK(!sim_wins(&s, !node), "restart of node %d: the other "
+		      "claims", node + 1);
+	}
+}
+
+
+int
+main(int argc, char **argv)
+{
+	int runs = argc > 1 ? atoi(argv[1]) : 20000;
+
+	srand(argc > 2 ? atoi(argv[2]) : 1);
+
+	test_split(runs);
+	test_peer_death();
+	test_tie();
+	test_restart();
+
+	if (failures) {
+		printf("qnet_vote: %d failures\n", failures);
+		return 1;
+	}
+	printf("qnet_vote: OK\n");
+	return 0;
+}
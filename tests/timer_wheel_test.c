@@ -0,0 +1,218 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Tests for timer_wheel.c: random adds, deletes and advances against a
+ * plain list of deadlines.
+ *
+ * Timers are armed at every range the wheel has (and beyond it), some
+ * callbacks re-arm themselves or cancel others, and time moves on by
+ * small steps, large jumps and straight to tw_next().  Whatever the
+ * order, a timer must fire once, never early and no later than the
+ * first advance past its tick, and tw_next() must never sleep past it.
+ */
+
+#include <timer_wheel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TIMERS		20000
+#define STEPS		5000
+#define TICK		100		/* usec */
+#define RANGE		((uint64_t)TICK << (TW_BITS * TW_LEVELS))
+
+struct ref {
+	struct tw_timer	r_timer;
+	uint64_t	r_expires;
+	int		r_armed;
+};
+
+static struct timer_wheel wheel;
+static struct ref refs[TIMERS];
+static uint64_t now;
+static int armed, draining, failures = 0;
+
+#define CHECK(cond, fmt, args...) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: " fmt "\n", __FILE__, __LINE__, \
+		       ##args); \
+		++failures; \
+	} } while(0)
+
+
+static uint64_t
+rand64(void)
+{
+	return ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+}
+
+
+/* Mostly soon, some in the upper levels, a few past the wheel's range */
+static uint64_t
+pick_delay(void)
+{
+	int r = rand() % 100;
+
+	if (r < 70)
+		return rand64() % ((uint64_t)TICK << TW_BITS);
+	if (r < 95)
+		return rand64() % ((uint64_t)TICK << (TW_BITS * 3));
+	return rand64() % (RANGE * 2);
+}
+
+
+static void
+ref_add(struct ref *r, uint64_t expires)
+{
+	if (!r->r_armed)
+		++armed;
+	r->r_armed = 1;
+	r->r_expires = expires;
+	tw_add(&wheel, &r->r_timer, expires);
+}
+
+
+static void
+ref_del(struct ref *r)
+{
+	if (r->r_armed)
+		--armed;
+	r->r_armed = 0;
+	tw_del(&wheel, &r->r_timer);
+}
+
+
+static void
+fire(struct tw_timer *t, uint64_t when)
+{
+	struct ref *r = t->tt_arg;
+
+	CHECK(r->r_armed, "timer %d fired while not armed",
+	      (int)(r - refs));
+	CHECK(when == now, "timer %d given the wrong time",
+	      (int)(r - refs));
+	CHECK(r->r_expires <= now, "timer %d fired %llu usec early",
+	      (int)(r - refs), (unsigned long long)(r->r_expires - now));
+	r->r_armed = 0;
+	--armed;
+
+	switch (draining ? -1 : rand() % 20) {
+	case 0:
+	case 1:
+		ref_add(r, now + pick_delay());
+		break;
+	case 2:
+		ref_del(&refs[rand() % TIMERS]);
+		break;
+	}
+}
+
+
+/*
+ * After advancing to now: everything whose tick has come has fired, the
+ * count agrees, and tw_next() is no later than the earliest deadline.
+ */
+static void
+check_state(void)
+{
+	uint64_t first = UINT64_MAX, tick, next;
+	int x, n = 0;
+
+	for (x = 0; x < TIMERS; x++) {
+		if (!refs[x].r_armed)
+			continue;
+		++n;
+		CHECK(tw_armed(&refs[x].r_timer), "timer %d lost", x);
+		tick = (refs[x].r_expires + TICK - 1) / TICK;
+		CHECK(tick > now / TICK, "timer %d overdue by %llu usec", x,
+		      (unsigned long long)(now - refs[x].r_expires));
+		if (tick * TICK < first)
+			first = tick * TICK;
+	}
+
+	CHECK(n == armed && wheel.tw_count == (uint64_t)n,
+	      "%d armed, %d expected, wheel says %llu", n, armed,
+	      (unsigned long long)wheel.tw_count);
+	next = tw_next(&wheel);
+	CHECK(next <= first, "tw_next %llu is past the first deadline %llu",
+	      (unsigned long long)next, (unsigned long long)first);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	uint64_t last;
+	int step, x, r;
+
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+
+	now = rand64() % RANGE;
+	tw_init(&wheel, TICK, now);
+	for (x = 0; x < TIMERS; x++) {
+		tw_timer_init(&refs[x].r_timer, fire, &refs[x]);
+		ref_add(&refs[x], now + pick_delay());
+	}
+	check_state();
+
+	for (step = 0; step < STEPS && !failures; step++) {
+		for (x = rand() % 20; x > 0; x--) {
+			r = rand() % TIMERS;
+			if (rand() % 3)
+				ref_add(&refs[r], now + pick_delay());
+			else
+				ref_del(&refs[r]);
+		}
+
+		switch (rand() % 10) {
+		case 0:
+			now += rand64() % (RANGE / 64);
+			break;
+		case 1:
+		case 2:
+			if (tw_next(&wheel) != UINT64_MAX &&
+			    tw_next(&wheel) > now)
+				now = tw_next(&wheel);
+			break;
+		default:
+			now += rand() % (TICK * 200);
+			break;
+		}
+		tw_advance(&wheel, now);
+		check_state();
+	}
+
+	/* And everything left goes off in the end */
+	draining = 1;
+	last = now;
+	for (x = 0; x < TIMERS; x++)
+		if (refs[x].r_armed && refs[x].r_expires > last)
+			last = refs[x].r_expires;
+	now = last + TICK;
+	tw_advance(&wheel, now);
+	CHECK(!armed && !wheel.tw_count, "%d timers never fired", armed);
+	CHECK(tw_next(&wheel) == UINT64_MAX, "tw_next with nothing armed");
+
+	if (failures) {
+		printf("timer_wheel: %d failures\n", failures);
+		return 1;
+	}
+	printf("timer_wheel: OK\n");
+	return 0;
+}
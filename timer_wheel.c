@@ -0,0 +1,266 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Hierarchical timing wheel, for probe deadlines and send schedules.
+ *
+ * A timer lands in the lowest level whose span covers it, in the slot
+ * for its expiry tick at that level's resolution.  Whenever level 0
+ * wraps, the next slot of level 1 is emptied and its timers re-filed,
+ * which drops them into level 0 (and so on up the levels).  Timers
+ * never fire early; they may fire up to one tick late.
+ */
+
+#include <timer_wheel.h>
+#include <string.h>
+
+
+/**
+ * Set up an empty wheel.
+ *
+ * @param tw		Wheel.
+ * @param tick_us	Resolution (microseconds).
+ * @param now		Current time (usec, monotonic).
+ */
+void
+tw_init(struct timer_wheel *tw, uint32_t tick_us, uint64_t now)
+{
+	memset(tw, 0, sizeof(*tw));
+	tw->tw_tick = tick_us ? tick_us : 1;
+	tw->tw_now = now / tw->tw_tick;
+}
+
+
+/**
+ * Set up a timer, unarmed.
+ */
+void
+tw_timer_init(struct tw_timer *t, tw_func_t func, void *arg)
+{
+	memset(t, 0, sizeof(*t));
+	t->tt_func = func;
+	t->tt_arg = arg;
+}
+
+
+static void
+tw_link(struct timer_wheel *tw, struct tw_timer *t, int slot)
+{
+	struct tw_timer **head = &tw->tw_slots[slot];
+
+	t->tt_next = *head;
+	if (*head)
+		(*head)->tt_pprev = &t->tt_next;
+	*head = t;
+	t->tt_pprev = head;
+	t->tt_slot = slot;
+	tw->tw_map[slot / TW_SIZE] |= 1ULL << (slot % TW_SIZE);
+}
+
+
+static void
+tw_unlink(struct timer_wheel *tw, struct tw_timer *t)
+{
+	int slot = t->tt_slot;
+
+	*t->tt_pprev = t->tt_next;
+	if (t->tt_next)
+		t->tt_next->tt_pprev = t->tt_pprev;
+	t->tt_next = NULL;
+	t->tt_pprev = NULL;
+	if (!tw->tw_slots[slot])
+		tw->tw_map[slot / TW_SIZE] &= ~(1ULL << (slot % TW_SIZE));
+}
+
+
+/**
+ * File a timer in the slot its expiry tick maps to, from where the
+ * wheel is now.  Timers already due go in the current slot; timers
+ * beyond the wheel's range go at the far end, and are re-filed from
+ * there until they come within range.
+ */
+static void
+tw_file(struct timer_wheel *tw, struct tw_timer *t)
+{
+	uint64_t tick = t->tt_tick, delta;
+	int lvl;
+
+	if (tick < tw->tw_now)
+		tick = tw->tw_now;
+	delta = tick - tw->tw_now;
+
+	for (lvl = 0; lvl < TW_LEVELS - 1; lvl++) {
+		if (delta < 1ULL << (TW_BITS * (lvl + 1)))
+			break;
+	}
+	if (delta >= 1ULL << (TW_BITS * TW_LEVELS))
+		tick = tw->tw_now + (1ULL << (TW_BITS * TW_LEVELS)) - 1;
+
+	tw_link(tw, t, lvl * TW_SIZE +
+		       (int)((tick >> (TW_BITS * lvl)) & TW_MASK));
+}
+
+
+/**
+ * Arm (or re-arm) a timer.
+ *
+ * @param tw		Wheel.
+ * @param t		Timer.
+ * @param expires	When to fire (usec, monotonic).
+ */
+void
+tw_add(struct timer_wheel *tw, struct tw_timer *t, uint64_t expires)
+{
+	if (tw_armed(t))
+		tw_del(tw, t);
+
+	t->tt_expires = expires;
+	/* Round up, so that we never fire early */
+	t->tt_tick = (expires + tw->tw_tick - 1) / tw->tw_tick;
+	tw_file(tw, t);
+	++tw->tw_count;
+}
+
+
+/**
+ * Disarm a timer.  Harmless if it is not armed.
+ */
+void
+tw_del(struct timer_wheel *tw, struct tw_timer *t)
+{
+	if (!tw_armed(t))
+		return;
+	tw_unlink(tw, t);
+	--tw->tw_count;
+}
+
+
+/**
+ * Empty one slot of an upper level and re-file its timers, which puts
+ * them in lower levels now that they are closer.
+ *
+ * @return		The slot index, so the caller knows whether this
+ *			level wrapped too.
+ */
+static int
+tw_cascade(struct timer_wheel *tw, int lvl)
+{
+	struct tw_timer *t;
+	int idx = (int)((tw->tw_now >> (TW_BITS * lvl)) & TW_MASK);
+	int slot = lvl * TW_SIZE + idx;
+
+	while ((t = tw->tw_slots[slot]) != NULL) {
+		tw_unlink(tw, t);
+		tw_file(tw, t);
+	}
+
+	return idx;
+}
+
+
+/**
+ * Run every timer which is due.  Callbacks may add and delete timers,
+ * including themselves.
+ *
+ * @param tw		Wheel.
+ * @param now		Current time (usec, monotonic); passed on to the
+ *			callbacks.
+ * @return		Number of timers fired.
+ */
+int
+tw_advance(struct timer_wheel *tw, uint64_t now)
+{
+	struct tw_timer *t;
+	uint64_t target = now / tw->tw_tick;
+	int idx, lvl, fired = 0;
+
+	while (tw->tw_now <= target) {
+		if (!tw->tw_count) {
+			tw->tw_now = target + 1;
+			break;
+		}
+
+		idx = (int)(tw->tw_now & TW_MASK);
+		for (lvl = 1; !idx && lvl < TW_LEVELS; lvl++)
+			idx = tw_cascade(tw, lvl);
+		idx = (int)(tw->tw_now & TW_MASK);
+
+		while ((t = tw->tw_slots[idx]) != NULL) {
+			tw_unlink(tw, t);
+			--tw->tw_count;
+			++fired;
+			t->tt_func(t, now);
+		}
+
+		/* Nothing more in level 0 this lap: skip to the wrap */
+		if (!((tw->tw_map[0] >> idx) >> 1))
+			tw->tw_now |= TW_MASK;
+		if (tw->tw_now > target)
+			tw->tw_now = target;
+		++tw->tw_now;
+	}
+
+	return fired;
+}
+
+
+/**
+ * When the next timer might fire: the exact time for one in level 0,
+ * or the time its slot is next cascaded for one further out.  Good for
+ * a poll() timeout; waking at a cascade merely costs a spare loop.
+ *
+ * @return		Time (usec, monotonic), or UINT64_MAX if no timer
+ *			is armed.
+ */
+uint64_t
+tw_next(const struct timer_wheel *tw)
+{
+	uint64_t map, rot, tick, best = UINT64_MAX;
+	int lvl, cur, shift, d;
+
+	if (!tw->tw_count)
+		return UINT64_MAX;
+
+	for (lvl = 0; lvl < TW_LEVELS; lvl++) {
+		map = tw->tw_map[lvl];
+		if (!map)
+			continue;
+		shift = TW_BITS * lvl;
+		cur = (int)((tw->tw_now >> shift) & TW_MASK);
+		rot = cur ? (map >> cur) | (map << (TW_SIZE - cur)) : map;
+
+		if (lvl == 0) {
+			d = __builtin_ctzll(rot);
+			tick = tw->tw_now + d;
+		} else {
+			/*
+			 * This level's current slot has been cascaded
+			 * already, unless we are sitting on the boundary
+			 * where that happens.
+			 */
+			if (tw->tw_now & ((1ULL << shift) - 1))
+				rot &= ~1ULL;
+			d = rot ? __builtin_ctzll(rot) : TW_SIZE;
+			tick = ((tw->tw_now >> shift) + d) << shift;
+		}
+		if (tick < best)
+			best = tick;
+	}
+
+	return best * tw->tw_tick;
+}
@@ -0,0 +1,81 @@
+/*
+  Copyright Red Hat, Inc. 2008
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the
+  Free Software Foundation; either version 2, or (at your option) any
+  later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; see the file COPYING.  If not, write to the
+  Free Software Foundation, Inc.,  675 Mass Ave, Cambridge,
+  MA 02139, USA.
+ */
+/** @file
+ * Header for timer_wheel.c.
+ */
+#ifndef __TIMER_WHEEL_H
+#define __TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TW_BITS		6
+#define TW_SIZE		(1 << TW_BITS)	/* slots per level */
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	4		/* range: TW_SIZE^TW_LEVELS ticks */
+
+struct tw_timer;
+
+typedef void (*tw_func_t)(struct tw_timer *t, uint64_t now);
+
+/**
+ * A timer.  Embed it in whatever it is for and find the container from
+ * tt_arg (or with offsetof) in the callback.
+ */
+struct tw_timer {
+	struct tw_timer		*tt_next;
+	struct tw_timer		**tt_pprev;	/* NULL: not armed */
+	uint64_t		tt_expires;	/* usec, monotonic */
+	uint64_t		tt_tick;
+	tw_func_t		tt_func;
+	void			*tt_arg;
+	int			tt_slot;
+};
+
+/**
+ * Hierarchical timing wheel.  Level 0 has one slot per tick; each level
+ * above covers TW_SIZE times the span of the one below, and its timers
+ * are moved down ("cascaded") as the lower level wraps around.  Adding
+ * and cancelling are O(1) whatever the number of timers.
+ */
+struct timer_wheel {
+	uint32_t		tw_tick;	/* usec per tick */
+	uint64_t		tw_now;		/* next tick to run */
+	uint64_t		tw_count;	/* timers armed */
+	uint64_t		tw_map[TW_LEVELS];	/* non-empty slots */
+	struct tw_timer		*tw_slots[TW_LEVELS * TW_SIZE];
+};
+
+void tw_init(struct timer_wheel *tw, uint32_t tick_us, uint64_t now);
+void tw_timer_init(struct tw_timer *t, tw_func_t func, void *arg);
+void tw_add(struct timer_wheel *tw, struct tw_timer *t, uint64_t expires);
+void tw_del(struct timer_wheel *tw, struct tw_timer *t);
+int tw_advance(struct timer_wheel *tw, uint64_t now);
+uint64_t tw_next(const struct timer_wheel *tw);
+
+#define tw_armed(t)	((t)->tt_pprev != NULL)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif